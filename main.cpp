@@ -403,8 +403,8 @@ public:
         otherEdit->setDocument(textEdit->document());
 
         lbl = new QLabel(w);
-        connect(textEdit, SIGNAL(cursorPositionChanged(int)),
-                this, SLOT(onCursorPositionChanged(int)));
+        connect(textEdit, SIGNAL(cursorPositionChanged(qint64)),
+                this, SLOT(onCursorPositionChanged(qint64)));
         l->addWidget(lbl);
 
         new QShortcut(QKeySequence(Qt::CTRL + Qt::Key_E), textEdit, SLOT(ensureCursorVisible()));
@@ -509,7 +509,7 @@ public slots:
                                  QMessageBox::Ok, QMessageBox::NoButton, QMessageBox::NoButton);
     }
 
-    void onCursorPositionChanged(int pos)
+    void onCursorPositionChanged(qint64 pos)
     {
         QString text = QString("Position: %1\n"
                                "Word: %2\n"
@@ -564,8 +564,8 @@ public slots:
                 format.setBackground(Qt::black);
                 format.setForeground(Qt::white);
             }
-            const int pos = cursor.selectionStart();
-            const int size = cursor.selectionEnd() - pos;
+            const qint64 pos = cursor.selectionStart();
+            const qint64 size = cursor.selectionEnd() - pos;
             TextSection *s = 0;
             if (first) {
                 s = textEdit->insertTextSection(pos, size, format, cursor.selectedText());
@@ -609,14 +609,14 @@ public slots:
     }
     void onScrollBarValueChanged()
     {
-        box->setValue(textEdit->viewportPosition());
+        box->setValue(int(qMin<qint64>(INT_MAX, textEdit->viewportPosition())));
     }
     void gotoPos()
     {
         TextCursor &cursor = textEdit->textCursor();
         bool ok;
-        int pos = QInputDialog::getInt(this, "Goto pos", "Pos", cursor.position(), 0,
-                                           textEdit->document()->documentSize(), 1, &ok);
+        int pos = QInputDialog::getInt(this, "Goto pos", "Pos", int(qMin<qint64>(INT_MAX, cursor.position())), 0,
+                                       int(qMin<qint64>(INT_MAX, textEdit->document()->documentSize())), 1, &ok);
         if (!ok)
             return;
         cursor.setPosition(pos);
@@ -116,7 +116,7 @@ void SyntaxHighlighter::setCurrentBlockState(int s)
     d->currentBlockState = s; // ### These don't entirely follow QSyntaxHighlighter's behavior
 }
 
-int SyntaxHighlighter::currentBlockPosition() const
+qint64 SyntaxHighlighter::currentBlockPosition() const
 {
     return d->currentBlockPosition;
 }
@@ -55,7 +55,7 @@ public:
     int previousBlockState() const;
     int currentBlockState() const;
     void setCurrentBlockState(int s);
-    int currentBlockPosition() const;
+    qint64 currentBlockPosition() const;
 public Q_SLOTS:
     void rehighlight();
 private:
@@ -64,7 +64,8 @@ private:
                     currentBlockPosition(-1) {}
         TextEdit *textEdit;
         TextLayout *textLayout;
-        int previousBlockState, currentBlockState, currentBlockPosition;
+        int previousBlockState, currentBlockState;
+        qint64 currentBlockPosition;
         QList<QTextLayout::FormatRange> formatRanges;
         QTextBlockFormat blockFormat;
         QString currentBlock;
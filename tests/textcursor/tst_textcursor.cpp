@@ -89,8 +89,8 @@ void tst_TextCursor::setPosition()
 
     cursor.setPosition(one);
     cursor.setPosition(two, moveMode);
-    QCOMPARE(expectedPos, cursor.position());
-    QCOMPARE(expectedAnchor, cursor.anchor());
+    QCOMPARE(qint64(expectedPos), cursor.position());
+    QCOMPARE(qint64(expectedAnchor), cursor.anchor());
     QCOMPARE(selectedText, cursor.selectedText());
 }
 
@@ -189,8 +189,8 @@ void tst_TextCursor::movePosition()
     Q_ASSERT(cursor.position() == initialPosition);
     Q_ASSERT(cursor.anchor() == initialAnchor);
     cursor.movePosition(moveOperation, moveMode, count);
-    QCOMPARE(cursor.position(), expectedPosition);
-    QCOMPARE(cursor.anchor(), expectedAnchor);
+    QCOMPARE(cursor.position(), qint64(expectedPosition));
+    QCOMPARE(cursor.anchor(), qint64(expectedAnchor));
     QCOMPARE(cursor.selectedText(), selectedText);
 }
 
@@ -213,7 +213,7 @@ void tst_TextCursor::invalidPosition()
 {
     TextDocument doc;
     doc.setText("foo bar");
-    QCOMPARE(doc.documentSize(), 7);
+    QCOMPARE(doc.documentSize(), qint64(7));
     TextCursor cursor(&doc, -1);
 
 }
@@ -13,11 +13,13 @@
 // limitations under the License.
 
 #include <QtTest/QtTest>
+#include <QPixmap>
 
 #define private public
 // to be able to access private data in textdocument
 #include <textdocument.h>
 #include <textdocument_p.h>
+#include <textscan_p.h>
 QT_FORWARD_DECLARE_CLASS(TextDocument)
 
 //TESTED_CLASS=
@@ -37,6 +39,9 @@ public:
 
 private:
     int convertRowColumnToIndex(const TextDocument *doc, int row, int column);
+    QString numberedLines(int count);
+    QString loadLines(TextDocument *doc, QBuffer *buffer, int count,
+                      TextDocument::Options options = TextDocument::DefaultOptions);
 
 private slots:
     void cursor_data();
@@ -78,6 +83,36 @@ private slots:
     void insertText();
     void memUsage();
     void textDocmentIteratorOnDocumentSize();
+    void chunkTree();
+    void mapFile_data();
+    void mapFile();
+    void saveMappedFile();
+    void sparseUtf8_data();
+    void sparseUtf8();
+    void sparseCheckpoints();
+    void concurrentReaders();
+    void chunkCache_data();
+    void chunkCache();
+    void pieceTable();
+    void chunkRebalance();
+    void prefetch();
+    void swapStore_data();
+    void swapStore();
+    void memoryLimit();
+    void compression();
+    void latin1Chunks();
+    void extents();
+    void forEachSpan();
+    void applyEdits();
+    void sectionTree();
+    void bulkSections();
+    void sectionFormats();
+    void cursorTracking();
+    void lineIndex();
+    void backgroundLineCount();
+    void scanKernels();
+    void findStringSearch();
+    void parallelFindAll();
 };
 
 tst_TextDocument::tst_TextDocument()
@@ -145,13 +180,11 @@ void tst_TextDocument::readCheck()
     static const int sizes[] = { 1, 100, -1 };
 
     const QString fileData = QTextStream(&file).readAll();
-    if (deviceMode == TextDocument::Sparse && doc.chunkSize() < 1000)
-        QEXPECT_FAIL("", "I don't know how to fix this", Abort);
 
-    QCOMPARE(fileData.size(), doc.documentSize());
+    QCOMPARE(qint64(fileData.size()), doc.documentSize());
     for (int i=0; sizes[i] != -1; ++i) {
         for (int j=0; j<fileData.size(); j+=sizes[i]) {
-            const int max = qMin(sizes[i], doc.documentSize() - j);
+            const int max = int(qMin<qint64>(sizes[i], doc.documentSize() - j));
             const QString dr = doc.read(j, max);
             QCOMPARE(dr.size(), max);
 
@@ -185,25 +218,25 @@ void tst_TextDocument::find()
     QVERIFY(!doc.find('\n', 0).isNull());
     QString searchTerm = "another";
     doc.append(searchTerm);
-    int index = doc.find(searchTerm, 0).anchor();
+    qint64 index = doc.find(searchTerm, 0).anchor();
     QVERIFY(index != -1);
-    const int first = index;
+    const qint64 first = index;
     index = doc.find(searchTerm, index).anchor();
     QCOMPARE(index, first);
 
     index = doc.find(searchTerm, index + 1).anchor();
     QCOMPARE(index, doc.documentSize() - searchTerm.size());
     QCOMPARE(doc.find(searchTerm, index - 1, TextDocument::FindBackward).anchor(), first);
-    QCOMPARE(doc.find(searchTerm, index + 1).anchor(), -1);
+    QCOMPARE(doc.find(searchTerm, index + 1).anchor(), qint64(-1));
     QCOMPARE(doc.find(searchTerm, index - 2, TextDocument::FindWholeWords).anchor(), index);
     QVERIFY(!doc.find(searchTerm, 0).isNull());
     searchTerm.chop(1);
     searchTerm.remove(0, 1);
     QVERIFY(doc.find(searchTerm, 0, TextDocument::FindWholeWords).isNull());
-    QCOMPARE(doc.find("This", 0, TextDocument::FindWholeWords).anchor(), 0);
+    QCOMPARE(doc.find("This", 0, TextDocument::FindWholeWords).anchor(), qint64(0));
     doc.remove(1, 1);
-    QCOMPARE(doc.find("This", 0, TextDocument::FindWholeWords).anchor(), 16);
-    QCOMPARE(doc.find("This", 0, TextDocument::FindWholeWords).position(), 20);
+    QCOMPARE(doc.find("This", 0, TextDocument::FindWholeWords).anchor(), qint64(16));
+    QCOMPARE(doc.find("This", 0, TextDocument::FindWholeWords).position(), qint64(20));
     QCOMPARE(doc.find("This", 0, TextDocument::FindWholeWords).selectedText(), QString("This"));
     QCOMPARE(doc.find("\n", 20, TextDocument::FindBackward).cursorCharacter(), QChar('\n'));
     QCOMPARE(doc.find(QRegExp("\n"), 20, TextDocument::FindBackward).cursorCharacter(), QChar('\n'));
@@ -216,11 +249,11 @@ void tst_TextDocument::find2()
     TextDocument doc;
     doc.setChunkSize(2);
     doc.insert(0, "foobar");
-    QCOMPARE(doc.find("oo", 0).anchor(), 1);
-    QCOMPARE(doc.find("foobar", 0).anchor(), 0);
-    QCOMPARE(doc.find("foobar", doc.documentSize(), TextDocument::FindBackward).anchor(), 0);
-    QCOMPARE(doc.find("b", 0).anchor(), 3);
-    QCOMPARE(doc.find("b", doc.documentSize(), TextDocument::FindBackward).anchor(), 3);
+    QCOMPARE(doc.find("oo", 0).anchor(), qint64(1));
+    QCOMPARE(doc.find("foobar", 0).anchor(), qint64(0));
+    QCOMPARE(doc.find("foobar", doc.documentSize(), TextDocument::FindBackward).anchor(), qint64(0));
+    QCOMPARE(doc.find("b", 0).anchor(), qint64(3));
+    QCOMPARE(doc.find("b", doc.documentSize(), TextDocument::FindBackward).anchor(), qint64(3));
 
 }
 
@@ -257,8 +290,8 @@ void tst_TextDocument::find3()
         position = doc.documentSize();
 
     TextCursor cursor = doc.find(regExp, position, (TextDocument::FindMode)flags);
-    QCOMPARE(cursor.anchor(), expectedAnchor);
-    QCOMPARE(cursor.position(), expectedPosition);
+    QCOMPARE(cursor.anchor(), qint64(expectedAnchor));
+    QCOMPARE(cursor.position(), qint64(expectedPosition));
     QCOMPARE(cursor.selectedText(), expectedText);
     QCOMPARE(doc.find(regExp, position, (TextDocument::FindMode)flags).selectedText(), expectedText);
 
@@ -301,7 +334,7 @@ void tst_TextDocument::save()
     QBuffer buffer;
     buffer.open(QIODevice::WriteOnly);
     QVERIFY(doc.save(&buffer));
-    QCOMPARE(doc.documentSize(), buffer.data().size());
+    QCOMPARE(doc.documentSize(), qint64(buffer.data().size()));
     const QString docSaved = doc.read(0, doc.documentSize());
     QVERIFY(docSaved.contains("This is inserted"));
     buffer.close();
@@ -331,10 +364,10 @@ void tst_TextDocument::documentSize()
     QBuffer buffer;
     buffer.setData("foobar\n");
     buffer.open(QIODevice::ReadOnly);
-    int bufferSize = buffer.size();
+    qint64 bufferSize = buffer.size();
     TextDocument doc;
     doc.load(&buffer);
-    QCOMPARE(int(buffer.size()), doc.documentSize());
+    QCOMPARE(buffer.size(), doc.documentSize());
     doc.remove(0, 2);
     bufferSize -= 2;
     QCOMPARE(bufferSize, doc.documentSize());
@@ -431,8 +464,8 @@ void tst_TextDocument::cursor()
     } else {
         doc.insert(command.pos, command.text);
     }
-    QCOMPARE(cursor.position(), expectedPosition);
-    QCOMPARE(cursor.anchor(), expectedAnchor);
+    QCOMPARE(cursor.position(), qint64(expectedPosition));
+    QCOMPARE(cursor.anchor(), qint64(expectedAnchor));
 }
 
 void tst_TextDocument::sections()
@@ -511,10 +544,10 @@ void tst_TextDocument::findQChar()
 //    qDebug() << ch << doc.readCharacter(position) << position << doc.read(qMax(0, position - 3), 7) << position;
 //    qDebug() << ch << position << doc.documentSize() << flags << expected;
     TextCursor cursor = doc.find(ch, position, (TextDocument::FindMode)flags);;
-    QCOMPARE(cursor.anchor(), expected);
+    QCOMPARE(cursor.anchor(), qint64(expected));
     QCOMPARE(cursor.selectedText().toUpper(), QString(ch).toUpper());
     cursor = doc.find(QString(ch), position, (TextDocument::FindMode)flags);
-    QCOMPARE(cursor.position(), expected + 1);
+    QCOMPARE(cursor.position(), qint64(expected + 1));
     QCOMPARE(cursor.selectedText().toUpper(), QString(ch).toUpper());
     QRegExp rx(ch);
     if (flags & TextDocument::FindCaseSensitively) {
@@ -525,8 +558,8 @@ void tst_TextDocument::findQChar()
     }
 
     cursor = doc.find(rx, position, (TextDocument::FindMode)flags);
-    QCOMPARE(cursor.anchor(), expected);
-    QCOMPARE(cursor.position(), expected + 1);
+    QCOMPARE(cursor.anchor(), qint64(expected));
+    QCOMPARE(cursor.position(), qint64(expected + 1));
     QCOMPARE(cursor.selectedText().toUpper(), QString(ch).toUpper());
     QCOMPARE(cursor.selectedText().toUpper(), rx.capturedTexts().value(0).toUpper());
 
@@ -688,7 +721,7 @@ void tst_TextDocument::lineNumbersGenerated()
 class DocumentSubClass : public TextDocument
 {
 public:
-    bool isWordCharacter(const QChar &ch, int) const
+    bool isWordCharacter(const QChar &ch, qint64) const
     {
         return !ch.isSpace();
     }
@@ -755,10 +788,6 @@ void tst_TextDocument::chunkBacktrack()
 
 int tst_TextDocument::convertRowColumnToIndex(const TextDocument *doc, int row, int column)
 {
-    // NOTE: this function works, but is slow. Quantify points
-    // the finger at the underlying lazy document counting lines.
-    // The line-numbering cache in there helps, but it's still
-    // much slower than motif.  Needs tuned.
     if (row < 0) {
         printf("Requested row index %d must be greater than 0\n", row);
         return -1;
@@ -768,90 +797,44 @@ int tst_TextDocument::convertRowColumnToIndex(const TextDocument *doc, int row,
         return -1;
     }
 
-
-    int max = doc->documentSize();
-
     // The Qt widget seems to start row numbering at 1, not 0...
-    int docrow = row+1;
-
-    // This is a bit lame.  Keep skipping through until we hit it.
-    int index = -1;
-    TextCursor tc(doc);
-    tc.setPosition(0);
-
-    if (getenv("QT_LOOKUP")) {
-        // TODO: I started to look at this, since it seems like a cleaner way
-        // to do things, but it ends up being noticably slower (with 10 operations
-        // in the test I was creating taking about 10 seconds, versus 4 with the code below).
-        // Needs further investigation, but this is really what we should be doing,
-        // (or rather, what TextCursor should be doing).
-
-        // Get to the right row
-        for (int i=0; i < docrow; ++i) {
-            if (tc.position() >= max) {
-                printf("Requested line number %d is out of range - the document has %d lines\n", row, i);
-                return -1;
-            }
-            tc.movePosition(TextCursor::NextBlock);
-        }
-
-        // At this stage, we're in the right row.  We should also be at the beginning,
-        // since we advanced from the start.
-
-        // Cache the number of columns in this row in case we need to print an error message
-        int rowStart = tc.position();
-        tc.movePosition(TextCursor::EndOfLine, TextCursor::KeepAnchor);
-        int actualColumns = tc.selectionSize();
-        if (column > actualColumns) {
-            printf("Requested column number %d is out of range - line %d has %d columns\n",
-                   column, row, actualColumns);
-            return -1;
-        }
-
-        return rowStart + column;
-    } else {
-
-        int inc = 100;
-        while (index < 0) {
-            int pos     = tc.position();
-            int thisrow = tc.lineNumber();
-
-            if (thisrow >= docrow) {
-                // If we passed the row we want - back up
-                while (tc.position() && tc.lineNumber() > docrow) {
-                    tc.movePosition(TextCursor::PreviousBlock);
-                }
-                // Now we're in the right row.
-                // First, determine whether we need to go back or forwards
-                int incr = (tc.columnNumber() > column ? -1 : 1);
-                while (tc.columnNumber() != column) {
-                    tc.setPosition(tc.position() + incr);
-                    if (tc.position() <=0
-                        || tc.position() >= max
-                        || tc.lineNumber() != docrow) {
-                        // Make sure we didn't 'wrap around' to another row.
-                        printf("Requested column number %d is out of range for line %d\n",
-                               column, row);
-                        return -1;
-                    }
-                }
-                index = tc.position() - (tc.columnNumber() - column);
-                break;
-            } else {
-                // Advance, but make sure we don't shoot off the end of the document
-                int incr = (pos + inc < max ? inc : max - pos);
-                if (incr) {
-                    tc.setPosition(pos + incr);
-                } else {
-                    // We already hit the end of the document
-                    printf("Requested line number %d is out of range - the document has %d lines\n", row, tc.lineNumber()-1);
-                    break;
-                }
-            }
-        }
+    const int docrow = row+1;
+    const qint64 rowStart = doc->positionForLine(docrow);
+    if (rowStart == -1) {
+        printf("Requested line number %d is out of range - the document has %d lines\n", row, doc->lineCount());
+        return -1;
     }
+    qint64 rowEnd = doc->positionForLine(docrow + 1);
+    rowEnd = (rowEnd == -1 ? doc->documentSize() : rowEnd - 1);
+    if (column > rowEnd - rowStart) {
+        printf("Requested column number %d is out of range - line %d has %lld columns\n",
+               column, row, rowEnd - rowStart);
+        return -1;
+    }
+    return int(rowStart + column);
+}
+
+QString tst_TextDocument::numberedLines(int count)
+{
+    QString text;
+    for (int i=0; i<count; ++i)
+        text += QString("line %1\n").arg(i, 3, 10, QLatin1Char('0'));
+    return text;
+}
 
-    return index;
+// Loads count numbered lines Sparse from buffer in chunks of 100
+// characters and returns the text
+QString tst_TextDocument::loadLines(TextDocument *doc, QBuffer *buffer, int count,
+                                    TextDocument::Options options)
+{
+    const QString text = numberedLines(count);
+    buffer->setData(text.toLatin1());
+    buffer->open(QIODevice::ReadOnly);
+    doc->setChunkSize(100);
+    doc->setOptions(options);
+    if (!doc->load(buffer, TextDocument::Sparse, "ISO-8859-1"))
+        return QString();
+    return text;
 }
 
 
@@ -877,10 +860,10 @@ void tst_TextDocument::insertText()
     c = TextCursor(&d);
     c.insertText(firstBlock);
     c.movePosition(TextCursor::End);
-    QCOMPARE(c.position(), blockSize);
+    QCOMPARE(c.position(), qint64(blockSize));
     c.insertText(secondBlock);
     c.movePosition(TextCursor::End);
-    QCOMPARE(c.position(), blockSize*2);
+    QCOMPARE(c.position(), qint64(blockSize*2));
     c.insertText(thirdBlock);
 
     QString out = d.read(0, blockSize*3);
@@ -955,6 +938,1347 @@ void tst_TextDocument::textDocmentIteratorOnDocumentSize()
     cursor.movePosition(TextCursor::PreviousBlock);
 }
 
+static qint64 checkChunkTree(const Chunk *c, const Chunk *parent)
+{
+    if (!c)
+        return 0;
+    if (c->parent != parent || (parent && c->priority > parent->priority))
+        return -1;
+    const qint64 left = checkChunkTree(c->left, c);
+    const qint64 right = checkChunkTree(c->right, c);
+    if (left == -1 || right == -1 || c->treeSize != left + right + c->size())
+        return -1;
+    return c->treeSize;
+}
+
+void tst_TextDocument::chunkTree()
+{
+    TextDocument doc;
+    doc.setChunkSize(10);
+    QString text;
+    for (int i=0; i<100; ++i)
+        text += QString::number(i) + QLatin1Char('\n');
+    doc.setText(text);
+    srand(0);
+    for (int i=0; i<1000; ++i) {
+        const int pos = rand() % (text.size() + 1);
+        if (rand() % 3 || text.isEmpty()) {
+            const QString string = QString::number(i);
+            if (rand() % 2) {
+                doc.append(string);
+                text.append(string);
+            } else {
+                doc.insert(pos, string);
+                text.insert(pos, string);
+            }
+        } else {
+            const int size = qMin(rand() % 40, text.size() - pos);
+            doc.remove(pos, size);
+            text.remove(pos, size);
+        }
+        QCOMPARE(checkChunkTree(doc.d->chunkTreeRoot, 0), qint64(text.size()));
+    }
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+
+    qint64 pos = 0;
+    for (const Chunk *c = doc.d->first; c; c = c->next) {
+        QCOMPARE(c->pos(), pos);
+        for (int i=0; i<c->size(); ++i) {
+            int offset;
+            QCOMPARE(doc.d->chunkAt(pos + i, &offset), c);
+            QCOMPARE(offset, i);
+        }
+        pos += c->size();
+    }
+}
+
+void tst_TextDocument::mapFile_data()
+{
+    QTest::addColumn<QString>("fileName");
+    QTest::addColumn<QByteArray>("codec");
+
+    QTest::newRow("Script latin1") << QString("Script") << QByteArray("ISO-8859-1");
+    QTest::newRow("Script utf8") << QString("Script") << QByteArray("UTF-8");
+    QTest::newRow("unicode.txt latin1") << QString("unicode.txt") << QByteArray("ISO-8859-1");
+}
+
+void tst_TextDocument::mapFile()
+{
+    QFETCH(QString, fileName);
+    QFETCH(QByteArray, codec);
+
+    TextDocument streamed;
+    streamed.setChunkSize(100);
+    streamed.setOptions(TextDocument::NoImplicitLoadAll);
+    QVERIFY(streamed.load(fileName, TextDocument::Sparse, codec));
+
+    TextDocument mapped;
+    mapped.setChunkSize(100);
+    mapped.setOptions(TextDocument::NoImplicitLoadAll|TextDocument::MapFile);
+    QVERIFY(mapped.load(fileName, TextDocument::Sparse, codec));
+    QVERIFY(mapped.d->mappedData);
+    QVERIFY(!streamed.d->mappedData);
+
+    QCOMPARE(mapped.documentSize(), streamed.documentSize());
+    for (int i=0; i<mapped.documentSize(); i += 37) {
+        QCOMPARE(mapped.read(i, 150), streamed.read(i, 150));
+    }
+    QCOMPARE(mapped.find("e", 0).position(), streamed.find("e", 0).position());
+    QCOMPARE(mapped.find("e", mapped.documentSize(), TextDocument::FindBackward).position(),
+             streamed.find("e", streamed.documentSize(), TextDocument::FindBackward).position());
+
+    mapped.insert(50, "inserted");
+    streamed.insert(50, "inserted");
+    QBuffer mappedBuffer, streamedBuffer;
+    mappedBuffer.open(QIODevice::WriteOnly);
+    streamedBuffer.open(QIODevice::WriteOnly);
+    QVERIFY(mapped.save(&mappedBuffer));
+    QVERIFY(streamed.save(&streamedBuffer));
+    QCOMPARE(mappedBuffer.data(), streamedBuffer.data());
+}
+
+void tst_TextDocument::saveMappedFile()
+{
+    QString text;
+    for (int i=0; i<300; ++i)
+        text += QString("line %1\n").arg(i);
+    QTemporaryFile file;
+    QVERIFY(file.open());
+    file.write(text.toLatin1());
+    file.flush();
+
+    TextDocument doc;
+    doc.setChunkSize(100);
+    doc.setOptions(TextDocument::NoImplicitLoadAll|TextDocument::MapFile);
+    QVERIFY(doc.load(file.fileName(), TextDocument::Sparse, "ISO-8859-1"));
+    QVERIFY(doc.d->mappedData);
+    doc.insert(1000, "inserted");
+    text.insert(1000, "inserted");
+    doc.remove(2000, 30);
+    text.remove(2000, 30);
+
+    // saving over the file the document is mapped from maps it again
+    QVERIFY(doc.save());
+    QVERIFY(doc.d->mappedData);
+    QVERIFY(doc.d->device->isReadable());
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+    QFile saved(file.fileName());
+    QVERIFY(saved.open(QIODevice::ReadOnly));
+    QCOMPARE(saved.readAll(), text.toLatin1());
+    const QString savedText = text;
+
+    doc.insert(10, "again");
+    text.insert(10, "again");
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+
+    // the chunks are read from the saved file from then on
+    TextDocument pieces;
+    pieces.setChunkSize(100);
+    pieces.setOptions(TextDocument::NoImplicitLoadAll|TextDocument::PieceTable);
+    QVERIFY(pieces.load(file.fileName(), TextDocument::Sparse, "ISO-8859-1"));
+    TextCursor cursor(&pieces, 2500);
+    TextSection *section = pieces.insertTextSection(2400, 50);
+    text = savedText;
+    for (int i=0; i<10; ++i) {
+        pieces.insert(i * 150, "0123456789");
+        text.insert(i * 150, "0123456789");
+        pieces.remove(i * 200 + 50, 3);
+        text.remove(i * 200 + 50, 3);
+    }
+    const qint64 cursorPosition = cursor.position();
+    const qint64 sectionPosition = section->position();
+    QVERIFY(pieces.save());
+    QCOMPARE(pieces.chunkCount(), 1);
+    QCOMPARE(pieces.read(0, pieces.documentSize()), text);
+    QCOMPARE(cursor.position(), cursorPosition);
+    QCOMPARE(section->position(), sectionPosition);
+    QCOMPARE(pieces.lineNumber(text.size() - 1), text.count(QLatin1Char('\n')) - 1);
+
+    // the checkpoints of a variable width codec are scanned again
+    QString utf8Text;
+    for (int i=0; i<300; ++i)
+        utf8Text += QString::fromUtf8("line %1 \xc3\xa6\xc3\xb8 \xe2\x82\xac\n").arg(i);
+    QTemporaryFile utf8File;
+    QVERIFY(utf8File.open());
+    utf8File.write(utf8Text.toUtf8());
+    utf8File.flush();
+    TextDocument utf8;
+    utf8.setChunkSize(100);
+    utf8.setOptions(TextDocument::NoImplicitLoadAll|TextDocument::MapFile);
+    QVERIFY(utf8.load(utf8File.fileName(), TextDocument::Sparse, "UTF-8"));
+    utf8.insert(500, QString::fromUtf8("\xe2\x82\xac\xe2\x82\xac"));
+    utf8Text.insert(500, QString::fromUtf8("\xe2\x82\xac\xe2\x82\xac"));
+    utf8.remove(3000, 40);
+    utf8Text.remove(3000, 40);
+    QVERIFY(utf8.save());
+    QVERIFY(!utf8.d->checkpoints.isEmpty());
+    QCOMPARE(utf8.documentSize(), qint64(utf8Text.size()));
+    QCOMPARE(utf8.read(0, utf8.documentSize()), utf8Text);
+    for (int i=0; i<utf8Text.size(); i += 97)
+        QCOMPARE(utf8.read(i, 50), utf8Text.mid(i, 50));
+    const int line250 = utf8Text.indexOf("line 250 ");
+    QCOMPARE(utf8.lineNumber(line250), utf8Text.left(line250).count(QLatin1Char('\n')));
+}
+
+void tst_TextDocument::sparseUtf8_data()
+{
+    QTest::addColumn<int>("chunkSize");
+    QTest::addColumn<bool>("mapFile");
+
+    for (int i=0; chunkSizes[i] != 0; ++i) {
+        QTest::newRow(QString("%0").arg(chunkSizes[i]).toLatin1().constData()) << chunkSizes[i] << false;
+        QTest::newRow(QString("%0 mapped").arg(chunkSizes[i]).toLatin1().constData()) << chunkSizes[i] << true;
+    }
+}
+
+void tst_TextDocument::sparseUtf8()
+{
+    QFETCH(int, chunkSize);
+    QFETCH(bool, mapFile);
+
+    QString text;
+    for (int i=0; i<500; ++i) {
+        text += QString::fromUtf8("line %1 \xc3\xa6\xc3\xb8\xc3\xa5 \xe2\x82\xac \xf0\x9f\x98\x80\n").arg(i);
+    }
+    QTemporaryFile file;
+    QVERIFY(file.open());
+    file.write(text.toUtf8());
+    file.flush();
+
+    TextDocument doc;
+    if (chunkSize != -1)
+        doc.setChunkSize(chunkSize);
+    doc.setOptions(mapFile ? TextDocument::MapFile|TextDocument::NoImplicitLoadAll : TextDocument::NoImplicitLoadAll);
+    QVERIFY(doc.load(file.fileName(), TextDocument::Sparse, "UTF-8"));
+    QCOMPARE(doc.documentSize(), qint64(text.size()));
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+    for (int i=0; i<text.size(); i += 97) {
+        QCOMPARE(doc.read(i, 50), text.mid(i, 50));
+    }
+    QCOMPARE(doc.lineNumber(text.size() - 1), 499);
+    QCOMPARE(doc.lineNumber(text.indexOf("line 250")), 250);
+
+    doc.insert(text.indexOf("line 100"), "\n");
+    text.insert(text.indexOf("line 100"), "\n");
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+    QCOMPARE(doc.lineNumber(text.indexOf("line 250")), 251);
+}
+
+class CheckpointReader : public QThread
+{
+public:
+    CheckpointReader(TextDocument *document, const QString &expected, int step)
+        : doc(document), text(expected), step(step), ok(true)
+    {}
+    void run()
+    {
+        for (int i=0; i<text.size() && ok; i += step)
+            ok = doc->read(i, 10) == text.mid(i, 10);
+    }
+    TextDocument *doc;
+    const QString text;
+    const int step;
+    bool ok;
+};
+
+void tst_TextDocument::sparseCheckpoints()
+{
+    QString text;
+    for (int i=0; i<2000; ++i) {
+        text += QString::fromUtf8("line %1 \xc3\xa6\xc3\xb8\xc3\xa5 \xf0\x9f\x98\x80\n").arg(i);
+    }
+    QTemporaryFile file;
+    QVERIFY(file.open());
+    file.write(text.toUtf8());
+    file.flush();
+
+    TextDocument doc;
+    doc.setChunkSize(100);
+    doc.setOptions(TextDocument::NoImplicitLoadAll);
+    QVERIFY(doc.load(file.fileName(), TextDocument::Sparse, "UTF-8"));
+    // the start can be read while the rest is still being scanned
+    QCOMPARE(doc.read(0, 20), text.left(20));
+    QCOMPARE(doc.lineNumber(text.indexOf("line 3 ")), 3);
+    QCOMPARE(doc.read(text.size() - 30, 30), text.right(30));
+    QCOMPARE(doc.documentSize(), qint64(text.size()));
+    QCOMPARE(doc.lineCount(), 2001);
+    QCOMPARE(doc.positionForLine(1500), qint64(text.indexOf("line 1500 ")));
+    QCOMPARE(doc.chunkCount(), 1);
+    QVERIFY(!doc.isCountingLines());
+
+    // the readers of a document with Locking grow it one at a time
+    TextDocument locked;
+    locked.setChunkSize(100);
+    locked.setOptions(TextDocument::NoImplicitLoadAll|TextDocument::Locking);
+    QVERIFY(locked.load(file.fileName(), TextDocument::Sparse, "UTF-8"));
+    CheckpointReader first(&locked, text, 37);
+    CheckpointReader second(&locked, text, 53);
+    first.start();
+    second.start();
+    QCOMPARE(locked.lineNumber(text.indexOf("line 1200 ")), 1200);
+    first.wait();
+    second.wait();
+    QVERIFY(first.ok);
+    QVERIFY(second.ok);
+    QCOMPARE(locked.documentSize(), qint64(text.size()));
+
+    doc.insert(text.indexOf("line 1000 "), "\n");
+    text.insert(text.indexOf("line 1000 "), "\n");
+    doc.remove(text.indexOf("line 10 "), 5);
+    text.remove(text.indexOf("line 10 "), 5);
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+    QCOMPARE(doc.lineNumber(text.indexOf("line 1500 ")), 1501);
+
+    // UTF-16 without a BOM is read in the host's byte order
+    QString wide;
+    for (int i=0; i<300; ++i) {
+        wide += QString::fromUtf8("line %1 \xf0\x9f\x98\x80\n").arg(i);
+    }
+    QTemporaryFile wideFile;
+    QVERIFY(wideFile.open());
+    wideFile.write(reinterpret_cast<const char*>(wide.utf16()), wide.size() * 2);
+    wideFile.flush();
+
+    TextDocument wideDoc;
+    wideDoc.setChunkSize(100);
+    wideDoc.setOptions(TextDocument::NoImplicitLoadAll);
+    QVERIFY(wideDoc.load(wideFile.fileName(), TextDocument::Sparse, "UTF-16"));
+    QCOMPARE(wideDoc.documentSize(), qint64(wide.size()));
+    QCOMPARE(wideDoc.read(0, wide.size()), wide);
+    QCOMPARE(wideDoc.lineNumber(wide.indexOf("line 250 ")), 250);
+}
+
+class LineReader : public QThread
+{
+public:
+    LineReader(TextDocument *document, const QString &expected, int step)
+        : doc(document), text(expected), step(step), ok(true)
+    {}
+    void run()
+    {
+        for (int i=0; i<text.size() && ok; i += step) {
+            ok = doc->read(i, 10) == text.mid(i, 10)
+                 && doc->lineNumber(i) == text.left(i).count(QLatin1Char('\n'));
+        }
+    }
+    TextDocument *doc;
+    const QString text;
+    const int step;
+    bool ok;
+};
+
+void tst_TextDocument::concurrentReaders()
+{
+    // the readers share the chunk cache, the used chunks and the line
+    // counts while the document is locked for reading
+    TextDocument doc;
+    doc.setChunkSize(100);
+    doc.setChunkCacheSize(2);
+    doc.setMemoryLimit(1000);
+    doc.setOptions(TextDocument::NoImplicitLoadAll|TextDocument::Locking);
+    QBuffer buffer;
+    QString text = loadLines(&doc, &buffer, 500, doc.options());
+    for (int i=0; i<10; ++i) {
+        const int pos = i * 400;
+        doc.insert(pos, "edit\n");
+        text.insert(pos, "edit\n");
+    }
+    LineReader first(&doc, text, 37);
+    LineReader second(&doc, text, 53);
+    first.start();
+    second.start();
+    first.wait();
+    second.wait();
+    QVERIFY(first.ok);
+    QVERIFY(second.ok);
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+    QCOMPARE(doc.lineCount(), text.count(QLatin1Char('\n')) + 1);
+}
+
+void tst_TextDocument::chunkCache_data()
+{
+    QTest::addColumn<bool>("pieceTable");
+    QTest::newRow("chunks") << false;
+    QTest::newRow("piece table") << true;
+}
+
+void tst_TextDocument::chunkCache()
+{
+#ifdef NO_TEXTDOCUMENT_CHUNK_CACHE
+    QSKIP("Built without the chunk cache");
+#endif
+    QFETCH(bool, pieceTable);
+    TextDocument::Options options = TextDocument::NoImplicitLoadAll;
+    if (pieceTable)
+        options |= TextDocument::PieceTable;
+    QBuffer buffer;
+    TextDocument doc;
+    QString text = loadLines(&doc, &buffer, 100, options);
+    QVERIFY(!text.isEmpty());
+
+    // two chunks fit so alternating between them only misses once for each
+    doc.setChunkCacheSize(2);
+    doc.resetStatistics();
+    for (int i=0; i<10; ++i) {
+        QCOMPARE(doc.readCharacter(150), text.at(150));
+        QCOMPARE(doc.readCharacter(250), text.at(250));
+    }
+    QCOMPARE(doc.statistics().chunkCacheMisses, qint64(2));
+    QCOMPARE(doc.statistics().chunkCacheHits, qint64(18));
+
+    doc.setChunkCacheSize(1);
+    doc.resetStatistics();
+    for (int i=0; i<10; ++i) {
+        QCOMPARE(doc.readCharacter(150), text.at(150));
+        QCOMPARE(doc.readCharacter(250), text.at(250));
+    }
+    QCOMPARE(doc.statistics().chunkCacheMisses, qint64(20));
+
+    doc.setChunkCacheSize(8);
+    doc.setChunkCacheMemoryLimit(100 * sizeof(QChar));
+    doc.resetStatistics();
+    for (int i=0; i<10; ++i) {
+        QCOMPARE(doc.readCharacter(150), text.at(150));
+        QCOMPARE(doc.readCharacter(250), text.at(250));
+    }
+    QCOMPARE(doc.statistics().chunkCacheMisses, qint64(20));
+
+    // cached chunks after an edit have to move with it
+    doc.setChunkCacheMemoryLimit(1024 * 1024);
+    for (int i=0; i<text.size(); i += 50)
+        QCOMPARE(doc.readCharacter(i), text.at(i));
+    doc.insert(120, "inserted");
+    text.insert(120, "inserted");
+    for (int i=0; i<text.size(); ++i)
+        QCOMPARE(doc.readCharacter(i), text.at(i));
+    doc.remove(90, 150);
+    text.remove(90, 150);
+    for (int i=text.size() - 1; i>=0; --i)
+        QCOMPARE(doc.readCharacter(i), text.at(i));
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+}
+
+void tst_TextDocument::pieceTable()
+{
+    QString text;
+    for (int i=0; i<200; ++i)
+        text += QString::fromUtf8("line %1 æøå\n").arg(i, 3, 10, QLatin1Char('0'));
+    QBuffer buffer;
+    buffer.setData(text.toUtf8());
+    buffer.open(QIODevice::ReadOnly);
+
+    TextDocument doc;
+    doc.setChunkSize(100);
+    doc.setOptions(TextDocument::NoImplicitLoadAll|TextDocument::PieceTable);
+    QVERIFY(doc.load(&buffer, TextDocument::Sparse, "UTF-8"));
+    QCOMPARE(doc.instantiatedChunkCount(), 0);
+
+    for (int i=0; i<20; ++i) {
+        const qint64 pos = (i * 487) % text.size();
+        if (i % 3 == 2) {
+            doc.remove(pos, 7);
+            text.remove(pos, 7);
+        } else {
+            const QString string = (i % 2 ? QString("new\nline") : QString("typed"));
+            doc.insert(pos, string);
+            text.insert(pos, string);
+        }
+    }
+    // typing extends the last piece rather than adding a new one
+    for (int i=0; i<10; ++i) {
+        doc.insert(500 + i, "x");
+        text.insert(500 + i, "x");
+    }
+    QCOMPARE(doc.instantiatedChunkCount(), 0);
+    QCOMPARE(doc.documentSize(), qint64(text.size()));
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+    for (int i=text.size() - 1; i>=0; i -= 13)
+        QCOMPARE(doc.readCharacter(i), text.at(i));
+
+    int line = 0;
+    for (int i=0; i<text.size(); ++i) {
+        QCOMPARE(doc.lineNumber(i), line);
+        if (text.at(i) == QLatin1Char('\n'))
+            ++line;
+    }
+
+    QBuffer out;
+    out.open(QIODevice::WriteOnly);
+    QVERIFY(doc.save(&out));
+    QCOMPARE(QString::fromUtf8(out.data()), text);
+}
+
+void tst_TextDocument::chunkRebalance()
+{
+    TextDocument doc;
+    doc.setChunkSize(100);
+    QString text = numberedLines(100);
+    doc.setText(text);
+    QCOMPARE(doc.lineNumber(text.size() - 1), 99); // makes edits maintain the line numbers
+
+    QString paste;
+    for (int i=0; i<1000; ++i)
+        paste += QString("pasted %1\n").arg(i);
+    doc.insert(450, paste);
+    text.insert(450, paste);
+    for (int i=0; i<200; ++i) {
+        doc.remove(2000, 17);
+        text.remove(2000, 17);
+    }
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+
+    for (const Chunk *c = doc.d->first; c; c = c->next) {
+        QVERIFY(c->size() <= 2 * doc.chunkSize());
+        QVERIFY(c->size() > 0);
+        if (c->next)
+            QVERIFY(c->size() >= doc.chunkSize() / 4 || c->next->size() >= doc.chunkSize() / 4);
+    }
+
+    int line = 0;
+    for (int i=0; i<text.size(); ++i) {
+        QCOMPARE(doc.lineNumber(i), line);
+        if (text.at(i) == QLatin1Char('\n'))
+            ++line;
+    }
+}
+
+void tst_TextDocument::prefetch()
+{
+    QBuffer buffer;
+    TextDocument doc;
+    doc.setChunkCacheSize(1);
+    doc.setPrefetchThreadCount(2);
+    doc.setPrefetchDepth(4);
+    const QString text = loadLines(&doc, &buffer, 500, TextDocument::NoImplicitLoadAll);
+    QVERIFY(!text.isEmpty());
+
+    doc.d->prefetch(0, true);
+    for (int i=0; i<500; ++i) {
+        QMutexLocker locker(&doc.d->prefetchMutex);
+        if (doc.d->prefetched.size() == 4)
+            break;
+        locker.unlock();
+        QThread::msleep(10);
+    }
+    doc.resetStatistics();
+    for (int i=0; i<400; i += 100)
+        QCOMPARE(doc.readCharacter(i), text.at(i));
+    QCOMPARE(doc.statistics().prefetchHits, qint64(4));
+
+    // iterating reads ahead of itself
+    QVERIFY(doc.find(QChar('#'), 0).isNull());
+    QVERIFY(doc.find(QChar('#'), doc.documentSize(), TextDocument::FindBackward).isNull());
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+
+    doc.setPrefetchDepth(0);
+    QVERIFY(doc.d->prefetchThreads.isEmpty());
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+}
+
+void tst_TextDocument::swapStore_data()
+{
+    QTest::addColumn<int>("options");
+
+    QTest::newRow("encoded") << int(TextDocument::SwapChunks);
+    QTest::newRow("raw") << int(TextDocument::SwapChunks|TextDocument::RawSwap);
+}
+
+void tst_TextDocument::swapStore()
+{
+    QFETCH(int, options);
+    QString fileName;
+    {
+        TextDocument doc;
+        doc.setChunkSize(100);
+        doc.setOptions(TextDocument::Options(options));
+        QString text;
+        for (int i=0; i<50; ++i) {
+            const QString string = QString::fromUtf8("%1 æøå---").arg(i, 3, 10, QLatin1Char('0')).repeated(10);
+            doc.append(string);
+            text.append(string);
+        }
+        QCOMPARE(doc.swappedChunkCount(), 48);
+        QVERIFY(doc.d->swapFile);
+        fileName = doc.d->swapFile->fileName();
+        QVERIFY(QFile::exists(fileName));
+        QCOMPARE(doc.read(0, doc.documentSize()), text);
+
+        // space given back by a chunk that is swapped in again gets reused
+        const qint64 swapFileSize = doc.d->swapFileSize;
+        doc.insert(1005, "x");
+        text.insert(1005, "x");
+        QCOMPARE(doc.swappedChunkCount(), 47);
+        QCOMPARE(doc.d->swapFreeList.size(), 1);
+        doc.remove(1000, 100);
+        text.remove(1000, 100);
+        doc.append(text.mid(1000, 100));
+        text.append(text.mid(1000, 100));
+        QCOMPARE(doc.swappedChunkCount(), 48);
+        QVERIFY(doc.d->swapFreeList.isEmpty());
+        QCOMPARE(doc.d->swapFileSize, swapFileSize);
+        QCOMPARE(doc.read(0, doc.documentSize()), text);
+    }
+    QVERIFY(!QFile::exists(fileName));
+}
+
+void tst_TextDocument::memoryLimit()
+{
+    TextDocument doc;
+    doc.setChunkSize(100);
+    QString text = numberedLines(1000);
+    doc.setText(text);
+    QCOMPARE(doc.currentMemoryUsage(), qint64(text.size() * sizeof(QChar)));
+
+    const qint64 limit = 10 * 2 * doc.chunkSize() * sizeof(QChar);
+    doc.setMemoryLimit(limit);
+    QVERIFY(doc.currentMemoryUsage() <= limit);
+    QVERIFY(doc.statistics().chunksEvicted > 0);
+
+    srand(0);
+    for (int i=0; i<500; ++i) {
+        const int pos = rand() % (text.size() + 1);
+        if (rand() % 2) {
+            const QString string = QString::number(i).repeated(rand() % 50);
+            doc.insert(pos, string);
+            text.insert(pos, string);
+        } else {
+            const int size = qMin(rand() % 60, text.size() - pos);
+            doc.remove(pos, size);
+            text.remove(pos, size);
+        }
+        QVERIFY(doc.currentMemoryUsage() <= limit);
+    }
+    QVERIFY(doc.statistics().chunksSwappedIn > 0);
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+
+    // without a limit swapped in chunks stay
+    doc.setMemoryLimit(0);
+    doc.resetStatistics();
+    const int swapped = doc.swappedChunkCount();
+    for (int i=0; i<text.size(); i += 50)
+        doc.insert(i, "x");
+    QCOMPARE(doc.statistics().chunksEvicted, qint64(0));
+    QVERIFY(doc.swappedChunkCount() < swapped);
+}
+
+void tst_TextDocument::compression()
+{
+    TextDocument doc;
+    doc.setChunkSize(100);
+    QString text = numberedLines(1000);
+    doc.setText(text);
+    const qint64 uncompressed = doc.currentMemoryUsage();
+
+    doc.setCompressionThreshold(5);
+    TextDocument::Statistics statistics = doc.statistics();
+    QCOMPARE(statistics.chunksCompressed, qint64(doc.chunkCount() - 6));
+    QVERIFY(statistics.compressedBytes < statistics.compressedSize);
+    QVERIFY(doc.currentMemoryUsage() < uncompressed);
+    QCOMPARE(doc.currentMemoryUsage() - statistics.compressedBytes,
+             uncompressed - statistics.compressedSize);
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+    QVERIFY(doc.statistics().chunksUncompressed > 0);
+
+    srand(0);
+    for (int i=0; i<200; ++i) {
+        const int pos = rand() % (text.size() + 1);
+        if (rand() % 2) {
+            const QString string = QString::number(i);
+            doc.insert(pos, string);
+            text.insert(pos, string);
+        } else {
+            const int size = qMin(rand() % 20, text.size() - pos);
+            doc.remove(pos, size);
+            text.remove(pos, size);
+        }
+    }
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+    QCOMPARE(doc.lineNumber(text.size() - 1), text.count(QLatin1Char('\n')) - (text.endsWith(QLatin1Char('\n')) ? 1 : 0));
+
+    doc.setCompressionThreshold(0);
+    statistics = doc.statistics();
+    for (int i=0; i<text.size(); i += 10)
+        doc.insert(i, "x");
+    QCOMPARE(doc.statistics().chunksCompressed, statistics.chunksCompressed);
+    QVERIFY(doc.statistics().compressedBytes < statistics.compressedBytes);
+}
+
+void tst_TextDocument::latin1Chunks()
+{
+    QString text = numberedLines(1000);
+    TextDocument wide;
+    wide.setChunkSize(100);
+    wide.setText(text);
+
+    TextDocument doc;
+    doc.setChunkSize(100);
+    doc.setOption(TextDocument::Latin1Chunks);
+    doc.setText(text);
+    QCOMPARE(doc.currentMemoryUsage() * 2, wide.currentMemoryUsage());
+    QVERIFY(!doc.d->first->latin1.isEmpty());
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+    QCOMPARE(doc.lineNumber(text.size() - 1), 999);
+    QCOMPARE(doc.find("line 500").position(), qint64(text.indexOf("line 500") + 8));
+
+    doc.insert(3, QString::fromUtf8("\xc3\xa6\xc3\xb8"));
+    text.insert(3, QString::fromUtf8("\xc3\xa6\xc3\xb8"));
+    QVERIFY(!doc.d->first->latin1.isEmpty());
+    doc.insert(2, QChar(0x263a));
+    text.insert(2, QChar(0x263a));
+    QVERIFY(doc.d->first->latin1.isEmpty());
+    QCOMPARE(doc.d->first->data, text.left(doc.d->first->size()));
+
+    srand(0);
+    for (int i=0; i<200; ++i) {
+        const int pos = rand() % (text.size() + 1);
+        if (rand() % 2) {
+            const QString string = (i % 10 == 0 ? QString(QChar(0x263a)) : QString()) + QString::number(i) + QLatin1Char('\n');
+            doc.insert(pos, string);
+            text.insert(pos, string);
+        } else {
+            const int size = qMin(rand() % 20, text.size() - pos);
+            doc.remove(pos, size);
+            text.remove(pos, size);
+        }
+    }
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+    for (int i=0; i<text.size(); i += 97) {
+        QCOMPARE(doc.readCharacter(i), text.at(i));
+        QCOMPARE(doc.lineNumber(i), text.left(i).count(QLatin1Char('\n')));
+    }
+    QVERIFY(doc.currentMemoryUsage() < wide.currentMemoryUsage());
+}
+
+void tst_TextDocument::extents()
+{
+    QBuffer buffer;
+    TextDocument doc;
+    QString text = loadLines(&doc, &buffer, 1000);
+    QVERIFY(!text.isEmpty());
+    QCOMPARE(doc.chunkCount(), 1);
+    QCOMPARE(doc.documentSize(), qint64(text.size()));
+
+    // reading leaves the extent alone
+    QCOMPARE(doc.readCharacter(5050), text.at(5050));
+    QCOMPARE(doc.readCharacter(text.size() - 1), text.at(text.size() - 1));
+    QCOMPARE(doc.read(4950, 100), text.mid(4950, 100));
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+    QCOMPARE(doc.readRef(5010, 20).toString(), text.mid(5010, 20));
+#endif
+    QCOMPARE(doc.lineNumber(5050), 561);
+    QCOMPARE(doc.positionForLine(700), qint64(6300));
+    QCOMPARE(doc.chunkCount(), 1);
+
+    QBuffer saved;
+    saved.open(QIODevice::WriteOnly);
+    QVERIFY(doc.save(&saved));
+    QCOMPARE(saved.data(), text.toLatin1());
+    QCOMPARE(doc.chunkCount(), 1);
+
+    doc.insert(4020, "inserted\n");
+    text.insert(4020, "inserted\n");
+    doc.remove(6000, 250);
+    text.remove(6000, 250);
+    const int chunks = doc.chunkCount();
+    QVERIFY(chunks > 1);
+    QCOMPARE(doc.lineNumber(7000), text.left(7000).count(QLatin1Char('\n')));
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+    QCOMPARE(doc.find("line 999").position(), qint64(text.indexOf("line 999") + 8));
+    QCOMPARE(doc.chunkCount(), chunks);
+}
+
+class SpanCollector : public TextDocument::SpanVisitor
+{
+public:
+    SpanCollector(int max = -1) : spans(0), maxSpans(max), next(-1) {}
+    bool visit(qint64 pos, const QChar *data, int size)
+    {
+        if (next != -1 && pos != next)
+            return false;
+        next = pos + size;
+        text.append(data, size);
+        return ++spans != maxSpans;
+    }
+    QString text;
+    int spans, maxSpans;
+    qint64 next;
+};
+
+void tst_TextDocument::forEachSpan()
+{
+    QBuffer buffer;
+    TextDocument doc;
+    QString text = loadLines(&doc, &buffer, 1000);
+    QVERIFY(!text.isEmpty());
+    SpanCollector all;
+    QVERIFY(doc.forEachSpan(0, -1, &all));
+    QCOMPARE(all.text, text);
+    QCOMPARE(all.spans, 90);
+    QCOMPARE(doc.chunkCount(), 1); // the extent was read without splitting it
+
+    SpanCollector part(2);
+    QVERIFY(!doc.forEachSpan(150, 1000, &part));
+    QCOMPARE(part.text, text.mid(150, 150));
+
+    doc.insert(310, QString::fromUtf8("\xe2\x98\xba"));
+    text.insert(310, QString::fromUtf8("\xe2\x98\xba"));
+    SpanCollector edited;
+    QVERIFY(doc.forEachSpan(250, 100, &edited));
+    QCOMPARE(edited.text, text.mid(250, 100));
+    QCOMPARE(doc.readRef(310, 5).toString(), text.mid(310, 5));
+
+    TextDocument narrow;
+    narrow.setChunkSize(100);
+    narrow.setOption(TextDocument::Latin1Chunks);
+    narrow.setText(text.left(300));
+    SpanCollector latin1;
+    QVERIFY(narrow.forEachSpan(50, -1, &latin1));
+    QCOMPARE(latin1.text, text.mid(50, 250));
+    QCOMPARE(latin1.spans, 3);
+}
+
+void tst_TextDocument::applyEdits()
+{
+    QBuffer buffer;
+    TextDocument doc;
+    QString text = loadLines(&doc, &buffer, 1000);
+    QVERIFY(!text.isEmpty());
+    QCOMPARE(doc.lineNumber(7000), 777);
+    TextCursor before(&doc, 95);
+    TextCursor inside(&doc, 4005);
+    TextCursor after(&doc, 7500);
+    TextSection *section = doc.insertTextSection(4000, 100);
+    TextSection *gone = doc.insertTextSection(5005, 10);
+
+    // given out of order. Positions are in the original text
+    QVector<TextDocument::Edit> edits;
+    edits.append(TextDocument::Edit(5000, 20));
+    edits.append(TextDocument::Edit(100, 0, "new\nlines\n"));
+    edits.append(TextDocument::Edit(4002, 4, "x\n"));
+    edits.append(TextDocument::Edit(7200, 0, "y"));
+    edits.append(TextDocument::Edit(100, 0, "first "));
+    QVERIFY(doc.applyEdits(edits));
+
+    const QString original = text;
+    text.insert(7200, "y");
+    text.remove(5000, 20);
+    text.replace(4002, 4, "x\n");
+    text.insert(100, "new\nlines\nfirst ");
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+    QCOMPARE(before.position(), qint64(95));
+    QCOMPARE(inside.position(), qint64(4002 + 16 + 2));
+    QCOMPARE(after.position(), qint64(7500 + 16 - 2 - 20 + 1));
+    QCOMPARE(section->position(), qint64(4016));
+    QCOMPARE(section->size(), qint64(98));
+    QVERIFY(!doc.sections().contains(gone));
+    for (int pos=0; pos<text.size(); pos += 97)
+        QCOMPARE(doc.lineNumber(pos), text.left(pos).count('\n'));
+
+    QVERIFY(!doc.applyEdits(QVector<TextDocument::Edit>() << TextDocument::Edit(10, 5) << TextDocument::Edit(12, 1)));
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+
+    doc.undo();
+    QCOMPARE(doc.read(0, doc.documentSize()), original);
+    QCOMPARE(doc.lineNumber(7000), 777);
+    doc.redo();
+    QCOMPARE(doc.read(0, doc.documentSize()), text);
+}
+
+void tst_TextDocument::sectionTree()
+{
+    TextDocument doc;
+    doc.setText(QString(5000, QLatin1Char('x')));
+    QHash<TextSection*, QPair<qint64, qint64> > expected;
+    srand(0);
+    for (int i=0; i<500; ++i) {
+        const qint64 pos = rand() % 4900;
+        const qint64 size = rand() % 3 ? rand() % 100 : 0;
+        expected[doc.insertTextSection(pos, size)] = qMakePair(pos, size);
+    }
+    for (int i=0; i<300; ++i) {
+        const qint64 pos = rand() % doc.documentSize();
+        QMutableHashIterator<TextSection*, QPair<qint64, qint64> > it(expected);
+        if (rand() % 2) {
+            const qint64 size = rand() % 50 + 1;
+            doc.insert(pos, QString(int(size), QLatin1Char('y')));
+            while (it.hasNext()) {
+                QPair<qint64, qint64> &section = it.next().value();
+                if (section.first >= pos) {
+                    section.first += size;
+                } else if (section.first + section.second > pos) {
+                    section.second += size;
+                }
+            }
+        } else {
+            const qint64 size = qMin<qint64>(rand() % 50 + 1, doc.documentSize() - pos);
+            doc.remove(pos, size);
+            while (it.hasNext()) {
+                QPair<qint64, qint64> &section = it.next().value();
+                const qint64 end = section.first + section.second;
+                if (section.first < pos) {
+                    section.second -= qBound<qint64>(0, end - pos, size);
+                } else if (section.first < pos + size) {
+                    if (section.second > 0 && end <= pos + size) {
+                        it.remove();
+                        continue;
+                    }
+                    section.first = pos;
+                    section.second = qMax<qint64>(0, end - pos - size);
+                } else {
+                    section.first -= size;
+                }
+            }
+        }
+    }
+    const QList<TextSection*> all = doc.sections();
+    QCOMPARE(all.size(), expected.size());
+    for (int i=0; i<all.size(); ++i) {
+        QVERIFY(expected.contains(all.at(i)));
+        QCOMPARE(all.at(i)->position(), expected.value(all.at(i)).first);
+        QCOMPARE(all.at(i)->size(), expected.value(all.at(i)).second);
+        QVERIFY(i == 0 || all.at(i - 1)->position() <= all.at(i)->position());
+    }
+    for (qint64 pos=0; pos<doc.documentSize(); pos += 97) {
+        const QList<TextSection*> partial = doc.sections(pos, 30, TextSection::IncludePartial);
+        int count = 0;
+        foreach(TextSection *section, all) {
+            // empty sections only match when they're inside the range
+            const bool after = section->size() > 0
+                               ? section->position() + section->size() > pos
+                               : section->position() > pos;
+            if (after && section->position() < pos + 30) {
+                QVERIFY(partial.contains(section));
+                ++count;
+            }
+        }
+        QCOMPARE(partial.size(), count);
+    }
+}
+
+class OddData : public TextDocument::SectionFilter
+{
+public:
+    bool matches(const TextSection *section) { return section->data().toInt() % 2; }
+};
+
+void tst_TextDocument::bulkSections()
+{
+    TextDocument doc;
+    doc.setText(QString(1000, QLatin1Char('x')));
+    TextSection *old = doc.insertTextSection(500, 10);
+    QVector<TextDocument::SectionSpec> specs;
+    for (int i=0; i<100; ++i)
+        specs.append(TextDocument::SectionSpec((i * 37) % 100 * 10, 5, QTextCharFormat(), i));
+    const QList<TextSection*> added = doc.insertTextSections(specs);
+    QCOMPARE(added.size(), 100);
+    const QList<TextSection*> all = doc.sections();
+    QCOMPARE(all.size(), 101);
+    for (int i=0; i<all.size(); ++i) {
+        QVERIFY(i == 0 || all.at(i - 1)->position() <= all.at(i)->position());
+        QCOMPARE(all.at(i)->document(), &doc);
+    }
+    QCOMPARE(all.indexOf(old), all.indexOf(doc.sections(500, 5).value(0)) + 1);
+    QCOMPARE(doc.sections(0, 100, TextSection::IncludePartial).size(), 10);
+
+    // a few go into the tree one at a time, in the same order
+    QVector<TextDocument::SectionSpec> few;
+    few << TextDocument::SectionSpec(500, 1, QTextCharFormat(), 1000)
+        << TextDocument::SectionSpec(500, 1, QTextCharFormat(), 1001);
+    const QList<TextSection*> fewAdded = doc.insertTextSections(few);
+    QCOMPARE(fewAdded.size(), 2);
+    QList<TextSection*> at500 = doc.sections(500, 10);
+    QCOMPARE(at500.size(), 4);
+    QCOMPARE(at500.at(0), fewAdded.at(0));
+    QCOMPARE(at500.at(1), fewAdded.at(1));
+    QCOMPARE(at500.at(3), old);
+    QCOMPARE(doc.removeTextSections(500, 1), 2);
+    QCOMPARE(doc.sections().size(), 101);
+
+    few << TextDocument::SectionSpec(998, 5);
+    QVERIFY(doc.insertTextSections(few).isEmpty());
+    QVERIFY(doc.insertTextSections(QVector<TextDocument::SectionSpec>()
+                                   << TextDocument::SectionSpec(-1, 1)).isEmpty());
+    QCOMPARE(doc.sections().size(), 101);
+    QCOMPARE(doc.d->sectionCount, 101);
+    doc.insert(0, "abc");
+    QCOMPARE(doc.sections(503, 10).size(), 2);
+
+    OddData odd;
+    QCOMPARE(doc.removeTextSections(0, -1, 0, &odd), 50);
+    QCOMPARE(doc.sections().size(), 51);
+    QCOMPARE(doc.removeTextSections(0, 503), 25);
+    QCOMPARE(doc.sections().value(1), old);
+    QCOMPARE(doc.removeTextSections(), 26);
+    QVERIFY(doc.sections().isEmpty());
+    QCOMPARE(doc.d->sectionCount, 0);
+}
+
+void tst_TextDocument::sectionFormats()
+{
+    TextDocument doc;
+    doc.setText(QString(100, QLatin1Char('x')));
+    QTextCharFormat blue;
+    blue.setBackground(Qt::blue);
+    QTextCharFormat red;
+    red.setForeground(Qt::red);
+    TextSection *a = doc.insertTextSection(0, 10, blue);
+    TextSection *b = doc.insertTextSection(20, 10, red);
+    TextSection *c = doc.insertTextSection(40, 10, blue);
+    QCOMPARE(a->format(), blue);
+    QCOMPARE(b->format(), red);
+    QCOMPARE(c->format(), a->format());
+    c->setFormat(red);
+    QCOMPARE(c->format(), red);
+    QCOMPARE(a->format(), blue);
+
+    QVERIFY(!a->hasCursor());
+    a->setCursor(QCursor(Qt::PointingHandCursor));
+    b->setCursor(QCursor(Qt::PointingHandCursor));
+    QVERIFY(a->hasCursor());
+    QCOMPARE(a->cursor().shape(), Qt::PointingHandCursor);
+    QCOMPARE(b->cursor().shape(), Qt::PointingHandCursor);
+    a->resetCursor();
+    QVERIFY(!a->hasCursor());
+    QVERIFY(b->hasCursor());
+
+    // bitmap cursors with the same pixmap and hot spot share one entry
+    const QPixmap pixmap(16, 16);
+    a->setCursor(QCursor(pixmap, 1, 2));
+    const int cursors = doc.d->sectionStyles.cursors.size();
+    for (int i=0; i<10; ++i)
+        c->setCursor(QCursor(pixmap, 1, 2));
+    QCOMPARE(doc.d->sectionStyles.cursors.size(), cursors);
+    QCOMPARE(c->cursor().pixmap().cacheKey(), pixmap.cacheKey());
+    c->setCursor(QCursor(pixmap, 2, 2));
+    QCOMPARE(doc.d->sectionStyles.cursors.size(), cursors + 1);
+
+    doc.takeTextSection(b);
+    QCOMPARE(b->format(), red);
+    QCOMPARE(b->cursor().shape(), Qt::PointingHandCursor);
+
+    // every document has a pool of its own
+    TextDocument other;
+    other.setText(QString(100, QLatin1Char('y')));
+    QVERIFY(other.d->sectionStyles.formats.isEmpty());
+    other.insertTextSection(b);
+    QCOMPARE(b->format(), red);
+    QCOMPARE(b->cursor().shape(), Qt::PointingHandCursor);
+    QCOMPARE(other.d->sectionStyles.formats.size(), 1);
+    other.takeTextSection(b);
+    delete b;
+
+    // sections that are deleted leave their styles where they were
+    const int detached = TextSectionStyles::detached()->styles.size();
+    QTextCharFormat green;
+    green.setForeground(Qt::green);
+    delete doc.insertTextSection(60, 10, green);
+    doc.insertTextSection(70, 5, green);
+    const int sections = doc.sections().size();
+    doc.remove(69, 10);
+    QCOMPARE(doc.sections().size(), sections - 1);
+    QCOMPARE(TextSectionStyles::detached()->styles.size(), detached);
+}
+
+void tst_TextDocument::cursorTracking()
+{
+    TextDocument doc;
+    doc.setText(QString(2000, QLatin1Char('x')));
+    QList<TextCursor> cursors;
+    QList<qint64> positions, anchors;
+    for (int i=0; i<500; ++i) {
+        const qint64 pos = (i * 7919) % 2001;
+        const qint64 anchor = (i * 104729) % 2001;
+        cursors.append(TextCursor(&doc, pos, anchor));
+        positions.append(pos);
+        anchors.append(anchor);
+    }
+    uint seed = 1;
+    for (int i=0; i<200; ++i) {
+        seed = seed * 1103515245 + 12345;
+        const qint64 pos = (seed >> 8) % (doc.documentSize() + 1);
+        seed = seed * 1103515245 + 12345;
+        const qint64 size = (seed >> 8) % 50;
+        if (i % 2) {
+            doc.insert(pos, QString(int(size), QLatin1Char('y')));
+            for (int j=0; j<cursors.size(); ++j) {
+                if (positions.at(j) >= pos)
+                    positions[j] += size;
+                if (anchors.at(j) >= pos)
+                    anchors[j] += size;
+            }
+        } else {
+            const qint64 count = qMin(size, doc.documentSize() - pos);
+            doc.remove(pos, count);
+            for (int j=0; j<cursors.size(); ++j) {
+                if (positions.at(j) >= pos)
+                    positions[j] -= qMin(count, positions.at(j) - pos);
+                if (anchors.at(j) >= pos)
+                    anchors[j] -= qMin(count, anchors.at(j) - pos);
+            }
+        }
+    }
+    for (int j=0; j<cursors.size(); ++j) {
+        QCOMPARE(cursors.at(j).position(), positions.at(j));
+        QCOMPARE(cursors.at(j).anchor(), anchors.at(j));
+    }
+
+    TextCursor moved = cursors.first();
+    moved.setPosition(10);
+    QCOMPARE(moved.position(), qint64(10));
+    QCOMPARE(cursors.first().position(), positions.first());
+    doc.insert(0, "abc");
+    QCOMPARE(moved.position(), qint64(13));
+    QCOMPARE(cursors.first().position(), positions.first() + 3);
+}
+
+static void compareLines(const TextDocument &doc, const QString &text)
+{
+    QList<qint64> starts;
+    starts.append(0);
+    for (int i=0; i<text.size(); ++i) {
+        if (text.at(i) == QLatin1Char('\n'))
+            starts.append(i + 1);
+    }
+    QCOMPARE(doc.lineCount(), starts.size());
+    for (int i=0; i<starts.size(); i += 7) {
+        QCOMPARE(doc.positionForLine(i), starts.at(i));
+        QCOMPARE(doc.lineNumber(starts.at(i)), i);
+    }
+    QCOMPARE(doc.positionForLine(starts.size() - 1), starts.last());
+    QCOMPARE(doc.positionForLine(starts.size()), qint64(-1));
+    QCOMPARE(doc.positionForLine(-1), qint64(-1));
+}
+
+void tst_TextDocument::lineIndex()
+{
+    QString text;
+    for (int i=0; i<2000; ++i)
+        text += QString(i % 13, QLatin1Char('x')) + QLatin1Char('\n');
+
+    TextDocument loaded;
+    loaded.setChunkSize(100);
+    loaded.setText(text);
+    compareLines(loaded, text);
+
+    // the lines of the parts of the extent that are still lazy are counted
+    // without splitting it up
+    QBuffer buffer;
+    buffer.setData(text.toLatin1());
+    buffer.open(QIODevice::ReadOnly);
+    TextDocument sparse;
+    sparse.setChunkSize(100);
+    sparse.setOptions(TextDocument::NoImplicitLoadAll);
+    QVERIFY(sparse.load(&buffer, TextDocument::Sparse, "ISO-8859-1"));
+    QCOMPARE(sparse.lineNumber(text.size() / 2), text.left(text.size() / 2).count(QLatin1Char('\n')));
+    compareLines(sparse, text);
+
+    for (int i=0; i<20; ++i) {
+        loaded.insert(i * 3, "a\nb");
+        text.insert(i * 3, "a\nb");
+        loaded.remove(text.size() / 2, 15);
+        text.remove(text.size() / 2, 15);
+    }
+    compareLines(loaded, text);
+}
+
+void tst_TextDocument::backgroundLineCount()
+{
+    QString text;
+    for (int i=0; i<20000; ++i)
+        text += QString(i % 17, QLatin1Char('y')) + QLatin1Char('\n');
+
+    QTemporaryFile file;
+    QVERIFY(file.open());
+    file.write(text.toLatin1());
+    file.flush();
+
+    for (int mapped=0; mapped<2; ++mapped) {
+        TextDocument doc;
+        doc.setChunkSize(100);
+        doc.setOptions(TextDocument::NoImplicitLoadAll|TextDocument::CountLinesInBackground
+                       |(mapped ? TextDocument::MapFile : TextDocument::NoOptions));
+        QVERIFY(doc.load(file.fileName(), TextDocument::Sparse, "ISO-8859-1"));
+        // answered right before the scan is done as well
+        QCOMPARE(doc.lineNumber(text.size() - 1), text.count(QLatin1Char('\n')) - 1);
+        for (int i=0; i<500 && doc.isCountingLines(); ++i)
+            QThread::msleep(10);
+        QVERIFY(!doc.isCountingLines());
+        compareLines(doc, text);
+
+        QString edited = text;
+        for (int i=0; i<20; ++i) {
+            doc.insert(i * 501, "a\nb");
+            edited.insert(i * 501, "a\nb");
+            doc.remove(edited.size() / 2 + i * 37, 15);
+            edited.remove(edited.size() / 2 + i * 37, 15);
+        }
+        compareLines(doc, edited);
+    }
+}
+
+void tst_TextDocument::scanKernels()
+{
+    QString text;
+    for (int i=0; i<3000; ++i)
+        text += QChar(i % 7 == 0 || i % 11 == 0 ? '\n' : i % 5 == 0 ? 0x0a0a : 'a' + i % 26);
+    const QByteArray latin1 = QString(text).replace(QChar(0x0a0a), QLatin1Char('x')).toLatin1();
+
+    const int sizes[] = { 0, 1, 7, 8, 15, 16, 17, 31, 32, 33, 100, 1000, 2900 };
+    for (int from=0; from<40; from += 3) {
+        for (uint s=0; s<sizeof(sizes) / sizeof(sizes[0]); ++s) {
+            const int size = sizes[s];
+            const QString part = text.mid(from, size);
+            const ushort *utf16 = text.utf16() + from;
+            const char *bytes = latin1.constData() + from;
+            const int count = part.count(QLatin1Char('\n'));
+            QCOMPARE(TextScan::count(utf16, size, '\n'), count);
+            QCOMPARE(TextScan::count(bytes, size, '\n'), count);
+            QCOMPARE(TextScan::count(utf16, size, 0x0a0a), part.count(QChar(0x0a0a)));
+            QCOMPARE(TextScan::indexOf(utf16, size, '\n'), part.indexOf(QLatin1Char('\n')));
+            QCOMPARE(TextScan::lastIndexOf(utf16, size, '\n'), part.lastIndexOf(QLatin1Char('\n')));
+            int index = -1;
+            for (int n=1; n<=count + 1; ++n) {
+                index = (n <= count ? part.indexOf(QLatin1Char('\n'), index + 1) : -1);
+                QCOMPARE(TextScan::indexOfNth(utf16, size, '\n', n), index);
+                QCOMPARE(TextScan::indexOfNth(bytes, size, '\n', n), index);
+            }
+        }
+    }
+
+    // find(QChar) goes through them as well, backwards a block at a time
+    TextDocument doc;
+    doc.setChunkSize(100);
+    doc.setText(text);
+    for (int pos=0; pos<text.size(); pos += 37) {
+        QCOMPARE(doc.find(QLatin1Char('\n'), pos).anchor(), qint64(text.indexOf(QLatin1Char('\n'), pos)));
+        QCOMPARE(doc.find(QLatin1Char('\n'), pos, TextDocument::FindBackward).anchor(),
+                 qint64(text.lastIndexOf(QLatin1Char('\n'), pos)));
+    }
+}
+
+void tst_TextDocument::findStringSearch()
+{
+    QString text;
+    for (int i=0; i<4000; ++i)
+        text += QLatin1Char("abAB c\n"[(i * 7 + i / 13) % 7]);
+    TextDocument doc;
+    doc.setChunkSize(64);
+    doc.setText(text);
+
+    // matches that cross chunks, and one longer than a chunk
+    QStringList needles;
+    needles << "ab" << "aba" << "bAB" << "ab c\na" << "AB" << "abababab" << text.mid(1000, 150);
+    foreach(const QString &needle, needles) {
+        for (int caseSensitive=0; caseSensitive<2; ++caseSensitive) {
+            const TextDocument::FindMode flags = (caseSensitive ? TextDocument::FindCaseSensitively : TextDocument::FindMode(0));
+            const Qt::CaseSensitivity cs = (caseSensitive ? Qt::CaseSensitive : Qt::CaseInsensitive);
+            int pos = 0;
+            forever {
+                const int expected = text.indexOf(needle, pos, cs);
+                QCOMPARE(doc.find(needle, pos, flags).anchor(), qint64(expected));
+                if (expected == -1)
+                    break;
+                pos = expected + 1;
+            }
+            pos = text.size() - 1;
+            forever {
+                const int from = pos + 1 - needle.size();
+                const int expected = (from >= 0 ? text.lastIndexOf(needle, from, cs) : -1);
+                QCOMPARE(doc.find(needle, pos, flags|TextDocument::FindBackward).anchor(), qint64(expected));
+                if (expected <= 0)
+                    break;
+                pos = expected + needle.size() - 2;
+            }
+        }
+    }
+}
+
+class FindCollector : public QObject
+{
+    Q_OBJECT
+public:
+    FindCollector(TextDocument *doc)
+        : document(doc), abortAfter(-1)
+    {
+        connect(document, SIGNAL(entryFound(TextCursor)), this, SLOT(onEntryFound(TextCursor)));
+    }
+public slots:
+    void onEntryFound(const TextCursor &cursor)
+    {
+        positions.append(cursor.anchor());
+        if (positions.size() == abortAfter)
+            document->abortFind();
+    }
+public:
+    TextDocument *document;
+    int abortAfter;
+    QList<qint64> positions;
+};
+
+void tst_TextDocument::parallelFindAll()
+{
+    QString text;
+    for (int i=0; i<6000; ++i)
+        text += QLatin1String(i % 3 ? "abc " : i % 5 ? "ab\nAB c " : "cabcab ");
+    QBuffer buffer;
+    buffer.setData(text.toLatin1());
+    buffer.open(QIODevice::ReadOnly);
+    TextDocument doc;
+    doc.setChunkSize(100);
+    doc.setOptions(TextDocument::NoImplicitLoadAll);
+    QVERIFY(doc.load(&buffer, TextDocument::Sparse, "ISO-8859-1"));
+    // some of the chunks in memory, the rest still on the device
+    for (int i=0; i<10; ++i) {
+        doc.insert(i * 1700, "ab cab");
+        doc.remove(i * 1900 + 50, 7);
+    }
+
+    FindCollector collector(&doc);
+    const TextDocument::FindMode modes[] = {
+        TextDocument::FindAll,
+        TextDocument::FindAll|TextDocument::FindAllowInterrupt,
+        TextDocument::FindAll|TextDocument::FindAllowInterrupt|TextDocument::FindCaseSensitively,
+        TextDocument::FindAll|TextDocument::FindAllowInterrupt|TextDocument::FindWholeWords
+    };
+    QStringList needles;
+    needles << "ab c" << "AB" << "abc" << "cab" << "c";
+    foreach(const QString &needle, needles) {
+        for (uint m=0; m<sizeof(modes) / sizeof(modes[0]); ++m) {
+            collector.positions.clear();
+            doc.find(needle, 0, modes[m]);
+            const QList<qint64> expected = collector.positions;
+            QVERIFY(!expected.isEmpty());
+            collector.positions.clear();
+            doc.find(needle, 0, modes[m]|TextDocument::FindParallel);
+            QCOMPARE(collector.positions, expected);
+
+            // aborting stops the reports in the same place
+            collector.positions.clear();
+            collector.abortAfter = 5;
+            QVERIFY(doc.find(needle, 0, modes[m]|TextDocument::FindParallel|TextDocument::FindAllowInterrupt).isNull());
+            QCOMPARE(collector.positions, expected.mid(0, 5));
+            collector.abortAfter = -1;
+        }
+    }
+
+    // the threads decode the pieces of a variable width device themselves
+    QTemporaryFile file;
+    QVERIFY(file.open());
+    file.write(text.replace(QString("AB"), QString::fromUtf8("\xc3\xa6B")).toUtf8());
+    file.flush();
+    TextDocument utf8;
+    utf8.setChunkSize(100);
+    utf8.setOptions(TextDocument::NoImplicitLoadAll);
+    QVERIFY(utf8.load(file.fileName(), TextDocument::Sparse, "UTF-8"));
+    FindCollector utf8Collector(&utf8);
+    utf8.find(QString::fromUtf8("\xc3\xa6B c"), 0, TextDocument::FindAll);
+    const QList<qint64> expected = utf8Collector.positions;
+    QVERIFY(!expected.isEmpty());
+    utf8Collector.positions.clear();
+    utf8.find(QString::fromUtf8("\xc3\xa6B c"), 0, TextDocument::FindAll|TextDocument::FindParallel);
+    QCOMPARE(utf8Collector.positions, expected);
+}
+
 void tst_TextDocument::find4()
 {
     TextDocument doc;
@@ -1028,10 +2352,10 @@ public:
     Aborter(TextDocument *doc)
         : document(doc)
     {
-        connect(document, SIGNAL(findProgress(qreal,int)), this, SLOT(onFindProgress(qreal,int)));
+        connect(document, SIGNAL(findProgress(qreal,qint64)), this, SLOT(onFindProgress(qreal,qint64)));
     }
 public slots:
-    void onFindProgress(qreal, int)
+    void onFindProgress(qreal, qint64)
     {
         document->abortFind();
     }
@@ -1079,7 +2403,7 @@ public:
     Aborter2(TextDocument *doc)
         : document(doc), prcnt(-1)
     {
-        connect(document, SIGNAL(findProgress(qreal,int)), this, SLOT(onFindProgress(qreal)));
+        connect(document, SIGNAL(findProgress(qreal,qint64)), this, SLOT(onFindProgress(qreal)));
     }
     qreal percentage() const { return prcnt; }
 public slots:
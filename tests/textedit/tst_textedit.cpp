@@ -71,6 +71,8 @@ private slots:
     void emptyDocumentTest();
     void changeDocumentTest();
     void clickInBlankAreaTest();
+    void sectionProviderTest();
+    void overlappingProvidedSections();
 };
 
 tst_TextEdit::tst_TextEdit()
@@ -257,38 +259,38 @@ void tst_TextEdit::selectionTest()
     QTest::keyClick(&edit, Qt::Key_Right, Qt::ShiftModifier);
     QVERIFY(edit.textCursor().hasSelection());
     QCOMPARE(edit.selectedText(), QString("1"));
-    QCOMPARE(edit.textCursor().anchor(), 0);
-    QCOMPARE(edit.textCursor().position(), 1);
+    QCOMPARE(edit.textCursor().anchor(), qint64(0));
+    QCOMPARE(edit.textCursor().position(), qint64(1));
 
     QTest::keyClick(&edit, Qt::Key_Right, Qt::ShiftModifier);
     QVERIFY(edit.textCursor().hasSelection());
     QCOMPARE(edit.selectedText(), QString("12"));
-    QCOMPARE(edit.textCursor().anchor(), 0);
-    QCOMPARE(edit.textCursor().position(), 2);
+    QCOMPARE(edit.textCursor().anchor(), qint64(0));
+    QCOMPARE(edit.textCursor().position(), qint64(2));
 
     QTest::keyClick(&edit, Qt::Key_Right, Qt::ShiftModifier);
     QVERIFY(edit.textCursor().hasSelection());
     QCOMPARE(edit.textCursor().selectedText(), QString("123"));
-    QCOMPARE(edit.textCursor().anchor(), 0);
-    QCOMPARE(edit.textCursor().position(), 3);
+    QCOMPARE(edit.textCursor().anchor(), qint64(0));
+    QCOMPARE(edit.textCursor().position(), qint64(3));
 
     QTest::keyClick(&edit, Qt::Key_Left, Qt::ShiftModifier);
     QVERIFY(edit.textCursor().hasSelection());
     QCOMPARE(edit.textCursor().selectedText(), QString("12"));
-    QCOMPARE(edit.textCursor().anchor(), 0);
-    QCOMPARE(edit.textCursor().position(), 2);
+    QCOMPARE(edit.textCursor().anchor(), qint64(0));
+    QCOMPARE(edit.textCursor().position(), qint64(2));
 
     QTest::keyClick(&edit, Qt::Key_Left, Qt::ShiftModifier);
     QVERIFY(edit.textCursor().hasSelection());
     QCOMPARE(edit.textCursor().selectedText(), QString("1"));
-    QCOMPARE(edit.textCursor().anchor(), 0);
-    QCOMPARE(edit.textCursor().position(), 1);
+    QCOMPARE(edit.textCursor().anchor(), qint64(0));
+    QCOMPARE(edit.textCursor().position(), qint64(1));
 
     QTest::keyClick(&edit, Qt::Key_Left, Qt::ShiftModifier);
     QVERIFY(!edit.textCursor().hasSelection());
     QCOMPARE(edit.textCursor().selectedText(), QString());
-    QCOMPARE(edit.textCursor().anchor(), 0);
-    QCOMPARE(edit.textCursor().position(), 0);
+    QCOMPARE(edit.textCursor().anchor(), qint64(0));
+    QCOMPARE(edit.textCursor().position(), qint64(0));
 }
 
 void tst_TextEdit::sectionTest()
@@ -358,7 +360,92 @@ void tst_TextEdit::clickInBlankAreaTest()
 		      QPoint(50, 1000));
 }
 
+class LineProvider : public TextEdit::SectionProvider
+{
+public:
+    LineProvider() : calls(0), largest(0) {}
+    QList<TextEdit::ProvidedSection> sections(qint64 position, qint64 size)
+    {
+        ++calls;
+        largest = qMax(largest, size);
+        QTextCharFormat format;
+        format.setBackground(Qt::yellow);
+        QList<TextEdit::ProvidedSection> ret;
+        ret.append(TextEdit::ProvidedSection(position, 4, format));
+        return ret;
+    }
+    int calls;
+    qint64 largest;
+};
+
+void tst_TextEdit::sectionProviderTest()
+{
+    TextEdit edit;
+    QString text;
+    for (int i=0; i<100000; ++i)
+        text += QString("This is text on line %1\n").arg(i);
+    edit.setText(text);
+    LineProvider provider;
+    edit.setSectionProvider(&provider);
+    QCOMPARE(edit.sectionProvider(), &provider);
+    edit.show();
+    QTest::qWaitForWindowShown(&edit);
+    QApplication::processEvents();
+    QVERIFY(provider.calls > 0);
+    QVERIFY(provider.largest < text.size() / 10);
+
+    const int calls = provider.calls;
+    edit.viewport()->repaint();
+    QCOMPARE(provider.calls, calls);
+    edit.invalidateProvidedSections();
+    edit.viewport()->repaint();
+    QCOMPARE(provider.calls, calls + 1);
+    edit.setSectionProvider(0);
+}
+
+class OverlappingProvider : public TextEdit::SectionProvider
+{
+public:
+    QList<TextEdit::ProvidedSection> sections(qint64 position, qint64 size)
+    {
+        QTextCharFormat longFormat;
+        longFormat.setForeground(Qt::blue);
+        QTextCharFormat shortFormat;
+        shortFormat.setBackground(Qt::yellow);
+        QList<TextEdit::ProvidedSection> ret;
+        ret.append(TextEdit::ProvidedSection(position, size, longFormat));
+        for (int i=0; i<size / 20; ++i)
+            ret.append(TextEdit::ProvidedSection(position + (i * 20), 4, shortFormat, 1));
+        return ret;
+    }
+};
 
+void tst_TextEdit::overlappingProvidedSections()
+{
+    TextEdit edit;
+    QString text;
+    for (int i=0; i<1000; ++i)
+        text += QString("This is text on line %1\n").arg(i);
+    edit.setText(text);
+    OverlappingProvider provider;
+    edit.setSectionProvider(&provider);
+    edit.show();
+    QTest::qWaitForWindowShown(&edit);
+    QApplication::processEvents();
+
+    // the short sections start after the long one that covers the whole
+    // viewport but must still be drawn
+    const QImage image = QPixmap::grabWidget(edit.viewport()).toImage();
+    const QRgb yellow = QColor(Qt::yellow).rgb();
+    bool found = false;
+    for (int y=0; y<image.height() && !found; ++y) {
+        for (int x=0; x<image.width() && !found; ++x) {
+            found = (image.pixel(x, y) == yellow);
+        }
+    }
+    QVERIFY(found);
+    edit.setSectionProvider(0);
+}
 
 QTEST_MAIN(tst_TextEdit)
 #include "tst_textedit.moc"
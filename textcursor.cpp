@@ -45,7 +45,7 @@ public:
         }
     }
 private:
-    int selectionStart, selectionEnd;
+    qint64 selectionStart, selectionEnd;
     TextEdit *textEdit;
 };
 
@@ -54,14 +54,15 @@ TextCursor::TextCursor()
 {
 }
 
-TextCursor::TextCursor(const TextDocument *document, int pos, int anc)
+TextCursor::TextCursor(const TextDocument *document, qint64 pos, qint64 anc)
     : d(0), textEdit(0)
 {
     if (document) {
-        const int documentSize = document->d->documentSize;
+        document->d->waitForCheckpoints(qMax(pos, anc));
+        const qint64 documentSize = document->d->documentSize;
         if (pos < 0 || pos > documentSize || anc < -1 || anc > documentSize) {
 #ifndef LAZYTEXTEDIT_AUTOTEST
-            qWarning("Invalid cursor data %d %d - %d\n",
+            qWarning("Invalid cursor data %lld %lld - %lld\n",
                      pos, anc, documentSize);
             Q_ASSERT(0);
 #endif
@@ -69,21 +70,22 @@ TextCursor::TextCursor(const TextDocument *document, int pos, int anc)
         }
         d = new TextCursorSharedPrivate;
         d->document = const_cast<TextDocument*>(document);
-        d->position = pos;
-        d->anchor = anc == -1 ? pos : anc;
-        d->document->d->textCursors.insert(d);
+        d->positionMark.offset = pos;
+        d->anchorMark.offset = anc == -1 ? pos : anc;
+        d->document->d->addCursor(d);
     }
 }
 
-TextCursor::TextCursor(const TextEdit *edit, int pos, int anc)
+TextCursor::TextCursor(const TextEdit *edit, qint64 pos, qint64 anc)
     : d(0), textEdit(0)
 {
     if (edit) {
         TextDocument *document = edit->document();
-        const int documentSize = document->d->documentSize;
+        document->d->waitForCheckpoints(qMax(pos, anc));
+        const qint64 documentSize = document->d->documentSize;
         if (pos < 0 || pos > documentSize || anc < -1 || anc > documentSize) {
 #ifndef LAZYTEXTEDIT_AUTOTEST
-            qWarning("Invalid cursor data %d %d - %d\n",
+            qWarning("Invalid cursor data %lld %lld - %lld\n",
                      pos, anc, documentSize);
             Q_ASSERT(0);
 #endif
@@ -91,9 +93,9 @@ TextCursor::TextCursor(const TextEdit *edit, int pos, int anc)
         }
         d = new TextCursorSharedPrivate;
         d->document = const_cast<TextDocument*>(document);
-        d->position = pos;
-        d->anchor = anc == -1 ? pos : anc;
-        d->document->d->textCursors.insert(d);
+        d->positionMark.offset = pos;
+        d->anchorMark.offset = anc == -1 ? pos : anc;
+        d->document->d->addCursor(d);
     }
 }
 
@@ -127,21 +129,21 @@ TextDocument *TextCursor::document() const
     return d ? d->document : 0;
 }
 
-void TextCursor::setSelection(int pos, int length) // can be negative
+void TextCursor::setSelection(qint64 pos, qint64 length) // can be negative
 {
     setPosition(pos + length);
     if (length != 0)
         setPosition(pos, KeepAnchor);
 }
 
-void TextCursor::setPosition(int pos, MoveMode mode)
+void TextCursor::setPosition(qint64 pos, MoveMode mode)
 {
     Q_ASSERT(!isNull());
     d->overrideColumn = -1;
     if (pos < 0 || pos > d->document->documentSize()) {
         clearSelection();
         return;
-    } else if (pos == d->position && (mode == KeepAnchor || d->anchor == d->position)) {
+    } else if (pos == d->position() && (mode == KeepAnchor || d->anchor() == d->position())) {
         return;
     }
 
@@ -152,7 +154,7 @@ void TextCursor::setPosition(int pos, MoveMode mode)
 #if 0
     Link *link = d->document->links(pos, 1).value(0, 0);
     if (link && link->position < pos && link->position + link->size > pos) { // inside a link
-        pos = (pos > d->position ? link->position + link->size : link->position);
+        pos = (pos > d->position() ? link->position + link->size : link->position);
     }
 #endif
 
@@ -160,21 +162,21 @@ void TextCursor::setPosition(int pos, MoveMode mode)
         clearSelection();
     }
 
-    d->position = pos;
+    d->setPosition(pos);
     if (mode == MoveAnchor) {
-        d->anchor = pos;
+        d->setAnchor(pos);
     }
     cursorChanged(true);
 }
 
-int TextCursor::position() const
+qint64 TextCursor::position() const
 {
-    return isNull() ? -1 : d->position;
+    return isNull() ? -1 : d->position();
 }
 
-int TextCursor::anchor() const
+qint64 TextCursor::anchor() const
 {
-    return isNull() ? -1 : d->anchor;
+    return isNull() ? -1 : d->anchor();
 }
 
 void TextCursor::insertText(const QString &text)
@@ -186,8 +188,8 @@ void TextCursor::insertText(const QString &text)
     }
     const bool old = d->document->d->cursorCommand;
     d->document->d->cursorCommand = true;
-    if (d->document->insert(d->position, text) && textEdit) {
-        emit textEdit->cursorPositionChanged(d->position);
+    if (d->document->insert(d->position(), text) && textEdit) {
+        emit textEdit->cursorPositionChanged(d->position());
     }
     if (doJoin)
         d->document->d->joinLastTwoCommands();
@@ -237,35 +239,35 @@ bool TextCursor::movePosition(TextCursor::MoveOperation op, TextCursor::MoveMode
         Q_ASSERT(textLayout);
         int index;
         bool currentIsLast;
-        const QTextLine currentLine = textLayout->lineForPosition(d->position, 0,
+        const QTextLine currentLine = textLayout->lineForPosition(d->position(), 0,
                                                                   &index,
                                                                   &currentIsLast);
         Q_ASSERT(textLayout->lines.size() <= 1 || (index != -1 && currentLine.isValid()));
         if (!currentLine.isValid())
             return false;
         const int col = columnNumber();
-        int targetLinePos;
+        qint64 targetLinePos;
         if (op == Up) {
-            targetLinePos = d->position - col - 1;
+            targetLinePos = d->position() - col - 1;
 //             qDebug() << "I was at column" << col << "and position"
-//                      << d->position << "so naturally I can find the previous line around"
-//                      << (d->position - col - 1);
+//                      << d->position() << "so naturally I can find the previous line around"
+//                      << (d->position() - col - 1);
         } else {
-            targetLinePos = d->position + currentLine.textLength() - col
+            targetLinePos = d->position() + currentLine.textLength() - col
                             + (currentIsLast ? 1 : 0);
 //             qDebug() << "currentLine.textLength" << currentLine.textLength() << "col" << col
 //                      << "currentIsLast" << currentIsLast;
             // ### probably need to add only if last line in layout
         }
         if (targetLinePos < 0) {
-            if (d->position == 0) {
+            if (d->position() == 0) {
                 return false;
             } else {
                 setPosition(0, mode);
                 return true;
             }
         } else if (targetLinePos >= d->document->documentSize()) {
-            if (d->position == d->document->documentSize()) {
+            if (d->position() == d->document->documentSize()) {
                 return false;
             } else {
                 setPosition(d->document->documentSize(), mode);
@@ -281,7 +283,7 @@ bool TextCursor::movePosition(TextCursor::MoveOperation op, TextCursor::MoveMode
 
 //         qDebug() << "finding targetLine at" << targetLinePos
 //                  << d->document->read(targetLinePos, 7)
-//                  << "d->position" << d->position
+//                  << "d->position()" << d->position()
 //                  << "col" << col
 //                  << "offsetInLine" << offsetInLine;
 
@@ -307,7 +309,7 @@ bool TextCursor::movePosition(TextCursor::MoveOperation op, TextCursor::MoveMode
         if (op == TextCursor::StartOfLine) {
             setPosition(position() - offset, mode);
         } else {
-            int pos = position() - offset + line.textLength();
+            qint64 pos = position() - offset + line.textLength();
             if (!lastLine)
                 --pos;
             setPosition(pos, mode);
@@ -315,7 +317,7 @@ bool TextCursor::movePosition(TextCursor::MoveOperation op, TextCursor::MoveMode
         break; }
 
     case StartOfBlock: {
-        TextDocumentIterator it(d->document->d, d->position);
+        TextDocumentIterator it(d->document->d, d->position());
         const QLatin1Char newline('\n');
         while (it.hasPrevious() && it.previous() != newline) ;
         if (it.hasPrevious())
@@ -323,7 +325,7 @@ bool TextCursor::movePosition(TextCursor::MoveOperation op, TextCursor::MoveMode
         setPosition(it.position(), mode);
         break; }
     case EndOfBlock: {
-        TextDocumentIterator it(d->document->d, d->position);
+        TextDocumentIterator it(d->document->d, d->position());
         const QLatin1Char newline('\n');
         while (it.current() != newline && it.hasNext() && it.next() != newline) ;
         setPosition(it.position(), mode);
@@ -332,7 +334,7 @@ bool TextCursor::movePosition(TextCursor::MoveOperation op, TextCursor::MoveMode
     case StartOfWord:
     case PreviousWord:
     case WordLeft: {
-        TextDocumentIterator it(d->document->d, d->position);
+        TextDocumentIterator it(d->document->d, d->position());
 
         while (it.hasPrevious()) {
             const QChar ch = it.previous();
@@ -353,7 +355,7 @@ bool TextCursor::movePosition(TextCursor::MoveOperation op, TextCursor::MoveMode
     case NextWord:
     case WordRight:
     case EndOfWord: {
-        TextDocumentIterator it(d->document->d, d->position);
+        TextDocumentIterator it(d->document->d, d->position());
         while (it.hasNext()) {
             const QChar ch = it.next();
             if (d->document->isWordCharacter(ch, it.position()))
@@ -382,7 +384,7 @@ bool TextCursor::movePosition(TextCursor::MoveOperation op, TextCursor::MoveMode
     case Left:
     case Right:
         d->overrideColumn = -1;
-        setPosition(qBound<int>(0, position() + (op == TextCursor::Left ? -1 : 1),
+        setPosition(qBound<qint64>(0, position() + (op == TextCursor::Left ? -1 : 1),
                                 d->document->documentSize()), mode);
         break;
     };
@@ -395,10 +397,10 @@ void TextCursor::deleteChar()
     Q_ASSERT(!isNull());
     if (hasSelection()) {
         removeSelectedText();
-    } else if (d->position < d->document->documentSize()) {
+    } else if (d->position() < d->document->documentSize()) {
         const bool old = d->document->d->cursorCommand;
         d->document->d->cursorCommand = true;
-        d->document->remove(d->position, 1);
+        d->document->remove(d->position(), 1);
         d->document->d->cursorCommand = old;
     }
 }
@@ -408,12 +410,13 @@ void TextCursor::deletePreviousChar()
     Q_ASSERT(!isNull());
     if (hasSelection()) {
         removeSelectedText();
-    } else if (d->position > 0) {
+    } else if (d->position() > 0) {
         const bool old = d->document->d->cursorCommand;
         d->document->d->cursorCommand = true;
-        d->document->remove(d->position - 1, 1);
+        d->document->remove(d->position() - 1, 1);
         d->document->d->cursorCommand = old;
-        d->anchor = --d->position;
+        d->setPosition(d->position() - 1);
+        d->setAnchor(d->position());
     }
 }
 
@@ -447,21 +450,22 @@ void TextCursor::select(SelectionType selection)
 
 bool TextCursor::hasSelection() const
 {
-    return !isNull() && d->anchor != d->position;
+    return !isNull() && d->anchor() != d->position();
 }
 
 void TextCursor::removeSelectedText()
 {
     Q_ASSERT(!isNull());
-    if (d->anchor == d->position)
+    if (d->anchor() == d->position())
         return;
 
     SelectionChangedEmitter emitter(textEdit);
     detach();
     cursorChanged(false);
-    const int min = qMin(d->anchor, d->position);
-    const int max = qMax(d->anchor, d->position);
-    d->anchor = d->position = min;
+    const qint64 min = qMin(d->anchor(), d->position());
+    const qint64 max = qMax(d->anchor(), d->position());
+    d->setPosition(min);
+    d->setAnchor(min);
     const bool old = d->document->d->cursorCommand;
     d->document->d->cursorCommand = true;
     d->document->remove(min, max - min);
@@ -475,21 +479,21 @@ void TextCursor::clearSelection()
     if (hasSelection()) {
         detach();
         SelectionChangedEmitter emitter(textEdit);
-        d->anchor = d->position;
+        d->setAnchor(d->position());
     }
 }
 
-int TextCursor::selectionStart() const
+qint64 TextCursor::selectionStart() const
 {
-    return qMin(d->anchor, d->position);
+    return qMin(d->anchor(), d->position());
 }
 
-int TextCursor::selectionEnd() const
+qint64 TextCursor::selectionEnd() const
 {
-    return qMax(d->anchor, d->position);
+    return qMax(d->anchor(), d->position());
 }
 
-int TextCursor::selectionSize() const
+qint64 TextCursor::selectionSize() const
 {
     return selectionEnd() - selectionStart();
 }
@@ -497,36 +501,36 @@ int TextCursor::selectionSize() const
 
 QString TextCursor::selectedText() const
 {
-    if (isNull() || d->anchor == d->position)
+    if (isNull() || d->anchor() == d->position())
         return QString();
 
-    const int min = qMin(d->anchor, d->position);
-    const int max = qMax(d->anchor, d->position);
+    const qint64 min = qMin(d->anchor(), d->position());
+    const qint64 max = qMax(d->anchor(), d->position());
     return d->document->read(min, max - min);
 }
 
 bool TextCursor::atBlockStart() const
 {
     Q_ASSERT(!isNull());
-    return atStart() || d->document->read(d->position - 1, 1).at(0) == '\n';
+    return atStart() || d->document->read(d->position() - 1, 1).at(0) == '\n';
 }
 
 bool TextCursor::atBlockEnd() const
 {
     Q_ASSERT(!isNull());
-    return atEnd() || d->document->read(d->position, 1).at(0) == '\n'; // ### is this right?
+    return atEnd() || d->document->read(d->position(), 1).at(0) == '\n'; // ### is this right?
 }
 
 bool TextCursor::atStart() const
 {
     Q_ASSERT(!isNull());
-    return d->position == 0;
+    return d->position() == 0;
 }
 
 bool TextCursor::atEnd() const
 {
     Q_ASSERT(!isNull());
-    return d->position == d->document->documentSize();
+    return d->position() == d->document->documentSize();
 }
 
 
@@ -546,7 +550,7 @@ bool TextCursor::operator<(const TextCursor &rhs) const
     Q_ASSERT_X(d->document == rhs.d->document, "TextCursor::operator<",
                "cannot compare cursors attached to different documents");
 
-    return d->position < rhs.d->position;
+    return d->position() < rhs.d->position();
 }
 
 bool TextCursor::operator<=(const TextCursor &rhs) const
@@ -562,8 +566,8 @@ bool TextCursor::operator==(const TextCursor &rhs) const
     if (!d || !rhs.d)
         return false;
 
-    return (d->position == rhs.d->position
-            && d->anchor == rhs.d->anchor
+    return (d->position() == rhs.d->position()
+            && d->anchor() == rhs.d->anchor()
             && d->document == rhs.d->document);
 }
 
@@ -583,7 +587,7 @@ bool TextCursor::operator>(const TextCursor &rhs) const
     Q_ASSERT_X(d->document == rhs.d->document, "TextCursor::operator>=",
                "cannot compare cursors attached to different documents");
 
-    return d->position > rhs.d->position;
+    return d->position() > rhs.d->position();
 }
 
 bool TextCursor::isCopyOf(const TextCursor &other) const
@@ -596,7 +600,7 @@ int TextCursor::columnNumber() const
     Q_ASSERT(d && d->document);
     TextLayout *textLayout = TextLayoutCacheManager::requestLayout(*this, 0);
     int col;
-    textLayout->lineForPosition(d->position, &col);
+    textLayout->lineForPosition(d->position(), &col);
     return col;
 }
 
@@ -612,15 +616,33 @@ void TextCursor::detach()
     if (d->ref > 1) {
         d->ref.deref();
         TextCursorSharedPrivate *p = new TextCursorSharedPrivate;
-        p->position = d->position;
+        p->positionMark.offset = d->position();
         p->overrideColumn = d->overrideColumn;
-        p->anchor = d->anchor;
+        p->anchorMark.offset = d->anchor();
         p->document = d->document;
-        d->document->d->textCursors.insert(p);
+        d->document->d->addCursor(p);
         d = p;
     }
 }
 
+void TextCursorSharedPrivate::setPosition(qint64 pos)
+{
+    if (document) {
+        document->d->moveMark(&positionMark, pos);
+    } else {
+        positionMark.offset = pos;
+    }
+}
+
+void TextCursorSharedPrivate::setAnchor(qint64 anc)
+{
+    if (document) {
+        document->d->moveMark(&anchorMark, anc);
+    } else {
+        anchorMark.offset = anc;
+    }
+}
+
 bool TextCursor::ref()
 {
     return d && d->ref.ref();
@@ -632,9 +654,7 @@ bool TextCursor::deref()
     d = 0;
     if (dd && !dd->ref.deref()) {
         if (dd->document) {
-            const bool removed = dd->document->d->textCursors.remove(dd);
-            Q_ASSERT(removed);
-            Q_UNUSED(removed)
+            dd->document->d->removeCursor(dd);
         }
         delete dd;
         return false;
@@ -648,7 +668,7 @@ void TextCursor::cursorChanged(bool ensureVisible)
         if (textEdit->d->cursorBlinkTimer.isActive())
             textEdit->d->cursorVisible = true;
         if (ensureVisible) {
-            emit textEdit->cursorPositionChanged(d->position);
+            emit textEdit->cursorPositionChanged(d->position());
             textEdit->ensureCursorVisible();
         }
         const QRect r = textEdit->cursorBlockRect(*this) & textEdit->viewport()->rect();
@@ -772,7 +792,7 @@ void TextCursor::setViewportWidth(int width)
 QChar TextCursor::cursorCharacter() const
 {
     Q_ASSERT(d && d->document);
-    return d->document->readCharacter(d->anchor);
+    return d->document->readCharacter(d->anchor());
 }
 
 QString TextCursor::cursorLine() const
@@ -806,13 +826,13 @@ int TextCursor::lineHeight() const
 QString TextCursor::wordUnderCursor() const
 {
     Q_ASSERT(!isNull());
-    return d->document->d->wordAt(d->position);
+    return d->document->d->wordAt(d->position());
 }
 
 QString TextCursor::paragraphUnderCursor() const
 {
     Q_ASSERT(!isNull());
-    return d->document->d->paragraphAt(d->position);
+    return d->document->d->paragraphAt(d->position());
 }
 
 QDebug operator<<(QDebug dbg, const TextCursor &cursor)
@@ -28,8 +28,8 @@ class TextCursor
 {
 public:
     TextCursor();
-    explicit TextCursor(const TextDocument *document, int pos = 0, int anchor = -1);
-    explicit TextCursor(const TextEdit *document, int pos = 0, int anchor = -1);
+    explicit TextCursor(const TextDocument *document, qint64 pos = 0, qint64 anchor = -1);
+    explicit TextCursor(const TextEdit *document, qint64 pos = 0, qint64 anchor = -1);
     TextCursor(const TextCursor &cursor);
     TextCursor &operator=(const TextCursor &other);
     ~TextCursor();
@@ -43,15 +43,15 @@ public:
         KeepAnchor
     };
 
-    void setPosition(int pos, MoveMode mode = MoveAnchor);
-    int position() const;
+    void setPosition(qint64 pos, MoveMode mode = MoveAnchor);
+    qint64 position() const;
 
-    void setSelection(int pos, int length); // can be negative
+    void setSelection(qint64 pos, qint64 length); // can be negative
 
     int viewportWidth() const;
     void setViewportWidth(int width);
 
-    int anchor() const;
+    qint64 anchor() const;
 
     void insertText(const QString &text);
 
@@ -102,10 +102,10 @@ public:
     bool hasSelection() const;
     void removeSelectedText();
     void clearSelection();
-    int selectionStart() const;
-    int selectionEnd() const;
-    int selectionSize() const;
-    inline int selectionLength() const { return selectionSize(); }
+    qint64 selectionStart() const;
+    qint64 selectionEnd() const;
+    qint64 selectionSize() const;
+    inline qint64 selectionLength() const { return selectionSize(); }
 
     QString selectedText() const;
 
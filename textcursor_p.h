@@ -82,10 +82,10 @@ public:
         }
         if (layouts.size() < instance()->maxLayouts) {
             if (layouts.isEmpty()) {
-                connect(cursor.document(), SIGNAL(charactersAdded(int, int)),
-                        instance(), SLOT(onCharactersAddedOrRemoved(int)));
-                connect(cursor.document(), SIGNAL(charactersRemoved(int, int)),
-                        instance(), SLOT(onCharactersAddedOrRemoved(int)));
+                connect(cursor.document(), SIGNAL(charactersAdded(qint64, qint64)),
+                        instance(), SLOT(onCharactersAddedOrRemoved(qint64)));
+                connect(cursor.document(), SIGNAL(charactersRemoved(qint64, qint64)),
+                        instance(), SLOT(onCharactersAddedOrRemoved(qint64)));
                 connect(cursor.document(), SIGNAL(destroyed(QObject*)),
                         instance(), SLOT(onDocumentDestroyed(QObject*)));
             }
@@ -107,9 +107,9 @@ public:
             // ### need to be in the actual textLayout shouldn't need
             // ### to care about the actual selection
         }
-        int startPos = (cursor.position() == 0
+        qint64 startPos = (cursor.position() == 0
                         ? 0
-                        : qMax(0, doc->find(QLatin1Char('\n'), cursor.position() - 1, TextDocument::FindBackward).anchor()));
+                        : qMax<qint64>(0, doc->find(QLatin1Char('\n'), cursor.position() - 1, TextDocument::FindBackward).anchor()));
         // We start at the beginning of the current line
         int linesAbove = margin;
         if (startPos > 0) {
@@ -129,7 +129,7 @@ public:
         }
 
         int linesBelow = margin;
-        int endPos = cursor.position();
+        qint64 endPos = cursor.position();
         if (endPos < doc->documentSize()) {
             while (linesBelow > 0) {
                 const TextCursor c = doc->find(QLatin1Char('\n'), endPos + 1);
@@ -146,7 +146,7 @@ public:
         l->viewportPosition = startPos;
         l->layoutDirty = true;
         ASSUME(l->viewportPosition == 0 || doc->readCharacter(l->viewportPosition - 1) == QLatin1Char('\n'));
-        l->relayoutByPosition(endPos - startPos + 100); // ### fudged a couple of lines likely
+        l->relayoutByPosition(int(endPos - startPos + 100)); // ### fudged a couple of lines likely
         ASSUME(l->viewportPosition < l->layoutEnd
                || (l->viewportPosition == l->layoutEnd && l->viewportPosition == doc->documentSize()));
         ASSUME(l->textLayouts.size() > margin * 2 || l->viewportPosition == 0 || l->layoutEnd == doc->documentSize());
@@ -158,7 +158,7 @@ private slots:
         qDeleteAll(cache.take(static_cast<TextDocument*>(o)));
     }
 
-    void onCharactersAddedOrRemoved(int pos)
+    void onCharactersAddedOrRemoved(qint64 pos)
     {
         QList<TextLayout*> &layouts = cache[qobject_cast<TextDocument*>(sender())];
         ASSUME(!layouts.isEmpty());
@@ -189,7 +189,7 @@ class TextLayout;
 struct TextCursorSharedPrivate
 {
 public:
-    TextCursorSharedPrivate() : ref(1), position(-1), anchor(-1),
+    TextCursorSharedPrivate() : ref(1),
         overrideColumn(-1), viewportWidth(-1),
         document(0)
     {}
@@ -204,8 +204,14 @@ public:
 
     }
 
+    inline qint64 position() const { return positionMark.position(); }
+    inline qint64 anchor() const { return anchorMark.position(); }
+    void setPosition(qint64 pos);
+    void setAnchor(qint64 anc);
+
     mutable QAtomicInt ref;
-    int position, anchor, overrideColumn, viewportWidth;
+    TextMark positionMark, anchorMark; // in the document's tree while document is set
+    int overrideColumn, viewportWidth;
 
     TextDocument *document;
 };
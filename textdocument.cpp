@@ -2,6 +2,7 @@
 #include "textcursor.h"
 #include "textcursor_p.h"
 #include "textdocument_p.h"
+#include "textscan_p.h"
 #include <QBuffer>
 #include <QIODevice>
 #include <QObject>
@@ -14,6 +15,10 @@
 #include <QVariant>
 #include <QDesktopServices>
 #include <qalgorithms.h>
+#include <string.h>
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#endif
 
 // #define DEBUG_CACHE_HITS
 
@@ -45,24 +50,37 @@ TextDocument::~TextDocument()
 {
     {
         QWriteLocker locker(d->readWriteLock);
+        // the cursors keep their positions but leave the tree
+        QList<QPair<qint64, qint64> > positions;
+        foreach(TextCursorSharedPrivate *cursor, d->textCursors)
+            positions.append(qMakePair(cursor->position(), cursor->anchor()));
+        int idx = 0;
         foreach(TextCursorSharedPrivate *cursor, d->textCursors) {
             cursor->document = 0;
+            cursor->positionMark = TextMark();
+            cursor->anchorMark = TextMark();
+            cursor->positionMark.offset = positions.at(idx).first;
+            cursor->anchorMark.offset = positions.at(idx++).second;
         }
         Chunk *c = d->first;
         while (c) {
-            if (!(d->options & KeepTemporaryFiles) && !c->swap.isEmpty())
-                QFile::remove(c->swap);
             Chunk *tmp = c;
             c = c->next;
             delete tmp;
         }
-        foreach(TextSection *section, d->sections) {
+        d->clearSwap();
+        foreach(TextSection *section, d->getSections(0, d->documentSize, 0, 0)) {
             section->d.document = 0;
             section->d.textEdit = 0;
             delete section;
         }
+        d->stopPrefetching();
+        d->stopLineScan();
         if (d->ownDevice)
             delete d->device.data();
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+        d->clearChunkCache();
+#endif
     }
     delete d->readWriteLock;
     delete d;
@@ -83,36 +101,31 @@ bool TextDocument::load(QIODevice *device, DeviceMode mode, QTextCodec *codec)
     if ((options & (AutoDetectCarriageReturns|ConvertCarriageReturns)) == (AutoDetectCarriageReturns|ConvertCarriageReturns))
         options &= ~AutoDetectCarriageReturns;
 
-    foreach(TextSection *section, d->sections) {
+    foreach(TextSection *section, d->getSections(0, d->documentSize, 0, 0)) {
         emit sectionRemoved(section);
         section->d.document = 0;
         delete section;
     }
-    d->sections.clear();
+    d->sectionTreeRoot = 0;
+    d->sectionCount = 0;
 
     if (d->documentSize > 0) {
         emit charactersRemoved(0, d->documentSize);
     }
 
-    Chunk *c = d->first;
-    while (c) {
-        Chunk *tmp = c;
-        c = c->next;
-        delete tmp;
-    }
+    d->clearChunks();
 
     d->textCodec = codec;
     d->documentSize = device->size();
     if (d->documentSize <= d->chunkSize && mode == Sparse && !(options & NoImplicitLoadAll))
         mode = LoadAll;
-#if 0
-    if (codec && mode == Sparse) {
-
-        qWarning("Sparse mode doesn't really work with unicode data yet. I am working on it.\n--\nAnders");
-    }
-#endif
-    d->first = d->last = 0;
 
+    d->stopPrefetching();
+    d->stopLineScan();
+    d->scannedLines.clear();
+    d->checkpoints.clear();
+    d->checkpointsPending = false;
+    d->unmapDevice();
     if (d->device) {
         if (d->ownDevice && d->device.data() != device) // this is done when saving to the same file
             delete d->device.data();
@@ -122,10 +135,9 @@ bool TextDocument::load(QIODevice *device, DeviceMode mode, QTextCodec *codec)
     d->device = device;
     d->deviceMode = mode;
 #ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
-    d->cachedChunk = 0;
-    d->cachedChunkPos = -1;
-    d->cachedChunkData.clear();
+    d->clearChunkCache();
 #endif
+    d->addBuffer.clear();
 #ifndef NO_TEXTDOCUMENT_READ_CACHE
     d->cachePos = -1;
     d->cache.clear();
@@ -151,40 +163,19 @@ bool TextDocument::load(QIODevice *device, DeviceMode mode, QTextCodec *codec)
             if (options & ConvertCarriageReturns)
                 c->data.remove(QLatin1Char('\r'));
             d->documentSize += c->data.size();
-            if (current) {
-                current->next = c;
-                c->previous = current;
-            } else {
-                d->first = c;
-            }
+            d->narrowChunk(c);
+            d->insertChunk(current, c);
+            d->useChunk(c);
             current = c;
         } while (!ts.atEnd());
-
-        d->last = current;
+        d->enforceMemoryLimit();
         break; }
 
-    case Sparse: {
-        int index = 0;
-        Chunk *current = 0;
-        do {
-            Chunk *chunk = new Chunk;
-            chunk->from = index;
-            chunk->length = qMin<int>(d->documentSize - index, d->chunkSize);
-            if (!current) {
-                d->first = chunk;
-            } else {
-                chunk->previous = current;
-                current->next = chunk;
-            }
-            current = chunk;
-            index += chunk->length;
-        } while (index < d->documentSize);
-
-        d->last = current;
-        break; }
+    case Sparse:
+        if (!d->loadCheckpoints(device))
+            d->loadExtent(options);
+        break;
     }
-//     if (d->first)
-//         d->first->firstLineIndex = 0;
     emit charactersAdded(0, d->documentSize);
     emit documentSizeChanged(d->documentSize);
     emit textChanged();
@@ -201,6 +192,12 @@ bool TextDocument::load(const QString &fileName, DeviceMode mode, QTextCodec *co
         QFile *file = new QFile(fileName);
         if (file->open(QIODevice::ReadOnly) && load(file, mode, codec)) {
             d->ownDevice = true;
+            if (d->deviceMode == Sparse && d->options & MapFile) {
+                // the scan threads pick the mapping up when they start again
+                d->stopLineScan();
+                d->mapDevice();
+                d->startLineScan();
+            }
             return true;
         } else {
             delete file;
@@ -215,10 +212,11 @@ void TextDocument::clear()
     setText(QString());
 }
 
-QString TextDocument::read(int pos, int size) const
+QString TextDocument::read(qint64 pos, int size) const
 {
-    QReadLocker locker(d->readWriteLock);
     Q_ASSERT(size >= 0);
+    d->waitForCheckpoints(pos + size);
+    QReadLocker locker(d->readWriteLock);
     if (size == 0 || pos == d->documentSize) {
         return QString();
     }
@@ -229,6 +227,7 @@ QString TextDocument::read(int pos, int size) const
     static int hits = 0;
     static int misses = 0;
 #endif
+    QMutexLocker cacheLocker(&d->cacheMutex);
     if (d->cachePos != -1 && pos >= d->cachePos && d->cache.size() - (pos - d->cachePos) >= size) {
 #ifdef DEBUG_CACHE_HITS
         qWarning() << "read hits" << ++hits << "misses" << misses;
@@ -238,48 +237,77 @@ QString TextDocument::read(int pos, int size) const
 #ifdef DEBUG_CACHE_HITS
     qWarning() << "read hits" << hits << "misses" << ++misses;
 #endif
+    cacheLocker.unlock();
 #endif
 
     QString ret(size, '\0');
     int written = 0;
     int offset;
-    Chunk *c = d->chunkAt(pos, &offset);
-    Q_ASSERT(c);
-    int chunkPos = pos - offset;
-
-    while (written < size && c) {
-        const int max = qMin(size - written, c->size() - offset);
-        const QString data = d->chunkData(c, chunkPos);
-        chunkPos += data.size();
-        ret.replace(written, max, data.constData() + offset, max);
+    ChunkRef ref = d->chunkRefAt(pos, &offset);
+    Q_ASSERT(ref.chunk);
+    qint64 chunkPos = pos - offset;
+
+    while (written < size && ref.chunk) {
+        const Chunk *c = ref.chunk;
+        const int max = qMin(size - written, ref.size - offset);
+        if (!c->latin1.isEmpty()) {
+            d->useChunk(c);
+            const uchar *latin1 = reinterpret_cast<const uchar*>(c->latin1.constData()) + offset;
+            QChar *out = ret.data() + written;
+            for (int i=0; i<max; ++i)
+                out[i] = QChar(latin1[i]);
+        } else {
+            const QString data = d->chunkRefData(ref, chunkPos);
+            ret.replace(written, max, data.constData() + offset, max);
+        }
+        chunkPos += ref.size;
         written += max;
         offset = 0;
-        c = c->next;
+        ref = d->nextChunkRef(ref);
     }
 
     if (written < size) {
         ret.truncate(written);
     }
-    Q_ASSERT(!c || written == size);
+    Q_ASSERT(!ref.chunk || written == size);
 #ifndef NO_TEXTDOCUMENT_READ_CACHE
+    cacheLocker.relock();
     d->cachePos = pos;
     d->cache = ret;
 #endif
     return ret;
 }
 
-QStringRef TextDocument::readRef(int pos, int size) const
+// Only works for ranges in one chunk that's in memory or in the chunk cache
+QStringRef TextDocument::readRef(qint64 pos, int size) const
 {
+    d->waitForCheckpoints(pos + size);
     QReadLocker locker(d->readWriteLock);
     int offset;
-    Chunk *c = d->chunkAt(pos, &offset);
-    if (c && pos + offset + size <= c->size()) {
-        const QString string = d->chunkData(c, pos - offset);
-        return string.midRef(offset, size);
+    const ChunkRef ref = d->chunkRefAt(pos, &offset);
+    const Chunk *c = ref.chunk;
+    if (!c || offset + size > ref.size || !c->latin1.isEmpty())
+        return QStringRef();
+    QMutexLocker cacheLocker(&d->cacheMutex); // another reader could drop the entry
+    if (c->from == -1) {
+        d->useChunk(c);
+        return c->data.midRef(offset, size);
     }
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+    d->chunkRefData(ref, pos - offset); // caches it
+    if (const ChunkCacheEntry *entry = d->cachedChunk(c, ref.start))
+        return entry->data.midRef(offset, size);
+#endif
     return QStringRef();
 }
 
+bool TextDocument::forEachSpan(qint64 pos, qint64 size, SpanVisitor *visitor) const
+{
+    d->waitForCheckpoints(size < 0 ? -1 : pos + size);
+    QReadLocker locker(d->readWriteLock);
+    return d->forEachSpan(pos, size, visitor);
+}
+
 
 bool TextDocument::save(const QString &file)
 {
@@ -293,6 +321,14 @@ bool TextDocument::save()
 }
 
 
+class SequentialScope
+{
+public:
+    SequentialScope(const TextDocumentPrivate *dd) : d(dd) { d->adviseSequential(true); }
+    ~SequentialScope() { d->adviseSequential(false); }
+    const TextDocumentPrivate *d;
+};
+
 static bool isSameFile(const QIODevice *left, const QIODevice *right)
 {
     if (left == right)
@@ -305,97 +341,119 @@ static bool isSameFile(const QIODevice *left, const QIODevice *right)
     return false;
 }
 
+class SaveVisitor : public TextDocument::SpanVisitor
+{
+public:
+    SaveVisitor(TextDocumentPrivate *dd, QTextStream *stream) : d(dd), ts(stream) {}
+    bool visit(qint64 pos, const QChar *data, int size)
+    {
+        *ts << QString::fromRawData(data, size);
+        const qint64 written = pos + size;
+        if (written < d->documentSize) {
+            const double part = qreal(written) / double(d->documentSize);
+            emit d->q->saveProgress(part * 100.0);
+        }
+        return d->saveState != TextDocumentPrivate::AbortSave;
+    }
+private:
+    TextDocumentPrivate *d;
+    QTextStream *ts;
+};
+
 bool TextDocument::save(QIODevice *device)
 {
-    QReadLocker locker(d->readWriteLock);
     Q_ASSERT(device);
-    if (::isSameFile(d->device.data(), device)) {
-        QTemporaryFile tmp(0);
-        if (!tmp.open())
-            return false;
-        if (save(&tmp)) {
-            Q_ASSERT(qobject_cast<QFile*>(device));
-            Q_ASSERT(qobject_cast<QFile*>(d->device));
-            d->device.data()->close();
-            d->device.data()->open(QIODevice::WriteOnly);
-            tmp.seek(0);
-            const int chunkSize = 128; //1024 * 16;
-            char chunk[chunkSize];
-            forever {
-                const qint64 read = tmp.read(chunk, chunkSize);
-                switch (read) {
-                case -1: return false;
-                case 0: return true;
-                default:
-                    if (d->device.data()->write(chunk, read) != read) {
-                        return false;
-                    }
-                    break;
-                }
+    d->waitForCheckpoints(-1);
+    if (!::isSameFile(d->device.data(), device)) {
+        QReadLocker locker(d->readWriteLock);
+        return d->save(device);
+    }
+
+    // the chunks are laid out over the file again so no one can be reading
+    QWriteLocker locker(d->readWriteLock);
+    QTemporaryFile tmp(0);
+    if (!tmp.open() || !d->save(&tmp))
+        return false;
+    Q_ASSERT(qobject_cast<QFile*>(device));
+    Q_ASSERT(qobject_cast<QFile*>(d->device));
+    const bool mapped = d->mappedData;
+    d->stopPrefetching();
+    d->stopLineScan();
+    d->scannedLines.clear();
+    d->checkpoints.clear();
+    d->checkpointsPending = false;
+    d->unmapDevice();
+    d->device.data()->close();
+    d->device.data()->open(QIODevice::WriteOnly);
+    tmp.seek(0);
+    const int chunkSize = 128; //1024 * 16;
+    char chunk[chunkSize];
+    bool copied = false;
+    while (!copied) {
+        const qint64 read = tmp.read(chunk, chunkSize);
+        switch (read) {
+        case -1: return false;
+        case 0: copied = true; break;
+        default:
+            if (d->device.data()->write(chunk, read) != read) {
+                return false;
             }
-            d->device.data()->close();
-            d->device.data()->open(QIODevice::ReadOnly);
-            if (d->deviceMode == Sparse) {
-                qDeleteAll(d->undoRedoStack);
-                d->undoRedoStack.clear();
-                d->undoRedoStackCurrent = 0;
+            break;
+        }
+    }
+    d->device.data()->close();
+    d->device.data()->open(QIODevice::ReadOnly);
+    if (mapped)
+        d->mapDevice();
+    if (d->deviceMode == Sparse) {
+        qDeleteAll(d->undoRedoStack);
+        d->undoRedoStack.clear();
+        d->undoRedoStackCurrent = 0;
+        // the edits are in the file now. The chunks go back to being read
+        // from it, the sections and cursors stay put
+        d->clearChunks();
 #ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
-                d->cachedChunkPos = -1;
-                d->cachedChunk = 0;
-                d->cachedChunkData.clear();
+        d->clearChunkCache();
 #endif
-                Chunk *c = d->first;
-                int pos = 0;
-                while (c) {
-                    Q_ASSERT((c->from == -1) == (c->length == -1));
-                    if (c->from == -1) { // unload chunks from memory
-                        c->from = pos;
-                        c->length = c->data.size();
-                        c->data.clear();
-                    }
-                    pos += c->length;
-                    c = c->next;
-                }
-            }
-
-            return true;
-//            return load(d->device, d->deviceMode);
+        d->addBuffer.clear();
+        if (d->loadCheckpoints(d->device.data())) {
+            // the file has what the document had so there's nothing to
+            // tell the listeners about
+            d->applyCheckpoints(-1);
+            d->unreportedSize = 0;
+        } else {
+            d->loadExtent(d->options);
         }
-        return false;
-
     }
-    Q_ASSERT(device);
-    if (!device->isWritable() || !d->first) {
+    return true;
+}
+
+// Writes the document to device with the document's codec
+bool TextDocumentPrivate::save(QIODevice *device)
+{
+    if (!device->isWritable() || !first) {
         return false;
     }
-    d->saveState = TextDocumentPrivate::Saving;
-    const Chunk *c = d->first;
-    emit saveProgress(0.0);
-    int written = 0;
+    saveState = Saving;
+    const SequentialScope sequential(this);
+    emit q->saveProgress(0.0);
     QTextStream ts(device);
-    if (d->textCodec)
-        ts.setCodec(d->textCodec);
-    while (c) {
-        ts << d->chunkData(c, written);
-        written += c->size();
-        if (c != d->last) {
-            const double part = qreal(written) / double(d->documentSize);
-            emit saveProgress(part * 100.0);
-        }
-        if (d->saveState == TextDocumentPrivate::AbortSave) {
-            d->saveState = TextDocumentPrivate::NotSaving;
-            return false;
-        }
-        c = c->next;
+    if (textCodec)
+        ts.setCodec(textCodec);
+    SaveVisitor visitor(this, &ts);
+    if (!forEachSpan(0, -1, &visitor)) {
+        saveState = NotSaving;
+        return false;
     }
-    d->saveState = TextDocumentPrivate::NotSaving;
-    emit saveProgress(100.0);
+    saveState = NotSaving;
+    emit q->saveProgress(100.0);
 
     return true;
 }
 
-int TextDocument::documentSize() const
+qint64 TextDocument::documentSize() const
 {
+    d->waitForCheckpoints(-1);
     QReadLocker locker(d->readWriteLock);
     return d->documentSize;
 }
@@ -418,7 +476,7 @@ int TextDocument::instantiatedChunkCount() const
     Chunk *c = d->first;
     int count = 0;
     while (c) {
-        if (!c->data.isEmpty())
+        if (!c->data.isEmpty() || !c->latin1.isEmpty())
             ++count;
         c = c->next;
     }
@@ -431,7 +489,7 @@ int TextDocument::swappedChunkCount() const
     Chunk *c = d->first;
     int count = 0;
     while (c) {
-        if (!c->swap.isEmpty())
+        if (c->swapped)
             ++count;
         c = c->next;
     }
@@ -458,7 +516,7 @@ public:
     TextDocumentPrivate::FindState *state;
 };
 
-static void initFind(const TextCursor &cursor, bool reverse, int *start, int *limit)
+static void initFind(const TextCursor &cursor, bool reverse, qint64 *start, qint64 *limit)
 {
     if (cursor.hasSelection()) {
         *start = cursor.selectionStart();
@@ -474,6 +532,7 @@ static void initFind(const TextCursor &cursor, bool reverse, int *start, int *li
 
 TextCursor TextDocument::find(const QRegExp &regexp, const TextCursor &cursor, FindMode flags) const
 {
+    d->waitForCheckpoints(-1);
     QReadLocker locker(d->readWriteLock);
     if (flags & FindWholeWords) {
         qWarning("FindWholeWords doesn't work with regexps. Instead use an actual RegExp for this");
@@ -487,8 +546,8 @@ TextCursor TextDocument::find(const QRegExp &regexp, const TextCursor &cursor, F
     }
 
     const bool reverse = flags & FindBackward;
-    int pos;
-    int limit;
+    qint64 pos;
+    qint64 limit;
     ::initFind(cursor, reverse, &pos, &limit);
 
     if (pos == d->documentSize) {
@@ -509,16 +568,17 @@ TextCursor TextDocument::find(const QRegExp &regexp, const TextCursor &cursor, F
         it.setMaxBoundary(limit);
     }
     const QLatin1Char newline('\n');
-    int last = pos;
+    qint64 last = pos;
     bool ok = true;
-    int progressInterval = 0;
-    int lastProgress = pos;
-    const int initialPos = pos;
-    int maxFindLength = 0;
+    qint64 progressInterval = 0;
+    qint64 lastProgress = pos;
+    const qint64 initialPos = pos;
+    qint64 maxFindLength = 0;
     const FindScope scope(flags & FindAllowInterrupt ? &d->findState : 0);
+    const SequentialScope sequential(d);
     QTime lastProgressTime;
     if (flags & FindAllowInterrupt) {
-        progressInterval = qMax<int>(1, (reverse
+        progressInterval = qMax<qint64>(1, (reverse
                                          ? (static_cast<qreal>(pos) / static_cast<qreal>(TEXTDOCUMENT_FIND_INTERVAL_PERCENTAGE))
                                          : (static_cast<qreal>(d->documentSize) - static_cast<qreal>(pos)) / 100.0));
         maxFindLength = (reverse ? pos : d->documentSize - pos);
@@ -529,8 +589,8 @@ TextCursor TextDocument::find(const QRegExp &regexp, const TextCursor &cursor, F
         findSleep(this);
 #endif
         while ((it.nextPrev(direction, ok) != newline) && ok) ;
-        int from = qMin(it.position(), last);
-        int to = qMax(it.position(), last);
+        qint64 from = qMin(it.position(), last);
+        qint64 to = qMax(it.position(), last);
         if (!ok) {
             if (direction == TextDocumentIterator::Right)
                 ++to;
@@ -538,7 +598,7 @@ TextCursor TextDocument::find(const QRegExp &regexp, const TextCursor &cursor, F
             ++from;
             ++to;
         }
-        const QString line = read(from, to - from);
+        const QString line = read(from, int(to - from));
         last = it.position() + 1;
         int lineIndex = reverse ? line.size() : 0;
         bool done;
@@ -569,10 +629,10 @@ TextCursor TextDocument::find(const QRegExp &regexp, const TextCursor &cursor, F
             }
         } while (!done);
         if (progressInterval != 0) {
-            const int progress = qAbs(it.position() - lastProgress);
+            const qint64 progress = qAbs(it.position() - lastProgress);
             if (progress >= progressInterval
                 || (lastProgressTime.elapsed() >= TEXTDOCUMENT_MAX_INTERVAL)) {
-                const qreal progress = qAbs<int>(static_cast<qreal>(it.position() - initialPos)) / static_cast<qreal>(maxFindLength);
+                const qreal progress = qAbs(static_cast<qreal>(it.position() - initialPos)) / static_cast<qreal>(maxFindLength);
                 emit findProgress(progress * 100.0, it.position());
                 if (d->findState == TextDocumentPrivate::AbortFind) {
                     return TextCursor();
@@ -597,152 +657,721 @@ TextCursor TextDocument::find(const QRegExp &regexp, const TextCursor &cursor, F
     return TextCursor();
 }
 
-TextCursor TextDocument::find(const QString &in, const TextCursor &cursor, FindMode flags) const
+// What the finds that look at more than one character at a time share:
+// reporting matches and progress and stopping when they're aborted
+class FindReporter
 {
-    if (in.isEmpty()) {
-        return TextCursor();
-    } else if (in.size() == 1) {
-        return find(in.at(0), cursor, flags);
+public:
+    FindReporter(const TextDocument *doc, const TextDocumentPrivate *dd, TextDocument::FindMode f, qint64 pos)
+        : aborted(false), document(doc), d(dd), flags(f), progressInterval(0), lastProgress(pos),
+          initialPos(pos), maxFindLength(0)
+    {
+        if (flags & TextDocument::FindAllowInterrupt) {
+            progressInterval = qMax<qint64>(1, (flags & TextDocument::FindBackward
+                                                ? (static_cast<qreal>(pos) / static_cast<qreal>(TEXTDOCUMENT_FIND_INTERVAL_PERCENTAGE))
+                                                : (static_cast<qreal>(d->documentSize) - static_cast<qreal>(pos)) / 100.0));
+            maxFindLength = (flags & TextDocument::FindBackward ? pos : d->documentSize - pos);
+            lastProgressTime.start();
+        }
     }
 
-    QReadLocker locker(d->readWriteLock);
-
-    const bool reverse = flags & FindBackward;
-    const bool caseSensitive = flags & FindCaseSensitively;
-    const bool wholeWords = flags & FindWholeWords;
-    if (flags & FindWrap && cursor.hasSelection()) {
-        qWarning("It makes no sense to pass FindWrap and set a selection for the cursor. The entire selection will be searched");
-        flags &= ~FindWrap;
+    // How much to look at between progress reports. Interruptible finds
+    // report at least every progressInterval characters
+    qint64 blockSize(qint64 minimum, qint64 preferred) const
+    {
+        return qMax(minimum, progressInterval ? qMin(preferred, progressInterval) : preferred);
     }
 
-    int pos;
-    int limit;
-    ::initFind(cursor, reverse, &pos, &limit);
+    bool aborted;
+    TextCursor result;
+protected:
+    bool wholeWord(qint64 position, int size) const
+    {
+        if (!(flags & TextDocument::FindWholeWords))
+            return true;
+        return (d->wordBoundariesAt(position) & TextDocumentIterator::Left)
+            && (d->wordBoundariesAt(position + size - 1) & TextDocumentIterator::Right);
+    }
 
-    if (pos == d->documentSize) {
-        if (reverse) {
-            --pos;
-        } else if (!(flags & FindWrap)) {
-            return TextCursor();
+    bool found(qint64 position, int size)
+    {
+        const TextCursor ret(document, position + size, position);
+        if (!(flags & TextDocument::FindAll)) {
+            result = ret;
+            return false;
         }
+        emit document->entryFound(ret);
+        if (d->findState == TextDocumentPrivate::AbortFind) {
+            aborted = true;
+            return false;
+        }
+        return true;
     }
 
-    // ### what if one searches for a string with non-word characters in it and FindWholeWords?
-    const TextDocumentIterator::Direction direction = (reverse ? TextDocumentIterator::Left : TextDocumentIterator::Right);
-    QString word = caseSensitive ? in : in.toLower();
-    if (reverse) {
-        QChar *data = word.data();
-        const int size = word.size();
-        for (int i=0; i<size / 2; ++i) {
-            qSwap(data[i], data[size - 1 - i]);
+    // next is where the find goes on from. Spans are long enough to check
+    // the time after every one of them
+    bool progressed(qint64 next, bool span)
+    {
+        if (progressInterval == 0)
+            return true;
+        const qint64 progress = qAbs(next - lastProgress);
+        if (progress >= progressInterval
+            || ((span || progress % 10 == 0) && lastProgressTime.elapsed() >= TEXTDOCUMENT_MAX_INTERVAL)) {
+            const qreal progress = qAbs(static_cast<qreal>(next - initialPos)) / static_cast<qreal>(maxFindLength);
+            emit document->findProgress(progress * 100.0, next);
+            if (d->findState == TextDocumentPrivate::AbortFind) {
+                aborted = true;
+                return false;
+            }
+            lastProgress = next;
+            lastProgressTime.restart();
         }
+        return true;
     }
-    TextDocumentIterator it(d, pos);
-    if (reverse) {
-        it.setMinBoundary(limit);
-    } else {
-        it.setMaxBoundary(limit);
-    }
-    if (!caseSensitive)
-        it.setConvertToLowerCase(true);
 
-    bool ok = true;
-    QChar ch = it.current();
-    int wordIndex = 0;
-    int progressInterval = 0;
-    int lastProgress = pos;
-    const int initialPos = pos;
-    int maxFindLength = 0;
-    const FindScope scope(flags & FindAllowInterrupt ? &d->findState : 0);
+    const TextDocument *document;
+    const TextDocumentPrivate *d;
+    const TextDocument::FindMode flags;
+    qint64 progressInterval, lastProgress;
+    const qint64 initialPos;
+    qint64 maxFindLength;
     QTime lastProgressTime;
-    if (flags & FindAllowInterrupt) {
-        progressInterval = qMax<int>(1, (reverse
-                                         ? (static_cast<qreal>(pos) / static_cast<qreal>(TEXTDOCUMENT_FIND_INTERVAL_PERCENTAGE))
-                                         : (static_cast<qreal>(d->documentSize) - static_cast<qreal>(pos)) / 100.0));
-        maxFindLength = (reverse ? pos : d->documentSize - pos);
-        lastProgressTime.start();
-    }
-    do {
+};
+
+// The TEXTDOCUMENT_FIND_SLEEP tests need the finds that go one character
+// at a time
+static inline bool findsInBlocks(const TextDocument *document)
+{
 #ifdef TEXTDOCUMENT_FIND_SLEEP
-        findSleep(this);
+    return document->property("TEXTDOCUMENT_FIND_SLEEP").toInt() <= 0;
+#else
+    Q_UNUSED(document);
+    return true;
 #endif
-        if (progressInterval != 0) {
-            const int progress = qAbs(it.position() - lastProgress);
-            if (progress >= progressInterval
-                || (progress % 10 == 0 && lastProgressTime.elapsed() >= TEXTDOCUMENT_MAX_INTERVAL)) {
-                const qreal progress = qAbs<int>(static_cast<qreal>(it.position() - initialPos)) / static_cast<qreal>(maxFindLength);
-                emit findProgress(progress * 100.0, it.position());
-                if (d->findState == TextDocumentPrivate::AbortFind) {
-                    return TextCursor();
+}
+
+// QChar::toLower() of every UTF-16 code unit so case insensitive finds
+// don't have to call it for each character they look at
+struct LowerCaseTable
+{
+    LowerCaseTable()
+    {
+        for (int i=0; i<0x10000; ++i)
+            chars[i] = QChar(ushort(i)).toLower().unicode();
+    }
+    ushort chars[0x10000];
+};
+
+class FindStringSearch;
+class FindThread : public QThread
+{
+public:
+    FindThread(FindStringSearch *s) : search(s) {}
+protected:
+    void run();
+private:
+    FindStringSearch *search;
+};
+
+// find(QString) with Boyer-Moore-Horspool. Forward finds run over the
+// chunks' spans and carry the end of each span over to the next one so
+// matches that cross chunks are found as well. Backward finds read the
+// document in blocks that overlap by the length of the string. The skip
+// table is indexed by the low byte of the characters, sharing an entry
+// only makes the skips shorter
+class FindStringSearch : public TextDocument::SpanVisitor, public FindReporter
+{
+public:
+    FindStringSearch(const TextDocument *doc, const TextDocumentPrivate *dd, const QString &string,
+                     TextDocument::FindMode f, qint64 pos)
+        : FindReporter(doc, dd, f, pos), lower(0)
+    {
+        if (!(flags & TextDocument::FindCaseSensitively)) {
+            static const LowerCaseTable table;
+            lower = table.chars;
+        }
+        const int size = string.size();
+        word.resize(size);
+        for (int i=0; i<size; ++i)
+            word[i] = fold(string.at(i).unicode());
+        for (int i=0; i<256; ++i)
+            skip[i] = size;
+        if (flags & TextDocument::FindBackward) {
+            for (int i=size - 1; i>0; --i)
+                skip[word.at(i) & 0xff] = i;
+        } else {
+            for (int i=0; i<size - 1; ++i)
+                skip[word.at(i) & 0xff] = size - 1 - i;
+        }
+    }
+
+    // Finds the matches that lie within [from, to)
+    void run(qint64 from, qint64 to)
+    {
+        const int size = word.size();
+        if (!(flags & TextDocument::FindBackward)) {
+            if (to - from < size)
+                return;
+            carry.clear();
+            next = from;
+            block = int(blockSize(size, qMax(d->chunkSize, size * 4)));
+            d->forEachSpan(from, to - from, this);
+        } else {
+            const int block = int(blockSize(size, qMax(d->chunkSize, size * 4)));
+            while (to - from >= size) {
+                const qint64 start = qMax(from, to - block - size + 1);
+                const QString data = document->read(start, int(to - start));
+                int i = data.size();
+                int index;
+                while ((index = lastIndexIn(data.utf16(), i)) != -1) {
+                    if (!wholeWord(start + index, size)) {
+                        i = index + size - 1;
+                        continue;
+                    }
+                    if (!found(start + index, size))
+                        return;
+                    i = index;
                 }
-                lastProgress = it.position();
-                lastProgressTime.restart();
+                if (!progressed(start, true) || start == from)
+                    return;
+                to = start + qMin(i, size - 1);
             }
         }
+    }
 
-        bool found = ch == word.at(wordIndex);
-        if (found && wholeWords && (wordIndex == 0 || wordIndex == word.size() - 1)) {
-            Q_ASSERT(word.size() > 1);
-            const uint requiredBounds = ((wordIndex == 0) != reverse)
-                                        ? TextDocumentIterator::Left
-                                        : TextDocumentIterator::Right;
-            const uint bounds = d->wordBoundariesAt(it.position());
-            if (requiredBounds & ~bounds) {
-                found = false;
+    // FindAll over [from, to) for FindParallel. The chunks are split into
+    // segments that FindThreads decode and search while find() holds the
+    // read lock, only the chunks and device ranges are noted here. Their
+    // matches are reported here in document order and the threads stay
+    // at most a few segments ahead of that
+    void runParallel(qint64 from, qint64 to)
+    {
+        if (to - from < word.size())
+            return;
+        const int size = word.size();
+        segmentSize = blockSize(size, qMax(d->chunkSize, 256 * 1024));
+        segmentLength = 0;
+        int offset;
+        ChunkRef ref = d->chunkRefAt(from, &offset);
+        qint64 pos = from - offset;
+        while (ref.chunk && pos < to) {
+            const Chunk *c = ref.chunk;
+            if (c->extent) {
+                const ExtentPiece piece = d->extentPiece(c, ref.start);
+                addSpan(pos, c, piece.from, piece.bytes, piece.length);
+            } else if (d->device && c->from != -1 && c->pieces.isEmpty() && c->compressed.isEmpty() && !c->swapped) {
+                addSpan(pos, c, c->from, c->bytes, c->length);
+            } else {
+                addSpan(pos, c, -1, -1, c->size());
             }
+            pos += ref.size;
+            ref = d->nextChunkRef(ref);
         }
-        if (found) {
-            if (++wordIndex == word.size()) {
-                const int pos = it.position() - (reverse ? 0 : word.size() - 1);
-                // the iterator reads one past the last matched character so we have to account for that here
-                const TextCursor ret(this, pos + wordIndex, pos);
-                if (flags & FindAll) {
-                    emit entryFound(ret);
-                    if (d->findState == TextDocumentPrivate::AbortFind)
-                        return TextCursor();
-                    wordIndex = 0;
-                } else {
-                    return ret;
-                }
-            }
-        } else if (wordIndex != 0) {
-            wordIndex = 0;
-            continue;
+        if (spans.isEmpty())
+            return;
+        segments.append(spans.size());
+        searchFrom = from;
+        searchTo = to;
+        const int segmentCount = segments.size() - 1;
+        nextSegment = 0;
+        reportedSegments = 0;
+        stop = false;
+
+        QList<FindThread*> threads;
+        const int threadCount = qMin(qMax(1, QThread::idealThreadCount()), segmentCount);
+        maxAhead = threadCount * 2;
+        for (int i=0; i<threadCount; ++i) {
+            FindThread *thread = new FindThread(this);
+            threads.append(thread);
+            thread->start();
         }
-        ch = it.nextPrev(direction, ok);
-    } while (ok);
-
-    if (flags & FindWrap) {
-        Q_ASSERT(!cursor.hasSelection());
-        if (reverse) {
-            if (cursor.position() + 1 < d->documentSize) {
-                return find(in, TextCursor(this, cursor.position(), d->documentSize), flags & ~FindWrap);
+        qint64 matchEnd = from;
+        for (int i=0; i<segmentCount && !aborted; ++i) {
+            QMutexLocker locker(&mutex);
+            while (!matches.contains(i))
+                condition.wait(&mutex);
+            const QVector<qint64> starts = matches.take(i);
+            reportedSegments = i + 1;
+            condition.wakeAll();
+            locker.unlock();
+            // the threads find overlapping matches too, FindAll doesn't report them
+            foreach(qint64 start, starts) {
+                if (start < matchEnd || !wholeWord(start, size))
+                    continue;
+                if (!found(start, size))
+                    break;
+                matchEnd = start + size;
             }
-        } else if (cursor.position() > 0) {
-            return find(in, TextCursor(this, 0, cursor.position()), flags & ~FindWrap);
+            if (!aborted) {
+                const Span &last = spans.at(segments.at(i + 1) - 1);
+                progressed(qMin(to, last.pos + last.length), true);
+            }
+        }
+        mutex.lock();
+        stop = true;
+        condition.wakeAll();
+        mutex.unlock();
+        foreach(FindThread *thread, threads) {
+            thread->wait();
+            delete thread;
         }
     }
 
-    return TextCursor();
-}
-
-TextCursor TextDocument::find(const QChar &chIn, const TextCursor &cursor, FindMode flags) const
-{
-    QReadLocker locker(d->readWriteLock);
-    if (flags & FindWrap && cursor.hasSelection()) {
-        qWarning("It makes no sense to pass FindWrap and set a selection for the cursor. The entire selection will be searched");
-        flags &= ~FindWrap;
+    // the span a block at a time so interruptible finds report often enough
+    bool visit(qint64 pos, const QChar *span, int length)
+    {
+        for (int i=0; i<length; i += block) {
+            if (!visitBlock(pos + i, span + i, qMin(block, length - i)))
+                return false;
+        }
+        return true;
     }
 
-    const bool reverse = flags & FindBackward;
-    int pos;
-    int limit;
-    ::initFind(cursor, reverse, &pos, &limit);
-    if (pos == d->documentSize) {
-        if (reverse) {
-            --pos;
-        } else if (!(flags & FindWrap)) {
-            return TextCursor();
+    // the matches that start in the carried characters first, then the ones in the block
+    bool visitBlock(qint64 pos, const QChar *span, int length)
+    {
+        const int size = word.size();
+        int index;
+        if (!carry.isEmpty()) {
+            const int carried = carry.size();
+            const qint64 carryPos = pos - carried;
+            carry.append(span, qMin(length, size - 1));
+            int i = int(qMax<qint64>(0, next - carryPos));
+            while ((index = indexIn(carry.utf16(), i, carry.size())) != -1 && index < carried) {
+                if (!report(carryPos, index, &i))
+                    return false;
+            }
+            if (length < size - 1) {
+                // too short for a match of its own, all of it is carried now
+                carry = carry.right(size - 1);
+                return progressed(pos + length, true);
+            }
+        }
+        const ushort *data = reinterpret_cast<const ushort*>(span);
+        int i = int(qMax<qint64>(0, next - pos));
+        while ((index = indexIn(data, i, length)) != -1) {
+            if (!report(pos, index, &i))
+                return false;
+        }
+        if (length >= size - 1) {
+            carry = QString(span + length - (size - 1), size - 1);
+        } else {
+            carry = QString(span, length);
+        }
+        return progressed(pos + length, true);
+    }
+
+    // Called from the FindThreads
+    void searchSegments()
+    {
+        QMutexLocker locker(&mutex);
+        while (!stop && nextSegment < segments.size() - 1) {
+            if (nextSegment >= reportedSegments + maxAhead) {
+                condition.wait(&mutex);
+                continue;
+            }
+            const int segment = nextSegment++;
+            locker.unlock();
+            const QVector<qint64> starts = searchSegment(segment);
+            locker.relock();
+            matches.insert(segment, starts);
+            condition.wakeAll();
+        }
+    }
+
+private:
+    // a chunk or a piece of an extent. from is -1 if the chunk has to
+    // be decoded instead of the device range
+    struct Span
+    {
+        qint64 pos;
+        const Chunk *chunk;
+        qint64 from;
+        int bytes, length;
+    };
+
+    void addSpan(qint64 pos, const Chunk *chunk, qint64 from, int bytes, int length)
+    {
+        if (segments.isEmpty() || segmentLength >= segmentSize) {
+            segments.append(spans.size());
+            segmentLength = 0;
+        }
+        segmentLength += length;
+        const Span span = { pos, chunk, from, bytes, length };
+        spans.append(span);
+    }
+
+    // the first length characters of the span
+    QString spanText(const Span &span, int length) const
+    {
+        if (span.from == -1) {
+            const Chunk *c = span.chunk;
+            if (c->from == -1 && !c->latin1.isEmpty())
+                return QString::fromLatin1(c->latin1.constData(), length);
+            const QString data = d->decodeChunk(c);
+            return length == span.length ? data : data.left(length);
+        }
+        if (span.bytes == -1)
+            return d->decodeDevice(span.from, -1, length);
+        return d->decodeDevice(span.from, span.bytes, span.length).left(length);
+    }
+
+    // every match that starts in the segment
+    QVector<qint64> searchSegment(int segment) const
+    {
+        const int first = segments.at(segment);
+        const int last = segments.at(segment + 1);
+        QString text;
+        for (int i=first; i<last; ++i)
+            text += spanText(spans.at(i), spans.at(i).length);
+        const int segmentLength = text.size();
+        // matches that start at the end of the segment reach into the next one
+        int needed = word.size() - 1;
+        for (int i=last; i<spans.size() && needed > 0; ++i) {
+            const QString next = spanText(spans.at(i), qMin(needed, spans.at(i).length));
+            text += next;
+            needed -= next.size();
+        }
+
+        const qint64 pos = spans.at(first).pos;
+        const int end = int(qMin<qint64>(text.size(), searchTo - pos));
+        QVector<qint64> ret;
+        int i = int(qMax<qint64>(0, searchFrom - pos));
+        int index;
+        while ((index = indexIn(text.utf16(), i, end)) != -1 && index < segmentLength) {
+            ret.append(pos + index);
+            i = index + 1;
+        }
+        return ret;
+    }
+
+    inline ushort fold(ushort ch) const { return lower ? lower[ch] : ch; }
+
+    // a candidate at index in data that starts at pos. i is where the
+    // search of data goes on from
+    bool report(qint64 pos, int index, int *i)
+    {
+        const int size = word.size();
+        if (!wholeWord(pos + index, size)) {
+            *i = index + 1;
+            return true;
+        }
+        if (!found(pos + index, size))
+            return false;
+        *i = index + size;
+        next = pos + index + size;
+        return true;
+    }
+
+    // the first match that starts at from or later and ends before to
+    int indexIn(const ushort *data, int from, int to) const
+    {
+        const int size = word.size();
+        const ushort *w = word.constData();
+        const ushort last = w[size - 1];
+        for (int i=from; i + size <= to; ) {
+            const ushort ch = fold(data[i + size - 1]);
+            if (ch == last) {
+                int j = size - 2;
+                while (j >= 0 && fold(data[i + j]) == w[j])
+                    --j;
+                if (j < 0)
+                    return i;
+            }
+            i += skip[ch & 0xff];
+        }
+        return -1;
+    }
+
+    // the last match that ends before to
+    int lastIndexIn(const ushort *data, int to) const
+    {
+        const int size = word.size();
+        const ushort *w = word.constData();
+        const ushort first = w[0];
+        for (int i=to - size; i >= 0; ) {
+            const ushort ch = fold(data[i]);
+            if (ch == first) {
+                int j = 1;
+                while (j < size && fold(data[i + j]) == w[j])
+                    ++j;
+                if (j == size)
+                    return i;
+            }
+            i -= skip[ch & 0xff];
+        }
+        return -1;
+    }
+
+    QVector<ushort> word;
+    const ushort *lower;
+    int skip[256];
+
+    // run() forward
+    QString carry; // the last word.size() - 1 characters before the block
+    qint64 next; // where the next match can start
+    int block;
+
+    // runParallel()
+    QVector<Span> spans;
+    QVector<int> segments; // the first span of each and spans.size() at the end
+    qint64 segmentSize, segmentLength;
+    qint64 searchFrom, searchTo;
+    QMutex mutex; // protects the members below
+    QWaitCondition condition;
+    QHash<int, QVector<qint64> > matches; // by segment, until they're reported
+    int nextSegment, reportedSegments, maxAhead;
+    bool stop;
+};
+
+void FindThread::run()
+{
+    search->searchSegments();
+}
+
+// Forward find(QChar) runs straight over the chunks' spans. When the
+// character can be matched exactly TextScan skips to the candidates, and
+// backward finds hand it blocks from the back with visitBackward()
+class FindCharVisitor : public TextDocument::SpanVisitor, public FindReporter
+{
+public:
+    FindCharVisitor(const TextDocument *doc, const TextDocumentPrivate *dd, const QChar &c, TextDocument::FindMode f, qint64 pos)
+        : FindReporter(doc, dd, f, pos), scan(false), ch(c)
+    {
+        // the lower case of a letter can come from more than one character
+        scan = findsInBlocks(document)
+               && ((flags & TextDocument::FindCaseSensitively) || (ch.unicode() < 0x80 && !ch.isLetter()));
+    }
+
+    bool visit(qint64 pos, const QChar *data, int size)
+    {
+        if (scan) {
+            const ushort *utf16 = reinterpret_cast<const ushort*>(data);
+            const int step = int(blockSize(1, size));
+            for (int from=0; from<size; from += step) {
+                const int end = qMin(size, from + step);
+                int i = from;
+                int index;
+                while ((index = TextScan::indexOf(utf16 + i, end - i, ch.unicode())) != -1) {
+                    i += index;
+                    if (wholeWord(pos + i, 1) && !found(pos + i, 1))
+                        return false;
+                    ++i;
+                }
+                if (!progressed(pos + end, true))
+                    return false;
+            }
+            return true;
+        }
+        const bool caseSensitive = flags & TextDocument::FindCaseSensitively;
+        for (int i=0; i<size; ++i) {
+#ifdef TEXTDOCUMENT_FIND_SLEEP
+            findSleep(document);
+#endif
+            const qint64 position = pos + i;
+            if ((caseSensitive ? data[i] : data[i].toLower()) == ch && wholeWord(position, 1) && !found(position, 1))
+                return false;
+            if (!progressed(position + 1, false))
+                return false;
+        }
+        return true;
+    }
+
+    // pos is where data starts. Has to be called with the blocks in reverse order
+    bool visitBackward(qint64 pos, const QChar *data, int size)
+    {
+        Q_ASSERT(scan);
+        const ushort *utf16 = reinterpret_cast<const ushort*>(data);
+        int index;
+        while ((index = TextScan::lastIndexOf(utf16, size, ch.unicode())) != -1) {
+            if (wholeWord(pos + index, 1) && !found(pos + index, 1))
+                return false;
+            size = index;
+        }
+        return progressed(pos, true);
+    }
+
+    bool scan;
+private:
+    const QChar ch;
+};
+
+TextCursor TextDocument::find(const QString &in, const TextCursor &cursor, FindMode flags) const
+{
+    if (in.isEmpty()) {
+        return TextCursor();
+    } else if (in.size() == 1) {
+        return find(in.at(0), cursor, flags);
+    }
+
+    d->waitForCheckpoints(-1);
+    QReadLocker locker(d->readWriteLock);
+
+    const bool reverse = flags & FindBackward;
+    const bool caseSensitive = flags & FindCaseSensitively;
+    const bool wholeWords = flags & FindWholeWords;
+    if (flags & FindWrap && cursor.hasSelection()) {
+        qWarning("It makes no sense to pass FindWrap and set a selection for the cursor. The entire selection will be searched");
+        flags &= ~FindWrap;
+    }
+
+    qint64 pos;
+    qint64 limit;
+    ::initFind(cursor, reverse, &pos, &limit);
+
+    if (pos == d->documentSize) {
+        if (reverse) {
+            --pos;
+        } else if (!(flags & FindWrap)) {
+            return TextCursor();
+        }
+    }
+
+    if (findsInBlocks(this)) {
+        const FindScope scope(flags & FindAllowInterrupt ? &d->findState : 0);
+        const SequentialScope sequential(d);
+        FindStringSearch search(this, d, in, flags, pos);
+        if (reverse) {
+            search.run(limit, qMin(pos + 1, d->documentSize));
+        } else if ((flags & (FindAll|FindParallel)) == (FindAll|FindParallel)) {
+            search.runParallel(pos, limit);
+        } else {
+            search.run(pos, limit);
+        }
+        if (search.aborted) {
+            return TextCursor();
+        } else if (!search.result.isNull()) {
+            return search.result;
+        } else if (flags & FindWrap) {
+            Q_ASSERT(!cursor.hasSelection());
+            if (reverse) {
+                if (cursor.position() + 1 < d->documentSize)
+                    return find(in, TextCursor(this, cursor.position(), d->documentSize), flags & ~FindWrap);
+            } else if (cursor.position() > 0) {
+                return find(in, TextCursor(this, 0, cursor.position()), flags & ~FindWrap);
+            }
+        }
+        return TextCursor();
+    }
+
+    // ### what if one searches for a string with non-word characters in it and FindWholeWords?
+    const TextDocumentIterator::Direction direction = (reverse ? TextDocumentIterator::Left : TextDocumentIterator::Right);
+    QString word = caseSensitive ? in : in.toLower();
+    if (reverse) {
+        QChar *data = word.data();
+        const int size = word.size();
+        for (int i=0; i<size / 2; ++i) {
+            qSwap(data[i], data[size - 1 - i]);
+        }
+    }
+    TextDocumentIterator it(d, pos);
+    if (reverse) {
+        it.setMinBoundary(limit);
+    } else {
+        it.setMaxBoundary(limit);
+    }
+    if (!caseSensitive)
+        it.setConvertToLowerCase(true);
+
+    bool ok = true;
+    QChar ch = it.current();
+    int wordIndex = 0;
+    qint64 progressInterval = 0;
+    qint64 lastProgress = pos;
+    const qint64 initialPos = pos;
+    qint64 maxFindLength = 0;
+    const FindScope scope(flags & FindAllowInterrupt ? &d->findState : 0);
+    const SequentialScope sequential(d);
+    QTime lastProgressTime;
+    if (flags & FindAllowInterrupt) {
+        progressInterval = qMax<qint64>(1, (reverse
+                                         ? (static_cast<qreal>(pos) / static_cast<qreal>(TEXTDOCUMENT_FIND_INTERVAL_PERCENTAGE))
+                                         : (static_cast<qreal>(d->documentSize) - static_cast<qreal>(pos)) / 100.0));
+        maxFindLength = (reverse ? pos : d->documentSize - pos);
+        lastProgressTime.start();
+    }
+    do {
+#ifdef TEXTDOCUMENT_FIND_SLEEP
+        findSleep(this);
+#endif
+        if (progressInterval != 0) {
+            const qint64 progress = qAbs(it.position() - lastProgress);
+            if (progress >= progressInterval
+                || (progress % 10 == 0 && lastProgressTime.elapsed() >= TEXTDOCUMENT_MAX_INTERVAL)) {
+                const qreal progress = qAbs(static_cast<qreal>(it.position() - initialPos)) / static_cast<qreal>(maxFindLength);
+                emit findProgress(progress * 100.0, it.position());
+                if (d->findState == TextDocumentPrivate::AbortFind) {
+                    return TextCursor();
+                }
+                lastProgress = it.position();
+                lastProgressTime.restart();
+            }
+        }
+
+        bool found = ch == word.at(wordIndex);
+        if (found && wholeWords && (wordIndex == 0 || wordIndex == word.size() - 1)) {
+            Q_ASSERT(word.size() > 1);
+            const uint requiredBounds = ((wordIndex == 0) != reverse)
+                                        ? TextDocumentIterator::Left
+                                        : TextDocumentIterator::Right;
+            const uint bounds = d->wordBoundariesAt(it.position());
+            if (requiredBounds & ~bounds) {
+                found = false;
+            }
+        }
+        if (found) {
+            if (++wordIndex == word.size()) {
+                const qint64 pos = it.position() - (reverse ? 0 : word.size() - 1);
+                // the iterator reads one past the last matched character so we have to account for that here
+                const TextCursor ret(this, pos + wordIndex, pos);
+                if (flags & FindAll) {
+                    emit entryFound(ret);
+                    if (d->findState == TextDocumentPrivate::AbortFind)
+                        return TextCursor();
+                    wordIndex = 0;
+                } else {
+                    return ret;
+                }
+            }
+        } else if (wordIndex != 0) {
+            wordIndex = 0;
+            continue;
+        }
+        ch = it.nextPrev(direction, ok);
+    } while (ok);
+
+    if (flags & FindWrap) {
+        Q_ASSERT(!cursor.hasSelection());
+        if (reverse) {
+            if (cursor.position() + 1 < d->documentSize) {
+                return find(in, TextCursor(this, cursor.position(), d->documentSize), flags & ~FindWrap);
+            }
+        } else if (cursor.position() > 0) {
+            return find(in, TextCursor(this, 0, cursor.position()), flags & ~FindWrap);
+        }
+    }
+
+    return TextCursor();
+}
+
+TextCursor TextDocument::find(const QChar &chIn, const TextCursor &cursor, FindMode flags) const
+{
+    d->waitForCheckpoints(-1);
+    QReadLocker locker(d->readWriteLock);
+    if (flags & FindWrap && cursor.hasSelection()) {
+        qWarning("It makes no sense to pass FindWrap and set a selection for the cursor. The entire selection will be searched");
+        flags &= ~FindWrap;
+    }
+
+    const bool reverse = flags & FindBackward;
+    qint64 pos;
+    qint64 limit;
+    ::initFind(cursor, reverse, &pos, &limit);
+    if (pos == d->documentSize) {
+        if (reverse) {
+            --pos;
+        } else if (!(flags & FindWrap)) {
+            return TextCursor();
         }
     }
     Q_ASSERT(pos >= 0 && pos <= d->documentSize);
@@ -750,6 +1379,52 @@ TextCursor TextDocument::find(const QChar &chIn, const TextCursor &cursor, FindM
     const bool caseSensitive = flags & FindCaseSensitively;
     const bool wholeWords = flags & FindWholeWords;
     const QChar ch = (caseSensitive ? chIn : chIn.toLower());
+    if (!reverse) {
+        const FindScope scope(flags & FindAllowInterrupt ? &d->findState : 0);
+        const SequentialScope sequential(d);
+        if ((flags & (FindAll|FindParallel)) == (FindAll|FindParallel) && findsInBlocks(this)) {
+            FindStringSearch search(this, d, QString(ch), flags, pos);
+            search.runParallel(pos, limit);
+            if (search.aborted)
+                return TextCursor();
+        } else {
+            FindCharVisitor visitor(this, d, ch, flags, pos);
+            d->forEachSpan(pos, limit - pos, &visitor);
+            if (visitor.aborted) {
+                return TextCursor();
+            } else if (!visitor.result.isNull()) {
+                return visitor.result;
+            }
+        }
+        if (flags & FindWrap && cursor.position() > 0) {
+            Q_ASSERT(!cursor.hasSelection());
+            return find(ch, TextCursor(this, 0, cursor.position()), flags & ~FindWrap);
+        }
+        return TextCursor();
+    }
+    {
+        FindCharVisitor visitor(this, d, ch, flags, pos);
+        if (visitor.scan) {
+            const FindScope scope(flags & FindAllowInterrupt ? &d->findState : 0);
+            const SequentialScope sequential(d);
+            const qint64 block = visitor.blockSize(1, d->chunkSize);
+            for (qint64 end = pos + 1; end > limit; ) {
+                const qint64 start = qMax(limit, end - block);
+                const QString data = read(start, int(end - start));
+                if (!visitor.visitBackward(start, data.constData(), data.size()))
+                    break;
+                end = start;
+            }
+            if (visitor.aborted) {
+                return TextCursor();
+            } else if (!visitor.result.isNull()) {
+                return visitor.result;
+            } else if (flags & FindWrap && cursor.position() + 1 < d->documentSize) {
+                return find(ch, TextCursor(this, cursor.position(), d->documentSize), flags & ~FindWrap);
+            }
+            return TextCursor();
+        }
+    }
     TextDocumentIterator it(d, pos);
     if (reverse) {
         it.setMinBoundary(limit);
@@ -759,14 +1434,15 @@ TextCursor TextDocument::find(const QChar &chIn, const TextCursor &cursor, FindM
     const TextDocumentIterator::Direction dir = (reverse
                                                  ? TextDocumentIterator::Left
                                                  : TextDocumentIterator::Right);
-    int lastProgress = pos;
-    const int initialPos = pos;
-    int maxFindLength = 0;
-    int progressInterval = 0;
+    qint64 lastProgress = pos;
+    const qint64 initialPos = pos;
+    qint64 maxFindLength = 0;
+    qint64 progressInterval = 0;
     const FindScope scope(flags & FindAllowInterrupt ? &d->findState : 0);
+    const SequentialScope sequential(d);
     QTime lastProgressTime;
     if (flags & FindAllowInterrupt) {
-        progressInterval = qMax<int>(1, (reverse
+        progressInterval = qMax<qint64>(1, (reverse
                                          ? (static_cast<qreal>(pos) / static_cast<qreal>(TEXTDOCUMENT_FIND_INTERVAL_PERCENTAGE))
                                          : (static_cast<qreal>(d->documentSize) - static_cast<qreal>(pos)) / 100.0));
         maxFindLength = (reverse ? pos : d->documentSize - pos);
@@ -794,10 +1470,10 @@ TextCursor TextDocument::find(const QChar &chIn, const TextCursor &cursor, FindM
 //         qDebug() << "progressInterval" << progressInterval << qAbs(it.position() - lastProgress)
 //                  << lastProgressTime.elapsed() << TEXTDOCUMENT_MAX_INTERVAL;
         if (progressInterval != 0) {
-            const int progress = qAbs(it.position() - lastProgress);
+            const qint64 progress = qAbs(it.position() - lastProgress);
             if (progress >= progressInterval
                 || (progress % 10 == 0 && lastProgressTime.elapsed() >= TEXTDOCUMENT_MAX_INTERVAL)) {
-                const qreal progress = qAbs<int>(static_cast<qreal>(it.position() - initialPos)) / static_cast<qreal>(maxFindLength);
+                const qreal progress = qAbs(static_cast<qreal>(it.position() - initialPos)) / static_cast<qreal>(maxFindLength);
                 emit findProgress(progress * 100.0, it.position());
                 if (d->findState == TextDocumentPrivate::AbortFind) {
                     return TextCursor();
@@ -822,9 +1498,21 @@ TextCursor TextDocument::find(const QChar &chIn, const TextCursor &cursor, FindM
     return TextCursor();
 }
 
-bool TextDocument::insert(int pos, const QString &string)
+static inline bool isLatin1(const QString &string)
+{
+    const ushort *data = string.utf16();
+    const int size = string.size();
+    for (int i=0; i<size; ++i) {
+        if (data[i] > 0xff)
+            return false;
+    }
+    return true;
+}
+
+bool TextDocument::insert(qint64 pos, const QString &string)
 {
     QWriteLocker locker(d->readWriteLock);
+    d->finishCheckpoints();
 #ifdef QT_DEBUG
     Q_ASSERT(d->iterators.isEmpty());
 #endif
@@ -853,119 +1541,96 @@ bool TextDocument::insert(int pos, const QString &string)
     }
     d->modified = true;
 
-    Chunk *c;
+    d->shiftMarks(pos, string.size());
+    d->moveSectionsForInsert(pos, string.size());
+
+    Chunk *edited = d->insertText(pos, string);
+    d->splitChunk(edited);
+    d->enforceMemoryLimit();
+
+    emit charactersAdded(pos, string.size());
+    emit documentSizeChanged(d->documentSize);
+    if (isUndoAvailable() != undoAvailable) {
+        emit undoAvailableChanged(!undoAvailable);
+    }
+    if (cmd)
+        emit d->undoRedoCommandFinished(cmd);
+
+    emit textChanged();
+    return true;
+}
+
+Chunk *TextDocumentPrivate::insertText(qint64 pos, const QString &string)
+{
     int offset;
-    c = d->chunkAt(pos, &offset);
-//    qDebug() << c << (c == d->last) << (c == d->first) <<  offset << c->size() << d->chunkSize;
-    if (c == d->last && offset == c->size() && c->size() >= d->chunkSize) {
+    Chunk *c = chunkAt(pos, &offset);
+//    qDebug() << c << (c == last) << (c == first) <<  offset << c->size() << chunkSize;
+    if (c == last && offset == c->size() && c->size() >= chunkSize) {
         Chunk *chunk = new Chunk;
-        c->next = chunk;
-        chunk->previous = c;
-        d->last = chunk;
-        offset = 0;
         chunk->data = string;
-        d->documentSize += string.size();
-        if (d->options & SwapChunks) {
+        narrowChunk(chunk);
+        insertChunk(c, chunk);
+        useChunk(chunk);
+        documentSize += string.size();
+        if (options & TextDocument::SwapChunks) {
             if (c->previous) {
-                d->swapOutChunk(c->previous);
+                swapOutChunk(c->previous);
             }
         }
-        c = chunk;
+        return chunk;
+    }
+
+    if (editInPieces(c)) {
+        insertPiece(c, offset, string);
     } else {
-        d->instantiateChunk(c);
-#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
-        if (c == d->cachedChunk) {
-            d->cachedChunkData.clear(); // avoid detach when inserting
+        instantiateChunk(c); // takes it out of the chunk cache
+        if (c->data.isEmpty() && options & TextDocument::Latin1Chunks && ::isLatin1(string)) {
+            c->latin1.insert(offset, string.toLatin1());
+        } else {
+            widenChunk(c);
+            c->data.insert(offset, string);
         }
+        useChunk(c);
+    }
+    if (c->newLines != -1)
+        c->newLines += TextScan::count(string.utf16(), string.size(), '\n');
+#ifdef TEXTDOCUMENT_LINENUMBER_CACHE
+    c->lineNumbers.clear(); // the newlines after pos moved to other areas
 #endif
-        c->data.insert(offset, string);
+    chunkSizeChanged(c);
 #ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
-        if (c == d->cachedChunk) {
-            d->cachedChunkData = c->data;
-        } else if (pos <= d->cachedChunkPos) {
-            Q_ASSERT(d->cachedChunk);
-            d->cachedChunkPos += string.size();
-        }
+    shiftChunkCache(pos, string.size());
 #endif
 #ifndef NO_TEXTDOCUMENT_READ_CACHE
-        if (pos <= d->cachePos) {
-            d->cachePos += string.size();
-        } else if (pos < d->cachePos + d->cache.size()) {
-            d->cachePos = -1;
-            d->cache.clear();
-        }
-#endif
-
-        TextSection *s = d->sectionAt(pos, 0);
-        if (s && s->position() != pos) {
-            s->d.size += string.size();
-        }
-
-        d->documentSize += string.size();
-
-        foreach(TextCursorSharedPrivate *cursor, d->textCursors) {
-            if (cursor->position >= pos)
-                cursor->position += string.size();
-            if (cursor->anchor >= pos)
-                cursor->anchor += string.size();
-        }
-        foreach(TextSection *section, d->getSections(pos, -1, 0, 0)) {
-            section->d.position += string.size();
-        }
-
-        if (d->hasChunksWithLineNumbers && c->firstLineIndex != -1) {
-            const int extraLines = string.count(QLatin1Char('\n'));
-            if (extraLines != 0) {
-#ifdef TEXTDOCUMENT_LINENUMBER_CACHE
-                c->lineNumbers.clear();
-                // ### could be optimized
-#else
-                Q_ASSERT(c->lines != -1);
-                c->lines += extraLines;
-#endif
-                c = c->next;
-                while (c) {
-                    if (c->firstLineIndex != -1) {
-//                     qDebug() << "changing chunk number" << d->chunkIndex(c)
-//                              << "starting with" << d->chunkData(c, -1).left(5)
-//                              << "from" << c->firstLineIndex << "to" << (c->firstLineIndex + extraLines);
-                        c->firstLineIndex += extraLines;
-                    }
-                    c = c->next;
-                }
-            }
-        }
-    }
-
-    emit charactersAdded(pos, string.size());
-    emit documentSizeChanged(d->documentSize);
-    if (isUndoAvailable() != undoAvailable) {
-        emit undoAvailableChanged(!undoAvailable);
+    if (pos <= cachePos) {
+        cachePos += string.size();
+    } else if (pos < cachePos + cache.size()) {
+        cachePos = -1;
+        cache.clear();
     }
-    if (cmd)
-        emit d->undoRedoCommandFinished(cmd);
+#endif
+    documentSize += string.size();
+    return c;
+}
 
-    emit textChanged();
-    return true;
+static inline int count(const QByteArray &latin1, int from, int size, char ch)
+{
+    Q_ASSERT(from + size <= latin1.size());
+    return TextScan::count(latin1.constData() + from, size, ch);
 }
 
 static inline int count(const QString &string, int from, int size, const QChar &ch)
 {
     Q_ASSERT(from + size <= string.size());
-    const ushort needle = ch.unicode();
-    const ushort *haystack = string.utf16() + from;
-    int num = 0;
-    for (int i=0; i<size; ++i) {
-        if (*haystack++ == needle)
-            ++num;
-    }
+    const int num = TextScan::count(string.utf16() + from, size, ch.unicode());
 //    Q_ASSERT(string.mid(from, size).count(ch) == num);
     return num;
 }
 
-void TextDocument::remove(int pos, int size)
+void TextDocument::remove(qint64 pos, qint64 size)
 {
     QWriteLocker locker(d->readWriteLock);
+    d->finishCheckpoints();
 #ifdef QT_DEBUG
     Q_ASSERT(d->iterators.isEmpty());
 #endif
@@ -982,10 +1647,10 @@ void TextDocument::remove(int pos, int size)
         if (!d->undoRedoStack.isEmpty()
             && d->undoRedoStack.last()->type == DocumentCommand::Removed
             && d->undoRedoStack.last()->position == pos + size) {
-            d->undoRedoStack.last()->text.prepend(read(pos, size));
+            d->undoRedoStack.last()->text.prepend(read(pos, int(size)));
             d->undoRedoStack.last()->position -= size;
         } else {
-            cmd = new DocumentCommand(DocumentCommand::Removed, pos, read(pos, size));
+            cmd = new DocumentCommand(DocumentCommand::Removed, pos, read(pos, int(size)));
             if (!d->modified)
                 d->modifiedIndex = d->undoRedoStackCurrent;
             emit d->undoRedoCommandInserted(cmd);
@@ -996,91 +1661,180 @@ void TextDocument::remove(int pos, int size)
     }
     d->modified = true;
 
-    int toRemove = size;
-    int newLinesRemoved = 0;
-    while (toRemove > 0) {
+    d->moveMarksForRemove(pos, size);
+    d->moveSectionsForRemove(pos, size);
+
+    d->removeText(pos, size);
+    if (d->documentSize > 0) {
         int offset;
         Chunk *c = d->chunkAt(pos, &offset);
+        if (c->next)
+            d->mergeChunk(c->next);
+        d->mergeChunk(c);
+    }
+    d->enforceMemoryLimit();
+
+    emit charactersRemoved(pos, size);
+    emit documentSizeChanged(d->documentSize);
+    if (isUndoAvailable() != undoAvailable) {
+        emit undoAvailableChanged(!undoAvailable);
+    }
+    if (cmd)
+        emit d->undoRedoCommandFinished(cmd);
+    emit textChanged();
+}
+
+void TextDocumentPrivate::removeText(qint64 pos, qint64 size)
+{
+    qint64 toRemove = size;
+    while (toRemove > 0) {
+        int offset;
+        Chunk *c = chunkAt(pos, &offset);
         if (offset == 0 && toRemove >= c->size()) {
             toRemove -= c->size();
-            if (d->hasChunksWithLineNumbers) {
-                newLinesRemoved += d->chunkData(c, pos).count('\n');
-                // ### should use the QVector<int> stuff if possible
-            }
-            d->removeChunk(c);
+            removeChunk(c);
         } else {
-            d->instantiateChunk(c);
-            const int removed = qMin(toRemove, c->size() - offset);
-            if (d->hasChunksWithLineNumbers) {
-                const int tmp = ::count(c->data, offset, removed, QLatin1Char('\n'));
-                newLinesRemoved += tmp;
+            const bool pieces = editInPieces(c);
+            if (!pieces)
+                instantiateChunk(c);
+            const int removed = int(qMin<qint64>(toRemove, c->size() - offset));
+            if (c->newLines != -1) {
+                c->newLines -= !c->latin1.isEmpty()
+                               ? ::count(c->latin1, offset, removed, '\n')
+                               : ::count(pieces ? chunkData(c, pos - offset) : c->data, offset, removed, QLatin1Char('\n'));
+            }
 #ifdef TEXTDOCUMENT_LINENUMBER_CACHE
-                if (tmp > 0)
-                    c->lineNumbers.clear();
-                    // ### Could clear only the parts that need to be cleared really
+            c->lineNumbers.clear();
 #endif
+            if (pieces) {
+                removePieces(c, offset, removed);
+            } else if (!c->latin1.isEmpty()) {
+                c->latin1.remove(offset, removed);
+                useChunk(c);
+            } else {
+                c->data.remove(offset, removed);
+                useChunk(c);
             }
+            chunkSizeChanged(c);
+            toRemove -= removed;
+        }
+    }
+
+    documentSize -= size;
 #ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
-//            qDebug() << "removing from" << c << d->cachedChunk;
-            if (d->cachedChunk == c) {
-                d->cachedChunkData.clear();
-            }
+    // chunks that were in the removed range are out of the cache already
+    shiftChunkCache(pos, -size);
 #endif
-            c->data.remove(offset, removed);
-#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
-            if (d->cachedChunk == c)
-                d->cachedChunkData = c->data;
+#ifndef NO_TEXTDOCUMENT_READ_CACHE
+    if (pos + size < cachePos) {
+        cachePos -= size;
+    } else if (pos <= cachePos + cache.size()) {
+        cachePos = -1;
+        cache.clear();
+    }
 #endif
+}
 
+static inline bool compareEdit(const TextDocument::Edit &left, const TextDocument::Edit &right)
+{
+    // text inserted where something else is removed goes first
+    return left.position < right.position || (left.position == right.position && !left.removed && right.removed);
+}
 
-            toRemove -= removed;
+bool TextDocument::applyEdits(const QVector<Edit> &edits)
+{
+    QWriteLocker locker(d->readWriteLock);
+    d->finishCheckpoints();
+#ifdef QT_DEBUG
+    Q_ASSERT(d->iterators.isEmpty());
+#endif
+    QVector<Edit> sorted;
+    sorted.reserve(edits.size());
+    foreach(const Edit &edit, edits) {
+        if (edit.removed != 0 || !edit.text.isEmpty())
+            sorted.append(edit);
+    }
+    if (sorted.isEmpty())
+        return false;
+    qStableSort(sorted.begin(), sorted.end(), compareEdit);
+
+    QVector<qint64> deltas(sorted.size());
+    qint64 delta = 0;
+    for (int i=0; i<sorted.size(); ++i) {
+        const Edit &edit = sorted.at(i);
+        if (edit.position < 0 || edit.removed < 0 || edit.position + edit.removed > d->documentSize
+            || (i > 0 && sorted.at(i - 1).position + sorted.at(i - 1).removed > edit.position)) {
+            qWarning("TextDocument::applyEdits() Edits out of range or overlapping");
+            return false;
         }
+        deltas[i] = delta;
+        delta += edit.text.size() - edit.removed;
     }
 
-    foreach(TextCursorSharedPrivate *cursor, d->textCursors) {
-        if (cursor->position >= pos)
-            cursor->position -= qMin(size, cursor->position - pos);
-        if (cursor->anchor >= pos)
-            cursor->anchor -= qMin(size, cursor->anchor - pos);
+    const bool undoAvailable = isUndoAvailable();
+    DocumentCommand *cmd = 0;
+    if (!d->ignoreUndoRedo && d->undoRedoEnabled) { // not only from cursors, see the header
+        d->clearRedo();
+        cmd = new DocumentCommand(DocumentCommand::Edited, sorted.first().position);
+        cmd->edits = sorted;
+        cmd->undoEdits.reserve(sorted.size());
+        for (int i=0; i<sorted.size(); ++i) {
+            const Edit &edit = sorted.at(i);
+            cmd->undoEdits.append(Edit(edit.position + deltas.at(i), edit.text.size(),
+                                       read(edit.position, int(edit.removed))));
+        }
+        if (!d->modified)
+            d->modifiedIndex = d->undoRedoStackCurrent;
+        emit d->undoRedoCommandInserted(cmd);
+        d->undoRedoStack.append(cmd);
+        ++d->undoRedoStackCurrent;
+        Q_ASSERT(d->undoRedoStackCurrent == d->undoRedoStack.size());
     }
+    d->modified = true;
 
-    QList<TextSection*> s = d->getSections(pos, -1, 0, 0);
-    foreach(TextSection *section, s) {
-        const QPair<int, int> intersection = ::intersection(pos, size, section->position(), section->size());
-        if (intersection.second == section->size()) {
-            delete section;
-        } else {
-            if (intersection.first == section->position() || intersection.first == -1)
-                section->d.position -= size;
-            section->d.size -= intersection.second;
+    // an edit doesn't move what's before it so going back to front the
+    // marks and sections end up where the edits put them
+    for (int i=sorted.size() - 1; i>=0; --i) {
+        const Edit &edit = sorted.at(i);
+        if (edit.removed > 0) {
+            d->moveMarksForRemove(edit.position, edit.removed);
+            d->moveSectionsForRemove(edit.position, edit.removed);
+        }
+        if (!edit.text.isEmpty()) {
+            d->shiftMarks(edit.position, edit.text.size());
+            d->moveSectionsForInsert(edit.position, edit.text.size());
         }
     }
 
-    d->documentSize -= size;
-#ifndef NO_TEXTDOCUMENT_READ_CACHE
-    if (pos + size < d->cachePos) {
-        d->cachePos -= size;
-    } else if (pos <= d->cachePos + d->cache.size()) {
-        d->cachePos = -1;
-        d->cache.clear();
+    // back to front so the positions of the edits still to come don't move
+    for (int i=sorted.size() - 1; i>=0; --i) {
+        const Edit &edit = sorted.at(i);
+        if (edit.removed > 0)
+            d->removeText(edit.position, edit.removed);
+        if (!edit.text.isEmpty())
+            d->insertText(edit.position, edit.text);
     }
-#endif
-    if (newLinesRemoved > 0) {
-        Q_ASSERT(d->hasChunksWithLineNumbers);
-        int offset;
-        Chunk *c = d->chunkAt(pos, &offset);
-        if (offset != 0)
-            c = c->next;
-        while (c) {
-            if (c->firstLineIndex != -1) {
-                c->firstLineIndex -= newLinesRemoved;
-            }
-            c = c->next;
+    int offset;
+    for (int i=0; i<sorted.size(); ++i) {
+        const qint64 pos = sorted.at(i).position + deltas.at(i);
+        d->splitChunk(d->chunkAt(pos, &offset));
+        if (d->documentSize > 0) {
+            Chunk *c = d->chunkAt(pos, &offset);
+            if (c->next)
+                d->mergeChunk(c->next);
+            d->mergeChunk(c);
         }
     }
-
-
-    emit charactersRemoved(pos, size);
+    d->enforceMemoryLimit();
+
+    const Edit &last = sorted.last();
+    const qint64 from = sorted.first().position;
+    const qint64 removed = last.position + last.removed - from;
+    if (removed > 0)
+        emit charactersRemoved(from, removed);
+    if (removed + delta > 0)
+        emit charactersAdded(from, removed + delta);
+    emit editsApplied(sorted);
     emit documentSizeChanged(d->documentSize);
     if (isUndoAvailable() != undoAvailable) {
         emit undoAvailableChanged(!undoAvailable);
@@ -1088,6 +1842,7 @@ void TextDocument::remove(int pos, int size)
     if (cmd)
         emit d->undoRedoCommandFinished(cmd);
     emit textChanged();
+    return true;
 }
 
 void TextDocument::takeTextSection(TextSection *section)
@@ -1096,26 +1851,129 @@ void TextDocument::takeTextSection(TextSection *section)
     Q_ASSERT(section);
     Q_ASSERT(section->document() == this);
 
-    QList<TextSection*>::iterator first = qLowerBound(d->sections.begin(), d->sections.end(), section, compareTextSection);
-    Q_ASSERT(first != d->sections.end());
-    const QList<TextSection*>::iterator last = qUpperBound(d->sections.begin(), d->sections.end(), section, compareTextSection);
-
-    while (first != last) {
-        if (*first == section) {
-            emit sectionRemoved(section);
-            d->sections.erase(first);
-            break;
-        }
-        ++first;
+    if (section->d.parent || d->sectionTreeRoot == section) {
+        emit sectionRemoved(section);
+        d->removeSection(section);
     }
 
     // Moved this to the end as the slots called by sectionRemoved (presently) rely
     // on section->d.document to be valid.
+    section->d.style = TextSectionStyles::detached()->copyStyle(&d->sectionStyles, section->d.style);
     section->d.textEdit = 0;
     section->d.document = 0;
 }
 
-QList<TextSection*> TextDocument::sections(int pos, int size, TextSection::TextSectionOptions flags) const
+static inline bool compareTextSection(const TextSection *left, const TextSection *right)
+{
+    return left->position() < right->position();
+}
+
+// Inserting or removing count sections one at a time is O(count log total)
+// while taking the tree apart and building it again is O(total)
+static inline bool fewSections(int count, int total)
+{
+    int depth = 1;
+    while (total >> depth)
+        ++depth;
+    return qint64(count) * depth < total;
+}
+
+QList<TextSection*> TextDocument::insertTextSections(const QVector<SectionSpec> &specs)
+{
+    QWriteLocker locker(d->readWriteLock);
+    QList<TextSection*> added;
+    if (specs.isEmpty())
+        return added;
+    d->applyCheckpoints(-1);
+    foreach(const SectionSpec &spec, specs) {
+        if (spec.position < 0 || spec.size < 0 || spec.position >= d->documentSize
+            || spec.position + spec.size > d->documentSize) {
+            qWarning("TextDocument::insertTextSections() Sections out of range");
+            return added;
+        }
+    }
+    added.reserve(specs.size());
+    foreach(const SectionSpec &spec, specs) {
+        added.append(new TextSection(spec.position, spec.size, this, spec.format, spec.data));
+    }
+    qStableSort(added.begin(), added.end(), compareTextSection);
+
+    // New ones go before the old ones at the same position like in
+    // insertSection(). Going backwards keeps the ones at the same position
+    // in the order of specs
+    if (::fewSections(added.size(), d->sectionCount)) {
+        for (int i=added.size() - 1; i>=0; --i)
+            d->insertSection(added.at(i));
+        emit sectionsAdded(added);
+        return added;
+    }
+
+    // otherwise merge with the sections there already and build the tree again
+    QList<TextSection*> old;
+    d->takeSections(d->sectionTreeRoot, 0, &old);
+    d->sectionTreeRoot = 0;
+    QList<TextSection*> merged;
+    merged.reserve(old.size() + added.size());
+    int i = 0;
+    foreach(TextSection *section, added) {
+        while (i < old.size() && old.at(i)->position() < section->position())
+            merged.append(old.at(i++));
+        merged.append(section);
+    }
+    while (i < old.size())
+        merged.append(old.at(i++));
+    d->buildSectionTree(merged);
+    emit sectionsAdded(added);
+    return added;
+}
+
+int TextDocument::removeTextSections(qint64 pos, qint64 size, TextSection::TextSectionOptions flags,
+                                     SectionFilter *filter)
+{
+    QWriteLocker locker(d->readWriteLock);
+    QList<TextSection*> removed = d->getSections(pos, size, flags, 0);
+    if (filter) {
+        for (int i=removed.size() - 1; i>=0; --i) {
+            if (!filter->matches(removed.at(i)))
+                removed.removeAt(i);
+        }
+    }
+    if (removed.isEmpty())
+        return 0;
+
+    if (::fewSections(removed.size(), d->sectionCount)) {
+        foreach(TextSection *section, removed)
+            d->removeSection(section);
+    } else {
+        // removed is in the same order as the tree
+        QList<TextSection*> all;
+        d->takeSections(d->sectionTreeRoot, 0, &all);
+        d->sectionTreeRoot = 0;
+        QList<TextSection*> kept;
+        kept.reserve(all.size() - removed.size());
+        int i = 0;
+        foreach(TextSection *section, all) {
+            if (i < removed.size() && removed.at(i) == section) {
+                ++i;
+            } else {
+                kept.append(section);
+            }
+        }
+        Q_ASSERT(i == removed.size());
+        d->buildSectionTree(kept);
+    }
+
+    // the slots rely on section->d.document being valid, like for sectionRemoved()
+    emit sectionsRemoved(removed);
+    foreach(TextSection *section, removed) {
+        section->d.textEdit = 0;
+        section->d.document = 0;
+        delete section;
+    }
+    return removed.size();
+}
+
+QList<TextSection*> TextDocument::sections(qint64 pos, qint64 size, TextSection::TextSectionOptions flags) const
 {
     QReadLocker locker(d->readWriteLock);
     return d->getSections(pos, size, flags, 0);
@@ -1124,24 +1982,24 @@ QList<TextSection*> TextDocument::sections(int pos, int size, TextSection::TextS
 void TextDocument::insertTextSection(TextSection *section)
 {
     QWriteLocker locker(d->readWriteLock);
-    Q_ASSERT(!d->sections.contains(section));
-    QList<TextSection*>::iterator it = qLowerBound<QList<TextSection*>::iterator>(d->sections.begin(), d->sections.end(),
-                                                                                  section, compareTextSection);
-    d->sections.insert(it, section);
+    Q_ASSERT(!section->d.parent && d->sectionTreeRoot != section);
+    section->d.style = d->sectionStyles.copyStyle(section->styles(), section->d.style);
+    section->d.document = this; // takeTextSection() cleared it
+    d->insertSection(section);
     emit sectionAdded(section);
 }
 
-TextSection *TextDocument::insertTextSection(int pos, int size,
+TextSection *TextDocument::insertTextSection(qint64 pos, qint64 size,
                                              const QTextCharFormat &format, const QVariant &data)
 {
     QWriteLocker locker(d->readWriteLock);
     Q_ASSERT(pos >= 0);
     Q_ASSERT(size >= 0);
+    d->applyCheckpoints(pos + size);
     Q_ASSERT(pos < d->documentSize);
 
     TextSection *l = new TextSection(pos, size, this, format, data);
-    QList<TextSection*>::iterator it = qLowerBound<QList<TextSection*>::iterator>(d->sections.begin(), d->sections.end(), l, compareTextSection);
-    d->sections.insert(it, l);
+    d->insertSection(l);
     emit sectionAdded(l);
     return l;
 }
@@ -1165,8 +2023,9 @@ bool TextDocument::abortFind() const
 }
 
 
-QChar TextDocument::readCharacter(int pos) const
+QChar TextDocument::readCharacter(qint64 pos) const
 {
+    d->waitForCheckpoints(pos + 1);
     QReadLocker locker(d->readWriteLock);
     if (pos == d->documentSize)
         return QChar();
@@ -1176,6 +2035,7 @@ QChar TextDocument::readCharacter(int pos) const
     static int hits = 0;
     static int misses = 0;
 #endif
+    QMutexLocker cacheLocker(&d->cacheMutex);
     if (pos >= d->cachePos && pos < d->cachePos + d->cache.size()) {
 #ifdef DEBUG_CACHE_HITS
         qWarning() << "readCharacter hits" << ++hits << "misses" << misses;
@@ -1185,11 +2045,16 @@ QChar TextDocument::readCharacter(int pos) const
 #ifdef DEBUG_CACHE_HITS
     qWarning() << "readCharacter hits" << hits << "misses" << ++misses;
 #endif
+    cacheLocker.unlock();
 #endif
 
     int offset;
-    Chunk *c = d->chunkAt(pos, &offset);
-    return d->chunkData(c, pos - offset).at(offset);
+    const ChunkRef ref = d->chunkRefAt(pos, &offset);
+    if (!ref.chunk->latin1.isEmpty()) {
+        d->useChunk(ref.chunk);
+        return QChar(uchar(ref.chunk->latin1.at(offset)));
+    }
+    return d->chunkRefData(ref, pos - offset).at(offset);
 }
 
 void TextDocument::setText(const QString &text)
@@ -1222,13 +2087,119 @@ void TextDocument::setChunkSize(int size)
     d->chunkSize = size;
 }
 
-int TextDocument::currentMemoryUsage() const
+int TextDocument::chunkCacheSize() const
+{
+    QReadLocker locker(d->readWriteLock);
+    return d->chunkCacheSize;
+}
+
+void TextDocument::setChunkCacheSize(int entries)
+{
+    QWriteLocker locker(d->readWriteLock);
+    Q_ASSERT(entries >= 0);
+    d->chunkCacheSize = entries;
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+    d->trimChunkCache();
+#endif
+}
+
+qint64 TextDocument::chunkCacheMemoryLimit() const
+{
+    QReadLocker locker(d->readWriteLock);
+    return d->chunkCacheMemoryLimit;
+}
+
+void TextDocument::setChunkCacheMemoryLimit(qint64 bytes)
+{
+    QWriteLocker locker(d->readWriteLock);
+    Q_ASSERT(bytes >= 0);
+    d->chunkCacheMemoryLimit = bytes;
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+    d->trimChunkCache();
+#endif
+}
+
+int TextDocument::prefetchDepth() const
+{
+    QReadLocker locker(d->readWriteLock);
+    return d->prefetchDepth;
+}
+
+void TextDocument::setPrefetchDepth(int chunks)
+{
+    QWriteLocker locker(d->readWriteLock);
+    Q_ASSERT(chunks >= 0);
+    d->stopPrefetching();
+    d->prefetchDepth = chunks;
+}
+
+int TextDocument::prefetchThreadCount() const
+{
+    QReadLocker locker(d->readWriteLock);
+    return d->prefetchThreadCount;
+}
+
+void TextDocument::setPrefetchThreadCount(int threads)
+{
+    QWriteLocker locker(d->readWriteLock);
+    Q_ASSERT(threads > 0);
+    d->stopPrefetching();
+    d->prefetchThreadCount = threads;
+}
+
+qint64 TextDocument::memoryLimit() const
+{
+    QReadLocker locker(d->readWriteLock);
+    return d->memoryLimit;
+}
+
+void TextDocument::setMemoryLimit(qint64 bytes)
+{
+    QWriteLocker locker(d->readWriteLock);
+    Q_ASSERT(bytes >= 0);
+    d->memoryLimit = bytes;
+    d->resetUsedChunks();
+    d->enforceMemoryLimit();
+}
+
+int TextDocument::compressionThreshold() const
+{
+    QReadLocker locker(d->readWriteLock);
+    return d->compressionThreshold;
+}
+
+void TextDocument::setCompressionThreshold(int accesses)
+{
+    QWriteLocker locker(d->readWriteLock);
+    Q_ASSERT(accesses >= 0);
+    d->compressionThreshold = accesses;
+    d->resetUsedChunks();
+    d->enforceMemoryLimit();
+}
+
+TextDocument::Statistics TextDocument::statistics() const
+{
+    QReadLocker locker(d->readWriteLock);
+    QMutexLocker cacheLocker(&d->cacheMutex);
+    Statistics ret = d->statistics;
+    ret.compressedBytes = d->compressedBytes;
+    ret.compressedSize = d->compressedSize;
+    return ret;
+}
+
+void TextDocument::resetStatistics()
+{
+    QWriteLocker locker(d->readWriteLock);
+    d->statistics = Statistics();
+}
+
+qint64 TextDocument::currentMemoryUsage() const
 {
     QReadLocker locker(d->readWriteLock);
     Chunk *c = d->first;
-    int used = 0;
+    qint64 used = d->addBuffer.size() * sizeof(QChar);
     while (c) {
-        used += c->data.size() * sizeof(QChar);
+        used += c->data.size() * sizeof(QChar) + c->latin1.size() + c->pieces.size() * sizeof(Piece) + c->compressed.size();
         c = c->next;
     }
     return used;
@@ -1306,33 +2277,132 @@ void TextDocument::setModified(bool modified)
     emit modificationChanged(modified);
 }
 
-int TextDocument::lineNumber(int position) const
+int TextDocument::lineNumber(qint64 position) const
 {
+    d->waitForCheckpoints(position);
     QReadLocker locker(d->readWriteLock);
-    d->hasChunksWithLineNumbers = true; // does this need to be a write lock?
+    QMutexLocker cacheLocker(&d->cacheMutex); // the line counts are summed up as they're read
     int offset;
-    Chunk *c = d->chunkAt(position, &offset);
-    d->updateChunkLineNumbers(c, position - offset);
-    Q_ASSERT(c->firstLineIndex != -1);
-    Q_ASSERT(d->first->firstLineIndex != -1);
-    const int extra = (offset == 0 ? 0 : d->countNewLines(c, position - offset, offset));
+    const ChunkRef ref = d->chunkRefAt(position, &offset);
+    Chunk *c = const_cast<Chunk*>(ref.chunk); // only the line counts change
+    int lines = int(d->linesBefore(c));
+    if (c->extent) {
+        // the pieces of the extent before this one are counted already
+        d->chunkNewLines(c);
+        const int index = d->extentPiece(c, ref.start).index;
+        for (int i=0; i<index; ++i)
+            lines += c->extentLines.at(i);
+        if (offset > 0)
+            lines += ::count(d->chunkRefData(ref, position - offset), 0, offset, QLatin1Char('\n'));
+    } else if (offset > 0) {
+        lines += d->countNewLines(c, position - offset, offset);
+    }
 #ifdef QT_DEBUG
     if (position <= 16000) {
-        const QString data = read(0, position);
+        const QString data = read(0, int(position));
         // if we're on a newline it shouldn't count so we do read(0, position)
         // not read(0, position + 1);
         const int count = data.count(QLatin1Char('\n'));
-        if (count != c->firstLineIndex + extra) {
-            qDebug() << "TextDocument::lineNumber returns" << (c->firstLineIndex + extra)
+        if (count != lines) {
+            qDebug() << "TextDocument::lineNumber returns" << lines
                      << "should have returned" << (count + 1)
                      << "for index" << position;
         }
     }
 #endif
-    return c->firstLineIndex + extra;
+    return lines;
+}
+
+/*!
+    Returns how many lines the document has. That's one more than the
+    number of newlines.
+*/
+
+int TextDocument::lineCount() const
+{
+    d->waitForCheckpoints(-1);
+    QReadLocker locker(d->readWriteLock);
+    QMutexLocker cacheLocker(&d->cacheMutex);
+    d->countTreeLines(d->chunkTreeRoot);
+    return int(d->chunkTreeRoot->treeLines) + 1;
+}
+
+/*!
+    Returns true while the newlines of a document loaded with
+    CountLinesInBackground, or Sparse with a variable width codec, are
+    still being counted. lineNumber() and the
+    other line functions don't have to wait for it, they count what the
+    scan hasn't gotten to yet themselves.
+*/
+
+bool TextDocument::isCountingLines() const
+{
+    QMutexLocker locker(&d->lineScanMutex);
+    return d->lineScanCounted < d->scannedLines.size();
+}
+
+/*!
+    Returns the position of the first character of \a line or -1 if the
+    document doesn't have that many lines. Lines are counted from 0 like
+    lineNumber() does.
+*/
+
+qint64 TextDocument::positionForLine(int line) const
+{
+    d->waitForCheckpoints(-1);
+    QReadLocker locker(d->readWriteLock);
+    QMutexLocker cacheLocker(&d->cacheMutex);
+    if (line <= 0)
+        return line == 0 ? 0 : -1;
+    // the line starts after the remaining'th newline from pos on
+    int remaining = line;
+    qint64 pos = 0;
+    Chunk *c = d->chunkTreeRoot;
+    Chunk *last = 0;
+    while (c) {
+        last = c;
+        d->countTreeLines(c->left);
+        if (c->left) {
+            if (remaining <= c->left->treeLines) {
+                c = c->left;
+                continue;
+            }
+            remaining -= int(c->left->treeLines);
+            pos += c->left->treeSize;
+        }
+        const int lines = d->chunkNewLines(c);
+        if (remaining <= lines)
+            break;
+        remaining -= lines;
+        pos += c->span();
+        c = c->right;
+    }
+    d->chunkSizeChanged(last);
+    if (!c)
+        return -1;
+    ChunkRef ref = d->chunkRef(c, 0);
+    if (c->extent) {
+        // only the piece with the newline is read
+        int piece = 0;
+        while (remaining > c->extentLines.at(piece)) {
+            remaining -= c->extentLines.at(piece++);
+            ref = d->nextChunkRef(ref);
+        }
+        Q_ASSERT(ref.chunk == c);
+        pos += ref.start;
+    }
+    int index;
+    if (!c->latin1.isEmpty()) {
+        index = TextScan::indexOfNth(c->latin1.constData(), c->latin1.size(), '\n', remaining);
+    } else {
+        const QString data = d->chunkRefData(ref, pos);
+        index = TextScan::indexOfNth(data.utf16(), data.size(), '\n', remaining);
+    }
+    Q_ASSERT(index != -1);
+    return index == -1 ? -1 : pos + index + 1;
 }
 
-int TextDocument::columnNumber(int position) const
+int TextDocument::columnNumber(qint64 position) const
 {
     TextCursor cursor(this, position);
     return cursor.isNull() ? -1 : cursor.columnNumber();
@@ -1351,9 +2421,10 @@ int TextDocument::columnNumber(const TextCursor &cursor) const
 void TextDocument::setOptions(Options opt)
 {
     d->options = opt;
-    if ((d->options & Locking) != (d->readWriteLock != 0)) {
+    if (bool(d->options & Locking) != (d->readWriteLock != 0)) {
         if (d->readWriteLock) {
             delete d->readWriteLock;
+            d->readWriteLock = 0;
         } else {
             d->readWriteLock = new QReadWriteLock(QReadWriteLock::Recursive);
         }
@@ -1365,7 +2436,7 @@ TextDocument::Options TextDocument::options() const
     return d->options;
 }
 
-bool TextDocument::isWordCharacter(const QChar &ch, int /*index*/) const
+bool TextDocument::isWordCharacter(const QChar &ch, qint64 /*index*/) const
 {
     // from qregexp.
     return ch.isLetterOrNumber() || ch.isMark() || ch == QLatin1Char('_');
@@ -1377,127 +2448,918 @@ QString TextDocument::swapFileName(Chunk *chunk)
     QString file = QStandardPaths::standardLocations(QStandardPaths::TempLocation).first();
     file.reserve(file.size() + 24);
     QTextStream ts(&file);
-    ts << QLatin1Char('/') << QLatin1String("lte_") << chunk << QLatin1Char('_')
-       << this << QLatin1Char('_') << QCoreApplication::applicationPid();
+    ts << QLatin1Char('/') << QLatin1String("lte_");
+    if (chunk)
+        ts << chunk << QLatin1Char('_');
+    ts << this << QLatin1Char('_') << QCoreApplication::applicationPid();
 
     return file;
 }
 
 // --- TextDocumentPrivate ---
 
-Chunk *TextDocumentPrivate::chunkAt(int p, int *offset) const
+// Only for the write paths since it splits the chunk out of an extent
+Chunk *TextDocumentPrivate::chunkAt(qint64 p, int *offset)
 {
     Q_ASSERT(p <= documentSize);
     Q_ASSERT(p >= 0);
     Q_ASSERT(first);
     Q_ASSERT(last);
     if (p == documentSize) {
+        if (last->extent)
+            splitExtent(last, last->extent - 1);
         if (offset)
             *offset = last->size();
         return last;
     }
 #ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
-    Q_ASSERT(!cachedChunk || cachedChunkPos != -1);
-    if (cachedChunk && p >= cachedChunkPos && p < cachedChunkPos + cachedChunkData.size()) {
+    if (chunkCacheFirst && !chunkCacheFirst->chunk->extent
+        && p >= chunkCacheFirst->pos && p < chunkCacheFirst->pos + chunkCacheFirst->data.size()) {
         if (offset)
-            *offset = p - cachedChunkPos;
-        return cachedChunk;
+            *offset = int(p - chunkCacheFirst->pos);
+        return const_cast<Chunk*>(chunkCacheFirst->chunk);
     }
 #endif
-    int pos = p;
-    Chunk *c = first;
-
-    forever {
-        const int size = c->size();
-        if (pos < size) {
-            break;
-        }
-        pos -= size;
-        c = c->next;
-        Q_ASSERT(c);
+    qint64 pos;
+    Chunk *c = findChunk(p, &pos);
+    if (c->extent) {
+        const ExtentPiece piece = extentPiece(c, pos);
+        c = splitExtent(c, pos);
+        pos -= piece.start;
     }
-
     if (offset)
-        *offset = pos;
+        *offset = int(pos);
 
     Q_ASSERT(c);
     return c;
 }
 
-void TextDocumentPrivate::clearRedo()
+// chunkAt() for the read paths. Extents are left alone, the ref is to the
+// piece of the extent that has p in it
+ChunkRef TextDocumentPrivate::chunkRefAt(qint64 p, int *offset) const
 {
-    const bool doEmit = undoRedoStackCurrent < undoRedoStack.size();
-    while (undoRedoStackCurrent < undoRedoStack.size()) {
-        DocumentCommand *cmd = undoRedoStack.takeLast();
-        emit undoRedoCommandRemoved(cmd);
-        delete cmd;
+    Q_ASSERT(p >= 0 && p <= documentSize);
+    if (p == documentSize) {
+        const ChunkRef ref = chunkRef(last, last->span() - 1);
+        if (offset)
+            *offset = ref.size;
+        return ref;
     }
-    if (doEmit) {
-        emit q->redoAvailableChanged(false);
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+    if (chunkCacheFirst && p >= chunkCacheFirst->pos && p < chunkCacheFirst->pos + chunkCacheFirst->data.size()) {
+        ChunkRef ref;
+        ref.chunk = chunkCacheFirst->chunk;
+        ref.start = chunkCacheFirst->start;
+        ref.size = chunkCacheFirst->data.size();
+        if (offset)
+            *offset = int(p - chunkCacheFirst->pos);
+        return ref;
     }
+#endif
+    qint64 pos;
+    const Chunk *c = findChunk(p, &pos);
+    const ChunkRef ref = chunkRef(c, pos);
+    if (offset)
+        *offset = int(pos - ref.start);
+    return ref;
 }
 
-/* Evil double meaning of pos here. If it's -1 we don't cache it. */
-QString TextDocumentPrivate::chunkData(const Chunk *chunk, int chunkPos) const
+// The ref to chunk or to the piece of it that has offset in it if it's an extent
+ChunkRef TextDocumentPrivate::chunkRef(const Chunk *chunk, qint64 offset) const
 {
-#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
-#ifdef DEBUG_CACHE_HITS
-    static int hits = 0;
-    static int misses = 0;
+    ChunkRef ref;
+    ref.chunk = chunk;
+    if (chunk && chunk->extent) {
+        const ExtentPiece piece = extentPiece(chunk, offset);
+        ref.start = piece.start;
+        ref.size = piece.length;
+    } else if (chunk) {
+        ref.size = chunk->size();
+    }
+    return ref;
+}
+
+ChunkRef TextDocumentPrivate::nextChunkRef(const ChunkRef &ref) const
+{
+    Q_ASSERT(ref.chunk);
+    if (ref.start + ref.size < ref.chunk->span())
+        return chunkRef(ref.chunk, ref.start + ref.size);
+    return chunkRef(ref.chunk->next, 0);
+}
+
+ChunkRef TextDocumentPrivate::previousChunkRef(const ChunkRef &ref) const
+{
+    Q_ASSERT(ref.chunk);
+    if (ref.start > 0)
+        return chunkRef(ref.chunk, ref.start - 1);
+    const Chunk *previous = ref.chunk->previous;
+    return chunkRef(previous, previous ? previous->span() - 1 : 0);
+}
+
+// chunkData() for refs. The pieces of extents are decoded into the chunk
+// cache without splitting the extent. pos == -1 means don't cache
+QString TextDocumentPrivate::chunkRefData(const ChunkRef &ref, qint64 pos) const
+{
+    QMutexLocker locker(&cacheMutex);
+    if (!ref.chunk->extent)
+        return chunkData(ref.chunk, pos);
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+    if (const ChunkCacheEntry *entry = cachedChunk(ref.chunk, ref.start)) {
+        ++statistics.chunkCacheHits;
+        Q_ASSERT(entry->data.size() == ref.size);
+        return entry->data;
+    }
 #endif
-    if (chunk == cachedChunk) {
+    if (!device)
+        return QString().fill(QLatin1Char(' '), ref.size);
+    const ExtentPiece piece = extentPiece(ref.chunk, ref.start);
+    const QString data = deviceData(piece.from, piece.bytes, piece.length);
+    Q_ASSERT(data.size() == ref.size);
+    ++statistics.chunkCacheMisses;
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+    if (pos != -1)
+        cacheChunk(ref.chunk, ref.start, pos, data);
+#endif
+    return data;
+}
+
+// Pieces are chunkSize characters from the start of the extent or the
+// checkpoints of a device with a variable width codec
+ExtentPiece TextDocumentPrivate::extentPiece(const Chunk *extent, qint64 offset) const
+{
+    Q_ASSERT(extent->extent > 0 && offset >= 0 && offset < extent->extent);
+    ExtentPiece piece;
+    if (!checkpoints.isEmpty()) {
+        QMutexLocker locker(&lineScanMutex);
+        const int first = checkpointIndex(extent->from);
+        Q_ASSERT(first != -1);
+        const qint64 base = checkpoints.at(first).position;
+        // the last piece that starts at or before offset
+        int lo = first;
+        int hi = checkpointsCounted - 1;
+        while (lo < hi) {
+            const int mid = (lo + hi + 1) / 2;
+            if (checkpoints.at(mid).position - base <= offset) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        const Checkpoint &checkpoint = checkpoints.at(lo);
+        piece.start = checkpoint.position - base;
+        piece.from = checkpoint.from;
+        piece.bytes = checkpoint.bytes;
+        piece.length = checkpoint.length;
+        piece.index = lo - first;
+        return piece;
+    }
+    piece.start = offset - offset % chunkSize;
+    piece.from = extent->from + piece.start;
+    piece.bytes = -1;
+    piece.length = int(qMin<qint64>(chunkSize, extent->extent - piece.start));
+    piece.index = int(piece.start / chunkSize);
+    return piece;
+}
+
+// Like chunkAt() but leaves extents alone. p has to be less than documentSize
+Chunk *TextDocumentPrivate::findChunk(qint64 p, qint64 *offset) const
+{
+    Q_ASSERT(p >= 0 && p < documentSize);
+    qint64 pos = p;
+    Chunk *c = chunkTreeRoot;
+
+    forever {
+        Q_ASSERT(c);
+        if (c->left) {
+            if (pos < c->left->treeSize) {
+                c = c->left;
+                continue;
+            }
+            pos -= c->left->treeSize;
+        }
+        const qint64 size = c->span();
+        if (pos < size) {
+            break;
+        }
+        pos -= size;
+        c = c->right;
+    }
+    *offset = pos;
+    return c;
+}
+
+void TextDocumentPrivate::clearRedo()
+{
+    const bool doEmit = undoRedoStackCurrent < undoRedoStack.size();
+    while (undoRedoStackCurrent < undoRedoStack.size()) {
+        DocumentCommand *cmd = undoRedoStack.takeLast();
+        emit undoRedoCommandRemoved(cmd);
+        delete cmd;
+    }
+    if (doEmit) {
+        emit q->redoAvailableChanged(false);
+    }
+}
+
+/* Evil double meaning of pos here. If it's -1 we don't cache it. */
+QString TextDocumentPrivate::chunkData(const Chunk *chunk, qint64 chunkPos) const
+{
+    QMutexLocker locker(&cacheMutex);
+    if (chunk->from == -1) {
+        useChunk(chunk);
+        return decodeChunk(chunk);
+    }
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+    if (const ChunkCacheEntry *entry = cachedChunk(chunk)) {
+        ++statistics.chunkCacheHits;
 #ifdef DEBUG_CACHE_HITS
-        qWarning() << "chunkData hits" << ++hits << "misses" << misses;
+        qWarning() << "chunkData hits" << statistics.chunkCacheHits << "misses" << statistics.chunkCacheMisses;
 #endif
-        Q_ASSERT(cachedChunkData.size() == chunk->size());
-        return cachedChunkData;
-    } else
+        Q_ASSERT(entry->data.size() == chunk->size());
+        return entry->data;
+    }
 #endif
-    if (chunk->from == -1) {
-        return chunk->data;
-    } else if (!device && chunk->swap.isEmpty()) {
-        // Can only happen if the device gets deleted behind our back when in Sparse mode
-        return QString().fill(QLatin1Char(' '), chunk->size());
+    if (!device && !chunk->swapped && chunk->compressed.isEmpty()) {
+        return decodeChunk(chunk);
     } else {
-        QFile file;
-        QIODevice *dev = device.data();
-        if (!chunk->swap.isEmpty()) {
-            file.setFileName(chunk->swap);
-            if (!file.open(QIODevice::ReadOnly)) {
-                qWarning("TextDocumentPrivate::chunkData() Can't open file for reading '%s'", qPrintable(chunk->swap));
-                return QString().fill(QLatin1Char(' '), chunk->size());
-            }
-            dev = &file;
-        }
-        QTextStream ts(dev);
-        if (textCodec)
-            ts.setCodec(textCodec);
-//         if (!chunk->swap.isEmpty()) {
-//             qDebug() << "reading stuff from swap" << chunk << chunk->from << chunk->size() << chunk->swap;
-//         }
-        ts.seek(chunk->from);
-        const QString data = ts.read(chunk->length);
-        Q_ASSERT(data.size() == chunk->size());
+        const QString data = decodeChunk(chunk);
+        ++statistics.chunkCacheMisses;
 #ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
 #ifdef DEBUG_CACHE_HITS
-        qWarning() << "chunkData hits" << hits << "misses" << ++misses;
+        qWarning() << "chunkData hits" << statistics.chunkCacheHits << "misses" << statistics.chunkCacheMisses;
 #endif
         if (chunkPos != -1) {
-            cachedChunk = const_cast<Chunk*>(chunk);
-            cachedChunkData = data;
-            cachedChunkPos = chunkPos;
 #ifdef QT_DEBUG
             if (chunkPos != chunk->pos()) {
                 qWarning() << chunkPos << chunk->pos();
             }
             Q_ASSERT(chunkPos == chunk->pos());
 #endif
+            cacheChunk(chunk, 0, chunkPos, data);
         }
 #endif
         return data;
     }
 }
 
+// chunkData() without the chunk cache. The chunks don't change while the
+// document is read locked so the find threads call this too
+QString TextDocumentPrivate::decodeChunk(const Chunk *chunk) const
+{
+    QString data;
+    if (chunk->from == -1) {
+        data = chunk->latin1.isEmpty() ? chunk->data : QString::fromLatin1(chunk->latin1);
+    } else if (!device && !chunk->swapped && chunk->compressed.isEmpty()) {
+        // Can only happen if the device gets deleted behind our back when in Sparse mode
+        data.fill(QLatin1Char(' '), chunk->size());
+    } else if (!chunk->pieces.isEmpty()) {
+        data = pieceData(chunk);
+    } else if (!chunk->compressed.isEmpty()) {
+        data = compressedData(chunk);
+    } else if (!chunk->swapped) {
+        data = deviceData(chunk->from, chunk->bytes, chunk->length);
+    } else {
+        data = swappedData(chunk);
+    }
+    Q_ASSERT(data.size() == chunk->size());
+    return data;
+}
+
+// The chunk is looked up again for every span since visit() may read
+// from the document. Extents are read a piece at a time without
+// splitting them
+bool TextDocumentPrivate::forEachSpan(qint64 pos, qint64 size, TextDocument::SpanVisitor *visitor) const
+{
+    Q_ASSERT(pos >= 0 && pos <= documentSize);
+    Q_ASSERT(visitor);
+    if (size < 0 || size > documentSize - pos)
+        size = documentSize - pos;
+    while (size > 0) {
+        int offset;
+        const ChunkRef ref = chunkRefAt(pos, &offset);
+        const Chunk *c = ref.chunk;
+        const int max = int(qMin<qint64>(size, ref.size - offset));
+        QString data;
+        const QChar *span;
+        if (!c->latin1.isEmpty()) {
+            // only the visited part gets widened
+            useChunk(c);
+            data = QString::fromLatin1(c->latin1.constData() + offset, max);
+            span = data.constData();
+        } else {
+            data = chunkRefData(ref, pos - offset);
+            span = data.constData() + offset;
+        }
+        if (!visitor->visit(pos, span, max))
+            return false;
+        pos += max;
+        size -= max;
+    }
+    return true;
+}
+
+static inline int sum(const QVector<int> &numbers)
+{
+    int ret = 0;
+    foreach(int number, numbers)
+        ret += number;
+    return ret;
+}
+
+// Replaces the chunkSize aligned part of an extent that has offset in
+// it with a chunk of its own and returns that chunk. What's before and
+// after it stays lazy
+Chunk *TextDocumentPrivate::splitExtent(Chunk *extent, qint64 offset)
+{
+    const ExtentPiece piece = extentPiece(extent, offset);
+    if (piece.length == extent->extent) {
+        extent->length = piece.length;
+        extent->bytes = piece.bytes;
+        extent->extent = 0;
+        extent->extentLines.clear();
+        return extent;
+    }
+    const qint64 start = piece.start;
+    const int length = piece.length;
+    // the newlines of the pieces go with them if they're counted
+    const int index = piece.index;
+    const QVector<int> lines = extent->extentLines;
+    Chunk *tail = 0;
+    if (start + length < extent->extent) {
+        tail = new Chunk;
+        // the pieces are back to back on the device
+        tail->from = piece.from + (piece.bytes == -1 ? length : piece.bytes);
+        tail->extent = extent->extent - start - length;
+        if (!lines.isEmpty()) {
+            tail->extentLines = lines.mid(index + 1);
+            tail->newLines = ::sum(tail->extentLines);
+        }
+        insertChunk(extent, tail);
+    }
+    // the head keeps the extent's Chunk so pointers to it stay good
+    Chunk *c = extent;
+    if (start == 0) {
+        extent->length = length;
+        extent->bytes = piece.bytes;
+        extent->extent = 0;
+        extent->extentLines.clear();
+        if (!lines.isEmpty())
+            extent->newLines = lines.at(0);
+    } else {
+        c = new Chunk;
+        c->from = piece.from;
+        c->bytes = piece.bytes;
+        c->length = length;
+        if (!lines.isEmpty())
+            c->newLines = lines.at(index);
+        insertChunk(extent, c);
+        extent->extent = start;
+        if (!lines.isEmpty()) {
+            extent->extentLines.resize(index);
+            extent->newLines = ::sum(extent->extentLines);
+        }
+    }
+    chunkSizeChanged(extent);
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+    // the pieces read so far stay cached with the chunks they ended up in
+    for (ChunkCacheEntry *entry = chunkCacheFirst; entry; entry = entry->next) {
+        if (entry->chunk != extent || entry->start < start)
+            continue;
+        chunkCache.remove(qMakePair(entry->chunk, entry->start));
+        if (entry->start == start) {
+            entry->chunk = c;
+            entry->start = 0;
+        } else {
+            entry->chunk = tail;
+            entry->start -= start + length;
+        }
+        chunkCache.insert(qMakePair(entry->chunk, entry->start), entry);
+    }
+#endif
+    return c;
+}
+
+// Splits all of an extent into chunks, leaving the first one in its place
+void TextDocumentPrivate::expandExtent(Chunk *extent)
+{
+    while (extent->extent)
+        splitExtent(extent, extent->extent - 1);
+}
+
+// Chunks grow past 2 * chunkSize by insertions and are split back into
+// pieces of at most chunkSize. Removals merge chunks below chunkSize / 4
+// into a neighbour that's in memory as well
+void TextDocumentPrivate::splitChunk(Chunk *chunk)
+{
+    const int size = chunk->size();
+    if (size <= chunkSize * 2)
+        return;
+    instantiateChunk(chunk);
+    widenChunk(chunk);
+    const QString data = chunk->data;
+    const int count = (size + chunkSize - 1) / chunkSize;
+    Chunk *c = chunk;
+    int index = 0;
+    for (int i=0; i<count; ++i) {
+        int next = int(qint64(size) * (i + 1) / count);
+        if (next < size && data.at(next).isLowSurrogate())
+            ++next;
+        if (i > 0) {
+            Chunk *previous = c;
+            c = new Chunk;
+            insertChunk(previous, c);
+        }
+        c->data = data.mid(index, next - index);
+        narrowChunk(c);
+        resetNewLines(c);
+        chunkSizeChanged(c);
+        useChunk(c);
+        index = next;
+    }
+    Q_ASSERT(index == size);
+}
+
+void TextDocumentPrivate::mergeChunk(Chunk *chunk)
+{
+    if (chunk->from != -1 || chunk->swapped || chunk->size() >= chunkSize / 4)
+        return;
+    Chunk *c = chunk->previous;
+    if (!c || c->from != -1 || c->swapped || c->size() + chunk->size() > chunkSize) {
+        c = chunk;
+        chunk = chunk->next;
+        if (!chunk || chunk->from != -1 || chunk->swapped || c->size() + chunk->size() > chunkSize)
+            return;
+    }
+    // chunk goes into c. The lines of the chunks after them don't move
+    if (c->latin1.isEmpty() || chunk->latin1.isEmpty()) {
+        widenChunk(c);
+        widenChunk(chunk);
+        c->data += chunk->data;
+    } else {
+        c->latin1 += chunk->latin1;
+    }
+    useChunk(c);
+    c->newLines = (c->newLines == -1 || chunk->newLines == -1 ? -1 : c->newLines + chunk->newLines);
+#ifdef TEXTDOCUMENT_LINENUMBER_CACHE
+    c->lineNumbers.clear();
+#endif
+    removeChunk(chunk);
+    chunkSizeChanged(c);
+}
+
+// The chunk's text was replaced. Its newlines are counted again when
+// they're needed. Call chunkSizeChanged() after this
+void TextDocumentPrivate::resetNewLines(Chunk *chunk)
+{
+    chunk->newLines = -1;
+#ifdef TEXTDOCUMENT_LINENUMBER_CACHE
+    chunk->lineNumbers.clear();
+#endif
+}
+
+QString TextDocumentPrivate::deviceData(qint64 from, int bytes, int length) const
+{
+    if (prefetchDepth > 0) {
+        QMutexLocker locker(&prefetchMutex);
+        if (prefetched.contains(from)) {
+            prefetchedOrder.removeOne(from);
+            ++statistics.prefetchHits;
+            return prefetched.take(from);
+        }
+    }
+    return decodeDevice(from, bytes, length);
+}
+
+// Called from the prefetch threads as well
+QString TextDocumentPrivate::decodeDevice(qint64 from, int bytes, int length) const
+{
+    if (bytes != -1) {
+        if (mappedData)
+            return deviceCodec->toUnicode(reinterpret_cast<const char*>(mappedData) + from, bytes);
+        QMutexLocker locker(&deviceMutex);
+        device->seek(from);
+        const QByteArray data = device->read(bytes);
+        locker.unlock();
+        return deviceCodec->toUnicode(data);
+    } else if (mappedData) {
+        return readMapped(from, length);
+    }
+    QMutexLocker locker(&deviceMutex);
+    QTextStream ts(device.data());
+    if (textCodec)
+        ts.setCodec(textCodec);
+    ts.seek(from);
+    return ts.read(length);
+}
+
+void ChunkPrefetchThread::run()
+{
+    QMutexLocker locker(&doc->prefetchMutex);
+    forever {
+        while (doc->prefetchQueue.isEmpty() && !doc->prefetchStop)
+            doc->prefetchCondition.wait(&doc->prefetchMutex);
+        if (doc->prefetchStop)
+            break;
+        const PrefetchJob job = doc->prefetchQueue.takeFirst();
+        doc->prefetchInFlight.insert(job.from);
+        locker.unlock();
+        const QString data = doc->decodeDevice(job.from, job.bytes, job.length);
+        locker.relock();
+        doc->prefetchInFlight.remove(job.from);
+        if (doc->prefetchStop)
+            break;
+        doc->prefetched.insert(job.from, data);
+        doc->prefetchedOrder.append(job.from);
+        // chunks that weren't read after all go first
+        while (doc->prefetchedOrder.size() > doc->prefetchDepth * 2)
+            doc->prefetched.remove(doc->prefetchedOrder.takeFirst());
+    }
+}
+
+// Queues the chunk or piece ref is to and the ones after it in the given
+// direction for the prefetch threads. Jobs queued earlier that haven't
+// started are dropped
+void TextDocumentPrivate::prefetch(ChunkRef ref, bool forward) const
+{
+    if (prefetchDepth <= 0 || !device || deviceMode != TextDocument::Sparse)
+        return;
+    QList<PrefetchJob> jobs;
+    QMutexLocker cacheLocker(&cacheMutex);
+    for (int i=0; ref.chunk && i<prefetchDepth; ++i) {
+        const Chunk *c = ref.chunk;
+        if (c->extent) {
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+            if (!chunkCache.contains(qMakePair(c, ref.start)))
+#endif
+            {
+                const ExtentPiece piece = extentPiece(c, ref.start);
+                const PrefetchJob job = { piece.from, piece.bytes, piece.length };
+                jobs.append(job);
+            }
+        } else if (c->from != -1 && !c->swapped && c->pieces.isEmpty() && c->compressed.isEmpty()
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+            && !chunkCache.contains(qMakePair(c, qint64(0)))
+#endif
+            ) {
+            const PrefetchJob job = { c->from, c->bytes, c->length };
+            jobs.append(job);
+        }
+        ref = forward ? nextChunkRef(ref) : previousChunkRef(ref);
+    }
+    cacheLocker.unlock();
+
+    QMutexLocker locker(&prefetchMutex);
+    prefetchQueue.clear();
+    foreach(const PrefetchJob &job, jobs) {
+        if (!prefetched.contains(job.from) && !prefetchInFlight.contains(job.from))
+            prefetchQueue.append(job);
+    }
+    if (prefetchQueue.isEmpty())
+        return;
+    while (prefetchThreads.size() < prefetchThreadCount) {
+        ChunkPrefetchThread *thread = new ChunkPrefetchThread(this);
+        prefetchThreads.append(thread);
+        thread->start();
+    }
+    prefetchCondition.wakeAll();
+}
+
+void TextDocumentPrivate::prefetch(qint64 pos, bool forward) const
+{
+    if (prefetchDepth <= 0 || pos < 0 || pos > documentSize)
+        return;
+    int offset;
+    prefetch(chunkRefAt(pos, &offset), forward);
+}
+
+// Has to be called before the device or its mapping go away
+void TextDocumentPrivate::stopPrefetching()
+{
+    QMutexLocker locker(&prefetchMutex);
+    prefetchStop = true;
+    prefetchQueue.clear();
+    prefetchCondition.wakeAll();
+    const QList<ChunkPrefetchThread*> threads = prefetchThreads;
+    prefetchThreads.clear();
+    locker.unlock();
+    foreach(ChunkPrefetchThread *thread, threads) {
+        thread->wait();
+        delete thread;
+    }
+    locker.relock();
+    prefetched.clear();
+    prefetchedOrder.clear();
+    prefetchStop = false;
+}
+
+void LineScanThread::run()
+{
+    QMutexLocker locker(&doc->lineScanMutex);
+    while (!doc->lineScanStop && doc->lineScanNext < doc->scannedLines.size()) {
+        const int index = doc->lineScanNext++;
+        int lines;
+        if (doc->checkpoints.isEmpty()) {
+            const qint64 from = qint64(index) * doc->lineScanPieceSize;
+            locker.unlock();
+            lines = doc->scanNewLines(from, int(qMin<qint64>(doc->lineScanPieceSize, doc->lineScanSize - from)));
+            locker.relock();
+        } else {
+            Checkpoint checkpoint;
+            locker.unlock();
+            lines = doc->scanCheckpoint(index, &checkpoint);
+            locker.relock();
+            doc->addCheckpoint(index, checkpoint);
+        }
+        doc->scannedLines[index] = lines;
+        const int percent = int(++doc->lineScanCounted * qint64(100) / doc->scannedLines.size());
+        if (percent > doc->lineScanPercent) {
+            doc->lineScanPercent = percent;
+            QMetaObject::invokeMethod(const_cast<TextDocumentPrivate*>(doc), "onLineCountProgress",
+                                      Qt::QueuedConnection, Q_ARG(qreal, qreal(percent)));
+        }
+        if (doc->lineScanCounted == doc->checkpoints.size()) {
+            // the document tells its listeners how big it got
+            QMetaObject::invokeMethod(const_cast<TextDocumentPrivate*>(doc), "onCheckpointScanFinished",
+                                      Qt::QueuedConnection);
+        }
+    }
+}
+
+// Counts the newlines of the pieces of the device that haven't been
+// counted yet on idealThreadCount() threads. The chunks pick the counts up
+// in chunkNewLines() so lineNumber() only reads what the scan hasn't
+void TextDocumentPrivate::startLineScan()
+{
+    QMutexLocker locker(&lineScanMutex);
+    if (lineScanNext >= scannedLines.size())
+        return;
+    const int threads = qMax(1, QThread::idealThreadCount());
+    while (lineScanThreads.size() < threads) {
+        LineScanThread *thread = new LineScanThread(this);
+        lineScanThreads.append(thread);
+        thread->start();
+    }
+}
+
+// Has to be called before the device or its mapping go away. The pieces
+// counted so far are kept, startLineScan() goes on from there
+void TextDocumentPrivate::stopLineScan()
+{
+    QMutexLocker locker(&lineScanMutex);
+    lineScanStop = true;
+    const QList<LineScanThread*> threads = lineScanThreads;
+    lineScanThreads.clear();
+    locker.unlock();
+    foreach(LineScanThread *thread, threads) {
+        thread->wait();
+        delete thread;
+    }
+    locker.relock();
+    lineScanStop = false;
+}
+
+// Called from the line scan threads. Latin-1 is counted on the bytes
+// without decoding them
+int TextDocumentPrivate::scanNewLines(qint64 from, int length) const
+{
+    QTextCodec *codec = textCodec ? textCodec : QTextCodec::codecForLocale();
+    if (codec->mibEnum() != 4) { // ISO-8859-1
+        const QString data = decodeDevice(from, -1, length);
+        return ::count(data, 0, data.size(), QLatin1Char('\n'));
+    }
+    QByteArray bytes;
+    const char *data;
+    if (mappedData) {
+        data = reinterpret_cast<const char*>(mappedData) + from;
+    } else {
+        QMutexLocker locker(&deviceMutex);
+        device->seek(from);
+        bytes = device->read(length);
+        data = bytes.constData();
+        length = bytes.size();
+    }
+    return TextScan::count(data, length, '\n');
+}
+
+// What the line scan counted for the device range or -1 if it hasn't
+// or the range isn't one of its pieces
+int TextDocumentPrivate::scannedNewLines(qint64 from, int bytes, int length) const
+{
+    QMutexLocker locker(&lineScanMutex);
+    if (!checkpoints.isEmpty()) {
+        const int index = checkpointIndex(from);
+        return index != -1 && checkpoints.at(index).bytes == bytes ? scannedLines.at(index) : -1;
+    }
+    if (scannedLines.isEmpty() || bytes != -1 || from % lineScanPieceSize
+        || length != qMin<qint64>(lineScanPieceSize, lineScanSize - from)) {
+        return -1;
+    }
+    const qint64 index = from / lineScanPieceSize;
+    return index < scannedLines.size() ? scannedLines.at(int(index)) : -1;
+}
+
+QString TextDocumentPrivate::pieceData(const Chunk *chunk) const
+{
+    QString ret;
+    ret.reserve(chunk->length);
+    // the device pieces of a chunk usually all come from the same range
+    qint64 sourceFrom = -1;
+    int sourceBytes = -1;
+    QString source;
+    foreach(const Piece &piece, chunk->pieces) {
+        if (piece.from == -1) {
+            ret += addBuffer.midRef(piece.offset, piece.length);
+            continue;
+        }
+        if (piece.from != sourceFrom || piece.bytes != sourceBytes) {
+            source = deviceData(piece.from, piece.bytes, piece.size);
+            sourceFrom = piece.from;
+            sourceBytes = piece.bytes;
+        }
+        ret += source.midRef(piece.offset, piece.length);
+    }
+    return ret;
+}
+
+bool TextDocumentPrivate::editInPieces(const Chunk *chunk) const
+{
+    enum { MaxPieces = 64 }; // past this stitching the chunk together costs more than keeping it in memory
+    return options & TextDocument::PieceTable && chunk->from != -1 && !chunk->swapped && chunk->compressed.isEmpty()
+        && device && chunk->pieces.size() < MaxPieces;
+}
+
+// Returns the index of the piece that starts at offset, splitting one if needed
+int TextDocumentPrivate::splitPiece(Chunk *chunk, int offset)
+{
+    if (chunk->pieces.isEmpty()) {
+        const Piece piece = { chunk->from, chunk->bytes, chunk->length, 0, chunk->length };
+        chunk->pieces.append(piece);
+    }
+    int i = 0;
+    while (i < chunk->pieces.size() && offset >= chunk->pieces.at(i).length) {
+        offset -= chunk->pieces.at(i).length;
+        ++i;
+    }
+    if (offset > 0) {
+        Piece tail = chunk->pieces.at(i);
+        tail.offset += offset;
+        tail.length -= offset;
+        chunk->pieces[i].length = offset;
+        chunk->pieces.insert(++i, tail);
+    }
+    return i;
+}
+
+void TextDocumentPrivate::insertPiece(Chunk *chunk, int offset, const QString &string)
+{
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+    uncacheChunk(chunk);
+#endif
+    const int i = splitPiece(chunk, offset);
+    if (i > 0 && chunk->pieces.at(i - 1).from == -1
+        && chunk->pieces.at(i - 1).offset + chunk->pieces.at(i - 1).length == addBuffer.size()) {
+        // typing
+        chunk->pieces[i - 1].length += string.size();
+    } else {
+        const Piece piece = { -1, -1, 0, addBuffer.size(), string.size() };
+        chunk->pieces.insert(i, piece);
+    }
+    addBuffer += string;
+    chunk->length += string.size();
+}
+
+void TextDocumentPrivate::removePieces(Chunk *chunk, int offset, int size)
+{
+    Q_ASSERT(size < chunk->length);
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+    uncacheChunk(chunk);
+#endif
+    const int first = splitPiece(chunk, offset);
+    const int last = splitPiece(chunk, offset + size);
+    chunk->pieces.remove(first, last - first);
+    chunk->length -= size;
+}
+
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+ChunkCacheEntry *TextDocumentPrivate::cachedChunk(const Chunk *c, qint64 start) const
+{
+    ChunkCacheEntry *entry = chunkCache.value(qMakePair(c, start));
+    if (entry && entry != chunkCacheFirst) {
+        entry->previous->next = entry->next;
+        if (entry->next) {
+            entry->next->previous = entry->previous;
+        } else {
+            chunkCacheLast = entry->previous;
+        }
+        entry->previous = 0;
+        entry->next = chunkCacheFirst;
+        chunkCacheFirst->previous = entry;
+        chunkCacheFirst = entry;
+    }
+    return entry;
+}
+
+void TextDocumentPrivate::cacheChunk(const Chunk *c, qint64 start, qint64 pos, const QString &data) const
+{
+    Q_ASSERT(!chunkCache.contains(qMakePair(c, start)));
+    if (chunkCacheSize == 0)
+        return;
+    ChunkCacheEntry *entry = new ChunkCacheEntry;
+    entry->chunk = c;
+    entry->start = start;
+    entry->pos = pos;
+    entry->data = data;
+    entry->previous = 0;
+    entry->next = chunkCacheFirst;
+    if (chunkCacheFirst) {
+        chunkCacheFirst->previous = entry;
+    } else {
+        chunkCacheLast = entry;
+    }
+    chunkCacheFirst = entry;
+    chunkCache.insert(qMakePair(c, start), entry);
+    chunkCacheUsed += data.size() * sizeof(QChar);
+    trimChunkCache();
+}
+
+// Drops what's cached of c, which is all the pieces read for an extent
+void TextDocumentPrivate::uncacheChunk(const Chunk *c) const
+{
+    if (!c->extent) {
+        if (ChunkCacheEntry *entry = chunkCache.value(qMakePair(c, qint64(0))))
+            uncacheEntry(entry);
+        return;
+    }
+    ChunkCacheEntry *entry = chunkCacheFirst;
+    while (entry) {
+        ChunkCacheEntry *next = entry->next;
+        if (entry->chunk == c)
+            uncacheEntry(entry);
+        entry = next;
+    }
+}
+
+void TextDocumentPrivate::uncacheEntry(ChunkCacheEntry *entry) const
+{
+    chunkCache.remove(qMakePair(entry->chunk, entry->start));
+    if (entry->previous) {
+        entry->previous->next = entry->next;
+    } else {
+        chunkCacheFirst = entry->next;
+    }
+    if (entry->next) {
+        entry->next->previous = entry->previous;
+    } else {
+        chunkCacheLast = entry->previous;
+    }
+    chunkCacheUsed -= entry->data.size() * sizeof(QChar);
+    delete entry;
+}
+
+void TextDocumentPrivate::clearChunkCache() const
+{
+    qDeleteAll(chunkCache);
+    chunkCache.clear();
+    chunkCacheFirst = chunkCacheLast = 0;
+    chunkCacheUsed = 0;
+}
+
+// Called after characters were added (delta > 0) or removed at from
+void TextDocumentPrivate::shiftChunkCache(qint64 from, qint64 delta) const
+{
+    for (ChunkCacheEntry *entry = chunkCacheFirst; entry; entry = entry->next) {
+        if (entry->pos >= from)
+            entry->pos += delta;
+    }
+}
+
+void TextDocumentPrivate::trimChunkCache() const
+{
+    // the most recently used chunk stays even if it's over the memory limit
+    while (chunkCacheLast && (chunkCache.size() > chunkCacheSize
+                              || (chunkCacheUsed > chunkCacheMemoryLimit && chunkCacheLast != chunkCacheFirst))) {
+        uncacheEntry(chunkCacheLast);
+    }
+}
+#endif
+
+static inline void updateChunkTree(Chunk *c)
+{
+    c->treeSize = c->span();
+    c->treeLines = qMax(0, c->newLines);
+    c->treeUncounted = (c->newLines == -1 ? 1 : 0);
+    if (c->left) {
+        c->treeSize += c->left->treeSize;
+        c->treeLines += c->left->treeLines;
+        c->treeUncounted += c->left->treeUncounted;
+    }
+    if (c->right) {
+        c->treeSize += c->right->treeSize;
+        c->treeLines += c->right->treeLines;
+        c->treeUncounted += c->right->treeUncounted;
+    }
+}
+
 int TextDocumentPrivate::chunkIndex(const Chunk *c) const
 {
     int index = 0;
@@ -1505,31 +3367,475 @@ int TextDocumentPrivate::chunkIndex(const Chunk *c) const
         ++index;
         c = c->previous;
     }
-    return index;
+    return index;
+}
+
+void TextDocumentPrivate::insertChunk(Chunk *after, Chunk *c)
+{
+    Q_ASSERT(c);
+    c->previous = after;
+    c->next = after ? after->next : first;
+    if (c->previous) {
+        c->previous->next = c;
+    } else {
+        first = c;
+    }
+    if (c->next) {
+        c->next->previous = c;
+    } else {
+        last = c;
+    }
+
+    // The in-order slot right after 'after' is either its empty right
+    // child or the empty left child of its successor
+    c->left = c->right = 0;
+    ::updateChunkTree(c);
+    chunkTreeSeed ^= chunkTreeSeed << 13;
+    chunkTreeSeed ^= chunkTreeSeed >> 17;
+    chunkTreeSeed ^= chunkTreeSeed << 5;
+    c->priority = chunkTreeSeed;
+    if (after && !after->right) {
+        c->parent = after;
+        after->right = c;
+    } else if (c->next) {
+        Q_ASSERT(!c->next->left);
+        c->parent = c->next;
+        c->next->left = c;
+    } else {
+        Q_ASSERT(!chunkTreeRoot);
+        c->parent = 0;
+        chunkTreeRoot = c;
+    }
+    chunkSizeChanged(c->parent);
+    while (c->parent && c->parent->priority < c->priority)
+        rotateChunkUp(c);
+}
+
+// Also sums up the newlines for lineNumber() and friends
+void TextDocumentPrivate::chunkSizeChanged(Chunk *c) const
+{
+    while (c) {
+        ::updateChunkTree(c);
+        c = c->parent;
+    }
+}
+
+void TextDocumentPrivate::rotateChunkUp(Chunk *c)
+{
+    Chunk *p = c->parent;
+    Q_ASSERT(p);
+    Chunk *grandParent = p->parent;
+    if (c == p->left) {
+        p->left = c->right;
+        if (p->left)
+            p->left->parent = p;
+        c->right = p;
+    } else {
+        p->right = c->left;
+        if (p->right)
+            p->right->parent = p;
+        c->left = p;
+    }
+    p->parent = c;
+    c->parent = grandParent;
+    if (!grandParent) {
+        chunkTreeRoot = c;
+    } else if (grandParent->left == p) {
+        grandParent->left = c;
+    } else {
+        grandParent->right = c;
+    }
+    ::updateChunkTree(p);
+    ::updateChunkTree(c);
+}
+
+void TextDocumentPrivate::instantiateChunk(Chunk *chunk)
+{
+    if (chunk->from == -1 && !chunk->swapped)
+        return;
+    chunk->data = chunkData(chunk, -1);
+    narrowChunk(chunk);
+//    qDebug() << "instantiateChunk" << chunk << chunk->swapped;
+    if (chunk->swapped)
+        freeSwap(chunk);
+    if (!chunk->compressed.isEmpty())
+        dropCompressedData(chunk);
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+    // Don't want to cache this chunk since it's going away. If it
+    // already was cached then sure, but otherwise don't
+    uncacheChunk(chunk);
+#endif
+    chunk->from = chunk->length = chunk->bytes = -1;
+    chunk->pieces.clear();
+    chunkSizeChanged(chunk);
+    useChunk(chunk);
+}
+
+// Latin1Chunks keeps the data of chunks in memory as Latin-1 when it
+// fits. Inserting anything else widens the chunk back to UTF-16
+void TextDocumentPrivate::narrowChunk(Chunk *chunk)
+{
+    if (!(options & TextDocument::Latin1Chunks) || chunk->data.isEmpty() || !::isLatin1(chunk->data))
+        return;
+    chunk->latin1 = chunk->data.toLatin1();
+    chunk->data.clear();
+}
+
+void TextDocumentPrivate::widenChunk(Chunk *chunk)
+{
+    if (chunk->latin1.isEmpty())
+        return;
+    chunk->data = QString::fromLatin1(chunk->latin1);
+    chunk->latin1.clear();
+}
+
+// Returns the first character boundary of data at or after i or -1 if the
+// codec isn't one we know how to split. Pieces of the device are split on
+// the boundary after their nominal end and the next one starts there too
+static int characterStart(int mib, const uchar *data, int size, int i)
+{
+    switch (mib) {
+    case 106: { // UTF-8
+        const int end = qMin(size, i + 3);
+        while (i < end && (data[i] & 0xc0) == 0x80)
+            ++i;
+        return i; }
+    case 1013: // UTF-16BE
+    case 1014: // UTF-16LE
+        if (i + 2 <= size) {
+            const ushort unit = (mib == 1013
+                                 ? (data[i] << 8) | data[i + 1]
+                                 : (data[i + 1] << 8) | data[i]);
+            if (QChar::isLowSurrogate(unit))
+                i += 2;
+        }
+        return i;
+    case 1018: // UTF-32BE
+    case 1019: // UTF-32LE
+        return i;
+    default:
+        break;
+    }
+    return -1;
+}
+
+// Deletes all the chunks along with what they keep in memory and in the
+// swap file
+void TextDocumentPrivate::clearChunks()
+{
+    Chunk *c = first;
+    while (c) {
+        Chunk *tmp = c;
+        c = c->next;
+        delete tmp;
+    }
+    clearSwap();
+    usedFirst = usedLast = 0;
+    usedMemory = 0;
+    compressedBytes = compressedSize = 0;
+    first = last = chunkTreeRoot = 0;
+}
+
+// One extent for the whole device, documentSize characters from its
+// start. Edits split chunks out of it as they're needed
+void TextDocumentPrivate::loadExtent(TextDocument::Options options)
+{
+    Chunk *chunk = new Chunk;
+    chunk->from = 0;
+    if (documentSize > chunkSize) {
+        chunk->extent = documentSize;
+    } else {
+        chunk->length = int(documentSize);
+    }
+    insertChunk(0, chunk);
+    if (options & TextDocument::CountLinesInBackground && chunk->extent) {
+        scannedLines = QVector<int>(int((documentSize + chunkSize - 1) / chunkSize), -1);
+        lineScanSize = documentSize;
+        lineScanPieceSize = chunkSize;
+        lineScanNext = lineScanCounted = lineScanPercent = 0;
+        startLineScan();
+    }
+}
+
+/*
+  For variable width encodings bytes and characters don't line up so
+  Sparse needs to know where each piece of the device starts and how
+  many characters it has. The line scan threads find out, see
+  scanCheckpoint(), while the document grows one extent from the
+  start of the device as the pieces are counted. Reads only wait for
+  the part they need, see waitForCheckpoints(), but documentSize() and
+  the functions that need all of the document wait for the whole scan.
+  Returns false if the
+  codec is assumed to be single-byte in which case byte offsets can be
+  used directly.
+*/
+bool TextDocumentPrivate::loadCheckpoints(QIODevice *device)
+{
+    device->seek(0);
+    QTextCodec *codec = textCodec ? textCodec : QTextCodec::codecForLocale();
+    int bom = 0;
+    // QTextStream would switch to UTF-16/UTF-32 when it sees a BOM
+    const QByteArray head = device->peek(4);
+    if (head.startsWith("\xef\xbb\xbf")) {
+        codec = QTextCodec::codecForMib(106);
+        bom = 3;
+    } else if (head.startsWith(QByteArray("\x00\x00\xfe\xff", 4))) {
+        codec = QTextCodec::codecForMib(1018);
+        bom = 4;
+    } else if (head.startsWith(QByteArray("\xff\xfe\x00\x00", 4))) {
+        codec = QTextCodec::codecForMib(1019);
+        bom = 4;
+    } else if (head.startsWith("\xfe\xff")) {
+        codec = QTextCodec::codecForMib(1013);
+        bom = 2;
+    } else if (head.startsWith("\xff\xfe")) {
+        codec = QTextCodec::codecForMib(1014);
+        bom = 2;
+    } else if (codec && (codec->mibEnum() == 1015 || codec->mibEnum() == 1017)) {
+        // without a BOM UTF-16 and UTF-32 are read in the host's byte order
+        const bool bigEndian = QSysInfo::ByteOrder == QSysInfo::BigEndian;
+        codec = QTextCodec::codecForMib(codec->mibEnum() == 1015
+                                        ? (bigEndian ? 1013 : 1014)
+                                        : (bigEndian ? 1018 : 1019));
+    }
+    if (!codec || characterStart(codec->mibEnum(), 0, 0, 0) == -1)
+        return false;
+
+    deviceCodec = codec;
+    documentSize = 0;
+    Chunk *chunk = new Chunk;
+    chunk->from = bom;
+    insertChunk(0, chunk);
+
+    const qint64 size = device->size() - bom;
+    const int pieceSize = qMax(4, chunkSize) & ~3;
+    const Checkpoint uncounted = { 0, -1, 0, -1 };
+    checkpoints = QVector<Checkpoint>(int((size + pieceSize - 1) / pieceSize), uncounted);
+    scannedLines = QVector<int>(checkpoints.size(), -1);
+    checkpointsCounted = 0;
+    checkpointsSize = 0;
+    checkpointStart = bom;
+    checkpointsPending = !checkpoints.isEmpty();
+    checkpointsApplied = 0;
+    unreportedSize = 0;
+    lineScanSize = device->size();
+    lineScanPieceSize = pieceSize;
+    lineScanNext = lineScanCounted = lineScanPercent = 0;
+    startLineScan();
+    return true;
+}
+
+// Called from the line scan threads. Finds where the index'th piece of
+// the device starts and ends on character boundaries, decodes it and
+// returns its newlines
+int TextDocumentPrivate::scanCheckpoint(int index, Checkpoint *checkpoint) const
+{
+    const qint64 start = checkpointStart + qint64(index) * lineScanPieceSize;
+    const qint64 end = qMin(start + lineScanPieceSize, lineScanSize);
+    // the bytes past the end show where the next piece starts
+    int size = int(qMin(end + 4, lineScanSize) - start);
+    QByteArray bytes;
+    const uchar *data;
+    if (mappedData) {
+        data = mappedData + start;
+    } else {
+        QMutexLocker locker(&deviceMutex);
+        device->seek(start);
+        bytes = device->read(size);
+        data = reinterpret_cast<const uchar*>(bytes.constData());
+        size = bytes.size();
+    }
+    const int mib = deviceCodec->mibEnum();
+    const int last = (end == lineScanSize ? size : qMin(size, ::characterStart(mib, data, size, int(end - start))));
+    const int first = (index == 0 ? 0 : qMin(last, ::characterStart(mib, data, size, 0)));
+    const QString text = deviceCodec->toUnicode(reinterpret_cast<const char*>(data) + first, last - first);
+    checkpoint->from = start + first;
+    checkpoint->position = -1;
+    checkpoint->bytes = last - first;
+    checkpoint->length = text.size();
+    return ::count(text, 0, text.size(), QLatin1Char('\n'));
+}
+
+// Called with lineScanMutex locked. The pieces up to the first one that
+// hasn't been counted get their positions
+void TextDocumentPrivate::addCheckpoint(int index, const Checkpoint &checkpoint) const
+{
+    checkpoints[index] = checkpoint;
+    while (checkpointsCounted < checkpoints.size() && checkpoints.at(checkpointsCounted).length != -1) {
+        Checkpoint &counted = checkpoints[checkpointsCounted++];
+        counted.position = checkpointsSize;
+        checkpointsSize += counted.length;
+    }
+    checkpointCondition.wakeAll();
+}
+
+// Called with lineScanMutex locked. Returns the index of the counted
+// piece that starts at from on the device or -1
+int TextDocumentPrivate::checkpointIndex(qint64 from) const
+{
+    int lo = 0;
+    int hi = checkpointsCounted;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (checkpoints.at(mid).from < from) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < checkpointsCounted && checkpoints.at(lo).from == from ? lo : -1;
+}
+
+// Waits until the checkpoint scan has counted size characters, or all of
+// the device if size is -1, and grows the document by what it counted.
+// Growing it takes the write lock so the readers call this before they
+// lock the document for reading, see applyCheckpoints()
+void TextDocumentPrivate::waitForCheckpoints(qint64 size) const
+{
+    {
+        QMutexLocker locker(&lineScanMutex);
+        if (!checkpointsPending || (size != -1 && size <= checkpointsApplied))
+            return;
+    }
+    QWriteLocker locker(readWriteLock);
+    const_cast<TextDocumentPrivate*>(this)->applyCheckpoints(size);
+}
+
+// Called with the document locked for writing so no reader is walking the
+// tree. Until the scan is done the document is the one extent
+// loadCheckpoints() made so that's all that changes
+void TextDocumentPrivate::applyCheckpoints(qint64 size)
+{
+    QMutexLocker locker(&lineScanMutex);
+    if (!checkpointsPending)
+        return;
+    while ((size == -1 || checkpointsSize < size) && checkpointsCounted < checkpoints.size())
+        checkpointCondition.wait(&lineScanMutex);
+    const qint64 counted = checkpointsSize;
+    checkpointsApplied = counted;
+    if (checkpointsCounted == checkpoints.size())
+        checkpointsPending = false;
+    locker.unlock();
+    if (counted > documentSize) {
+        Q_ASSERT(first == last && first->from == checkpointStart);
+        first->extent = counted;
+        first->newLines = -1;
+        first->extentLines.clear();
+        chunkSizeChanged(first);
+        unreportedSize += counted - documentSize;
+        documentSize = counted;
+    }
+}
+
+// The write paths need all of the document. Tells the listeners about
+// what it grew by since they last heard
+void TextDocumentPrivate::finishCheckpoints()
+{
+    applyCheckpoints(-1);
+    if (!unreportedSize)
+        return;
+    const qint64 added = unreportedSize;
+    unreportedSize = 0;
+    emit q->charactersAdded(documentSize - added, added);
+    emit q->documentSizeChanged(documentSize);
+    emit q->textChanged();
+}
+
+void TextDocumentPrivate::onLineCountProgress(qreal percent)
+{
+    emit q->lineCountProgress(percent);
+}
+
+void TextDocumentPrivate::onCheckpointScanFinished()
+{
+    QWriteLocker locker(readWriteLock);
+    {
+        QMutexLocker scanLocker(&lineScanMutex);
+        if (checkpointsCounted < checkpoints.size())
+            return; // load() started another scan since
+    }
+    finishCheckpoints();
+}
+
+void TextDocumentPrivate::mapDevice()
+{
+    Q_ASSERT(!mappedData);
+    QFile *file = qobject_cast<QFile*>(device.data());
+    if (!file || file->size() == 0)
+        return;
+    mappedData = file->map(0, file->size());
+    if (!mappedData) {
+        qWarning("TextDocumentPrivate::mapDevice() Can't map '%s'", qPrintable(file->fileName()));
+        return;
+    }
+    mappedSize = file->size();
 }
 
-void TextDocumentPrivate::instantiateChunk(Chunk *chunk)
+void TextDocumentPrivate::unmapDevice()
 {
-    if (chunk->from == -1 && chunk->swap.isEmpty())
+    if (!mappedData)
         return;
-    chunk->data = chunkData(chunk, -1);
-//    qDebug() << "instantiateChunk" << chunk << chunk->swap;
-    chunk->swap.clear();
-#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
-    // Don't want to cache this chunk since it's going away. If it
-    // already was cached then sure, but otherwise don't
-    if (chunk == cachedChunk) {
-        cachedChunk = 0;
-        cachedChunkPos = -1;
-        cachedChunkData.clear();
+    if (QFile *file = qobject_cast<QFile*>(device.data()))
+        file->unmap(const_cast<uchar*>(mappedData));
+    mappedData = 0;
+    mappedSize = 0;
+}
+
+// Same semantics as QTextStream::seek(from) followed by read(length)
+QString TextDocumentPrivate::readMapped(qint64 from, int length) const
+{
+    Q_ASSERT(mappedData);
+    const char *data = reinterpret_cast<const char*>(mappedData) + from;
+    const qint64 available = mappedSize - from;
+    QTextCodec *codec = textCodec ? textCodec : QTextCodec::codecForLocale();
+    if (codec->mibEnum() == 4) // ISO-8859-1
+        return QString::fromLatin1(data, qMin<qint64>(length, available));
+
+    // every character takes at least one byte so this never reads
+    // more than one chunk's worth past what's needed
+    QTextCodec::ConverterState state;
+    QString ret;
+    qint64 read = 0;
+    while (ret.size() < length && read < available) {
+        const int size = qMin<qint64>(length - ret.size(), available - read);
+        ret += codec->toUnicode(data + read, size, &state);
+        read += size;
     }
+    ret.truncate(length);
+    return ret;
+}
+
+void TextDocumentPrivate::adviseSequential(bool on) const
+{
+#ifdef Q_OS_UNIX
+    if (mappedData)
+        posix_madvise(const_cast<uchar*>(mappedData), mappedSize, on ? POSIX_MADV_SEQUENTIAL : POSIX_MADV_NORMAL);
+#else
+    Q_UNUSED(on);
 #endif
-    chunk->from = chunk->length = -1;
 }
 
 void TextDocumentPrivate::removeChunk(Chunk *c)
 {
     Q_ASSERT(c);
+    while (c->left || c->right) {
+        if (!c->right || (c->left && c->left->priority > c->right->priority)) {
+            rotateChunkUp(c->left);
+        } else {
+            rotateChunkUp(c->right);
+        }
+    }
+    if (!c->parent) {
+        chunkTreeRoot = 0;
+    } else {
+        if (c->parent->left == c) {
+            c->parent->left = 0;
+        } else {
+            c->parent->right = 0;
+        }
+        chunkSizeChanged(c->parent);
+    }
+
     if (c == first) {
         first = c->next;
     } else {
@@ -1541,15 +3847,16 @@ void TextDocumentPrivate::removeChunk(Chunk *c)
         c->next->previous = c->previous;
     }
 #ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
-    if (c == cachedChunk) {
-        cachedChunk = 0;
-        cachedChunkPos = -1;
-        cachedChunkData.clear();
-    }
+    uncacheChunk(c);
 #endif
+    if (c->swapped)
+        freeSwap(c);
+    if (!c->compressed.isEmpty())
+        dropCompressedData(c);
+    unuseChunk(c);
     if (!first) {
         Q_ASSERT(!last);
-        first = last = new Chunk;
+        insertChunk(0, new Chunk);
     }
 
     delete c;
@@ -1566,7 +3873,9 @@ void TextDocumentPrivate::undoRedo(bool undo)
     const bool was = ignoreUndoRedo;
     ignoreUndoRedo = true;
     Q_ASSERT(cmd->type != DocumentCommand::None);
-    if ((cmd->type == DocumentCommand::Inserted) == undo) {
+    if (cmd->type == DocumentCommand::Edited) {
+        q->applyEdits(undo ? cmd->undoEdits : cmd->edits);
+    } else if ((cmd->type == DocumentCommand::Inserted) == undo) {
         q->remove(cmd->position, cmd->text.size());
     } else {
         q->insert(cmd->position, cmd->text);
@@ -1586,7 +3895,7 @@ void TextDocumentPrivate::undoRedo(bool undo)
         q->setModified(false);
 }
 
-QString TextDocumentPrivate::wordAt(int position, int *start) const
+QString TextDocumentPrivate::wordAt(qint64 position, qint64 *start) const
 {
     TextDocumentIterator from(this, position);
     if (!q->isWordCharacter(from.current(), position)) {
@@ -1612,10 +3921,10 @@ QString TextDocumentPrivate::wordAt(int position, int *start) const
 
     if (start)
         *start = from.position();
-    return q->read(from.position(), to.position() - from.position());
+    return q->read(from.position(), int(to.position() - from.position()));
 }
 
-QString TextDocumentPrivate::paragraphAt(int position, int *start) const
+QString TextDocumentPrivate::paragraphAt(qint64 position, qint64 *start) const
 {
     const QLatin1Char newline('\n');
     TextDocumentIterator from(this, position);
@@ -1626,10 +3935,10 @@ QString TextDocumentPrivate::paragraphAt(int position, int *start) const
         ;
     if (start)
         *start = from.position();
-    return q->read(from.position(), to.position() - from.position());
+    return q->read(from.position(), int(to.position() - from.position()));
 }
 
-uint TextDocumentPrivate::wordBoundariesAt(int pos) const
+uint TextDocumentPrivate::wordBoundariesAt(qint64 pos) const
 {
     Q_ASSERT(pos >= 0 && pos < documentSize);
     uint ret = 0;
@@ -1651,85 +3960,124 @@ void TextDocumentPrivate::joinLastTwoCommands()
     undoRedoStack.at(undoRedoStack.size() - 2)->joinStatus = DocumentCommand::Forward;
 }
 
-void TextDocumentPrivate::updateChunkLineNumbers(Chunk *c, int chunkPos) const
+// Counts the newlines of c unless they have been already. Extents are read
+// a piece at a time, see extentPiece(), and keep the count of each piece
+// so splitExtent() doesn't have to count them again
+int TextDocumentPrivate::chunkNewLines(Chunk *c) const
 {
-    Q_ASSERT(c);
-    if (c->firstLineIndex == -1) {
-        Chunk *cc = c;
-        int pos = chunkPos;
-        while (cc->previous && cc->previous->firstLineIndex == -1) {
-            pos -= cc->size();
-            cc = cc->previous;
-        }
-        // cc is at the first chunk that has firstLineIndex != -1
-        Q_ASSERT(!cc->previous || cc->previous->firstLineIndex != -1);
-        Q_ASSERT(cc->firstLineIndex == 1 || cc->firstLineIndex == -1);
-        // special case for first chunk
-        do {
-            const int size = cc->size();
-            if (!cc->previous) {
-                cc->firstLineIndex = 0;
-            } else {
-                const int prevSize = cc->previous->size();
-                const int lineCount = countNewLines(cc->previous, pos - prevSize, prevSize);
-                Q_ASSERT(cc->previous->firstLineIndex != -1);
-                cc->firstLineIndex = cc->previous->firstLineIndex + lineCount;
+    if (c->newLines == -1) {
+        if (c->extent) {
+            c->newLines = 0;
+            c->extentLines.clear();
+            for (qint64 start = 0; start < c->extent; ) {
+                const ExtentPiece piece = extentPiece(c, start);
+                int lines = scannedNewLines(piece.from, piece.bytes, piece.length);
+                if (lines == -1) {
+                    const QString data = deviceData(piece.from, piece.bytes, piece.length);
+                    lines = ::count(data, 0, data.size(), QLatin1Char('\n'));
+                }
+                c->extentLines.append(lines);
+                c->newLines += lines;
+                start += piece.length;
             }
-            pos += size;
-            cc = cc->next;
-        } while (cc && cc != c->next);
-        countNewLines(c, chunkPos, c->size());
+        } else {
+            if (c->from != -1 && c->pieces.isEmpty())
+                c->newLines = scannedNewLines(c->from, c->bytes, c->length);
+            if (c->newLines == -1)
+                countNewLines(c, -1, c->size());
+        }
+    }
+    Q_ASSERT(c->newLines != -1);
+    return c->newLines;
+}
+
+// Counts the chunks of the subtree that haven't been counted yet. Their
+// parents' treeLines are left for chunkSizeChanged()
+void TextDocumentPrivate::countTreeLines(Chunk *c) const
+{
+    if (!c || !c->treeUncounted)
+        return;
+    countTreeLines(c->left);
+    countTreeLines(c->right);
+    chunkNewLines(c);
+    ::updateChunkTree(c);
+}
+
+// How many newlines there are before c. The chunks before it are summed up
+// in the tree so only the ones that haven't been counted yet are read
+qint64 TextDocumentPrivate::linesBefore(Chunk *c) const
+{
+    countTreeLines(c->left);
+    qint64 lines = c->left ? c->left->treeLines : 0;
+    for (const Chunk *child = c; child->parent; child = child->parent) {
+        Chunk *p = child->parent;
+        if (child == p->right) {
+            countTreeLines(p->left);
+            lines += chunkNewLines(p) + (p->left ? p->left->treeLines : 0);
+        }
     }
-    Q_ASSERT(c->firstLineIndex != -1);
+    chunkSizeChanged(c);
+    return lines;
 }
 
 static inline QList<int> dumpNewLines(const QString &string, int from, int size)
 {
     QList<int> ret;
-    for (int i=from; i<from + size; ++i) {
-        if (string.at(i) == QLatin1Char('\n'))
-            ret.append(i);
+    const ushort *data = string.utf16();
+    int i = from;
+    int index;
+    while ((index = TextScan::indexOf(data + i, from + size - i, '\n')) != -1) {
+        i += index;
+        ret.append(i++);
     }
     return ret;
 }
 
 
-int TextDocumentPrivate::countNewLines(Chunk *c, int chunkPos, int size) const
+int TextDocumentPrivate::countNewLines(Chunk *c, qint64 chunkPos, int size) const
 {
 //     qDebug() << "CALLING countNewLines on" << chunkIndex(c) << chunkPos << size;
-//     qDebug() << (c == first) << c->firstLineIndex << chunkPos << size
+//     qDebug() << (c == first) << linesBefore(c) << chunkPos << size
 //              << c->size();
     int ret = 0;
+    // Latin1Chunks chunks are counted without widening them
+    const QByteArray latin1 = c->latin1;
+    if (!latin1.isEmpty())
+        useChunk(c);
 #ifndef TEXTDOCUMENT_LINENUMBER_CACHE
     if (size == c->size()) {
-        if (c->lines == -1) {
-            c->lines = ::count(chunkData(c, chunkPos), 0, size, QLatin1Char('\n'));
-//             qDebug() << "counting" << c->lines << "in" << chunkIndex(c)
+        if (c->newLines == -1) {
+            c->newLines = latin1.isEmpty() ? ::count(chunkData(c, chunkPos), 0, size, QLatin1Char('\n')) : ::count(latin1, 0, size, '\n');
+//             qDebug() << "counting" << c->newLines << "in" << chunkIndex(c)
 //                      << "Size" << size << "chunkPos" << chunkPos;
         }
-        ret = c->lines;
+        ret = c->newLines;
     } else {
-        ret = ::count(chunkData(c, chunkPos), 0, size, QLatin1Char('\n'));
+        ret = latin1.isEmpty() ? ::count(chunkData(c, chunkPos), 0, size, QLatin1Char('\n')) : ::count(latin1, 0, size, '\n');
     }
 #else
 //     qDebug() << size << ret << c->lineNumbers << chunkPos
 //              << dumpNewLines(chunkData(c, chunkPos), 0, c->size());
     static const int lineNumberCacheInterval = TEXTDOCUMENT_LINENUMBER_CACHE_INTERVAL;
     if (c->lineNumbers.isEmpty()) {
-        const QString data = chunkData(c, chunkPos);
-        const int s = data.size();
+        const QString data = latin1.isEmpty() ? chunkData(c, chunkPos) : QString();
+        const int s = c->size();
         c->lineNumbers.fill(0, (s + lineNumberCacheInterval - 1) / lineNumberCacheInterval);
 //        qDebug() << data.size() << c->lineNumbers.size() << lineNumberCacheInterval;
 
-        for (int i=0; i<s; ++i) {
-            if (data.at(i) == QLatin1Char('\n')) {
-                ++c->lineNumbers[i / lineNumberCacheInterval];
-//                 qDebug() << "found one at" << i << "put it in" << (i / lineNumberCacheInterval)
-//                          << "chunkPos" << chunkPos;
-                if (i < size)
-                    ++ret;
+        int total = 0;
+        for (int i=0; i<c->lineNumbers.size(); ++i) {
+            const int from = i * lineNumberCacheInterval;
+            const int count = qMin(lineNumberCacheInterval, s - from);
+            c->lineNumbers[i] = latin1.isEmpty() ? ::count(data, from, count, QLatin1Char('\n')) : ::count(latin1, from, count, '\n');
+            total += c->lineNumbers.at(i);
+            if (from + count <= size) {
+                ret += c->lineNumbers.at(i);
+            } else if (from < size) {
+                ret += latin1.isEmpty() ? ::count(data, from, size - from, QLatin1Char('\n')) : ::count(latin1, from, size - from, '\n');
             }
         }
+        c->newLines = total;
     } else {
         for (int i=0; i<c->lineNumbers.size(); ++i) {
             if (i * lineNumberCacheInterval > size) {
@@ -1738,8 +4086,11 @@ int TextDocumentPrivate::countNewLines(Chunk *c, int chunkPos, int size) const
                 // nothing in this area
                 continue;
             } else if ((i + 1) * lineNumberCacheInterval > size) {
-                ret += ::count(chunkData(c, chunkPos), i * lineNumberCacheInterval,
-                               size - i * lineNumberCacheInterval, QChar('\n'));
+                ret += latin1.isEmpty()
+                       ? ::count(chunkData(c, chunkPos), i * lineNumberCacheInterval,
+                                 size - i * lineNumberCacheInterval, QChar('\n'))
+                       : ::count(latin1, i * lineNumberCacheInterval,
+                                 size - i * lineNumberCacheInterval, '\n');
                 // partly
                 break;
             } else {
@@ -1753,47 +4104,263 @@ int TextDocumentPrivate::countNewLines(Chunk *c, int chunkPos, int size) const
 
 void TextDocumentPrivate::swapOutChunk(Chunk *c)
 {
-    if (!c->swap.isEmpty())
+    if (c->swapped || c->from != -1) // already backed by the device or swap
         return;
-    Q_ASSERT(!c->data.isEmpty());
-    c->from = 0;
-    c->length = c->data.size();
-    c->swap = q->swapFileName(c);
-    QFile file(c->swap);
-    if (!file.open(QIODevice::WriteOnly)) {
-        qWarning("TextDocumentPrivate::chunkData() Can't open file for writing '%s'", qPrintable(c->swap));
-        c->swap.clear();
+    Q_ASSERT(!c->data.isEmpty() || !c->latin1.isEmpty());
+    widenChunk(c);
+    if (!swapFile) {
+        swapFile = new QFile(q->swapFileName(0));
+        if (!swapFile->open(QIODevice::ReadWrite|QIODevice::Truncate)) {
+            qWarning("TextDocumentPrivate::swapOutChunk() Can't open file for writing '%s'", qPrintable(swapFile->fileName()));
+            delete swapFile;
+            swapFile = 0;
+            return;
+        }
+    }
+    QByteArray data;
+    if (options & TextDocument::RawSwap) {
+        data = QByteArray::fromRawData(reinterpret_cast<const char*>(c->data.constData()), c->data.size() * sizeof(QChar));
+    } else {
+        data = (textCodec ? textCodec : QTextCodec::codecForLocale())->fromUnicode(c->data);
+    }
+    const qint64 offset = allocateSwap(data.size());
+    if (!swapFile->seek(offset) || swapFile->write(data) != data.size()) {
+        qWarning("TextDocumentPrivate::swapOutChunk() Can't write to '%s'", qPrintable(swapFile->fileName()));
+        c->from = offset;
+        c->bytes = data.size();
+        freeSwap(c);
+        c->from = -1;
+        c->bytes = -1;
         return;
     }
-    QTextStream ts(&file);
-    if (textCodec)
-        ts.setCodec(textCodec);
-    ts << c->data;
+    c->from = offset;
+    c->length = c->data.size();
+    c->bytes = data.size();
+    c->swapped = true;
     c->data.clear();
+    unuseChunk(c);
 #ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
     // ### do I want to do this?
-    if (cachedChunk == c) {
-        cachedChunk = 0;
-        cachedChunkPos = -1;
-        cachedChunkData.clear();
-    }
+    uncacheChunk(c);
 #endif
 }
 
-static inline bool match(int pos, int left, int size)
+QString TextDocumentPrivate::swappedData(const Chunk *c) const
 {
-    return pos >= left && pos < left + size;
+    Q_ASSERT(c->swapped && swapFile);
+    QByteArray data;
+    QMutexLocker locker(&deviceMutex);
+    if (swapFile->seek(c->from))
+        data = swapFile->read(c->bytes);
+    locker.unlock();
+    if (data.size() != c->bytes) {
+        qWarning("TextDocumentPrivate::swappedData() Can't read from '%s'", qPrintable(swapFile->fileName()));
+        return QString().fill(QLatin1Char(' '), c->length);
+    }
+    {
+        QMutexLocker cacheLocker(&cacheMutex); // the find threads decode chunks too
+        ++statistics.chunksSwappedIn;
+    }
+    if (options & TextDocument::RawSwap)
+        return QString(reinterpret_cast<const QChar*>(data.constData()), c->length);
+    return (textCodec ? textCodec : QTextCodec::codecForLocale())->toUnicode(data);
+}
+
+// first fit from the free list, otherwise the end of the file
+qint64 TextDocumentPrivate::allocateSwap(int bytes)
+{
+    for (QMap<qint64, qint64>::iterator it = swapFreeList.begin(); it != swapFreeList.end(); ++it) {
+        if (it.value() >= bytes) {
+            const qint64 offset = it.key();
+            const qint64 left = it.value() - bytes;
+            swapFreeList.erase(it);
+            if (left > 0)
+                swapFreeList.insert(offset + bytes, left);
+            return offset;
+        }
+    }
+    const qint64 offset = swapFileSize;
+    swapFileSize += bytes;
+    return offset;
+}
+
+void TextDocumentPrivate::freeSwap(Chunk *c)
+{
+    qint64 offset = c->from;
+    qint64 size = c->bytes;
+    c->swapped = false;
+    if (size <= 0)
+        return;
+    QMap<qint64, qint64>::iterator next = swapFreeList.lowerBound(offset);
+    if (next != swapFreeList.end() && next.key() == offset + size) {
+        size += next.value();
+        next = swapFreeList.erase(next);
+    }
+    if (next != swapFreeList.begin()) {
+        QMap<qint64, qint64>::iterator previous = next;
+        --previous;
+        if (previous.key() + previous.value() == offset) {
+            offset = previous.key();
+            size += previous.value();
+            swapFreeList.erase(previous);
+        }
+    }
+    if (offset + size == swapFileSize) {
+        swapFileSize = offset;
+    } else {
+        swapFreeList.insert(offset, size);
+    }
+}
+
+void TextDocumentPrivate::clearSwap()
+{
+    if (swapFile) {
+        if (options & TextDocument::KeepTemporaryFiles) {
+            swapFile->close();
+        } else {
+            swapFile->remove();
+        }
+        delete swapFile;
+        swapFile = 0;
+    }
+    swapFileSize = 0;
+    swapFreeList.clear();
+}
+
+// Moves c to the front of the used list and updates what it accounts for
+void TextDocumentPrivate::useChunk(const Chunk *c) const
+{
+    if (memoryLimit <= 0 && compressionThreshold <= 0)
+        return;
+    QMutexLocker locker(&cacheMutex);
+    Chunk *chunk = const_cast<Chunk*>(c);
+    if (c->usedBytes != -1) {
+        usedMemory -= c->usedBytes;
+        if (c != usedFirst) {
+            c->usedPrevious->usedNext = c->usedNext;
+            if (c == usedLast) {
+                usedLast = c->usedPrevious;
+            } else {
+                c->usedNext->usedPrevious = c->usedPrevious;
+            }
+            c->usedPrevious = 0;
+            c->usedNext = usedFirst;
+            usedFirst->usedPrevious = chunk;
+            usedFirst = chunk;
+        }
+    } else {
+        c->usedNext = usedFirst;
+        if (usedFirst) {
+            usedFirst->usedPrevious = chunk;
+        } else {
+            usedLast = chunk;
+        }
+        usedFirst = chunk;
+    }
+    c->usedBytes = c->data.size() * sizeof(QChar) + c->latin1.size();
+    c->lastUsed = ++useCount;
+    usedMemory += c->usedBytes;
+}
+
+void TextDocumentPrivate::unuseChunk(const Chunk *c) const
+{
+    if (c->usedBytes == -1)
+        return;
+    if (c->usedPrevious) {
+        c->usedPrevious->usedNext = c->usedNext;
+    } else {
+        usedFirst = c->usedNext;
+    }
+    if (c->usedNext) {
+        c->usedNext->usedPrevious = c->usedPrevious;
+    } else {
+        usedLast = c->usedPrevious;
+    }
+    c->usedPrevious = c->usedNext = 0;
+    usedMemory -= c->usedBytes;
+    c->usedBytes = -1;
+}
+
+// Compresses the chunks that have gone cold and then swaps out the
+// least recently used ones. The most recently used chunk stays even if
+// it's bigger than the limit on its own
+void TextDocumentPrivate::enforceMemoryLimit()
+{
+    while (compressionThreshold > 0 && usedLast != usedFirst
+           && useCount - usedLast->lastUsed > quint64(compressionThreshold)) {
+        compressChunk(usedLast);
+    }
+    while (memoryLimit > 0 && usedMemory > memoryLimit && usedLast != usedFirst) {
+        Chunk *c = usedLast;
+        if (c->data.isEmpty() && c->latin1.isEmpty()) {
+            unuseChunk(c);
+            continue;
+        }
+        swapOutChunk(c);
+        if (!c->swapped) { // no swap store
+            unuseChunk(c);
+            break;
+        }
+        ++statistics.chunksEvicted;
+    }
+}
+
+void TextDocumentPrivate::resetUsedChunks()
+{
+    while (usedFirst)
+        unuseChunk(usedFirst);
+    for (Chunk *c = first; c; c = c->next) {
+        if (c->from == -1)
+            useChunk(c);
+    }
+}
+
+void TextDocumentPrivate::compressChunk(Chunk *c)
+{
+    Q_ASSERT(c->from == -1);
+    unuseChunk(c);
+    widenChunk(c);
+    if (c->data.isEmpty())
+        return;
+    c->compressed = qCompress(reinterpret_cast<const uchar*>(c->data.constData()), c->data.size() * sizeof(QChar));
+    c->from = 0;
+    c->length = c->data.size();
+    c->bytes = c->compressed.size();
+    c->data.clear();
+    compressedBytes += c->compressed.size();
+    compressedSize += c->length * sizeof(QChar);
+    ++statistics.chunksCompressed;
+}
+
+void TextDocumentPrivate::dropCompressedData(Chunk *c)
+{
+    compressedBytes -= c->compressed.size();
+    compressedSize -= c->length * sizeof(QChar);
+    c->compressed.clear();
+}
+
+QString TextDocumentPrivate::compressedData(const Chunk *c) const
+{
+    const QByteArray data = qUncompress(c->compressed);
+    {
+        QMutexLocker locker(&cacheMutex); // the find threads decode chunks too
+        ++statistics.chunksUncompressed;
+    }
+    Q_ASSERT(data.size() == int(c->length * sizeof(QChar)));
+    return QString(reinterpret_cast<const QChar*>(data.constData()), c->length);
 }
 
-static inline bool match(int pos, int size, const TextSection *section, TextSection::TextSectionOptions flags)
+static inline bool match(qint64 pos, qint64 left, qint64 size)
 {
-    const int sectionPos = section->position();
-    const int sectionSize = section->size();
+    return pos >= left && pos < left + size;
+}
 
+static inline bool match(qint64 pos, qint64 size, qint64 sectionPos, qint64 sectionSize, TextSection::TextSectionOptions flags)
+{
     if (::match(sectionPos, pos, size) && ::match(sectionPos + sectionSize - 1, pos, size)) {
         return true;
     } else if (flags & TextSection::IncludePartial) {
-        const int boundaries[] = { pos, pos + size - 1 };
+        const qint64 boundaries[] = { pos, pos + size - 1 };
         for (int i=0; i<2; ++i) {
             if (::match(boundaries[i], sectionPos, sectionSize))
                 return true;
@@ -1812,55 +4379,466 @@ static inline void filter(QList<TextSection*> &sections, const TextEdit *filter)
     }
 }
 
-QList<TextSection*> TextDocumentPrivate::getSections(int pos, int size, TextSection::TextSectionOptions flags, const TextEdit *filter) const
+QList<TextSection*> TextDocumentPrivate::getSections(qint64 pos, qint64 size, TextSection::TextSectionOptions flags, const TextEdit *filter) const
 {
     if (size == -1)
         size = documentSize - pos;
     QList<TextSection*> ret;
     if (pos == 0 && size == documentSize) {
-        ret = sections;
-        ::filter(ret, filter);
-        return ret;
+        // all of them, even the ones that are past the end
+        findSections(sectionTreeRoot, 0, 0, -1, flags, &ret);
+    } else {
+        findSections(sectionTreeRoot, 0, pos, size, flags, &ret);
     }
-    // binary search. TextSections are sorted in order of position
-    if (sections.isEmpty()) {
-        return ret;
+    ::filter(ret, filter);
+    return ret;
+}
+
+// Appends the sections in the subtree that match, in order. base is the
+// position section's is relative to. size -1 means every section
+void TextDocumentPrivate::findSections(TextSection *section, qint64 base, qint64 pos, qint64 size,
+                                       TextSection::TextSectionOptions flags, QList<TextSection*> *out) const
+{
+    while (section) {
+        const qint64 sectionPos = base + section->d.position;
+        if (size != -1 && sectionPos + section->d.end <= pos)
+            return; // everything in here ends before pos
+        findSections(section->d.left, sectionPos, pos, size, flags, out);
+        if (size != -1 && sectionPos >= pos + size)
+            return;
+        if (size == -1 || ::match(pos, size, sectionPos, section->d.size, flags))
+            out->append(section);
+        base = sectionPos;
+        section = section->d.right;
     }
+}
 
-    const TextSection tmp(pos, size, static_cast<TextDocument*>(0), QTextCharFormat(), QVariant());
-    QList<TextSection*>::const_iterator it = qLowerBound(sections.begin(), sections.end(), &tmp, compareTextSection);
-    if (flags & TextSection::IncludePartial && it != sections.begin()) {
-        QList<TextSection*>::const_iterator prev = it;
-        do {
-            if (::match(pos, size, *--prev, flags))
-                ret.append(*prev);
-        } while (prev != sections.begin());
+void TextDocumentPrivate::textEditDestroyed(TextEdit *edit)
+{
+    foreach(TextSection *section, getSections(0, documentSize, 0, 0)) {
+        if (section->textEdit() == edit) {
+            // Make sure we also remove it from the tree of sections so it
+            // isn't deleted in the TextDocument destructor too.
+            removeSection(section);
+            section->d.document = 0;
+            delete section;
+        }
+    }
+}
+
+void TextDocumentPrivate::updateSectionEnd(TextSection *section)
+{
+    qint64 end = section->d.size;
+    if (section->d.left)
+        end = qMax(end, section->d.left->d.position + section->d.left->d.end);
+    if (section->d.right)
+        end = qMax(end, section->d.right->d.position + section->d.right->d.end);
+    section->d.end = end;
+}
+
+void TextDocumentPrivate::addCursor(TextCursorSharedPrivate *cursor)
+{
+    Q_ASSERT(!textCursors.contains(cursor));
+    textCursors.insert(cursor);
+    insertMark(&cursor->positionMark, cursor->positionMark.offset);
+    insertMark(&cursor->anchorMark, cursor->anchorMark.offset);
+}
+
+void TextDocumentPrivate::removeCursor(TextCursorSharedPrivate *cursor)
+{
+    const bool removed = textCursors.remove(cursor);
+    Q_ASSERT(removed);
+    Q_UNUSED(removed);
+    removeMark(&cursor->positionMark);
+    removeMark(&cursor->anchorMark);
+}
+
+void TextDocumentPrivate::moveMark(TextMark *mark, qint64 pos)
+{
+    if (mark->position() != pos) {
+        removeMark(mark);
+        insertMark(mark, pos);
+    }
+}
+
+// Works like the tree of sections. Only the marks on the path to a position
+// have to change for all the marks from it on to move, see shiftMarks()
+void TextDocumentPrivate::insertMark(TextMark *mark, qint64 pos)
+{
+    mark->left = mark->right = 0;
+    markTreeSeed ^= markTreeSeed << 13;
+    markTreeSeed ^= markTreeSeed >> 17;
+    markTreeSeed ^= markTreeSeed << 5;
+    mark->treePriority = markTreeSeed;
+
+    TextMark *parent = 0;
+    qint64 parentPos = 0;
+    TextMark **link = &markTreeRoot;
+    while (*link) {
+        parent = *link;
+        parentPos += parent->offset;
+        link = pos < parentPos ? &parent->left : &parent->right;
+    }
+    mark->parent = parent;
+    mark->offset = pos - parentPos;
+    *link = mark;
+    while (mark->parent && mark->parent->treePriority < mark->treePriority)
+        rotateMarkUp(mark);
+}
+
+// Takes mark out of the tree, leaving its absolute position in offset
+void TextDocumentPrivate::removeMark(TextMark *mark)
+{
+    const qint64 pos = mark->position();
+    while (mark->left || mark->right) {
+        if (!mark->right || (mark->left && mark->left->treePriority > mark->right->treePriority)) {
+            rotateMarkUp(mark->left);
+        } else {
+            rotateMarkUp(mark->right);
+        }
+    }
+    TextMark *parent = mark->parent;
+    if (!parent) {
+        markTreeRoot = 0;
+    } else if (parent->left == mark) {
+        parent->left = 0;
+    } else {
+        parent->right = 0;
+    }
+    mark->parent = 0;
+    mark->offset = pos;
+}
+
+void TextDocumentPrivate::rotateMarkUp(TextMark *mark)
+{
+    TextMark *p = mark->parent;
+    Q_ASSERT(p);
+    TextMark *grandParent = p->parent;
+    const qint64 offset = mark->offset;
+    TextMark *moved;
+    if (mark == p->left) {
+        moved = p->left = mark->right;
+        mark->right = p;
+    } else {
+        moved = p->right = mark->left;
+        mark->left = p;
+    }
+    if (moved) {
+        moved->parent = p;
+        moved->offset += offset;
+    }
+    mark->offset += p->offset;
+    p->offset = -offset;
+    p->parent = mark;
+    mark->parent = grandParent;
+    if (!grandParent) {
+        markTreeRoot = mark;
+    } else if (grandParent->left == p) {
+        grandParent->left = mark;
+    } else {
+        grandParent->right = mark;
+    }
+}
+
+// Appends the marks of the subtree that are after from and before to
+void TextDocumentPrivate::findMarks(TextMark *mark, qint64 base, qint64 from, qint64 to,
+                                    QList<TextMark*> *out) const
+{
+    while (mark) {
+        const qint64 pos = base + mark->offset;
+        if (pos <= from) {
+            base = pos;
+            mark = mark->right;
+        } else if (pos >= to) {
+            base = pos;
+            mark = mark->left;
+        } else {
+            findMarks(mark->left, pos, from, to, out);
+            out->append(mark);
+            base = pos;
+            mark = mark->right;
+        }
     }
-    while (it != sections.end()) {
-        if (::match(pos, size, *it, flags)) {
-            ret.append(*it);
+}
+
+// Moves the marks at from or later by delta
+void TextDocumentPrivate::shiftMarks(qint64 from, qint64 delta)
+{
+    TextMark *mark = markTreeRoot;
+    qint64 base = 0;
+    while (mark) {
+        const qint64 pos = base + mark->offset;
+        if (pos >= from) {
+            mark->offset += delta;
+            if (mark->left)
+                mark->left->offset -= delta;
+            base = pos + delta;
+            mark = mark->left;
         } else {
-            break;
+            base = pos;
+            mark = mark->right;
         }
-        ++it;
     }
-    ::filter(ret, filter);
-    return ret;
 }
 
-void TextDocumentPrivate::textEditDestroyed(TextEdit *edit)
+// Marks in the removed text end up where it was, the ones after it move back
+void TextDocumentPrivate::moveMarksForRemove(qint64 pos, qint64 size)
 {
-    QMutableListIterator<TextSection*> i(sections);
-    while (i.hasNext()) {
-        TextSection *section = i.next();
-        if (section->textEdit() == edit) {
-            section->d.document = 0;
-            // Make sure we also remove it from the list of sections so it
-            // isn't deleted in the TextDocument destructor too.
-            i.remove();
+    QList<TextMark*> inside;
+    findMarks(markTreeRoot, 0, pos, pos + size, &inside);
+    foreach(TextMark *mark, inside)
+        removeMark(mark);
+    shiftMarks(pos + size, -size);
+    foreach(TextMark *mark, inside)
+        insertMark(mark, pos);
+}
+
+// The treap priority of a section comes from its address so sections
+// don't have to keep one
+static inline uint sectionPriority(const TextSection *section)
+{
+    quint64 key = quint64(quintptr(section));
+    key ^= key >> 33;
+    key *= Q_UINT64_C(0xff51afd7ed558ccd);
+    key ^= key >> 33;
+    return uint(key);
+}
+
+// The treap works like the one for chunks except that a section's
+// d.position is relative to its parent's. Moving all the sections from a
+// position on only touches the path down to it, see shiftSections()
+void TextDocumentPrivate::insertSection(TextSection *section)
+{
+    const qint64 pos = section->d.position;
+    section->d.left = section->d.right = 0;
+    section->d.end = section->d.size;
+
+    TextSection *parent = 0;
+    qint64 parentPos = 0;
+    TextSection **link = &sectionTreeRoot;
+    while (*link) {
+        parent = *link;
+        parentPos += parent->d.position;
+        // goes before the sections at the same position
+        link = pos <= parentPos ? &parent->d.left : &parent->d.right;
+    }
+    section->d.parent = parent;
+    section->d.position = pos - parentPos;
+    *link = section;
+    ++sectionCount;
+    sectionEndChanged(parent);
+    while (section->d.parent && ::sectionPriority(section->d.parent) < ::sectionPriority(section))
+        rotateSectionUp(section);
+}
+
+// Takes section out of the tree, leaving its absolute position in d.position
+void TextDocumentPrivate::removeSection(TextSection *section)
+{
+    const qint64 pos = section->position();
+    while (section->d.left || section->d.right) {
+        if (!section->d.right || (section->d.left && ::sectionPriority(section->d.left) > ::sectionPriority(section->d.right))) {
+            rotateSectionUp(section->d.left);
+        } else {
+            rotateSectionUp(section->d.right);
+        }
+    }
+    TextSection *parent = section->d.parent;
+    if (!parent) {
+        sectionTreeRoot = 0;
+    } else {
+        if (parent->d.left == section) {
+            parent->d.left = 0;
+        } else {
+            parent->d.right = 0;
+        }
+        sectionEndChanged(parent);
+    }
+    --sectionCount;
+    section->d.parent = 0;
+    section->d.position = pos;
+}
+
+// Takes a section that's being deleted out of the document. Unlike
+// takeTextSection() its style is left in the document's pool since
+// nothing uses it after this
+void TextDocumentPrivate::discardSection(TextSection *section)
+{
+    if (section->d.parent || sectionTreeRoot == section) {
+        emit q->sectionRemoved(section);
+        removeSection(section);
+    }
+    section->d.textEdit = 0;
+    section->d.document = 0;
+}
+
+void TextDocumentPrivate::rotateSectionUp(TextSection *section)
+{
+    TextSection *p = section->d.parent;
+    Q_ASSERT(p);
+    TextSection *grandParent = p->d.parent;
+    const qint64 offset = section->d.position;
+    TextSection *moved;
+    if (section == p->d.left) {
+        moved = p->d.left = section->d.right;
+        section->d.right = p;
+    } else {
+        moved = p->d.right = section->d.left;
+        section->d.left = p;
+    }
+    if (moved) {
+        moved->d.parent = p;
+        moved->d.position += offset;
+    }
+    section->d.position += p->d.position;
+    p->d.position = -offset;
+    p->d.parent = section;
+    section->d.parent = grandParent;
+    if (!grandParent) {
+        sectionTreeRoot = section;
+    } else if (grandParent->d.left == p) {
+        grandParent->d.left = section;
+    } else {
+        grandParent->d.right = section;
+    }
+    updateSectionEnd(p);
+    updateSectionEnd(section);
+}
+
+void TextDocumentPrivate::sectionEndChanged(TextSection *section)
+{
+    while (section) {
+        updateSectionEnd(section);
+        section = section->d.parent;
+    }
+}
+
+// Moves the sections that start at from or later by delta
+void TextDocumentPrivate::shiftSections(qint64 from, qint64 delta)
+{
+    TextSection *section = sectionTreeRoot;
+    TextSection *last = 0;
+    qint64 base = 0;
+    while (section) {
+        const qint64 pos = base + section->d.position;
+        last = section;
+        if (pos >= from) {
+            // it and its right subtree move, the left subtree stays put
+            section->d.position += delta;
+            if (section->d.left)
+                section->d.left->d.position -= delta;
+            base = pos + delta;
+            section = section->d.left;
+        } else {
+            base = pos;
+            section = section->d.right;
+        }
+    }
+    sectionEndChanged(last);
+}
+
+// Takes all the sections of the subtree out of the tree, in order and with
+// their absolute positions. base is the position section's is relative to
+void TextDocumentPrivate::takeSections(TextSection *section, qint64 base, QList<TextSection*> *out)
+{
+    while (section) {
+        const qint64 pos = base + section->d.position;
+        takeSections(section->d.left, pos, out);
+        TextSection *right = section->d.right;
+        section->d.parent = section->d.left = section->d.right = 0;
+        section->d.position = pos;
+        out->append(section);
+        --sectionCount;
+        base = pos;
+        section = right;
+    }
+}
+
+// Builds the tree out of sections that are sorted and have absolute
+// positions in linear time. A section is the left child of the first one
+// after it with a higher priority or the right child of the one before it
+void TextDocumentPrivate::buildSectionTree(const QList<TextSection*> &sections)
+{
+    Q_ASSERT(!sectionTreeRoot);
+    QVector<TextSection*> stack;
+    foreach(TextSection *section, sections) {
+        TextSection *left = 0;
+        while (!stack.isEmpty() && ::sectionPriority(stack.last()) < ::sectionPriority(section)) {
+            left = stack.last();
+            stack.remove(stack.size() - 1);
+        }
+        section->d.left = left;
+        section->d.right = 0;
+        if (left)
+            left->d.parent = section;
+        if (!stack.isEmpty()) {
+            stack.last()->d.right = section;
+            section->d.parent = stack.last();
+        } else {
+            section->d.parent = 0;
+        }
+        stack.append(section);
+    }
+    sectionCount += sections.size();
+    if (!stack.isEmpty()) {
+        sectionTreeRoot = stack.first();
+        finishSectionTree(sectionTreeRoot, 0);
+    }
+}
+
+// Makes the absolute positions in the subtree relative and sets up end
+void TextDocumentPrivate::finishSectionTree(TextSection *section, qint64 parentPos)
+{
+    const qint64 pos = section->d.position;
+    if (section->d.left)
+        finishSectionTree(section->d.left, pos);
+    if (section->d.right)
+        finishSectionTree(section->d.right, pos);
+    section->d.position = pos - parentPos;
+    updateSectionEnd(section);
+}
+
+// Sections that text is inserted into grow and the ones at pos or later move
+void TextDocumentPrivate::moveSectionsForInsert(qint64 pos, qint64 size)
+{
+    QList<TextSection*> inside;
+    findSections(sectionTreeRoot, 0, pos, 1, TextSection::IncludePartial, &inside);
+    foreach(TextSection *section, inside) {
+        if (section->position() != pos) {
+            section->d.size += size;
+            sectionEndChanged(section);
+        }
+    }
+    shiftSections(pos, size);
+}
+
+// Sections lose the removed part of their text. The ones that had all their
+// text removed are deleted
+void TextDocumentPrivate::moveSectionsForRemove(qint64 pos, qint64 size)
+{
+    QList<TextSection*> hit;
+    findSections(sectionTreeRoot, 0, pos, size, TextSection::IncludePartial, &hit);
+    QList<TextSection*> moved;
+    foreach(TextSection *section, hit) {
+        const qint64 start = section->position();
+        const qint64 end = start + section->size();
+        if (start < pos) {
+            section->d.size -= qMin(end, pos + size) - pos;
+            sectionEndChanged(section);
+        } else if (end <= pos + size && section->size() > 0) {
+            discardSection(section);
             delete section;
+        } else {
+            // starts in the removed text. Goes back in at pos once the
+            // sections after the removed text have moved
+            removeSection(section);
+            section->d.position = pos;
+            section->d.size = qMax<qint64>(0, end - pos - size);
+            moved.append(section);
         }
     }
+    shiftSections(pos + size, -size);
+    for (int i=moved.size() - 1; i>=0; --i)
+        insertSection(moved.at(i));
 }
 
 void TextDocument::lockForRead()
@@ -21,6 +21,7 @@
 #include <QPair>
 #include <QEventLoop>
 #include <QList>
+#include <QVector>
 #include <QVariant>
 #include <QTextCharFormat>
 #include <QTextCodec>
@@ -34,11 +35,17 @@ class TextDocumentPrivate;
 class TextDocument : public QObject
 {
     Q_OBJECT
-    Q_PROPERTY(int documentSize READ documentSize)
+    Q_PROPERTY(qint64 documentSize READ documentSize)
     Q_PROPERTY(int chunkCount READ chunkCount)
     Q_PROPERTY(int instantiatedChunkCount READ instantiatedChunkCount)
     Q_PROPERTY(int swappedChunkCount READ swappedChunkCount)
     Q_PROPERTY(int chunkSize READ chunkSize WRITE setChunkSize)
+    Q_PROPERTY(int chunkCacheSize READ chunkCacheSize WRITE setChunkCacheSize)
+    Q_PROPERTY(qint64 chunkCacheMemoryLimit READ chunkCacheMemoryLimit WRITE setChunkCacheMemoryLimit)
+    Q_PROPERTY(int prefetchDepth READ prefetchDepth WRITE setPrefetchDepth)
+    Q_PROPERTY(int prefetchThreadCount READ prefetchThreadCount WRITE setPrefetchThreadCount)
+    Q_PROPERTY(qint64 memoryLimit READ memoryLimit WRITE setMemoryLimit)
+    Q_PROPERTY(int compressionThreshold READ compressionThreshold WRITE setCompressionThreshold)
     Q_PROPERTY(bool undoRedoEnabled READ isUndoRedoEnabled WRITE setUndoRedoEnabled)
     Q_PROPERTY(bool modified READ isModified WRITE setModified DESIGNABLE false)
     Q_PROPERTY(bool undoAvailable READ isUndoAvailable NOTIFY undoAvailableChanged)
@@ -65,6 +72,11 @@ public:
         AutoDetectCarriageReturns = 0x0010,
         NoImplicitLoadAll = 0x0020,
         Locking = 0x0040,
+        MapFile = 0x0080, // Sparse only, must be set before load(const QString &)
+        PieceTable = 0x0100, // Sparse only, edits keep unchanged text on the device
+        RawSwap = 0x0200, // SwapChunks stores UTF-16 as is instead of encoding it with the codec
+        Latin1Chunks = 0x0400, // chunks in memory that fit in Latin-1 take one byte per character
+        CountLinesInBackground = 0x0800, // Sparse only, load() counts the device's newlines on other threads
         DefaultOptions = AutoDetectCarriageReturns
     };
     Q_DECLARE_FLAGS(Options, Option);
@@ -86,13 +98,29 @@ public:
     QTextCodec *textCodec() const;
 
     void setText(const QString &text);
-    QString read(int pos, int size) const;
-    QStringRef readRef(int pos, int size) const;
-    QChar readCharacter(int index) const;
+    QString read(qint64 pos, int size) const;
+    QStringRef readRef(qint64 pos, int size) const;
+    QChar readCharacter(qint64 index) const;
+
+    // forEachSpan() hands the text of [pos, pos + size) to visit() a piece
+    // at a time, pointing into the chunks or the chunk cache instead of
+    // copying it. The pointer is only valid during the call and visit()
+    // returns false to stop. size -1 means to the end of the document
+    class SpanVisitor
+    {
+    public:
+        virtual ~SpanVisitor() {}
+        virtual bool visit(qint64 pos, const QChar *data, int size) = 0;
+    };
+    bool forEachSpan(qint64 pos, qint64 size, SpanVisitor *visitor) const;
     bool save(const QString &file);
     bool save(QIODevice *device);
     bool save();
-    int documentSize() const;
+    // Sparse documents with a variable width codec grow as the device is
+    // scanned and documentSize() waits for all of it, see isCountingLines().
+    // Reading past what's been scanned locks the document for writing so
+    // don't hold lockForRead() while doing that
+    qint64 documentSize() const;
     int chunkCount() const;
     int instantiatedChunkCount() const;
     int swappedChunkCount() const;
@@ -110,13 +138,49 @@ public:
         FindWholeWords = 0x00004,
         FindAllowInterrupt = 0x00008,
         FindWrap = 0x00010,
-        FindAll = 0x00020
+        FindAll = 0x00020,
+        FindParallel = 0x00040 // forward FindAll searches on idealThreadCount() threads
     };
     Q_DECLARE_FLAGS(FindMode, FindModeFlag);
 
     int chunkSize() const;
     void setChunkSize(int pos);
 
+    // how many decoded Sparse chunks are kept around and how much memory they may use
+    int chunkCacheSize() const;
+    void setChunkCacheSize(int entries);
+    qint64 chunkCacheMemoryLimit() const;
+    void setChunkCacheMemoryLimit(qint64 bytes);
+
+    // how many Sparse chunks ahead of reading and scrolling get decoded by
+    // background threads. 0 turns it off
+    int prefetchDepth() const;
+    void setPrefetchDepth(int chunks);
+    int prefetchThreadCount() const;
+    void setPrefetchThreadCount(int threads);
+
+    // how much memory the instantiated chunks may use before the least
+    // recently used ones go to the swap store. 0 means no limit
+    qint64 memoryLimit() const;
+    void setMemoryLimit(qint64 bytes);
+    // instantiated chunks that go unused while this many other chunk
+    // accesses happen are kept qCompress()ed. 0 means never
+    int compressionThreshold() const;
+    void setCompressionThreshold(int accesses);
+
+    struct Statistics {
+        Statistics() : chunkCacheHits(0), chunkCacheMisses(0), prefetchHits(0), chunksEvicted(0), chunksSwappedIn(0),
+                       chunksCompressed(0), chunksUncompressed(0), compressedBytes(0), compressedSize(0) {}
+        qint64 chunkCacheHits, chunkCacheMisses;
+        qint64 prefetchHits; // chunk cache misses that found the chunk prefetched
+        qint64 chunksEvicted, chunksSwappedIn; // by the memory limit and reads from the swap store
+        qint64 chunksCompressed, chunksUncompressed;
+        // what the compressed chunks use now and would use uncompressed. Not reset
+        qint64 compressedBytes, compressedSize;
+    };
+    Statistics statistics() const;
+    void resetStatistics();
+
     bool isUndoRedoEnabled() const;
     void setUndoRedoEnabled(bool enable);
 
@@ -126,25 +190,67 @@ public:
     TextCursor find(const QString &ba, const TextCursor &cursor, FindMode flags = 0) const;
     TextCursor find(const QChar &ch, const TextCursor &cursor, FindMode flags = 0) const;
 
-    inline TextCursor find(const QRegExp &rx, int pos = 0, FindMode flags = 0) const
+    inline TextCursor find(const QRegExp &rx, qint64 pos = 0, FindMode flags = 0) const
     { return find(rx, TextCursor(this, pos), flags); }
-    inline TextCursor find(const QString &ba, int pos = 0, FindMode flags = 0) const
+    inline TextCursor find(const QString &ba, qint64 pos = 0, FindMode flags = 0) const
     { return find(ba, TextCursor(this, pos), flags); }
-    inline TextCursor find(const QChar &ch, int pos = 0, FindMode flags = 0) const
+    inline TextCursor find(const QChar &ch, qint64 pos = 0, FindMode flags = 0) const
     { return find(ch, TextCursor(this, pos), flags); }
 
 
-    bool insert(int pos, const QString &ba);
-    inline bool insert(int pos, const QChar &ba) { return insert(pos, QString(ba)); }
-    void remove(int pos, int size);
+    bool insert(qint64 pos, const QString &ba);
+    inline bool insert(qint64 pos, const QChar &ba) { return insert(pos, QString(ba)); }
+    void remove(qint64 pos, qint64 size);
+
+    // applyEdits() replaces edit.removed characters at edit.position with
+    // edit.text for a whole batch at once. Positions refer to the document
+    // before any of the edits, which may not overlap. Cursors, sections and
+    // line numbers are adjusted in one pass and charactersRemoved()/
+    // charactersAdded() cover everything from the first edit to the end of
+    // the last. The batch is a single undo step whenever undo/redo is
+    // enabled: unlike insert() and remove(), which only record what a
+    // TextCursor does, applyEdits() is always undoable
+    struct Edit {
+        Edit(qint64 pos = 0, qint64 count = 0, const QString &string = QString())
+            : position(pos), removed(count), text(string)
+        {}
+        qint64 position, removed;
+        QString text;
+    };
+    bool applyEdits(const QVector<Edit> &edits);
 
-    QList<TextSection*> sections(int from = 0, int size = -1, TextSection::TextSectionOptions opt = 0) const;
-    inline TextSection *sectionAt(int pos) const { return sections(pos, 1, TextSection::IncludePartial).value(0); }
-    TextSection *insertTextSection(int pos, int size, const QTextCharFormat &format = QTextCharFormat(),
+    QList<TextSection*> sections(qint64 from = 0, qint64 size = -1, TextSection::TextSectionOptions opt = 0) const;
+    inline TextSection *sectionAt(qint64 pos) const { return sections(pos, 1, TextSection::IncludePartial).value(0); }
+    TextSection *insertTextSection(qint64 pos, qint64 size, const QTextCharFormat &format = QTextCharFormat(),
                                    const QVariant &data = QVariant());
     void insertTextSection(TextSection *section);
     void takeTextSection(TextSection *section);
-    int currentMemoryUsage() const;
+
+    // insertTextSections() and removeTextSections() handle many sections at
+    // once and emit sectionsAdded() or sectionsRemoved() a single time
+    // instead of sectionAdded() or sectionRemoved() for every section.
+    // insertTextSections() adds nothing if any of the specs is out of range
+    struct SectionSpec {
+        SectionSpec(qint64 pos = 0, qint64 count = 0, const QTextCharFormat &f = QTextCharFormat(),
+                    const QVariant &d = QVariant())
+            : position(pos), size(count), format(f), data(d)
+        {}
+        qint64 position, size;
+        QTextCharFormat format;
+        QVariant data;
+    };
+    QList<TextSection*> insertTextSections(const QVector<SectionSpec> &specs);
+    class SectionFilter
+    {
+    public:
+        virtual ~SectionFilter() {}
+        virtual bool matches(const TextSection *section) = 0;
+    };
+    // deletes the sections that sections(pos, size, opt) returns and filter
+    // matches. Returns how many were removed
+    int removeTextSections(qint64 pos = 0, qint64 size = -1, TextSection::TextSectionOptions opt = 0,
+                           SectionFilter *filter = 0);
+    qint64 currentMemoryUsage() const;
 
     bool isUndoAvailable() const;
     bool isRedoAvailable() const;
@@ -154,11 +260,14 @@ public:
 
     bool isModified() const;
 
-    int lineNumber(int position) const;
-    int columnNumber(int position) const;
+    int lineNumber(qint64 position) const;
+    int columnNumber(qint64 position) const;
+    int lineCount() const;
+    qint64 positionForLine(int line) const;
+    bool isCountingLines() const;
     int lineNumber(const TextCursor &cursor) const;
     int columnNumber(const TextCursor &cursor) const;
-    virtual bool isWordCharacter(const QChar &ch, int index) const;
+    virtual bool isWordCharacter(const QChar &ch, qint64 index) const;
 public slots:
     inline bool append(const QString &ba) { return insert(documentSize(), ba); }
     inline bool append(const QChar &ba) { return append(QString(ba)); }
@@ -172,16 +281,20 @@ signals:
     void textChanged();
     void sectionAdded(TextSection *section);
     void sectionRemoved(TextSection *removed);
-    void charactersAdded(int from, int count);
-    void charactersRemoved(int from, int count);
+    void sectionsAdded(const QList<TextSection*> &sections);
+    void sectionsRemoved(const QList<TextSection*> &removed);
+    void charactersAdded(qint64 from, qint64 count);
+    void charactersRemoved(qint64 from, qint64 count);
+    void editsApplied(const QVector<TextDocument::Edit> &edits); // sorted, positions before the edits
     void saveProgress(qreal progress);
-    void findProgress(qreal progress, int position) const;
-    void documentSizeChanged(int size);
+    void findProgress(qreal progress, qint64 position) const;
+    void lineCountProgress(qreal progress) const; // percent of the CountLinesInBackground scan, queued to this thread
+    void documentSizeChanged(qint64 size);
     void undoAvailableChanged(bool on);
     void redoAvailableChanged(bool on);
     void modificationChanged(bool modified);
 protected:
-    virtual QString swapFileName(Chunk *chunk);
+    virtual QString swapFileName(Chunk *chunk); // chunk is 0 for the document's swap store
 private:
     TextDocumentPrivate *d;
     friend class TextEdit;
@@ -189,6 +302,7 @@ private:
     friend class TextDocumentPrivate;
     friend class TextLayout;
     friend class TextSection;
+    friend struct TextCursorSharedPrivate;
 };
 
 Q_DECLARE_OPERATORS_FOR_FLAGS(TextDocument::FindMode);
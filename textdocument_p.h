@@ -23,7 +23,10 @@
 #include <QMutexLocker>
 #include <QReadWriteLock>
 #include <QMutex>
+#include <QWaitCondition>
 #include <QSet>
+#include <QHash>
+#include <QMap>
 #include <QTemporaryFile>
 #include <QDebug>
 #include <QPointer>
@@ -62,67 +65,176 @@ static inline bool matchSection(const TextSection *section, const TextEdit *text
 }
 
 
+// A piece of an edited PieceTable chunk. Device pieces use part of
+// what the chunk was loaded from, the others part of the add buffer
+struct Piece {
+    qint64 from; // -1 for the add buffer
+    int bytes, size; // Chunk::bytes and Chunk::length of the chunk the piece came from
+    int offset, length; // characters used from the decoded device range or the add buffer
+};
+
 struct Chunk {
-    Chunk() : previous(0), next(0), from(-1), length(0), firstLineIndex(-1)
-#ifndef TEXTDOCUMENT_LINENUMBER_CACHE
-            , lines(-1)
-#endif
+    Chunk() : previous(0), next(0), parent(0), left(0), right(0), priority(0), treeSize(0),
+              treeLines(0), treeUncounted(1), from(-1), length(0), bytes(-1), extent(0), newLines(-1),
+              swapped(false), usedPrevious(0), usedNext(0), usedBytes(-1), lastUsed(0)
         {}
 
     mutable QString data;
+    QByteArray latin1; // set instead of data for Latin1Chunks chunks that fit in Latin-1
     Chunk *previous, *next;
-    int size() const { return data.isEmpty() ? length : data.size(); }
-#ifdef QT_DEBUG
-    int pos() const { int p = 0; Chunk *c = previous; while (c) { p += c->size(); c = c->previous; }; return p; }
-#endif
-    mutable int from, length; // Not used when all is loaded
-    mutable int firstLineIndex;
+    // The chunks are also kept in a treap ordered like the list.
+    // treeSize is the sum of size() for this chunk and its subtrees,
+    // treeLines the sum of their newLines and treeUncounted how many of
+    // them haven't had their newLines counted yet
+    Chunk *parent, *left, *right;
+    uint priority;
+    qint64 treeSize;
+    mutable qint64 treeLines;
+    mutable int treeUncounted;
+    int size() const
+    {
+        Q_ASSERT(!extent);
+        return !data.isEmpty() ? data.size() : !latin1.isEmpty() ? latin1.size() : length;
+    }
+    qint64 span() const { return extent ? extent : size(); } // what the chunk adds to treeSize
+    qint64 pos() const
+    {
+        qint64 p = left ? left->treeSize : 0;
+        for (const Chunk *c = this; c->parent; c = c->parent) {
+            if (c == c->parent->right)
+                p += c->parent->treeSize - c->treeSize;
+        }
+        return p;
+    }
+    mutable qint64 from; // Not used when all is loaded
+    mutable int length;
+    int bytes; // byte size of the chunk on the device. -1 means read length characters from 'from'
+    // Non-zero for an untouched range of a single-byte Sparse device that
+    // hasn't been split into chunks yet. It covers 'extent' characters
+    // from 'from' and only span() may be called on it
+    qint64 extent;
+    QVector<Piece> pieces; // only set for edited PieceTable chunks. length is the sum of the pieces then
+    mutable int newLines; // -1 until they're counted
+    mutable QVector<int> extentLines; // newlines in each chunkSize piece of a counted extent
 #ifdef TEXTDOCUMENT_LINENUMBER_CACHE
     mutable QVector<int> lineNumbers;
     // format is how many endlines in the area from (n *
     // TEXTDOCUMENT_LINENUMBER_CACHE_INTERVAL) to
     // ((n + 1) * TEXTDOCUMENT_LINENUMBER_CACHE_INTERVAL)
-#else
-    mutable int lines;
 #endif
-    QString swap;
+    bool swapped; // the data is in the swap store, 'bytes' long at 'from'
+    QByteArray compressed; // qCompress()ed data of a cold chunk. from is 0 and bytes the compressed size then
+    // instantiated chunks under a memory limit or compression, most recently used first
+    mutable Chunk *usedPrevious, *usedNext;
+    mutable int usedBytes; // -1 when not in the list
+    mutable quint64 lastUsed;
 };
 
 
 // should really use this stuff for all of this stuff
 
-static inline QPair<int, int> intersection(int index1, int size1, int index2, int size2)
+static inline QPair<qint64, qint64> intersection(qint64 index1, qint64 size1, qint64 index2, qint64 size2)
 {
-    QPair<int, int> ret;
+    QPair<qint64, qint64> ret;
     ret.first = qMax(index1, index2);
-    const int right = qMin(index1 + size1, index2 + size2);
+    const qint64 right = qMin(index1 + size1, index2 + size2);
     ret.second = right - ret.first;
     if (ret.second <= 0)
-        return qMakePair(-1, 0);
+        return qMakePair<qint64, qint64>(-1, 0);
     return ret;
 }
 
-static inline bool compareTextSection(const TextSection *left, const TextSection *right)
+// The chunkSize piece of an extent that splitExtent() would make a chunk of
+struct ExtentPiece
 {
-    // don't make this compare document. Look at ::sections()
-    return left->position() < right->position();
-}
+    qint64 start; // in the extent
+    qint64 from; // on the device
+    int bytes, length; // like Chunk::bytes and Chunk::length
+    int index; // in the extent's extentLines
+};
+
+// What the read paths use instead of chunkAt(), which splits extents and
+// is only for the write paths. It's a chunk or the piece of an extent
+struct ChunkRef
+{
+    ChunkRef() : chunk(0), start(0), size(0) {}
+    const Chunk *chunk; // 0 past the first or last chunk
+    qint64 start; // where the piece starts in an extent, 0 for other chunks
+    int size;
+};
+
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+// decoded data of a chunk that isn't instantiated, or of a piece of an extent
+struct ChunkCacheEntry
+{
+    const Chunk *chunk;
+    qint64 start; // ChunkRef::start
+    qint64 pos;
+    QString data;
+    ChunkCacheEntry *previous, *next; // most recently used first
+};
+typedef QPair<const Chunk*, qint64> ChunkCacheKey;
+#endif
+
+// A piece of a Sparse device with a variable width codec. The line scan
+// threads find where each piece starts and ends on a character boundary
+// and count it, see loadCheckpoints()
+struct Checkpoint
+{
+    qint64 from; // on the device
+    qint64 position; // of its first character, -1 until the pieces before it are counted
+    int bytes, length; // length is -1 until it's counted
+};
+
+// a Sparse chunk's device range, decoded ahead of time by a ChunkPrefetchThread
+struct PrefetchJob
+{
+    qint64 from;
+    int bytes, length;
+};
+
+struct TextDocumentPrivate;
+class ChunkPrefetchThread : public QThread
+{
+public:
+    ChunkPrefetchThread(const TextDocumentPrivate *d) : doc(d) {}
+protected:
+    void run();
+private:
+    const TextDocumentPrivate *doc;
+};
+
+// counts the newlines of a Sparse device one piece at a time for
+// CountLinesInBackground and the checkpoints of variable width codecs,
+// see TextDocumentPrivate::startLineScan()
+class LineScanThread : public QThread
+{
+public:
+    LineScanThread(const TextDocumentPrivate *d) : doc(d) {}
+protected:
+    void run();
+private:
+    const TextDocumentPrivate *doc;
+};
 
 class TextDocumentIterator;
 struct DocumentCommand {
     enum Type {
         None,
         Inserted,
-        Removed
+        Removed,
+        Edited
     };
 
-    DocumentCommand(Type t, int pos = -1, const QString &string = QString())
+    DocumentCommand(Type t, qint64 pos = -1, const QString &string = QString())
         : type(t), position(pos), text(string), joinStatus(NoJoin)
     {}
 
     const Type type;
-    int position;
+    qint64 position;
     QString text;
+    // Edited: what applyEdits() got and the edits that take it back
+    QVector<TextDocument::Edit> edits, undoEdits;
 
     enum JoinStatus {
         NoJoin,
@@ -131,6 +243,57 @@ struct DocumentCommand {
     } joinStatus;
 };
 
+// A position that moves with the text, like either end of a TextCursor.
+// The document keeps its marks in a treap ordered by position where each
+// offset is relative to the parent's, see insertMark()
+struct TextMark
+{
+    TextMark() : offset(-1), parent(0), left(0), right(0), treePriority(0) {}
+
+    inline qint64 position() const
+    {
+        qint64 pos = offset;
+        for (const TextMark *mark = parent; mark; mark = mark->parent)
+            pos += mark->offset;
+        return pos;
+    }
+
+    qint64 offset;
+    TextMark *parent, *left, *right;
+    uint treePriority;
+};
+
+// The formats and cursors of a document's sections. Most sections look
+// like many others so they share one copy and only keep the index of
+// their style, the pair of their format and cursor
+class TextSectionStyles
+{
+public:
+    int style(const QTextCharFormat &format, const QCursor *cursor);
+    int setFormat(int style, const QTextCharFormat &format);
+    int setCursor(int style, const QCursor *cursor);
+    int copyStyle(const TextSectionStyles *from, int style);
+    QTextCharFormat format(int style) const;
+    QCursor cursor(int style) const;
+    bool hasCursor(int style) const;
+
+    // for the sections that aren't in a document, see TextDocument::takeTextSection()
+    static TextSectionStyles *detached();
+private:
+    int formatIndex(const QTextCharFormat &format);
+    int cursorIndex(const QCursor &cursor);
+    int styleIndex(int format, int cursor);
+
+    mutable QReadWriteLock lock;
+    QVector<QTextCharFormat> formats;
+    QHash<uint, QVector<int> > formatsByHash;
+    QVector<QCursor> cursors;
+    QHash<int, int> cursorsByShape;
+    QHash<qint64, QVector<int> > cursorsByPixmap; // bitmap cursors by cacheKey()
+    QVector<QPair<int, int> > styles; // the format and cursor indexes, cursor -1 means none
+    QHash<QPair<int, int>, int> stylesByIndexes;
+};
+
 struct TextSection;
 struct TextCursorSharedPrivate;
 struct TextDocumentPrivate : public QObject
@@ -140,19 +303,28 @@ public:
     TextDocumentPrivate(TextDocument *doc)
         : q(doc), first(0), last(0),
 #ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
-          cachedChunk(0), cachedChunkPos(-1),
+          chunkCacheFirst(0), chunkCacheLast(0), chunkCacheUsed(0),
 #endif
 #ifndef NO_TEXTDOCUMENT_READ_CACHE
           cachePos(-1),
 #endif
           documentSize(0),
-          saveState(NotSaving), findState(NotFinding), ownDevice(false), modified(false),
+          saveState(NotSaving), findState(NotFinding), markTreeRoot(0), markTreeSeed(0x9e3779b9),
+          sectionTreeRoot(0), sectionCount(0),
+          ownDevice(false), modified(false),
           deviceMode(TextDocument::Sparse), chunkSize(16384),
           undoRedoStackCurrent(0), modifiedIndex(-1), undoRedoEnabled(true), ignoreUndoRedo(false),
-          collapseInsertUndo(false), hasChunksWithLineNumbers(false), textCodec(0), options(TextDocument::DefaultOptions),
-          readWriteLock(0), cursorCommand(false)
+          collapseInsertUndo(false), textCodec(0), options(TextDocument::DefaultOptions),
+          readWriteLock(0), cursorCommand(false), chunkTreeRoot(0), chunkTreeSeed(0x9e3779b9),
+          mappedData(0), mappedSize(0), deviceCodec(0), chunkCacheSize(8), chunkCacheMemoryLimit(4 * 1024 * 1024),
+          cacheMutex(QMutex::Recursive), prefetchDepth(0), prefetchThreadCount(1), prefetchStop(false),
+          lineScanSize(0), lineScanPieceSize(0), lineScanNext(0), lineScanCounted(0), lineScanPercent(0),
+          lineScanStop(false), checkpointsCounted(0), checkpointsSize(0), checkpointStart(0),
+          checkpointsPending(false), checkpointsApplied(0), unreportedSize(0), swapFile(0), swapFileSize(0),
+          memoryLimit(0), usedFirst(0), usedLast(0), usedMemory(0), useCount(0),
+          compressionThreshold(0), compressedBytes(0), compressedSize(0)
     {
-        first = last = new Chunk;
+        insertChunk(0, new Chunk);
     }
 
     TextDocument *q;
@@ -160,19 +332,25 @@ public:
     mutable Chunk *first, *last;
 
 #ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
-    mutable Chunk *cachedChunk;
-    mutable int cachedChunkPos;
-    mutable QString cachedChunkData; // last uninstantiated chunk's read from file
+    mutable QHash<ChunkCacheKey, ChunkCacheEntry*> chunkCache;
+    mutable ChunkCacheEntry *chunkCacheFirst, *chunkCacheLast;
+    mutable qint64 chunkCacheUsed; // bytes
 #endif
 #ifndef NO_TEXTDOCUMENT_READ_CACHE
-    mutable int cachePos;
+    mutable qint64 cachePos;
     mutable QString cache; // results of last read(). Could span chunks
 #endif
 
-    int documentSize;
+    qint64 documentSize;
     enum SaveState { NotSaving, Saving, AbortSave } saveState;
     enum FindState { NotFinding, Finding, AbortFind } mutable findState;
-    QList<TextSection*> sections;
+    // the positions and anchors of textCursors
+    TextMark *markTreeRoot;
+    uint markTreeSeed;
+    // TextSections are a treap ordered by position, see insertSection()
+    TextSection *sectionTreeRoot;
+    int sectionCount;
+    TextSectionStyles sectionStyles;
     QPointer<QIODevice> device;
     bool ownDevice, modified;
     TextDocument::DeviceMode deviceMode;
@@ -182,41 +360,192 @@ public:
     int undoRedoStackCurrent, modifiedIndex;
     bool undoRedoEnabled, ignoreUndoRedo, collapseInsertUndo;
 
-    bool hasChunksWithLineNumbers;
     QTextCodec *textCodec;
     TextDocument::Options options;
     QReadWriteLock *readWriteLock;
     bool cursorCommand;
+    Chunk *chunkTreeRoot;
+    uint chunkTreeSeed;
+    const uchar *mappedData; // only set for MapFile documents
+    qint64 mappedSize;
+    QTextCodec *deviceCodec; // decodes chunks with known byte sizes. Can differ from textCodec if the device has a BOM
+    int chunkCacheSize;
+    qint64 chunkCacheMemoryLimit;
+    QString addBuffer; // text inserted into PieceTable chunks. Only appended to
+    mutable TextDocument::Statistics statistics;
+    // readers change the chunk and read caches, the used list, the
+    // statistics and the newline counts under the read lock
+    mutable QMutex cacheMutex;
+
+    int prefetchDepth, prefetchThreadCount;
+    mutable QMutex deviceMutex; // the prefetch and find threads share the device and the swap file
+    mutable QMutex prefetchMutex; // protects the members below
+    mutable QWaitCondition prefetchCondition;
+    mutable QList<ChunkPrefetchThread*> prefetchThreads;
+    mutable QList<PrefetchJob> prefetchQueue;
+    mutable QSet<qint64> prefetchInFlight;
+    mutable QHash<qint64, QString> prefetched; // by device position
+    mutable QList<qint64> prefetchedOrder; // oldest first
+    mutable bool prefetchStop;
+
+    mutable QMutex lineScanMutex; // protects the members below
+    QList<LineScanThread*> lineScanThreads;
+    mutable QVector<int> scannedLines; // newlines of each lineScanPieceSize piece of the device, -1 until counted
+    qint64 lineScanSize; // of the device when the scan started
+    int lineScanPieceSize;
+    mutable int lineScanNext, lineScanCounted, lineScanPercent;
+    mutable bool lineScanStop;
+    // the pieces of a device with a variable width codec, empty for other devices
+    mutable QVector<Checkpoint> checkpoints;
+    mutable int checkpointsCounted; // the leading pieces that have positions
+    mutable qint64 checkpointsSize; // characters in them
+    mutable QWaitCondition checkpointCondition;
+    qint64 checkpointStart; // after the BOM
+
+    // the document is still growing as the checkpoints are counted, see waitForCheckpoints()
+    bool checkpointsPending;
+    qint64 checkpointsApplied; // what the document has grown to, with lineScanMutex
+    qint64 unreportedSize; // what it grew by that charactersAdded() hasn't been emitted for
+
+    // SwapChunks puts all swapped chunks in one file. The chunks know
+    // where their data is and the free list has the space they left
+    QFile *swapFile;
+    qint64 swapFileSize;
+    QMap<qint64, qint64> swapFreeList; // offset -> bytes
+
+    qint64 memoryLimit; // 0 means no limit
+    mutable Chunk *usedFirst, *usedLast;
+    mutable qint64 usedMemory; // bytes of data in the used chunks
+    mutable quint64 useCount;
+
+    int compressionThreshold; // uses of other chunks before an instantiated chunk gets compressed. 0 means never
+    qint64 compressedBytes, compressedSize; // of all compressed chunks, and what they'd take uncompressed
 
 #ifdef QT_DEBUG
     mutable QSet<TextDocumentIterator*> iterators;
 #endif
     void joinLastTwoCommands();
 
+    void insertChunk(Chunk *after, Chunk *c); // after == 0 means prepend
     void removeChunk(Chunk *c);
-    QString chunkData(const Chunk *chunk, int pos) const;
+    void chunkSizeChanged(Chunk *c) const;
+    void rotateChunkUp(Chunk *c);
+    QString chunkData(const Chunk *chunk, qint64 pos) const;
+    QString decodeChunk(const Chunk *chunk) const;
+    ChunkRef chunkRefAt(qint64 pos, int *offset) const;
+    ChunkRef chunkRef(const Chunk *chunk, qint64 offset) const;
+    ChunkRef nextChunkRef(const ChunkRef &ref) const;
+    ChunkRef previousChunkRef(const ChunkRef &ref) const;
+    QString chunkRefData(const ChunkRef &ref, qint64 pos) const;
+    ExtentPiece extentPiece(const Chunk *extent, qint64 offset) const;
+    bool forEachSpan(qint64 pos, qint64 size, TextDocument::SpanVisitor *visitor) const;
     int chunkIndex(const Chunk *c) const;
+#ifndef NO_TEXTDOCUMENT_CHUNK_CACHE
+    ChunkCacheEntry *cachedChunk(const Chunk *c, qint64 start = 0) const;
+    void cacheChunk(const Chunk *c, qint64 start, qint64 pos, const QString &data) const;
+    void uncacheEntry(ChunkCacheEntry *entry) const;
+    void uncacheChunk(const Chunk *c) const;
+    void clearChunkCache() const;
+    void shiftChunkCache(qint64 from, qint64 delta) const;
+    void trimChunkCache() const;
+#endif
 
     // evil API. pos < 0 means don't cache
 
-    void updateChunkLineNumbers(Chunk *c, int pos) const;
-    int countNewLines(Chunk *c, int chunkPos, int index) const;
+    int countNewLines(Chunk *c, qint64 chunkPos, int index) const;
+    int chunkNewLines(Chunk *c) const;
+    void countTreeLines(Chunk *c) const;
+    qint64 linesBefore(Chunk *c) const;
+    void resetNewLines(Chunk *chunk);
 
     void instantiateChunk(Chunk *chunk);
-    Chunk *chunkAt(int pos, int *offset) const;
+    void narrowChunk(Chunk *chunk);
+    void widenChunk(Chunk *chunk);
+    Chunk *splitExtent(Chunk *extent, qint64 offset);
+    void expandExtent(Chunk *extent);
+    void splitChunk(Chunk *chunk);
+    void mergeChunk(Chunk *chunk);
+    // the chunk side of insert() and remove()
+    Chunk *insertText(qint64 pos, const QString &string);
+    void removeText(qint64 pos, qint64 size);
+    QString deviceData(qint64 from, int bytes, int length) const;
+    QString decodeDevice(qint64 from, int bytes, int length) const;
+    void prefetch(ChunkRef ref, bool forward) const;
+    void prefetch(qint64 pos, bool forward) const;
+    void stopPrefetching();
+    void startLineScan();
+    void stopLineScan();
+    int scanNewLines(qint64 from, int length) const;
+    int scannedNewLines(qint64 from, int bytes, int length) const;
+    int scanCheckpoint(int index, Checkpoint *checkpoint) const;
+    void addCheckpoint(int index, const Checkpoint &checkpoint) const;
+    int checkpointIndex(qint64 from) const;
+    void waitForCheckpoints(qint64 size) const;
+    void applyCheckpoints(qint64 size);
+    void finishCheckpoints();
+    QString pieceData(const Chunk *chunk) const;
+    bool editInPieces(const Chunk *chunk) const;
+    int splitPiece(Chunk *chunk, int offset);
+    void insertPiece(Chunk *chunk, int offset, const QString &string);
+    void removePieces(Chunk *chunk, int offset, int size);
+    bool save(QIODevice *device);
+    void clearChunks();
+    void loadExtent(TextDocument::Options options);
+    bool loadCheckpoints(QIODevice *device);
+    void mapDevice();
+    void unmapDevice();
+    QString readMapped(qint64 from, int length) const;
+    void adviseSequential(bool on) const;
+    Chunk *chunkAt(qint64 pos, int *offset);
+    Chunk *findChunk(qint64 pos, qint64 *offset) const;
     void clearRedo();
     void undoRedo(bool undo);
 
-    QString wordAt(int position, int *start = 0) const;
-    QString paragraphAt(int position, int *start = 0) const;
+    QString wordAt(qint64 position, qint64 *start = 0) const;
+    QString paragraphAt(qint64 position, qint64 *start = 0) const;
 
-    uint wordBoundariesAt(int pos) const;
+    uint wordBoundariesAt(qint64 pos) const;
 
     friend class TextDocument;
     void swapOutChunk(Chunk *c);
-    QList<TextSection*> getSections(int from, int size, TextSection::TextSectionOptions opt, const TextEdit *filter) const;
-    inline TextSection *sectionAt(int pos, const TextEdit *filter) const { return getSections(pos, 1, TextSection::IncludePartial, filter).value(0); }
+    QString swappedData(const Chunk *c) const;
+    qint64 allocateSwap(int bytes);
+    void freeSwap(Chunk *c);
+    void clearSwap();
+    void useChunk(const Chunk *c) const;
+    void unuseChunk(const Chunk *c) const;
+    void enforceMemoryLimit();
+    void resetUsedChunks();
+    void compressChunk(Chunk *c);
+    void dropCompressedData(Chunk *c);
+    QString compressedData(const Chunk *c) const;
+    void addCursor(TextCursorSharedPrivate *cursor);
+    void removeCursor(TextCursorSharedPrivate *cursor);
+    void moveMark(TextMark *mark, qint64 pos);
+    void insertMark(TextMark *mark, qint64 pos);
+    void removeMark(TextMark *mark);
+    void rotateMarkUp(TextMark *mark);
+    void findMarks(TextMark *mark, qint64 base, qint64 from, qint64 to, QList<TextMark*> *out) const;
+    void shiftMarks(qint64 from, qint64 delta);
+    void moveMarksForRemove(qint64 pos, qint64 size);
+
+    QList<TextSection*> getSections(qint64 from, qint64 size, TextSection::TextSectionOptions opt, const TextEdit *filter) const;
+    inline TextSection *sectionAt(qint64 pos, const TextEdit *filter) const { return getSections(pos, 1, TextSection::IncludePartial, filter).value(0); }
     void textEditDestroyed(TextEdit *edit);
+    void insertSection(TextSection *section);
+    void removeSection(TextSection *section);
+    void discardSection(TextSection *section);
+    void rotateSectionUp(TextSection *section);
+    static void updateSectionEnd(TextSection *section);
+    void sectionEndChanged(TextSection *section);
+    void findSections(TextSection *section, qint64 base, qint64 pos, qint64 size,
+                      TextSection::TextSectionOptions flags, QList<TextSection*> *out) const;
+    void shiftSections(qint64 from, qint64 delta);
+    void moveSectionsForInsert(qint64 pos, qint64 size);
+    void moveSectionsForRemove(qint64 pos, qint64 size);
+    void takeSections(TextSection *section, qint64 base, QList<TextSection*> *out);
+    void buildSectionTree(const QList<TextSection*> &sections);
+    void finishSectionTree(TextSection *section, qint64 parentPos);
 signals:
     void sectionFormatChanged(TextSection *section);
     void sectionCursorChanged(TextSection *section);
@@ -224,6 +553,9 @@ signals:
     void undoRedoCommandRemoved(DocumentCommand *cmd);
     void undoRedoCommandTriggered(DocumentCommand *cmd, bool undo);
     void undoRedoCommandFinished(DocumentCommand *cmd);
+private slots:
+    void onLineCountProgress(qreal percent);
+    void onCheckpointScanFinished();
 private:
     friend class TextSection;
 };
@@ -232,25 +564,23 @@ private:
 class TextDocumentIterator
 {
 public:
-    TextDocumentIterator(const TextDocumentPrivate *d, int p)
+    TextDocumentIterator(const TextDocumentPrivate *d, qint64 p)
         : doc(d), pos(p), min(0), max(-1), convert(false)
     {
         Q_ASSERT(doc);
 #ifndef NO_TEXTDOCUMENTITERATOR_CACHE
-        chunk = doc->chunkAt(p, &offset);
-        Q_ASSERT(chunk);
-        const int chunkPos = p - offset;
-        chunkData = doc->chunkData(chunk, chunkPos);
-        Q_COMPARE_ASSERT(chunkData.size(), chunk->size());
+        chunk = doc->chunkRefAt(p, &offset);
+        Q_ASSERT(chunk.chunk);
+        loadChunk(p - offset);
 #ifdef QT_DEBUG
         if (p != d->documentSize) {
-            if (doc->q->readCharacter(p) != chunkData.at(offset)) {
-                qDebug() << "got" << chunkData.at(offset) << "at" << offset << "in" << chunk << "of size" << chunkData.size()
+            if (doc->q->readCharacter(p) != chunkAt(offset)) {
+                qDebug() << "got" << chunkAt(offset) << "at" << offset << "in" << chunk.chunk << "of size" << chunkSize
                          << "expected" << doc->q->readCharacter(p) << "at document pos" << pos;
             }
-            Q_ASSERT(chunkData.at(offset) == doc->q->readCharacter(p));
+            Q_ASSERT(chunkAt(offset) == doc->q->readCharacter(p));
         } else {
-            Q_ASSERT(chunkData.size() == offset);
+            Q_ASSERT(chunkSize == offset);
         }
 #endif
 #endif
@@ -266,18 +596,18 @@ public:
     }
 #endif
 
-    int end() const
+    qint64 end() const
     {
         return max != -1 ? max : doc->documentSize;
     }
 
-    void setMinBoundary(int bound)
+    void setMinBoundary(qint64 bound)
     {
         min = bound;
         Q_ASSERT(pos >= min);
     }
 
-    void setMaxBoundary(int bound)
+    void setMaxBoundary(qint64 bound)
     {
         max = bound;
         Q_ASSERT(pos <= max);
@@ -294,7 +624,7 @@ public:
         return pos > min;
     }
 
-    inline int position() const
+    inline qint64 position() const
     {
         return pos;
     }
@@ -303,18 +633,19 @@ public:
     {
         Q_ASSERT(doc);
 #ifndef NO_TEXTDOCUMENTITERATOR_CACHE
-        Q_ASSERT(chunk);
-        Q_COMPARE_ASSERT(chunkData.size(), chunk->size());
+        Q_ASSERT(chunk.chunk);
+        Q_COMPARE_ASSERT(chunkSize, chunk.size);
         if (pos == end())
             return QChar();
+        const QChar ch = chunkAt(offset);
 #ifdef QT_DEBUG
-        if (doc->q->readCharacter(pos) != chunkData.at(offset)) {
-            qDebug() << "got" << chunkData.at(offset) << "at" << offset << "in" << chunk << "of size" << chunkData.size()
+        if (doc->q->readCharacter(pos) != ch) {
+            qDebug() << "got" << ch << "at" << offset << "in" << chunk.chunk << "of size" << chunkSize
                      << "expected" << doc->q->readCharacter(pos) << "at document pos" << pos;
         }
 #endif
-        ASSUME(doc->q->readCharacter(pos) == chunkData.at(offset));
-        return convert ? chunkData.at(offset).toLower() : chunkData.at(offset);
+        ASSUME(doc->q->readCharacter(pos) == ch);
+        return convert ? ch.toLower() : ch;
 #else
         return convert ? doc->q->readCharacter(pos).toLower() : doc->q->readCharacter(pos);
 #endif
@@ -325,13 +656,15 @@ public:
         Q_ASSERT(doc);
         ++pos;
 #ifndef NO_TEXTDOCUMENTITERATOR_CACHE
-        Q_ASSERT(chunk);
-        if (++offset >= chunkData.size() && chunk->next) { // special case for offset == chunkData.size() and !chunk->next
-            offset = 0;
-            chunk = chunk->next;
-            Q_ASSERT(chunk);
-            chunkData = doc->chunkData(chunk, pos);
-            Q_COMPARE_ASSERT(chunkData.size(), chunk->size());
+        Q_ASSERT(chunk.chunk);
+        if (++offset >= chunkSize) {
+            const ChunkRef next = doc->nextChunkRef(chunk);
+            if (next.chunk) { // special case for offset == chunkSize at the end
+                offset = 0;
+                chunk = next;
+                doc->prefetch(doc->nextChunkRef(chunk), true);
+                loadChunk(pos);
+            }
         }
 #endif
         return current();
@@ -345,13 +678,13 @@ public:
         Q_ASSERT(pos >= min);
         Q_ASSERT(pos <= end());
 #ifndef NO_TEXTDOCUMENTITERATOR_CACHE
-        Q_ASSERT(chunk);
+        Q_ASSERT(chunk.chunk);
         if (--offset < 0) {
-            chunk = chunk->previous;
-            Q_ASSERT(chunk);
-            chunkData = doc->chunkData(chunk, pos - chunk->size() + 1);
-            Q_COMPARE_ASSERT(chunkData.size(), chunk->size());
-            offset = chunkData.size() - 1;
+            chunk = doc->previousChunkRef(chunk);
+            Q_ASSERT(chunk.chunk);
+            doc->prefetch(doc->previousChunkRef(chunk), false);
+            loadChunk(pos - chunk.size + 1);
+            offset = chunkSize - 1;
         }
 #endif
         return current();
@@ -388,13 +721,37 @@ public:
     }
 
 private:
+#ifndef NO_TEXTDOCUMENTITERATOR_CACHE
+    // Latin1Chunks chunks are read as they are instead of being widened
+    inline void loadChunk(qint64 chunkPos)
+    {
+        if (!chunk.chunk->latin1.isEmpty()) {
+            doc->useChunk(chunk.chunk);
+            chunkLatin1 = chunk.chunk->latin1;
+            chunkData.clear();
+            chunkSize = chunkLatin1.size();
+        } else {
+            chunkLatin1.clear();
+            chunkData = doc->chunkRefData(chunk, chunkPos);
+            chunkSize = chunkData.size();
+        }
+        Q_COMPARE_ASSERT(chunkSize, chunk.size);
+    }
+
+    inline QChar chunkAt(int index) const
+    {
+        return chunkLatin1.isEmpty() ? chunkData.at(index) : QChar(uchar(chunkLatin1.at(index)));
+    }
+#endif
+
     const TextDocumentPrivate *doc;
-    int pos;
-    int min, max;
+    qint64 pos;
+    qint64 min, max;
 #ifndef NO_TEXTDOCUMENTITERATOR_CACHE
-    int offset;
+    int offset, chunkSize;
     QString chunkData;
-    Chunk *chunk;
+    QByteArray chunkLatin1;
+    ChunkRef chunk;
 #endif
     bool convert;
 };
@@ -18,6 +18,7 @@
 #include "textedit_p.h"
 #include "textcursor_p.h"
 #include "textdocument_p.h"
+#include "textscan_p.h"
 
 #ifndef QT_NO_DEBUG
 bool doLog = true;
@@ -75,7 +76,7 @@ TextEdit::TextEdit(QWidget *parent)
     returns the current cursor position
 */
 
-int TextEdit::cursorPosition() const
+qint64 TextEdit::cursorPosition() const
 {
     return d->textCursor.position();
 }
@@ -188,6 +189,7 @@ void TextEdit::setDocument(TextDocument *doc)
         doc = new TextDocument(this);
 
     d->sections.clear();
+    d->providedSectionsCache.clear();
     d->buffer.clear();
     d->sectionsDirty = true;
     d->document = doc;
@@ -209,21 +211,25 @@ void TextEdit::setDocument(TextDocument *doc)
             d, SLOT(onTextSectionAdded(TextSection *)));
     connect(d->document, SIGNAL(sectionRemoved(TextSection *)),
             d, SLOT(onTextSectionRemoved(TextSection *)));
+    connect(d->document, SIGNAL(sectionsAdded(QList<TextSection*>)),
+            d, SLOT(onTextSectionsAdded(QList<TextSection*>)));
+    connect(d->document, SIGNAL(sectionsRemoved(QList<TextSection*>)),
+            d, SLOT(onTextSectionsRemoved(QList<TextSection*>)));
     connect(d->document->d, SIGNAL(undoRedoCommandRemoved(DocumentCommand *)),
             d, SLOT(onDocumentCommandRemoved(DocumentCommand *)));
     connect(d->document->d, SIGNAL(undoRedoCommandTriggered(DocumentCommand *, bool)),
             d, SLOT(onDocumentCommandTriggered(DocumentCommand *, bool)));
-    connect(d->document, SIGNAL(charactersAdded(int, int)),
-            d, SLOT(onCharactersAddedOrRemoved(int, int)));
-    connect(d->document, SIGNAL(charactersRemoved(int, int)),
-            d, SLOT(onCharactersAddedOrRemoved(int, int)));
+    connect(d->document, SIGNAL(charactersAdded(qint64, qint64)),
+            d, SLOT(onCharactersAddedOrRemoved(qint64, qint64)));
+    connect(d->document, SIGNAL(charactersRemoved(qint64, qint64)),
+            d, SLOT(onCharactersAddedOrRemoved(qint64, qint64)));
     connect(d->document, SIGNAL(textChanged()), this, SIGNAL(textChanged()));
     connect(d->document, SIGNAL(undoAvailableChanged(bool)),
             this, SIGNAL(undoAvailableChanged(bool)));
     connect(d->document, SIGNAL(redoAvailableChanged(bool)),
             this, SIGNAL(redoAvailableChanged(bool)));
 
-    connect(d->document, SIGNAL(documentSizeChanged(int)), d, SLOT(onDocumentSizeChanged(int)));
+    connect(d->document, SIGNAL(documentSizeChanged(qint64)), d, SLOT(onDocumentSizeChanged(qint64)));
     connect(d->document, SIGNAL(destroyed(QObject*)), d, SLOT(onDocumentDestroyed()));
     connect(d->document->d, SIGNAL(sectionFormatChanged(TextSection *)),
             d, SLOT(onTextSectionFormatChanged(TextSection *)));
@@ -303,7 +309,7 @@ enum SelectionAddStatus {
     After,
     Success
 };
-static inline SelectionAddStatus addSelection(int layoutStart, int layoutLength,
+static inline SelectionAddStatus addSelection(qint64 layoutStart, int layoutLength,
                                               const TextCursor &cursor, QTextLayout::FormatRange *format)
 {
     Q_ASSERT(format);
@@ -314,9 +320,9 @@ static inline SelectionAddStatus addSelection(int layoutStart, int layoutLength,
     if (cursor.selectionStart() > layoutStart + layoutLength)
         return After;
 
-    format->start = qMax(0, cursor.selectionStart() - layoutStart);
-    format->length = qMin(layoutLength - format->start,
-                          cursor.selectionEnd() - layoutStart - format->start);
+    format->start = int(qMax<qint64>(0, cursor.selectionStart() - layoutStart));
+    format->length = int(qMin<qint64>(layoutLength - format->start,
+                                      cursor.selectionEnd() - layoutStart - format->start));
     return Success;
 }
 
@@ -335,7 +341,7 @@ void TextEdit::paintEvent(QPaintEvent *e)
     p.setFont(font());
     QVector<QTextLayout::FormatRange> selections;
     selections.reserve(d->extraSelections.size() + 1);
-    int textLayoutOffset = d->viewportPosition;
+    qint64 textLayoutOffset = d->viewportPosition;
 
     const QTextLayout *cursorLayout = d->cursorVisible ? d->layoutForPosition(d->textCursor.position()) : 0;
     int extraSelectionIndex = 0;
@@ -364,7 +370,7 @@ void TextEdit::paintEvent(QPaintEvent *e)
                     selections.append(range);
 
                     const TextCursor &cursor = d->extraSelections.at(extraSelectionIndex).cursor;
-                    int lastPos = cursor.position() + cursor.selectionSize();
+                    const qint64 lastPos = cursor.position() + cursor.selectionSize();
                     if (lastPos > textLayoutOffset+textSize && lowestIncompleteSelection < 0) {
                         lowestIncompleteSelection = extraSelectionIndex;
                     }
@@ -387,7 +393,7 @@ void TextEdit::paintEvent(QPaintEvent *e)
             if (!selections.isEmpty())
                 selections.clear();
             if (cursorLayout == l) {
-                cursorLayout->drawCursor(&p, QPoint(0, 0), d->textCursor.position() - textLayoutOffset,
+                cursorLayout->drawCursor(&p, QPoint(0, 0), int(d->textCursor.position() - textLayoutOffset),
                                          d->cursorWidth);
             }
         } else if (r.top() > er.bottom()) {
@@ -411,7 +417,7 @@ void TextEdit::scrollContentsBy(int dx, int dy)
     viewport()->scroll(dx, dy); // seems to jitter more
 }
 
-int TextEdit::viewportPosition() const
+qint64 TextEdit::viewportPosition() const
 {
     return d->viewportPosition;
 }
@@ -447,7 +453,7 @@ void TextEdit::mousePressEvent(QMouseEvent *e)
             if (!shift) {
                 clearSelection();
             }
-            int pos = textPositionAt(e->pos());
+            qint64 pos = textPositionAt(e->pos());
             if (pos == -1)
                 pos = d->document->documentSize() - 1;
             d->sectionPressed = d->document->d->sectionAt(pos, this);
@@ -455,7 +461,7 @@ void TextEdit::mousePressEvent(QMouseEvent *e)
         }
         e->accept();
     } else if (e->button() == Qt::MidButton && qApp->clipboard()->supportsSelection()) {
-        int pos = textPositionAt(e->pos());
+        qint64 pos = textPositionAt(e->pos());
         if (pos == -1)
             pos = d->document->documentSize() - 1;
         paste(pos, QClipboard::Selection);
@@ -476,7 +482,7 @@ void TextEdit::mouseDoubleClickEvent(QMouseEvent *e)
             ds << int(e->type()) << e->pos() << e->button() << e->buttons() << e->modifiers();
         }
 #endif
-        const int pos = textPositionAt(e->pos());
+        const qint64 pos = textPositionAt(e->pos());
         if (pos == d->textCursor.position()) {
             d->tripleClickTimer.start(qApp->doubleClickInterval(), d);
             if (d->document->isWordCharacter(d->textCursor.cursorCharacter(),
@@ -520,7 +526,7 @@ void TextEdit::mouseMoveEvent(QMouseEvent *e)
                 return;
             }
         } else {
-            int pos = textPositionAt(QPoint(qBound(0, d->lastMouseMove.x(), r.right()), d->lastMouseMove.y()));
+            qint64 pos = textPositionAt(QPoint(qBound(0, d->lastMouseMove.x(), r.right()), d->lastMouseMove.y()));
             if (pos == -1)
                 pos = d->document->documentSize();
             d->autoScrollTimer.stop();
@@ -606,7 +612,7 @@ void TextEdit::dragMoveEvent(QDragMoveEvent *e)
     }
 
     if (!d->readOnly && d->canInsertFromMimeData(e->mimeData())) {
-        int pos;
+        qint64 pos;
         if (e->pos().y() > viewport()->rect().bottom()) {
             pos = d->document->documentSize();
         } else {
@@ -628,7 +634,7 @@ void TextEdit::dragMoveEvent(QDragMoveEvent *e)
 void TextEdit::dropEvent(QDropEvent *e)
 {
     if (!d->readOnly && d->canInsertFromMimeData(e->mimeData())) {
-        int pos;
+        qint64 pos;
         if (e->pos().y() > viewport()->rect().bottom()) {
             pos = d->document->documentSize();
         } else {
@@ -648,7 +654,7 @@ void TextEdit::dropEvent(QDropEvent *e)
 }
 #endif
 
-int TextEdit::textPositionAt(const QPoint &pos) const
+qint64 TextEdit::textPositionAt(const QPoint &pos) const
 {
     if (!viewport()->rect().contains(pos))
         return -1;
@@ -722,12 +728,12 @@ QRect TextEdit::cursorRect(const TextCursor &textCursor) const
     return QRect();
 }
 
-int TextEdit::lineNumber(int position) const
+int TextEdit::lineNumber(qint64 position) const
 {
     return d->document->lineNumber(position);
 }
 
-int TextEdit::columnNumber(int position) const
+int TextEdit::columnNumber(qint64 position) const
 {
     TextCursor cursor(this, position);
     return cursor.isNull() ? -1 : cursor.columnNumber();
@@ -818,11 +824,11 @@ void TextEdit::keyPressEvent(QKeyEvent *e)
     }
     if (operation != TextCursor::NoMove) {
         if (hasSelection()) {
-            const int old = qMin(d->textCursor.anchor(), d->textCursor.position());
+            const qint64 old = qMin(d->textCursor.anchor(), d->textCursor.position());
             removeSelectedText();
             setCursorPosition(old, TextCursor::MoveAnchor);
         } else {
-            const int old = d->textCursor.position();
+            const qint64 old = d->textCursor.position();
             if (moveCursorPosition(operation, TextCursor::KeepAnchor)) {
                 removeSelectedText();
                 if (restoreCursorPosition) {
@@ -856,7 +862,7 @@ void TextEdit::keyReleaseEvent(QKeyEvent *e)
 }
 
 
-void TextEdit::setCursorPosition(int pos, TextCursor::MoveMode mode)
+void TextEdit::setCursorPosition(qint64 pos, TextCursor::MoveMode mode)
 {
     d->textCursor.setPosition(pos, mode);
 }
@@ -878,7 +884,7 @@ void TextEdit::paste(QClipboard::Mode mode)
     paste(cursorPosition(), mode);
 }
 
-void TextEdit::paste(int pos, QClipboard::Mode mode)
+void TextEdit::paste(qint64 pos, QClipboard::Mode mode)
 {
     if (d->readOnly)
         return;
@@ -926,13 +932,13 @@ bool TextEdit::hasSelection() const
     return d->textCursor.hasSelection();
 }
 
-void TextEdit::insert(int pos, const QString &text)
+void TextEdit::insert(qint64 pos, const QString &text)
 {
     Q_ASSERT(d->document);
     d->document->insert(pos, text);
 }
 
-void TextEdit::remove(int from, int size)
+void TextEdit::remove(qint64 from, qint64 size)
 {
     if (d->readOnly)
         return;
@@ -1006,21 +1012,25 @@ void TextEdit::setText(const QString &text)
     d->document->setText(text);
 }
 
-QString TextEdit::read(int pos, int size) const
+QString TextEdit::read(qint64 pos, int size) const
 {
     return d->document->read(pos, size);
 }
 
-QChar TextEdit::readCharacter(int index) const
+QChar TextEdit::readCharacter(qint64 index) const
 {
     return d->document->readCharacter(index);
 }
 
-void TextEditPrivate::onDocumentSizeChanged(int size)
+void TextEditPrivate::onDocumentSizeChanged(qint64 size)
 {
-    textEdit->verticalScrollBar()->setRange(0, qMax(0, size));
+    size = qMax<qint64>(0, size);
+    scrollBarShift = 0;
+    while ((size >> scrollBarShift) > INT_MAX)
+        ++scrollBarShift;
+    textEdit->verticalScrollBar()->setRange(0, scrollBarValue(size));
 //    qDebug() << findLastPageSize();
-    maxViewportPosition = textEdit->verticalScrollBar()->maximum();
+    maxViewportPosition = size;
     updateScrollBarPageStepPending = true;
 }
 
@@ -1098,6 +1108,39 @@ QList<SyntaxHighlighter*> TextEdit::syntaxHighlighters() const
     return d->syntaxHighlighters;
 }
 
+/*!
+    Sets the provider that is asked for the sections of the text around
+    the viewport whenever it is laid out. The TextEdit doesn't take
+    ownership of \a provider. Pass 0 to stop using one.
+    \sa invalidateProvidedSections
+*/
+
+void TextEdit::setSectionProvider(SectionProvider *provider)
+{
+    if (provider == d->sectionProvider)
+        return;
+    d->sectionProvider = provider;
+    invalidateProvidedSections();
+}
+
+TextEdit::SectionProvider *TextEdit::sectionProvider() const
+{
+    return d->sectionProvider;
+}
+
+/*!
+    Forgets what the section provider has returned so it's asked again the
+    next time the text is laid out.
+*/
+
+void TextEdit::invalidateProvidedSections()
+{
+    d->providedSectionsCache.clear();
+    d->sectionsDirty = true;
+    d->layoutDirty = true;
+    viewport()->update();
+}
+
 static inline bool compareExtraSelection(const TextEdit::ExtraSelection &left, const TextEdit::ExtraSelection &right)
 {
     return left.cursor < right.cursor;
@@ -1138,11 +1181,38 @@ void TextEditPrivate::onTextSectionAdded(TextSection *section)
     sectionsDirty = true;
 }
 
+void TextEditPrivate::onTextSectionsAdded(const QList<TextSection*> &sections)
+{
+    foreach(TextSection *section, sections) {
+        if (dirtyForSection(section))
+            break;
+    }
+    updateCursorPosition(lastHoverPos);
+    sectionsDirty = true;
+}
+
+void TextEditPrivate::onTextSectionsRemoved(const QList<TextSection*> &sections)
+{
+    bool dirty = false;
+    bool cursor = false;
+    foreach(TextSection *section, sections) {
+        if (!dirty)
+            dirty = dirtyForSection(section);
+        if (section == sectionPressed)
+            sectionPressed = 0;
+        cursor = cursor || section->hasCursor();
+    }
+    sectionsDirty = true;
+    if (cursor)
+        updateCursorPosition(lastHoverPos);
+}
+
 void TextEditPrivate::onScrollBarValueChanged(int value)
 {
-    if (blockScrollBarUpdate || value == requestedScrollBarPosition || value == viewportPosition)
+    const qint64 pos = scrollBarPosition(value);
+    if (blockScrollBarUpdate || pos == requestedScrollBarPosition || value == scrollBarValue(viewportPosition))
         return;
-    requestedScrollBarPosition = value;
+    requestedScrollBarPosition = pos;
     layoutDirty = true;
     textEdit->viewport()->update();
 }
@@ -1164,16 +1234,17 @@ void TextEditPrivate::updateScrollBar()
     if (pendingScrollBarUpdate) {
         const bool old = blockScrollBarUpdate;
         blockScrollBarUpdate = true;
-        textEdit->verticalScrollBar()->setValue(viewportPosition);
+        textEdit->verticalScrollBar()->setValue(scrollBarValue(viewportPosition));
         blockScrollBarUpdate = old;
         pendingScrollBarUpdate  = false;
     }
 }
 
-void TextEditPrivate::onCharactersAddedOrRemoved(int from, int count)
+void TextEditPrivate::onCharactersAddedOrRemoved(qint64 from, qint64 count)
 {
     Q_ASSERT(count >= 0);
     Q_UNUSED(count);
+    providedSectionsCache.clear(); // positions after from have moved
     if (from > qMin(bufferPosition + buffer.size(), layoutEnd)) {
         return;
     }
@@ -1185,7 +1256,7 @@ void TextEditPrivate::onCharactersAddedOrRemoved(int from, int count)
 void TextEdit::ensureCursorVisible()
 {
     if (d->textCursor.position() < d->viewportPosition) {
-        d->updateViewportPosition(qMax(0, d->textCursor.position() - 1), TextLayout::Backward);
+        d->updateViewportPosition(qMax<qint64>(0, d->textCursor.position() - 1), TextLayout::Backward);
     } else if (d->textCursor.position() > d->layoutEnd) {
         d->updateViewportPosition(d->textCursor.position(), TextLayout::Backward);
         viewport()->update();
@@ -1236,7 +1307,7 @@ void TextEdit::setTextCursor(const TextCursor &textCursor)
 
 TextCursor TextEdit::cursorForPosition(const QPoint &pos) const
 {
-    const int idx = textPositionAt(pos);
+    const qint64 idx = textPositionAt(pos);
     if (idx == -1)
         return TextCursor();
     return TextCursor(this, idx);
@@ -1245,20 +1316,20 @@ TextCursor TextEdit::cursorForPosition(const QPoint &pos) const
 TextSection *TextEdit::sectionAt(const QPoint &pos) const
 {
     Q_ASSERT(d->document);
-    int textPos = textPositionAt(pos);
+    qint64 textPos = textPositionAt(pos);
     if (textPos == -1)
-        textPos = d->document->d->documentSize - 1;
+        textPos = d->document->documentSize() - 1;
     return d->document->d->sectionAt(textPos, this);
 }
 
-QList<TextSection*> TextEdit::sections(int from, int size, TextSection::TextSectionOptions opt) const
+QList<TextSection*> TextEdit::sections(qint64 from, qint64 size, TextSection::TextSectionOptions opt) const
 {
     Q_ASSERT(d->document);
     QList<TextSection*> sections = d->document->d->getSections(from, size, opt, this);
     return sections;
 }
 
-TextSection *TextEdit::insertTextSection(int pos, int size, const QTextCharFormat &format, const QVariant &data)
+TextSection *TextEdit::insertTextSection(qint64 pos, qint64 size, const QTextCharFormat &format, const QVariant &data)
 {
     Q_ASSERT(d->document);
     TextSection *section = d->document->insertTextSection(pos, size, format, data);
@@ -1274,7 +1345,7 @@ void TextEditPrivate::updateHorizontalPosition()
     const QRect r = textEdit->viewport()->rect();
     const QPoint p(qBound(0, lastMouseMove.x(), r.right()),
                    qBound(0, lastMouseMove.y(), r.bottom()));
-    int pos = textPositionAt(p);
+    qint64 pos = textPositionAt(p);
     if (pos == -1)
         pos = document->documentSize() - 1;
     textEdit->setCursorPosition(pos, TextCursor::KeepAnchor);
@@ -1289,7 +1360,7 @@ void TextEditPrivate::updateScrollBarPosition()
         return;
     }
 
-    const int req = requestedScrollBarPosition;
+    const qint64 req = requestedScrollBarPosition;
     requestedScrollBarPosition = -1;
 
     Direction direction = Forward;
@@ -1312,8 +1383,8 @@ void TextEditPrivate::updateScrollBarPageStep()
         textEdit->verticalScrollBar()->setPageStep(1);
         return;
     }
-    const int visibleCharacters = lines.at(qMin(visibleLines, lines.size() - 1)).first - lines.at(0).first;
-    textEdit->verticalScrollBar()->setPageStep(visibleCharacters);
+    const qint64 visibleCharacters = lines.at(qMin(visibleLines, lines.size() - 1)).first - lines.at(0).first;
+    textEdit->verticalScrollBar()->setPageStep(qMax(1, scrollBarValue(visibleCharacters)));
 }
 
 void TextEditPrivate::onDocumentDestroyed()
@@ -1359,28 +1430,61 @@ void TextEditPrivate::onDocumentCommandTriggered(DocumentCommand *cmd, bool undo
     }
 }
 
+// Finds the nth newline from where it starts
+class NewLineVisitor : public TextDocument::SpanVisitor
+{
+public:
+    NewLineVisitor(int n) : remaining(n), position(-1) {}
+    bool visit(qint64 pos, const QChar *data, int size)
+    {
+        const ushort *utf16 = reinterpret_cast<const ushort*>(data);
+        const int index = TextScan::indexOfNth(utf16, size, '\n', remaining);
+        if (index != -1) {
+            position = pos + index;
+            return false;
+        }
+        remaining -= TextScan::count(utf16, size, '\n');
+        return true;
+    }
+
+    int remaining;
+    qint64 position;
+};
+
 void TextEditPrivate::scrollLines(int lines)
 {
-    int pos = viewportPosition;
+    qint64 pos = viewportPosition;
     const Direction d = (lines < 0 ? Backward : Forward);
-    const int add = lines < 0 ? -1 : 1;
-
-    while (pos + add >= 0 && pos + add < document->documentSize()) {
-        if (d == Forward &&
-            (lines - add == 0) &&
-            bufferReadCharacter(pos) == '\n') {
-            // When iterating forwards, be sure not to skip over blank lines
-            // (ie. lines containing only '\n') by just ignoring them here
-            // - updateViewportPosition automatically takes us one index past
-            // this newline, thus displaying the next line)
-            break;
-        } else {
-            pos += add;
-            if (bufferReadCharacter(pos) == '\n') {
-                if ((lines -= add) == 0) {
+    const qint64 size = document->documentSize();
+
+    if (lines > 0 && pos + 1 < size) {
+        // When iterating forwards, be sure not to skip over blank lines
+        // (ie. lines containing only '\n') by stopping on the newline
+        // before the last one - updateViewportPosition automatically
+        // takes us one index past this newline, thus displaying the next
+        // line)
+        const int newLines = (lines > 1 ? lines - 1 : bufferReadCharacter(pos) == '\n' ? 0 : 1);
+        if (newLines > 0) {
+            NewLineVisitor visitor(newLines);
+            document->forEachSpan(pos + 1, size - pos - 1, &visitor);
+            pos = (visitor.position != -1 ? visitor.position : size - 1);
+        }
+    } else if (lines < 0) {
+        enum { BlockSize = 4096 };
+        int remaining = -lines;
+        qint64 end = pos;
+        pos = 0;
+        while (end > 0 && remaining > 0) {
+            const qint64 start = qMax<qint64>(0, end - BlockSize);
+            const QString block = document->read(start, int(end - start));
+            int index = block.size();
+            while ((index = TextScan::lastIndexOf(block.utf16(), index, '\n')) != -1) {
+                if (--remaining == 0) {
+                    pos = start + index;
                     break;
                 }
             }
+            end = start;
         }
     }
     updateViewportPosition(pos, d);
@@ -1410,7 +1514,7 @@ void TextEditPrivate::timerEvent(QTimerEvent *e)
         }
         const QPoint p(qBound(0, lastMouseMove.x(), r.right()),
                        qBound(0, lastMouseMove.y(), r.bottom()));
-        int pos = textPositionAt(p);
+        qint64 pos = textPositionAt(p);
         if (pos == -1)
             pos = document->documentSize() - 1;
         textEdit->setCursorPosition(pos, TextCursor::KeepAnchor);
@@ -1432,7 +1536,7 @@ static inline bool compareTextSectionByPriority(const TextSection *left, const T
 void TextEditPrivate::updateCursorPosition(const QPoint &pos)
 {
     lastHoverPos = pos;
-    const int textPos = textPositionAt(pos);
+    const qint64 textPos = textPositionAt(pos);
     if (textPos != -1) {
         QList<TextSection*> hovered = textEdit->sections(textPos, 1, TextSection::IncludePartial);
         qSort(hovered.begin(), hovered.end(), compareTextSectionByPriority);
@@ -1532,20 +1636,20 @@ bool TextEditPrivate::canInsertFromMimeData(const QMimeData *data) const
     return data->hasText();
 }
 
-int TextEditPrivate::findLastPageSize() const
+qint64 TextEditPrivate::findLastPageSize() const
 {
     if (!document || document->documentSize() == 0)
         return -1;
     TextEditPrivate p(textEdit);
     p.viewportPosition = 0;
     p.document = document;
-    const int documentSize = document->documentSize();
+    const qint64 documentSize = document->documentSize();
     p.maxViewportPosition = documentSize;
-    int start = 0;
+    qint64 start = 0;
     int i = 0;
     forever {
         p.updateViewportPosition(start, Backward);
-        p.relayoutByPosition(documentSize);
+        p.relayoutByPosition(int(qMin<qint64>(documentSize, INT_MAX)));
         qDebug() << "i" << i++ << "start" << start << "layoutEnd" << p.layoutEnd << "documentSize" << documentSize << "viewportPosition" << p.viewportPosition;
         if (p.layoutEnd == documentSize) {
             break;
@@ -69,12 +69,12 @@ public:
     void scrollContentsBy(int dx, int dy);
 
     bool moveCursorPosition(TextCursor::MoveOperation op, TextCursor::MoveMode = TextCursor::MoveAnchor, int n = 1);
-    void setCursorPosition(int pos, TextCursor::MoveMode mode = TextCursor::MoveAnchor);
+    void setCursorPosition(qint64 pos, TextCursor::MoveMode mode = TextCursor::MoveAnchor);
 
-    int viewportPosition() const;
-    int cursorPosition() const;
+    qint64 viewportPosition() const;
+    qint64 cursorPosition() const;
 
-    int textPositionAt(const QPoint &pos) const;
+    qint64 textPositionAt(const QPoint &pos) const;
 
     bool readOnly() const;
     void setReadOnly(bool rr);
@@ -88,8 +88,8 @@ public:
     QRect cursorBlockRect(const TextCursor &cursor) const;
     QRect cursorRect(const TextCursor &cursor) const;
 
-    int lineNumber(int position) const;
-    int columnNumber(int position) const;
+    int lineNumber(qint64 position) const;
+    int columnNumber(qint64 position) const;
     int lineNumber(const TextCursor &cursor) const;
     int columnNumber(const TextCursor &cursor) const;
 
@@ -104,11 +104,11 @@ public:
     bool save(const QString &file);
 
     void setText(const QString &text);
-    QString read(int pos, int size) const;
-    QChar readCharacter(int index) const;
+    QString read(qint64 pos, int size) const;
+    QChar readCharacter(qint64 index) const;
 
-    void insert(int pos, const QString &text);
-    void remove(int from, int size);
+    void insert(qint64 pos, const QString &text);
+    void remove(qint64 from, qint64 size);
 
     TextCursor &textCursor();
     const TextCursor &textCursor() const;
@@ -118,11 +118,33 @@ public:
 
     TextSection *sectionAt(const QPoint &pos) const;
 
-    QList<TextSection*> sections(int from = 0, int size = -1, TextSection::TextSectionOptions opt = 0) const;
-    inline TextSection *sectionAt(int pos) const { return sections(pos, 1, TextSection::IncludePartial).value(0); }
-    TextSection *insertTextSection(int pos, int size, const QTextCharFormat &format = QTextCharFormat(),
+    QList<TextSection*> sections(qint64 from = 0, qint64 size = -1, TextSection::TextSectionOptions opt = 0) const;
+    inline TextSection *sectionAt(qint64 pos) const { return sections(pos, 1, TextSection::IncludePartial).value(0); }
+    TextSection *insertTextSection(qint64 pos, qint64 size, const QTextCharFormat &format = QTextCharFormat(),
                                    const QVariant &data = QVariant());
 
+    struct ProvidedSection {
+        ProvidedSection(qint64 pos = 0, qint64 count = 0, const QTextCharFormat &f = QTextCharFormat(),
+                        int prio = 0)
+            : position(pos), size(count), format(f), priority(prio)
+        {}
+        qint64 position, size;
+        QTextCharFormat format;
+        int priority;
+    };
+    // Formats sections that are only wanted while they're on screen. The
+    // TextEdit asks for the ones in its buffer when it lays out and caches
+    // the answers until the document changes or invalidate is called
+    class SectionProvider
+    {
+    public:
+        virtual ~SectionProvider() {}
+        virtual QList<ProvidedSection> sections(qint64 position, qint64 size) = 0;
+    };
+    void setSectionProvider(SectionProvider *provider);
+    SectionProvider *sectionProvider() const;
+    void invalidateProvidedSections();
+
     void ensureCursorVisible(const TextCursor &cursor, int linesMargin = 0);
     bool isUndoAvailable() const;
     bool isRedoAvailable() const;
@@ -151,12 +173,12 @@ signals:
     void copyAvailable(bool on);
     void textChanged();
     void selectionChanged();
-    void cursorPositionChanged(int pos);
+    void cursorPositionChanged(qint64 pos);
     void sectionClicked(TextSection *section, const QPoint &pos);
     void undoAvailableChanged(bool on);
     void redoAvailableChanged(bool on);
 protected:
-    virtual void paste(int position, QClipboard::Mode mode);
+    virtual void paste(qint64 position, QClipboard::Mode mode);
     virtual void changeEvent(QEvent *e);
     virtual void keyPressEvent(QKeyEvent *e);
     virtual void keyReleaseEvent(QKeyEvent *e);
@@ -27,7 +27,7 @@
 
 struct DocumentCommand;
 struct CursorData {
-    int position, anchor;
+    qint64 position, anchor;
 };
 
 class TextEditPrivate : public QObject, public TextLayout
@@ -35,8 +35,8 @@ class TextEditPrivate : public QObject, public TextLayout
     Q_OBJECT
 public:
     TextEditPrivate(TextEdit *qptr)
-        : requestedScrollBarPosition(-1), lastRequestedScrollBarPosition(-1), cursorWidth(1),
-        sectionCount(0), maximumSizeCopy(50000), pendingTimeOut(-1), autoScrollLines(0),
+        : requestedScrollBarPosition(-1), lastRequestedScrollBarPosition(-1), scrollBarShift(0),
+        cursorWidth(1), sectionCount(0), maximumSizeCopy(50000), pendingTimeOut(-1), autoScrollLines(0),
         readOnly(false), cursorVisible(false), blockScrollBarUpdate(false),
         updateScrollBarPageStepPending(true), inMouseEvent(false), sectionPressed(0),
         pendingScrollBarUpdate(false), sectionCursor(0)
@@ -51,7 +51,7 @@ public:
     void scrollLines(int lines);
     void timerEvent(QTimerEvent *e);
     void updateCursorPosition(const QPoint &pos);
-    int findLastPageSize() const;
+    qint64 findLastPageSize() const;
     bool atBeginning() const { return viewportPosition == 0; }
     bool atEnd() const { return textEdit->verticalScrollBar()->value() == textEdit->verticalScrollBar()->maximum(); }
     bool dirtyForSection(TextSection *section);
@@ -60,7 +60,13 @@ public:
     void cursorMoveKeyEventReadOnly(QKeyEvent *e);
     virtual void relayout(); // from TextLayout
 
-    int requestedScrollBarPosition, lastRequestedScrollBarPosition, cursorWidth, sectionCount,
+    // QScrollBar only takes int, documents larger than INT_MAX map several
+    // characters to each scroll bar step
+    int scrollBarValue(qint64 pos) const { return int(pos >> scrollBarShift); }
+    qint64 scrollBarPosition(int value) const { return qint64(value) << scrollBarShift; }
+
+    qint64 requestedScrollBarPosition, lastRequestedScrollBarPosition;
+    int scrollBarShift, cursorWidth, sectionCount,
         maximumSizeCopy, pendingTimeOut, autoScrollLines;
     bool readOnly, cursorVisible, blockScrollBarUpdate, updateScrollBarPageStepPending, inMouseEvent;
     QBasicTimer autoScrollTimer, cursorBlinkTimer;
@@ -77,18 +83,20 @@ public slots:
     void onSelectionChanged();
     void onTextSectionAdded(TextSection *section);
     void onTextSectionRemoved(TextSection *section);
+    void onTextSectionsAdded(const QList<TextSection*> &sections);
+    void onTextSectionsRemoved(const QList<TextSection*> &sections);
     void onTextSectionFormatChanged(TextSection *section);
     void onTextSectionCursorChanged(TextSection *section);
     void updateScrollBar();
     void onDocumentDestroyed();
-    void onDocumentSizeChanged(int size);
+    void onDocumentSizeChanged(qint64 size);
     void onDocumentCommandInserted(DocumentCommand *cmd);
     void onDocumentCommandFinished(DocumentCommand *cmd);
     void onDocumentCommandRemoved(DocumentCommand *cmd);
     void onDocumentCommandTriggered(DocumentCommand *cmd, bool undo);
     void onScrollBarValueChanged(int value);
     void onScrollBarActionTriggered(int action);
-    void onCharactersAddedOrRemoved(int index, int count);
+    void onCharactersAddedOrRemoved(qint64 index, qint64 count);
 };
 
 class DebugWindow : public QWidget
@@ -112,7 +120,7 @@ public:
         p.fillRect(QRect(0, pixels(priv->viewportPosition), width(), pixels(priv->layoutEnd)), Qt::red);
     }
 
-    int pixels(int pos) const
+    int pixels(qint64 pos) const
     {
         double fraction = double(pos) / double(priv->document->documentSize());
         return int(double(height()) * fraction);
@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #include "textlayout_p.h"
+#include "textscan_p.h"
 #include "textedit_p.h"
 #include "textdocument.h"
 #include "textedit.h"
@@ -24,7 +25,8 @@ int TextLayout::viewportWidth() const
     return textEdit ? textEdit->viewport()->width() : viewport;
 }
 
-int TextLayout::doLayout(int index, QList<TextSection*> *sections) // index is in document coordinates
+qint64 TextLayout::doLayout(qint64 index, QList<TextSection*> *sections,
+                            QList<TextEdit::ProvidedSection> *provided) // index is in document coordinates
 {
     QTextLayout *textLayout = 0;
     if (!unusedTextLayouts.isEmpty()) {
@@ -44,12 +46,17 @@ int TextLayout::doLayout(int index, QList<TextSection*> *sections) // index is i
                    << bufferReadCharacter(index - 1);
     }
     Q_ASSERT(index == 0 || bufferReadCharacter(index - 1) == '\n');
-    const int max = bufferPosition + buffer.size();
-    const int lineStart = index;
+    const qint64 max = bufferPosition + buffer.size();
+    const qint64 lineStart = index;
+    if (index >= bufferPosition && index < max) {
+        const int offset = int(index - bufferPosition);
+        const int newLine = TextScan::indexOf(buffer.utf16() + offset, buffer.size() - offset, '\n');
+        index = (newLine == -1 ? max : index + newLine);
+    }
     while (index < max && bufferReadCharacter(index) != '\n')
         ++index;
 
-    const QString string = buffer.mid(lineStart - bufferPosition, index - lineStart);
+    const QString string = buffer.mid(int(lineStart - bufferPosition), int(index - lineStart));
     Q_ASSERT(string.size() == index - lineStart);
     Q_ASSERT(!string.contains('\n'));
     if (index < max)
@@ -62,23 +69,48 @@ int TextLayout::doLayout(int index, QList<TextSection*> *sections) // index is i
             Q_ASSERT(!sections->isEmpty());
             TextSection *l = sections->first();
             Q_ASSERT(::matchSection(l, textEdit));
-            Q_ASSERT(l->position() + l->size() >= lineStart);
-            if (l->position() >= index) {
+            // position() adds up the offsets in the document's section tree
+            const qint64 sectionPos = l->position();
+            const qint64 sectionEnd = sectionPos + l->size();
+            Q_ASSERT(sectionEnd >= lineStart);
+            if (sectionPos >= index) {
                 break;
             }
             // section is in this QTextLayout
             QTextLayout::FormatRange range;
-            range.start = qMax(0, l->position() - lineStart); // offset in QTextLayout
-            range.length = qMin(l->position() + l->size(), index) - lineStart - range.start;
+            range.start = int(qMax<qint64>(0, sectionPos - lineStart)); // offset in QTextLayout
+            range.length = int(qMin(sectionEnd, index) - lineStart - range.start);
             range.format = l->format();
             formatMap.insertMulti(l->priority(), range);
-            if (l->position() + l->size() >= index) { // > ### ???
+            if (sectionEnd >= index) { // > ### ???
                 // means section didn't end here. It continues in the next QTextLayout
                 break;
             }
             sections->removeFirst();
         } while (!sections->isEmpty());
     }
+    // provided sections are sorted by start, not end, so a long one mustn't
+    // hide the shorter ones behind it. Keep those that continue on later
+    // lines and drop the ones that end on this one.
+    int providedIndex = 0;
+    while (provided && providedIndex < provided->size()) {
+        const TextEdit::ProvidedSection &section = provided->at(providedIndex);
+        const qint64 sectionEnd = section.position + section.size;
+        if (section.position >= index)
+            break;
+        if (sectionEnd >= lineStart) {
+            QTextLayout::FormatRange range;
+            range.start = int(qMax<qint64>(0, section.position - lineStart));
+            range.length = int(qMin(sectionEnd, index) - lineStart - range.start);
+            range.format = section.format;
+            formatMap.insertMulti(section.priority, range);
+            if (sectionEnd >= index) {
+                ++providedIndex;
+                continue;
+            }
+        }
+        provided->removeAt(providedIndex);
+    }
     QList<QTextLayout::FormatRange> formats = formatMap.values();
 
     int leftMargin = LeftMargin;
@@ -159,13 +191,13 @@ int TextLayout::doLayout(int index, QList<TextSection*> *sections) // index is i
     return index;
 }
 
-int TextLayout::textPositionAt(const QPoint &p) const
+qint64 TextLayout::textPositionAt(const QPoint &p) const
 {
     QPoint pos = p;
     if (pos.x() >= 0 && pos.x() < LeftMargin)
         pos.rx() = LeftMargin; // clicking in the margin area should count as the first characters
 
-    int textLayoutOffset = viewportPosition;
+    qint64 textLayoutOffset = viewportPosition;
     foreach(const QTextLayout *l, textLayouts) {
         if (l->boundingRect().toRect().contains(pos)) {
             const int lineCount = l->lineCount();
@@ -181,7 +213,62 @@ int TextLayout::textPositionAt(const QPoint &p) const
     return -1;
 }
 
-QList<TextSection*> TextLayout::relayoutCommon()
+// fills the buffer straight from the document's chunks
+class BufferFill : public TextDocument::SpanVisitor
+{
+public:
+    BufferFill(QString *b) : buffer(b) {}
+    bool visit(qint64, const QChar *data, int size)
+    {
+        buffer->append(data, size);
+        return true;
+    }
+private:
+    QString *buffer;
+};
+
+static inline bool compareProvidedSection(const TextEdit::ProvidedSection &left,
+                                          const TextEdit::ProvidedSection &right)
+{
+    return left.position < right.position;
+}
+
+// Finds the sections the provider gave for the buffer, asking it again only
+// if none of the recent answers covers it
+void TextLayout::updateProvidedSections()
+{
+    providedSections.clear();
+    if (!sectionProvider)
+        return;
+    const qint64 end = bufferPosition + buffer.size();
+    int idx = 0;
+    while (idx < providedSectionsCache.size()) {
+        const ProvidedSections &cached = providedSectionsCache.at(idx);
+        if (cached.position <= bufferPosition && cached.position + cached.size >= end)
+            break;
+        ++idx;
+    }
+    if (idx < providedSectionsCache.size()) {
+        providedSectionsCache.move(idx, 0);
+    } else {
+        ProvidedSections cached;
+        cached.position = bufferPosition;
+        cached.size = buffer.size();
+        cached.sections = sectionProvider->sections(cached.position, cached.size);
+        qStableSort(cached.sections.begin(), cached.sections.end(), compareProvidedSection);
+        providedSectionsCache.prepend(cached);
+        while (providedSectionsCache.size() > MaxProvidedSectionsCache)
+            providedSectionsCache.removeLast();
+    }
+    foreach(const TextEdit::ProvidedSection &section, providedSectionsCache.first().sections) {
+        if (section.position >= end)
+            break;
+        if (section.position + section.size >= bufferPosition)
+            providedSections.append(section);
+    }
+}
+
+QList<TextSection*> TextLayout::relayoutCommon(QList<TextEdit::ProvidedSection> *provided)
 {
 //    widest = -1; // ### should this be relative to current content or remember? What if you remove the line that was the widest?
     Q_ASSERT(layoutDirty);
@@ -200,16 +287,24 @@ QList<TextSection*> TextLayout::relayoutCommon()
     if (viewportPosition < bufferPosition
         || (bufferPosition + buffer.size() < document->documentSize()
             && buffer.size() - bufferOffset() < MinimumBufferSize)) {
-        bufferPosition = qMax(0, viewportPosition - MinimumBufferSize);
-        buffer = document->read(bufferPosition, int(MinimumBufferSize * 2.5));
+        bufferPosition = qMax<qint64>(0, viewportPosition - MinimumBufferSize);
+        buffer.clear();
+        buffer.reserve(int(MinimumBufferSize * 2.5));
+        BufferFill fill(&buffer);
+        document->forEachSpan(bufferPosition, int(MinimumBufferSize * 2.5), &fill);
         sections = document->d->getSections(bufferPosition, buffer.size(), TextSection::IncludePartial, textEdit);
+        updateProvidedSections();
     } else if (sectionsDirty) {
         sections = document->d->getSections(bufferPosition, buffer.size(), TextSection::IncludePartial, textEdit);
+        updateProvidedSections();
     }
     sectionsDirty = false;
     QList<TextSection*> l = sections;
     while (!l.isEmpty() && l.first()->position() + l.first()->size() < viewportPosition)
         l.takeFirst(); // could cache these as well
+    *provided = providedSections;
+    while (!provided->isEmpty() && provided->first().position + provided->first().size < viewportPosition)
+        provided->removeFirst();
     return l;
 }
 
@@ -218,15 +313,16 @@ void TextLayout::relayoutByGeometry(int height)
     if (!layoutDirty)
         return;
 
-    QList<TextSection*> l = relayoutCommon();
+    QList<TextEdit::ProvidedSection> provided;
+    QList<TextSection*> l = relayoutCommon(&provided);
 
-    const int max = viewportPosition + buffer.size() - bufferOffset(); // in document coordinates
+    const qint64 max = viewportPosition + buffer.size() - bufferOffset(); // in document coordinates
     ASSUME(viewportPosition == 0 || bufferReadCharacter(viewportPosition - 1) == '\n');
 
     static const int extraLines = qMax(2, qgetenv("LAZYTEXTEDIT_EXTRA_LINES").toInt());
-    int index = viewportPosition;
+    qint64 index = viewportPosition;
     while (index < max) {
-        index = doLayout(index, l.isEmpty() ? 0 : &l);
+        index = doLayout(index, l.isEmpty() ? 0 : &l, &provided);
         Q_ASSERT(index == max || document->readCharacter(index - 1) == '\n');
         Q_ASSERT(!textLayouts.isEmpty());
         const int y = int(textLayouts.last()->boundingRect().bottom());
@@ -258,13 +354,14 @@ void TextLayout::relayoutByPosition(int size)
     if (!layoutDirty)
         return;
 
-    QList<TextSection*> l = relayoutCommon();
+    QList<TextEdit::ProvidedSection> provided;
+    QList<TextSection*> l = relayoutCommon(&provided);
 
-    const int max = viewportPosition + qMin(size, buffer.size() - bufferOffset());
+    const qint64 max = viewportPosition + qMin(size, buffer.size() - bufferOffset());
     Q_ASSERT(viewportPosition == 0 || bufferReadCharacter(viewportPosition - 1) == '\n');
-    int index = viewportPosition;
+    qint64 index = viewportPosition;
     while (index < max) {
-        index = doLayout(index, l.isEmpty() ? 0 : &l);
+        index = doLayout(index, l.isEmpty() ? 0 : &l, &provided);
     }
     layoutEnd = index;
 
@@ -279,7 +376,7 @@ void TextLayout::relayout()
     relayoutByPosition(2000); // ### totally arbitrary number
 }
 
-QTextLayout *TextLayout::layoutForPosition(int pos, int *offset, int *index) const
+QTextLayout *TextLayout::layoutForPosition(qint64 pos, int *offset, int *index) const
 {
     if (offset)
         *offset = -1;
@@ -290,13 +387,13 @@ QTextLayout *TextLayout::layoutForPosition(int pos, int *offset, int *index) con
         return 0;
     }
 
-    int textLayoutOffset = viewportPosition;
+    qint64 textLayoutOffset = viewportPosition;
     int i = 0;
 
     foreach(QTextLayout *l, textLayouts) {
         if (pos >= textLayoutOffset && pos <= l->text().size() + textLayoutOffset) {
             if (offset)
-                *offset = pos - textLayoutOffset;
+                *offset = int(pos - textLayoutOffset);
             if (index)
                 *index = i;
             return l;
@@ -307,7 +404,7 @@ QTextLayout *TextLayout::layoutForPosition(int pos, int *offset, int *index) con
     return 0;
 }
 
-QTextLine TextLayout::lineForPosition(int pos, int *offsetInLine, int *lineIndex, bool *lastLine) const
+QTextLine TextLayout::lineForPosition(qint64 pos, int *offsetInLine, int *lineIndex, bool *lastLine) const
 {
     if (offsetInLine)
         *offsetInLine = -1;
@@ -323,8 +420,8 @@ QTextLine TextLayout::lineForPosition(int pos, int *offsetInLine, int *lineIndex
     QTextLayout *layout = textLayouts.value(layoutIndex);
     Q_ASSERT(layout);
     for (int i=0; i<lines.size(); ++i) {
-        const QPair<int, QTextLine> &line = lines.at(i);
-        int lineEnd = line.first + line.second.textLength();
+        const QPair<qint64, QTextLine> &line = lines.at(i);
+        qint64 lineEnd = line.first + line.second.textLength();
         const bool last = line.second.lineNumber() + 1 == layout->lineCount();
         if (last) {
             ++lineEnd;
@@ -334,7 +431,7 @@ QTextLine TextLayout::lineForPosition(int pos, int *offsetInLine, int *lineIndex
         }
         if (pos < lineEnd) {
             if (offsetInLine) {
-                *offsetInLine = pos - line.first;
+                *offsetInLine = int(pos - line.first);
                 Q_ASSERT(*offsetInLine >= 0);
                 Q_ASSERT(*offsetInLine < lineEnd + pos);
             }
@@ -358,20 +455,20 @@ QTextLine TextLayout::lineForPosition(int pos, int *offsetInLine, int *lineIndex
 // right direction and sets viewportPosition to that. Updates
 // scrollbars if this is a TextEditPrivate
 
-void TextLayout::updateViewportPosition(int pos, Direction direction)
+void TextLayout::updateViewportPosition(qint64 pos, Direction direction)
 {
     pos = qMin(pos, maxViewportPosition);
     if (document->documentSize() == 0) {
         viewportPosition = 0;
     } else {
         Q_ASSERT(document->documentSize() > 0);
-        int index = document->find('\n', qMax(0, pos + (direction == Backward ? -1 : 0)),
+        qint64 index = document->find('\n', qMax<qint64>(0, pos + (direction == Backward ? -1 : 0)),
                                    TextDocument::FindMode(direction)).anchor();
         if (index == -1) {
             if (direction == Backward) {
                 index = 0;
             } else {
-                index = qMax(0, document->find('\n', document->documentSize() - 1, TextDocument::FindBackward).position());
+                index = qMax<qint64>(0, document->find('\n', document->documentSize() - 1, TextDocument::FindBackward).position());
                 // position after last newline in document
                 // if there is no newline put it at 0
             }
@@ -389,6 +486,10 @@ void TextLayout::updateViewportPosition(int pos, Direction direction)
         updateViewportPosition(viewportPosition, Backward);
         return;
     }
+    {
+        QReadLocker locker(document->d->readWriteLock);
+        document->d->prefetch(viewportPosition, direction == Forward);
+    }
     layoutDirty = true;
 
     if (textEdit && !suppressTextEditUpdates) {
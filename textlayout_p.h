@@ -40,19 +40,19 @@ public:
     TextDocumentBuffer(TextDocument *doc) : document(doc), bufferPosition(0) {}
     virtual ~TextDocumentBuffer() {}
 
-    inline QString bufferRead(int from, int size) const
+    inline QString bufferRead(qint64 from, int size) const
     {
         Q_ASSERT(document);
         if (from < bufferPosition || from + size > bufferPosition + buffer.size()) {
             return document->read(from, size);
         }
-        return buffer.mid(from - bufferPosition, size);
+        return buffer.mid(int(from - bufferPosition), size);
     }
-    inline QChar bufferReadCharacter(int index) const // document coordinates
+    inline QChar bufferReadCharacter(qint64 index) const // document coordinates
     {
         Q_ASSERT(document);
         if (index >= bufferPosition && index < bufferPosition + buffer.size()) {
-            return buffer.at(index - bufferPosition);
+            return buffer.at(int(index - bufferPosition));
         } else {
             Q_ASSERT(index >= 0 && index < document->documentSize()); // what if index == documentSize?
             return document->readCharacter(index);
@@ -60,7 +60,7 @@ public:
     }
 
     TextDocument *document;
-    int bufferPosition;
+    qint64 bufferPosition;
     QString buffer;
 };
 
@@ -74,7 +74,7 @@ public:
         viewportPosition(0), layoutEnd(-1), viewport(-1),
         visibleLines(-1), lastVisibleCharacter(-1), lastBottomMargin(0),
         widest(-1), maxViewportPosition(0), layoutDirty(true), sectionsDirty(true),
-        lineBreaking(true), suppressTextEditUpdates(false)
+        lineBreaking(true), suppressTextEditUpdates(false), sectionProvider(0)
     {
     }
 
@@ -86,32 +86,46 @@ public:
 
     TextEdit *textEdit;
     QList<SyntaxHighlighter*> syntaxHighlighters;
-    int viewportPosition, layoutEnd, viewport, visibleLines,
-        lastVisibleCharacter, lastBottomMargin, widest, maxViewportPosition;
+    qint64 viewportPosition, layoutEnd;
+    int viewport, visibleLines;
+    qint64 lastVisibleCharacter;
+    int lastBottomMargin, widest;
+    qint64 maxViewportPosition;
     bool layoutDirty, sectionsDirty, lineBreaking, suppressTextEditUpdates;
     QList<QTextLayout*> textLayouts, unusedTextLayouts;
     QHash<QTextLayout*, QTextBlockFormat> blockFormats;
     QList<TextEdit::ExtraSelection> extraSelections;
-    QList<QPair<int, QTextLine> > lines; // int is start position of line in document coordinates
+    QList<QPair<qint64, QTextLine> > lines; // first is start position of line in document coordinates
     QRect contentRect; // contentRect means the laid out area, not just the area currently visible
     QList<TextSection*> sections; // these are all the sections in the buffer. Some might be before the current viewport
     QFont font;
 
-    QList<TextSection*> relayoutCommon(); // should maybe be smarter about MinimumScreenSize. Detect it based on font and viewport size
+    enum { MaxProvidedSectionsCache = 4 };
+    struct ProvidedSections {
+        qint64 position, size;
+        QList<TextEdit::ProvidedSection> sections;
+    };
+    TextEdit::SectionProvider *sectionProvider;
+    QList<ProvidedSections> providedSectionsCache; // most recently used first
+    QList<TextEdit::ProvidedSection> providedSections; // sorted by position, like sections
+
+    // should maybe be smarter about MinimumScreenSize. Detect it based on font and viewport size
+    QList<TextSection*> relayoutCommon(QList<TextEdit::ProvidedSection> *provided);
+    void updateProvidedSections();
     void relayoutByPosition(int size);
     void relayoutByGeometry(int height);
     virtual void relayout();
 
     int viewportWidth() const;
 
-    int doLayout(int index, QList<TextSection*> *sections);
+    qint64 doLayout(qint64 index, QList<TextSection*> *sections, QList<TextEdit::ProvidedSection> *provided);
 
-    QTextLine lineForPosition(int pos, int *offsetInLine = 0,
+    QTextLine lineForPosition(qint64 pos, int *offsetInLine = 0,
                               int *lineIndex = 0, bool *lastLine = 0) const;
-    QTextLayout *layoutForPosition(int pos, int *offset = 0, int *index = 0) const;
+    QTextLayout *layoutForPosition(qint64 pos, int *offset = 0, int *index = 0) const;
 
-    int textPositionAt(const QPoint &pos) const;
-    inline int bufferOffset() const { return viewportPosition - bufferPosition; }
+    qint64 textPositionAt(const QPoint &pos) const;
+    inline int bufferOffset() const { return int(viewportPosition - bufferPosition); }
 
     QString dump() const;
 
@@ -119,7 +133,7 @@ public:
         Forward = 0,
         Backward = TextDocument::FindBackward
     };
-    void updateViewportPosition(int pos, Direction direction);
+    void updateViewportPosition(qint64 pos, Direction direction);
 };
 
 #endif
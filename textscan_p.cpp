@@ -0,0 +1,408 @@
+// Copyright 2010 Anders Bakken
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "textscan_p.h"
+#include <string.h>
+
+#if !defined(NO_TEXTSCAN_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TEXTSCAN_X86
+#include <immintrin.h>
+#define TEXTSCAN_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+static int countScalar(const ushort *data, int size, ushort ch)
+{
+    int ret = 0;
+    for (int i=0; i<size; ++i) {
+        if (data[i] == ch)
+            ++ret;
+    }
+    return ret;
+}
+
+static int countScalar(const char *data, int size, char ch)
+{
+    const char *end = data + size;
+    int ret = 0;
+    while ((data = static_cast<const char*>(memchr(data, ch, end - data)))) {
+        ++ret;
+        ++data;
+    }
+    return ret;
+}
+
+static int indexOfScalar(const ushort *data, int size, ushort ch)
+{
+    for (int i=0; i<size; ++i) {
+        if (data[i] == ch)
+            return i;
+    }
+    return -1;
+}
+
+static int lastIndexOfScalar(const ushort *data, int size, ushort ch)
+{
+    for (int i=size - 1; i>=0; --i) {
+        if (data[i] == ch)
+            return i;
+    }
+    return -1;
+}
+
+static int indexOfNthScalar(const ushort *data, int size, ushort ch, int n)
+{
+    for (int i=0; i<size; ++i) {
+        if (data[i] == ch && --n == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int indexOfNthScalar(const char *data, int size, char ch, int n)
+{
+    const char *start = data;
+    const char *end = data + size;
+    while ((data = static_cast<const char*>(memchr(data, ch, end - data)))) {
+        if (--n == 0)
+            return int(data - start);
+        ++data;
+    }
+    return -1;
+}
+
+// the tails of the vector loops
+static inline int offsetIndex(int offset, int index)
+{
+    return index == -1 ? -1 : offset + index;
+}
+
+#ifdef TEXTSCAN_X86
+// The counting loops add the compare results up in 16 or 8 bit lanes and
+// only sum the lanes when they could overflow
+
+TEXTSCAN_TARGET("sse2")
+static int countSSE2(const ushort *data, int size, ushort ch)
+{
+    const __m128i needle = _mm_set1_epi16(short(ch));
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i total = _mm_setzero_si128();
+    int i = 0;
+    while (size - i >= 8) {
+        const int end = i + qMin((size - i) / 8, 0x7fff) * 8;
+        __m128i counts = _mm_setzero_si128();
+        for (; i<end; i += 8) {
+            const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            counts = _mm_sub_epi16(counts, _mm_cmpeq_epi16(chars, needle));
+        }
+        total = _mm_add_epi32(total, _mm_madd_epi16(counts, ones));
+    }
+    total = _mm_add_epi32(total, _mm_shuffle_epi32(total, _MM_SHUFFLE(1, 0, 3, 2)));
+    total = _mm_add_epi32(total, _mm_shuffle_epi32(total, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(total) + countScalar(data + i, size - i, ch);
+}
+
+TEXTSCAN_TARGET("sse2")
+static int countSSE2(const char *data, int size, char ch)
+{
+    const __m128i needle = _mm_set1_epi8(ch);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i total = _mm_setzero_si128();
+    int i = 0;
+    while (size - i >= 16) {
+        const int end = i + qMin((size - i) / 16, 0xff) * 16;
+        __m128i counts = _mm_setzero_si128();
+        for (; i<end; i += 16) {
+            const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(chars, needle));
+        }
+        total = _mm_add_epi64(total, _mm_sad_epu8(counts, zero));
+    }
+    return _mm_cvtsi128_si32(total) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(total, total))
+        + countScalar(data + i, size - i, ch);
+}
+
+TEXTSCAN_TARGET("sse2")
+static int indexOfSSE2(const ushort *data, int size, ushort ch)
+{
+    const __m128i needle = _mm_set1_epi16(short(ch));
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        const int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(chars, needle));
+        if (mask)
+            return i + __builtin_ctz(mask) / 2;
+    }
+    return offsetIndex(i, indexOfScalar(data + i, size - i, ch));
+}
+
+TEXTSCAN_TARGET("sse2")
+static int lastIndexOfSSE2(const ushort *data, int size, ushort ch)
+{
+    const __m128i needle = _mm_set1_epi16(short(ch));
+    int i = size;
+    while (i >= 8) {
+        i -= 8;
+        const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        const int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(chars, needle));
+        if (mask)
+            return i + (31 - __builtin_clz(mask)) / 2;
+    }
+    return lastIndexOfScalar(data, i, ch);
+}
+
+TEXTSCAN_TARGET("sse2")
+static int indexOfNthSSE2(const ushort *data, int size, ushort ch, int n)
+{
+    const __m128i needle = _mm_set1_epi16(short(ch));
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        // one bit per character
+        uint mask = _mm_movemask_epi8(_mm_cmpeq_epi16(chars, needle)) & 0x5555;
+        const int found = __builtin_popcount(mask);
+        if (found < n) {
+            n -= found;
+            continue;
+        }
+        while (--n)
+            mask &= mask - 1;
+        return i + __builtin_ctz(mask) / 2;
+    }
+    return offsetIndex(i, indexOfNthScalar(data + i, size - i, ch, n));
+}
+
+TEXTSCAN_TARGET("sse2")
+static int indexOfNthSSE2(const char *data, int size, char ch, int n)
+{
+    const __m128i needle = _mm_set1_epi8(ch);
+    int i = 0;
+    for (; i + 16 <= size; i += 16) {
+        const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        uint mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chars, needle));
+        const int found = __builtin_popcount(mask);
+        if (found < n) {
+            n -= found;
+            continue;
+        }
+        while (--n)
+            mask &= mask - 1;
+        return i + __builtin_ctz(mask);
+    }
+    return offsetIndex(i, indexOfNthScalar(data + i, size - i, ch, n));
+}
+
+TEXTSCAN_TARGET("avx2")
+static int countAVX2(const ushort *data, int size, ushort ch)
+{
+    const __m256i needle = _mm256_set1_epi16(short(ch));
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i total = _mm256_setzero_si256();
+    int i = 0;
+    while (size - i >= 16) {
+        const int end = i + qMin((size - i) / 16, 0x7fff) * 16;
+        __m256i counts = _mm256_setzero_si256();
+        for (; i<end; i += 16) {
+            const __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            counts = _mm256_sub_epi16(counts, _mm256_cmpeq_epi16(chars, needle));
+        }
+        total = _mm256_add_epi32(total, _mm256_madd_epi16(counts, ones));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum) + countScalar(data + i, size - i, ch);
+}
+
+TEXTSCAN_TARGET("avx2")
+static int countAVX2(const char *data, int size, char ch)
+{
+    const __m256i needle = _mm256_set1_epi8(ch);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i total = _mm256_setzero_si256();
+    int i = 0;
+    while (size - i >= 32) {
+        const int end = i + qMin((size - i) / 32, 0xff) * 32;
+        __m256i counts = _mm256_setzero_si256();
+        for (; i<end; i += 32) {
+            const __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(chars, needle));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, zero));
+    }
+    const __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+    return _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum))
+        + countScalar(data + i, size - i, ch);
+}
+
+TEXTSCAN_TARGET("avx2")
+static int indexOfAVX2(const ushort *data, int size, ushort ch)
+{
+    const __m256i needle = _mm256_set1_epi16(short(ch));
+    int i = 0;
+    for (; i + 16 <= size; i += 16) {
+        const __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        const uint mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(chars, needle));
+        if (mask)
+            return i + __builtin_ctz(mask) / 2;
+    }
+    return offsetIndex(i, indexOfSSE2(data + i, size - i, ch));
+}
+
+TEXTSCAN_TARGET("avx2")
+static int lastIndexOfAVX2(const ushort *data, int size, ushort ch)
+{
+    const __m256i needle = _mm256_set1_epi16(short(ch));
+    int i = size;
+    while (i >= 16) {
+        i -= 16;
+        const __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        const uint mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(chars, needle));
+        if (mask)
+            return i + (31 - __builtin_clz(mask)) / 2;
+    }
+    return lastIndexOfSSE2(data, i, ch);
+}
+
+TEXTSCAN_TARGET("avx2")
+static int indexOfNthAVX2(const ushort *data, int size, ushort ch, int n)
+{
+    const __m256i needle = _mm256_set1_epi16(short(ch));
+    int i = 0;
+    for (; i + 16 <= size; i += 16) {
+        const __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        uint mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(chars, needle)) & 0x55555555;
+        const int found = __builtin_popcount(mask);
+        if (found < n) {
+            n -= found;
+            continue;
+        }
+        while (--n)
+            mask &= mask - 1;
+        return i + __builtin_ctz(mask) / 2;
+    }
+    return offsetIndex(i, indexOfNthSSE2(data + i, size - i, ch, n));
+}
+
+TEXTSCAN_TARGET("avx2")
+static int indexOfNthAVX2(const char *data, int size, char ch, int n)
+{
+    const __m256i needle = _mm256_set1_epi8(ch);
+    int i = 0;
+    for (; i + 32 <= size; i += 32) {
+        const __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        uint mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chars, needle));
+        const int found = __builtin_popcount(mask);
+        if (found < n) {
+            n -= found;
+            continue;
+        }
+        while (--n)
+            mask &= mask - 1;
+        return i + __builtin_ctz(mask);
+    }
+    return offsetIndex(i, indexOfNthSSE2(data + i, size - i, ch, n));
+}
+#endif
+
+static TextScan::Level detectLevel()
+{
+#ifdef TEXTSCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return TextScan::AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return TextScan::SSE2;
+#endif
+    return TextScan::Scalar;
+}
+
+TextScan::Level TextScan::level()
+{
+    static const Level level = detectLevel();
+    return level;
+}
+
+int TextScan::count(const ushort *data, int size, ushort ch)
+{
+    switch (level()) {
+#ifdef TEXTSCAN_X86
+    case AVX2: return countAVX2(data, size, ch);
+    case SSE2: return countSSE2(data, size, ch);
+#endif
+    default: break;
+    }
+    return countScalar(data, size, ch);
+}
+
+int TextScan::count(const char *data, int size, char ch)
+{
+    switch (level()) {
+#ifdef TEXTSCAN_X86
+    case AVX2: return countAVX2(data, size, ch);
+    case SSE2: return countSSE2(data, size, ch);
+#endif
+    default: break;
+    }
+    return countScalar(data, size, ch);
+}
+
+int TextScan::indexOf(const ushort *data, int size, ushort ch)
+{
+    switch (level()) {
+#ifdef TEXTSCAN_X86
+    case AVX2: return indexOfAVX2(data, size, ch);
+    case SSE2: return indexOfSSE2(data, size, ch);
+#endif
+    default: break;
+    }
+    return indexOfScalar(data, size, ch);
+}
+
+int TextScan::lastIndexOf(const ushort *data, int size, ushort ch)
+{
+    switch (level()) {
+#ifdef TEXTSCAN_X86
+    case AVX2: return lastIndexOfAVX2(data, size, ch);
+    case SSE2: return lastIndexOfSSE2(data, size, ch);
+#endif
+    default: break;
+    }
+    return lastIndexOfScalar(data, size, ch);
+}
+
+int TextScan::indexOfNth(const ushort *data, int size, ushort ch, int n)
+{
+    Q_ASSERT(n > 0);
+    switch (level()) {
+#ifdef TEXTSCAN_X86
+    case AVX2: return indexOfNthAVX2(data, size, ch, n);
+    case SSE2: return indexOfNthSSE2(data, size, ch, n);
+#endif
+    default: break;
+    }
+    return indexOfNthScalar(data, size, ch, n);
+}
+
+int TextScan::indexOfNth(const char *data, int size, char ch, int n)
+{
+    Q_ASSERT(n > 0);
+    switch (level()) {
+#ifdef TEXTSCAN_X86
+    case AVX2: return indexOfNthAVX2(data, size, ch, n);
+    case SSE2: return indexOfNthSSE2(data, size, ch, n);
+#endif
+    default: break;
+    }
+    return indexOfNthScalar(data, size, ch, n);
+}
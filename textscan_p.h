@@ -0,0 +1,37 @@
+// Copyright 2010 Anders Bakken
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TEXTSCAN_P_H
+#define TEXTSCAN_P_H
+
+#include <qglobal.h>
+
+// Kernels that look for one character in UTF-16 or 8-bit text. On x86 they
+// use AVX2 or SSE2 depending on what the CPU has, elsewhere plain loops.
+// The indexes returned are relative to data and -1 means not found
+struct TextScan
+{
+    static int count(const ushort *data, int size, ushort ch);
+    static int count(const char *data, int size, char ch);
+    static int indexOf(const ushort *data, int size, ushort ch);
+    static int lastIndexOf(const ushort *data, int size, ushort ch);
+    // the nth occurrence, counting from 1
+    static int indexOfNth(const ushort *data, int size, ushort ch, int n);
+    static int indexOfNth(const char *data, int size, char ch, int n);
+
+    enum Level { Scalar, SSE2, AVX2 };
+    static Level level(); // what the kernels use on this CPU
+};
+
+#endif
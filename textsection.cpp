@@ -15,48 +15,221 @@
 #include "textsection.h"
 #include "textdocument.h"
 #include "textdocument_p.h"
+#include <QReadWriteLock>
+#include <QBitmap>
+
+static inline uint formatHash(const QTextCharFormat &format)
+{
+    return uint(format.propertyCount()) * 31 + format.foreground().color().rgba()
+        + format.background().color().rgba() * 7 + qHash(format.fontFamily()) * 3
+        + uint(format.fontPointSize() * 64) * 11 + uint(format.fontWeight()) * 13
+        + (format.fontItalic() ? 17 : 0) + (format.fontUnderline() ? 19 : 0);
+}
+
+// Looked up with the read lock first since nearly every format is there already
+int TextSectionStyles::formatIndex(const QTextCharFormat &format)
+{
+    const uint hash = ::formatHash(format);
+    {
+        QReadLocker locker(&lock);
+        foreach(int index, formatsByHash.value(hash)) {
+            if (formats.at(index) == format)
+                return index;
+        }
+    }
+    QWriteLocker locker(&lock);
+    QVector<int> &indexes = formatsByHash[hash];
+    foreach(int index, indexes) {
+        if (formats.at(index) == format)
+            return index;
+    }
+    indexes.append(formats.size());
+    formats.append(format);
+    return formats.size() - 1;
+}
+
+// Bitmap cursors are told apart by their pixmap and hot spot
+int TextSectionStyles::cursorIndex(const QCursor &cursor)
+{
+    const int shape = cursor.shape();
+    qint64 key = 0;
+    if (shape == Qt::BitmapCursor) {
+        key = cursor.pixmap().cacheKey();
+        if (!key && cursor.bitmap())
+            key = cursor.bitmap()->cacheKey() ^ (cursor.mask() ? cursor.mask()->cacheKey() << 1 : 0);
+    }
+    {
+        QReadLocker locker(&lock);
+        if (shape != Qt::BitmapCursor) {
+            const QHash<int, int>::const_iterator it = cursorsByShape.find(shape);
+            if (it != cursorsByShape.end())
+                return it.value();
+        } else {
+            foreach(int index, cursorsByPixmap.value(key)) {
+                if (cursors.at(index).hotSpot() == cursor.hotSpot())
+                    return index;
+            }
+        }
+    }
+    QWriteLocker locker(&lock);
+    if (shape != Qt::BitmapCursor) {
+        if (cursorsByShape.contains(shape))
+            return cursorsByShape.value(shape);
+        cursorsByShape[shape] = cursors.size();
+    } else {
+        QVector<int> &indexes = cursorsByPixmap[key];
+        foreach(int index, indexes) {
+            if (cursors.at(index).hotSpot() == cursor.hotSpot())
+                return index;
+        }
+        indexes.append(cursors.size());
+    }
+    cursors.append(cursor);
+    return cursors.size() - 1;
+}
+
+int TextSectionStyles::styleIndex(int format, int cursor)
+{
+    const QPair<int, int> indexes(format, cursor);
+    {
+        QReadLocker locker(&lock);
+        const QHash<QPair<int, int>, int>::const_iterator it = stylesByIndexes.find(indexes);
+        if (it != stylesByIndexes.end())
+            return it.value();
+    }
+    QWriteLocker locker(&lock);
+    if (stylesByIndexes.contains(indexes))
+        return stylesByIndexes.value(indexes);
+    stylesByIndexes.insert(indexes, styles.size());
+    styles.append(indexes);
+    return styles.size() - 1;
+}
+
+int TextSectionStyles::style(const QTextCharFormat &format, const QCursor *cursor)
+{
+    return styleIndex(formatIndex(format), cursor ? cursorIndex(*cursor) : -1);
+}
+
+int TextSectionStyles::setFormat(int style, const QTextCharFormat &format)
+{
+    int cursor;
+    {
+        QReadLocker locker(&lock);
+        cursor = styles.at(style).second;
+    }
+    return styleIndex(formatIndex(format), cursor);
+}
+
+int TextSectionStyles::setCursor(int style, const QCursor *cursor)
+{
+    int format;
+    {
+        QReadLocker locker(&lock);
+        format = styles.at(style).first;
+    }
+    return styleIndex(format, cursor ? cursorIndex(*cursor) : -1);
+}
+
+// The index of from's style in this pool
+int TextSectionStyles::copyStyle(const TextSectionStyles *from, int style)
+{
+    if (from == this)
+        return style;
+    const bool cursor = from->hasCursor(style);
+    const QCursor c = (cursor ? from->cursor(style) : QCursor());
+    return this->style(from->format(style), cursor ? &c : 0);
+}
+
+QTextCharFormat TextSectionStyles::format(int style) const
+{
+    QReadLocker locker(&lock);
+    return formats.at(styles.at(style).first);
+}
+
+QCursor TextSectionStyles::cursor(int style) const
+{
+    QReadLocker locker(&lock);
+    const int index = styles.at(style).second;
+    return index == -1 ? QCursor() : cursors.at(index);
+}
+
+bool TextSectionStyles::hasCursor(int style) const
+{
+    QReadLocker locker(&lock);
+    return styles.at(style).second != -1;
+}
+
+TextSectionStyles *TextSectionStyles::detached()
+{
+    static TextSectionStyles instance;
+    return &instance;
+}
+
+int TextSection::style(TextDocument *doc, const QTextCharFormat &format)
+{
+    Q_ASSERT(doc);
+    return doc->d->sectionStyles.style(format, 0);
+}
+
+TextSectionStyles *TextSection::styles() const
+{
+    return d.document ? &d.document->d->sectionStyles : TextSectionStyles::detached();
+}
 
 TextSection::~TextSection()
 {
-    if (d.document)
-        d.document->takeTextSection(this);
+    if (d.document) {
+        QWriteLocker locker(d.document->d->readWriteLock);
+        d.document->d->discardSection(this);
+    }
+}
+
+qint64 TextSection::position() const
+{
+    qint64 pos = d.position;
+    for (const TextSection *section = d.parent; section; section = section->d.parent)
+        pos += section->d.position;
+    return pos;
 }
 
 QString TextSection::text() const
 {
     Q_ASSERT(d.document);
-    return d.document->read(d.position, d.size);
+    return d.document->read(position(), int(d.size));
+}
+
+QTextCharFormat TextSection::format() const
+{
+    return styles()->format(d.style);
 }
 
 void TextSection::setFormat(const QTextCharFormat &format)
 {
     Q_ASSERT(d.document);
-    d.format = format;
+    d.style = styles()->setFormat(d.style, format);
     emit d.document->d->sectionFormatChanged(this);
 }
 
 QCursor TextSection::cursor() const
 {
-    return d.cursor;
+    return styles()->cursor(d.style);
 }
 
 void TextSection::setCursor(const QCursor &cursor)
 {
-    d.cursor = cursor;
-    d.hasCursor = true;
+    d.style = styles()->setCursor(d.style, &cursor);
     emit d.document->d->sectionCursorChanged(this);
 }
 
 void TextSection::resetCursor()
 {
-    d.hasCursor = false;
-    d.cursor = QCursor();
+    d.style = styles()->setCursor(d.style, 0);
     emit d.document->d->sectionCursorChanged(this);
 }
 
 bool TextSection::hasCursor() const
 {
-    return d.hasCursor;
+    return styles()->hasCursor(d.style);
 }
 
 void TextSection::setPriority(int priority)
@@ -22,6 +22,7 @@
 
 class TextDocument;
 class TextEdit;
+class TextSectionStyles;
 class TextSection
 {
 public:
@@ -32,9 +33,9 @@ public:
 
     ~TextSection();
     QString text() const;
-    int position() const { return d.position; }
-    int size() const { return d.size; }
-    QTextCharFormat format() const { return d.format; }
+    qint64 position() const;
+    qint64 size() const { return d.size; }
+    QTextCharFormat format() const;
     void setFormat(const QTextCharFormat &format);
     QVariant data() const { return d.data; }
     void setData(const QVariant &data) { d.data = data; }
@@ -48,20 +49,26 @@ public:
     void setPriority(int priority);
 private:
     struct Data {
-        Data(int p, int s, TextDocument *doc, const QTextCharFormat &f, const QVariant &d)
-            : position(p), size(s), priority(0), document(doc), textEdit(0), format(f), data(d), hasCursor(false)
+        Data(qint64 p, qint64 s, TextDocument *doc, int st, const QVariant &d)
+            : position(p), size(s), end(s), priority(0), style(st), document(doc), textEdit(0), data(d),
+              parent(0), left(0), right(0)
         {}
-        int position, size, priority;
+        // in the document's tree position is relative to the parent's and
+        // end is where the last section of the subtree ends, relative to position
+        qint64 position, size, end;
+        int priority;
+        int style; // index of the format and cursor in the document's TextSectionStyles
         TextDocument *document;
         TextEdit *textEdit;
-        QTextCharFormat format;
         QVariant data;
-        QCursor cursor;
-        bool hasCursor;
+        TextSection *parent, *left, *right;
     } d;
 
-    TextSection(int pos, int size, TextDocument *doc, const QTextCharFormat &format, const QVariant &data)
-        : d(pos, size, doc, format, data)
+    static int style(TextDocument *doc, const QTextCharFormat &format);
+    TextSectionStyles *styles() const;
+
+    TextSection(qint64 pos, qint64 size, TextDocument *doc, const QTextCharFormat &format, const QVariant &data)
+        : d(pos, size, doc, style(doc, format), data)
     {}
 
     friend class TextDocument;